@@ -5,189 +5,421 @@
 #include "rss.h"
 #include "debug.h"
 
+#define PORT_SET_MIN_BITS	4		/* 16 buckets per core, doubled with the sets */
+#define PORT_SET_MIN_SWEEP	64		/* sets a core keeps before freeing idle ones */
+#define ADDR_CACHE_LINE		64
+
+#define MAX(a, b) ((a)>(b)?(a):(b))
 /*----------------------------------------------------------------------------*/
-struct addr_entry
+/*
+ * The RSS (Toeplitz) hash is linear, so the rx queue of a connection is
+ * picked by the hash bits of (saddr, daddr, 0, dport) XORed with those of
+ * the source port alone. With every port sorted once by its own bits
+ * (port_order), the ports that bring a given pair of addresses back to a
+ * core are a handful of contiguous runs; nothing is hashed per connect.
+ *
+ * A core keeps the ports of each (source address, destination) pair it
+ * connects to in a port_set of its own. The sets of two cores never share
+ * a port: the application thread takes ports off the free stack, the mtcp
+ * thread gives them back through a single producer, single consumer ring
+ * that is drained into the stack once the stack runs dry.
+ *
+ * Only the application thread adds and frees sets, so it looks them up
+ * without a lock; it takes the lock of the core to change the table.
+ * FreeAddress() takes it to look a set up and fill the ring, so the ring
+ * keeps a single producer at a time even when the application thread
+ * gives back a port whose connect could not start. A set whose ports are
+ * all back is freed once the core has gathered enough sets.
+ */
+struct port_set
 {
-	struct sockaddr_in addr;
-	TAILQ_ENTRY(addr_entry) addr_link;
+	struct port_set *next;		/* in the bucket of the core */
+	uint32_t saddr;				/* in host order */
+	uint32_t daddr;				/* in host order */
+	uint16_t dport;				/* in host order */
+
+	uint16_t *ports;			/* free stack (application thread) */
+	int num_free;
+	int num_ports;
+
+	/* ports given back; it holds every port, so it never fills up */
+	uint16_t *ret;
+	uint32_t ret_mask;
+	uint32_t ret_head;			/* application thread */
+	uint32_t ret_tail __attribute__((aligned(ADDR_CACHE_LINE)));	/* mtcp thread */
 };
 /*----------------------------------------------------------------------------*/
-struct addr_map
+struct addr_core
 {
-	struct addr_entry *addrmap[MAX_PORT];
+	pthread_spinlock_t lock;	/* table changes and mtcp thread lookups */
+	struct port_set **sets;		/* hash buckets */
+	int bucket_bits;			/* 1 << bucket_bits buckets */
+	int num_sets;
+	int sweep_at;				/* free the idle sets at this many sets */
+
+	int cur_addr;				/* source address tried first */
 };
 /*----------------------------------------------------------------------------*/
 struct addr_pool
 {
-	struct addr_entry *pool;		/* address pool */
-	struct addr_map *mapper;		/* address map  */
+	uint32_t addr_base;			/* in host order */
+	int num_addr;				/* number of addresses in use */
 
-	uint32_t addr_base;				/* in host order */
-	int num_addr;					/* number of addresses in use */
+	struct addr_core *cores[MAX_CPUS];	/* all created with the pool */
+};
+/*----------------------------------------------------------------------------*/
+static uint16_t port_bits[MAX_PORT];				/* hash bits of each port */
+static uint16_t port_order[MAX_PORT - MIN_PORT];	/* ports sorted by them */
+static int bits_start[RSS_HASH_BITS + 1];			/* first port of each value */
+static pthread_once_t port_order_once = PTHREAD_ONCE_INIT;
+/*----------------------------------------------------------------------------*/
+static void
+BuildPortOrder(void)
+{
+	int count[RSS_HASH_BITS] = {0};
+	int p, b;
 
-	int num_entry;
-	int num_free;
-	int num_used;
+	for (p = MIN_PORT; p < MAX_PORT; p++) {
+		port_bits[p] = GetRSSHashBits(0, 0, p, 0);
+		count[port_bits[p]]++;
+	}
 
-	pthread_mutex_t lock;
-	TAILQ_HEAD(, addr_entry) free_list;
-	TAILQ_HEAD(, addr_entry) used_list;
-};
+	bits_start[0] = 0;
+	for (b = 0; b < RSS_HASH_BITS; b++) {
+		bits_start[b + 1] = bits_start[b] + count[b];
+		count[b] = bits_start[b];
+	}
+
+	for (p = MIN_PORT; p < MAX_PORT; p++)
+		port_order[count[port_bits[p]]++] = p;
+}
 /*----------------------------------------------------------------------------*/
-addr_pool_t 
-CreateAddressPool(in_addr_t addr_base, int num_addr)
+static inline int
+PortSetBucket(int bucket_bits, uint32_t saddr, uint32_t daddr, uint16_t dport)
 {
-	struct addr_pool *ap;
-	int num_entry;
-	int i, j, cnt;
-	in_addr_t addr;
-	uint32_t addr_h;
+	return ((saddr ^ (daddr * 31) ^ dport) * 2654435761u) >> (32 - bucket_bits);
+}
+/*----------------------------------------------------------------------------*/
+/* the ports of (saddr, daddr, dport) whose packets come in on core */
+static struct port_set *
+CreatePortSet(int core, int num_queues, uint8_t endian_check,
+		uint32_t saddr, uint32_t daddr, uint16_t dport)
+{
+	struct port_set *ps;
+	uint32_t pair_bits, bits, nslots = 1;
+	int b, i, cnt = 0;
 
-	ap = (addr_pool_t)calloc(1, sizeof(struct addr_pool));
-	if (!ap)
+	pair_bits = GetRSSHashBits(saddr, daddr, 0, dport);
+
+	for (b = 0; b < RSS_HASH_BITS; b++) {
+		if (RSSHashBitsToCPUCore(b, num_queues, endian_check) != core)
+			continue;
+		bits = b ^ pair_bits;
+		cnt += bits_start[bits + 1] - bits_start[bits];
+	}
+
+	ps = (struct port_set *)calloc(1, sizeof(struct port_set));
+	if (!ps)
 		return NULL;
 
-	/* initialize address pool */
-	num_entry = num_addr * (MAX_PORT - MIN_PORT);
-	ap->pool = (struct addr_entry *)calloc(num_entry, sizeof(struct addr_entry));
-	if (!ap->pool) {
-		free(ap);
+	while (nslots < (uint32_t)cnt)
+		nslots <<= 1;
+	ps->ports = (uint16_t *)malloc(sizeof(uint16_t) * (cnt + 1));
+	ps->ret = (uint16_t *)malloc(sizeof(uint16_t) * nslots);
+	if (!ps->ports || !ps->ret) {
+		free(ps->ports);
+		free(ps->ret);
+		free(ps);
 		return NULL;
 	}
+	ps->ret_mask = nslots - 1;
+
+	ps->saddr = saddr;
+	ps->daddr = daddr;
+	ps->dport = dport;
+
+	for (b = 0; b < RSS_HASH_BITS; b++) {
+		if (RSSHashBitsToCPUCore(b, num_queues, endian_check) != core)
+			continue;
+		bits = b ^ pair_bits;
+		for (i = bits_start[bits]; i < bits_start[bits + 1]; i++)
+			ps->ports[ps->num_ports++] = port_order[i];
+	}
+	ps->num_free = ps->num_ports;
 
-	/* initialize address map */
-	ap->mapper = (struct addr_map *)calloc(num_addr, sizeof(struct addr_map));
-	if (!ap->mapper) {
-		free(ap->pool);
-		free(ap);
+	return ps;
+}
+/*----------------------------------------------------------------------------*/
+static void
+DestroyPortSet(struct port_set *ps)
+{
+	free(ps->ports);
+	free(ps->ret);
+	free(ps);
+}
+/*----------------------------------------------------------------------------*/
+/* takes the ports given back into the free stack (application thread) */
+static inline void
+DrainReturnedPorts(struct port_set *ps)
+{
+	uint32_t tail = __atomic_load_n(&ps->ret_tail, __ATOMIC_ACQUIRE);
+
+	while (ps->ret_head != tail)
+		ps->ports[ps->num_free++] = ps->ret[ps->ret_head++ & ps->ret_mask];
+}
+/*----------------------------------------------------------------------------*/
+/* the mtcp thread calls this only with the lock of the core held */
+static inline struct port_set *
+FindPortSet(struct addr_core *ac, uint32_t saddr, uint32_t daddr, uint16_t dport)
+{
+	struct port_set *ps;
+
+	ps = ac->sets[PortSetBucket(ac->bucket_bits, saddr, daddr, dport)];
+	for (; ps; ps = ps->next) {
+		if (ps->saddr == saddr && ps->daddr == daddr && ps->dport == dport)
+			break;
+	}
+
+	return ps;
+}
+/*----------------------------------------------------------------------------*/
+/* rehashes the sets into 1 << bits buckets; called with the lock held */
+static void
+ResizePortSets(struct addr_core *ac, int bits)
+{
+	struct port_set **sets;
+	struct port_set *ps, *next;
+	int i, idx;
+
+	sets = (struct port_set **)calloc(1 << bits, sizeof(struct port_set *));
+	if (!sets)
+		return;		/* keep the longer chains */
+
+	for (i = 0; i < (1 << ac->bucket_bits); i++) {
+		for (ps = ac->sets[i]; ps; ps = next) {
+			next = ps->next;
+			idx = PortSetBucket(bits, ps->saddr, ps->daddr, ps->dport);
+			ps->next = sets[idx];
+			sets[idx] = ps;
+		}
+	}
+
+	free(ac->sets);
+	ac->sets = sets;
+	ac->bucket_bits = bits;
+}
+/*----------------------------------------------------------------------------*/
+/* frees the sets with all their ports back and fits the buckets to the rest */
+static void
+SweepPortSets(struct addr_core *ac)
+{
+	struct port_set **pp, *ps;
+	int i, bits;
+
+	pthread_spin_lock(&ac->lock);
+
+	for (i = 0; i < (1 << ac->bucket_bits); i++) {
+		pp = &ac->sets[i];
+		while ((ps = *pp)) {
+			DrainReturnedPorts(ps);
+			if (ps->num_free >= ps->num_ports) {
+				*pp = ps->next;
+				DestroyPortSet(ps);
+				ac->num_sets--;
+			} else {
+				pp = &ps->next;
+			}
+		}
+	}
+
+	for (bits = ac->bucket_bits; 
+			bits > PORT_SET_MIN_BITS && ac->num_sets < (1 << bits) / 4; bits--)
+		;
+	if (bits != ac->bucket_bits)
+		ResizePortSets(ac, bits);
+
+	/* sweep again once the sets in use have doubled */
+	ac->sweep_at = MAX(PORT_SET_MIN_SWEEP, ac->num_sets * 2);
+
+	pthread_spin_unlock(&ac->lock);
+}
+/*----------------------------------------------------------------------------*/
+static struct port_set *
+GetPortSet(struct addr_core *ac, int core, int num_queues, uint8_t endian_check,
+		uint32_t saddr, uint32_t daddr, uint16_t dport)
+{
+	struct port_set *ps;
+	int idx;
+
+	ps = FindPortSet(ac, saddr, daddr, dport);
+	if (ps)
+		return ps;
+
+	if (ac->num_sets >= ac->sweep_at)
+		SweepPortSets(ac);
+
+	ps = CreatePortSet(core, num_queues, endian_check, saddr, daddr, dport);
+	if (!ps)
 		return NULL;
+
+	pthread_spin_lock(&ac->lock);
+	idx = PortSetBucket(ac->bucket_bits, saddr, daddr, dport);
+	ps->next = ac->sets[idx];
+	ac->sets[idx] = ps;
+	if (++ac->num_sets > (1 << ac->bucket_bits))
+		ResizePortSets(ac, ac->bucket_bits + 1);
+	pthread_spin_unlock(&ac->lock);
+
+	return ps;
+}
+/*----------------------------------------------------------------------------*/
+/* a free port of the set (port if non-zero), or 0 */
+static uint16_t
+TakePort(struct port_set *ps, uint16_t port)
+{
+	int i;
+
+	/* a specific port may be among the returned ones */
+	if (ps->num_free == 0 || port)
+		DrainReturnedPorts(ps);
+
+	if (!port)
+		return (ps->num_free > 0)? ps->ports[--ps->num_free] : 0;
+
+	for (i = 0; i < ps->num_free; i++) {
+		if (ps->ports[i] == port) {
+			ps->ports[i] = ps->ports[--ps->num_free];
+			return port;
+		}
 	}
 
-	TAILQ_INIT(&ap->free_list);
-	TAILQ_INIT(&ap->used_list);
+	return 0;
+}
+/*----------------------------------------------------------------------------*/
+static inline struct addr_core *
+GetAddressCore(addr_pool_t ap, int core)
+{
+	if (core < 0 || core >= MAX_CPUS)
+		return NULL;
+
+	return ap->cores[core];
+}
+/*----------------------------------------------------------------------------*/
+static struct addr_core *
+CreateAddressCore(void)
+{
+	struct addr_core *ac;
 
-	if (pthread_mutex_init(&ap->lock, NULL)) {
-		free(ap->pool);
-		free(ap);
+	ac = (struct addr_core *)calloc(1, sizeof(struct addr_core));
+	if (!ac)
+		return NULL;
+
+	ac->bucket_bits = PORT_SET_MIN_BITS;
+	ac->sweep_at = PORT_SET_MIN_SWEEP;
+	ac->sets = (struct port_set **)calloc(1 << ac->bucket_bits, 
+			sizeof(struct port_set *));
+	if (!ac->sets) {
+		free(ac);
+		return NULL;
+	}
+	if (pthread_spin_init(&ac->lock, PTHREAD_PROCESS_PRIVATE)) {
+		perror("pthread_spin_init of addr_core->lock");
+		free(ac->sets);
+		free(ac);
 		return NULL;
 	}
 
-	pthread_mutex_lock(&ap->lock);
+	return ac;
+}
+/*----------------------------------------------------------------------------*/
+static void
+DestroyAddressCore(struct addr_core *ac)
+{
+	struct port_set *ps, *next;
+	int i;
+
+	for (i = 0; i < (1 << ac->bucket_bits); i++) {
+		for (ps = ac->sets[i]; ps; ps = next) {
+			next = ps->next;
+			DestroyPortSet(ps);
+		}
+	}
+	pthread_spin_destroy(&ac->lock);
+	free(ac->sets);
+	free(ac);
+}
+/*----------------------------------------------------------------------------*/
+addr_pool_t
+CreateAddressPool(in_addr_t addr_base, int num_addr)
+{
+	struct addr_pool *ap;
+	int core;
+
+	pthread_once(&port_order_once, BuildPortOrder);
+
+	ap = (addr_pool_t)calloc(1, sizeof(struct addr_pool));
+	if (!ap)
+		return NULL;
 
 	ap->addr_base = ntohl(addr_base);
 	ap->num_addr = num_addr;
 
-	cnt = 0;
-	for (i = 0; i < num_addr; i++) {
-		addr_h = ap->addr_base + i;
-		addr = htonl(addr_h);
-		for (j = MIN_PORT; j < MAX_PORT; j++) {
-			ap->pool[cnt].addr.sin_addr.s_addr = addr;
-			ap->pool[cnt].addr.sin_port = htons(j);
-			ap->mapper[i].addrmap[j] = &ap->pool[cnt];
-			
-			TAILQ_INSERT_TAIL(&ap->free_list, &ap->pool[cnt], addr_link);
-
-			if ((++cnt) >= num_entry)
-				break;
+	/* the pool is shared by the threads of all the cores: every core 
+	   gets its part here, before any of them can look at it */
+	for (core = 0; core < MAX_CPUS; core++) {
+		ap->cores[core] = CreateAddressCore();
+		if (!ap->cores[core]) {
+			DestroyAddressPool(ap);
+			return NULL;
 		}
 	}
-	ap->num_entry = cnt;
-	ap->num_free = cnt;
-	ap->num_used = 0;
-	
-	pthread_mutex_unlock(&ap->lock);
 
 	return ap;
 }
 /*----------------------------------------------------------------------------*/
-addr_pool_t 
-CreateAddressPoolPerCore(int core, int num_queues, 
+addr_pool_t
+CreateAddressPoolPerCore(int core, int num_queues,
 		in_addr_t saddr_base, int num_addr, in_addr_t daddr, in_port_t dport)
 {
 	struct addr_pool *ap;
-	int num_entry;
-	int i, j, cnt;
-	in_addr_t saddr;
-	uint32_t saddr_h, daddr_h;
-	uint16_t sport_h, dport_h;
-	int rss_core;
+	struct addr_core *ac;
+	struct port_set *ps;
+	int i, cnt;
 #if 0
 	uint8_t endian_check = (current_iomodule_func == &dpdk_module_func) ?
 		0 : 1;
 #else
-	uint8_t endian_check = FetchEndianType();	
+	uint8_t endian_check = FetchEndianType();
 #endif
 
-	ap = (addr_pool_t)calloc(1, sizeof(struct addr_pool));
+	ap = CreateAddressPool(saddr_base, num_addr);
 	if (!ap)
 		return NULL;
 
-	/* initialize address pool */
-	num_entry = (num_addr * (MAX_PORT - MIN_PORT)) / num_queues;
-	ap->pool = (struct addr_entry *)calloc(num_entry, sizeof(struct addr_entry));
-	if (!ap->pool) {
-		free(ap);
-		return NULL;
-	}
-	
-	/* initialize address map */
-	ap->mapper = (struct addr_map *)calloc(num_addr, sizeof(struct addr_map));
-	if (!ap->mapper) {
-		free(ap->pool);
-		free(ap);
+	ac = GetAddressCore(ap, core);
+	if (!ac) {
+		DestroyAddressPool(ap);
 		return NULL;
 	}
 
-	TAILQ_INIT(&ap->free_list);
-	TAILQ_INIT(&ap->used_list);
-
-	if (pthread_mutex_init(&ap->lock, NULL)) {
-		free(ap->pool);
-		free(ap);
-		return NULL;
-	}
-
-	pthread_mutex_lock(&ap->lock);
-
-	ap->addr_base = ntohl(saddr_base);
-	ap->num_addr = num_addr;
-	daddr_h = ntohl(daddr);
-	dport_h = ntohs(dport);
-
-	/* search address space to get RSS-friendly addresses */
+	/* the destination is known: have its ports ready for the first connect */
 	cnt = 0;
 	for (i = 0; i < num_addr; i++) {
-		saddr_h = ap->addr_base + i;
-		saddr = htonl(saddr_h);
-		for (j = MIN_PORT; j < MAX_PORT; j++) {
-			if (cnt >= num_entry)
-				break;
-
-			sport_h = j;
-			rss_core = GetRSSCPUCore(daddr_h, saddr_h, dport_h, sport_h, num_queues, endian_check);
-			if (rss_core != core)
-				continue;
-
-			ap->pool[cnt].addr.sin_addr.s_addr = saddr;
-			ap->pool[cnt].addr.sin_port = htons(sport_h);
-			ap->mapper[i].addrmap[j] = &ap->pool[cnt];
-			TAILQ_INSERT_TAIL(&ap->free_list, &ap->pool[cnt], addr_link);
-			cnt++;
+		ps = GetPortSet(ac, core, num_queues, endian_check,
+				ap->addr_base + i, ntohl(daddr), ntohs(dport));
+		if (!ps) {
+			DestroyAddressPool(ap);
+			return NULL;
 		}
+		cnt += ps->num_ports;
 	}
 
-	ap->num_entry = cnt;
-	ap->num_free = cnt;
-	ap->num_used = 0;
 	//fprintf(stderr, "CPU %d: Created %d address entries.\n", core, cnt);
-	if (ap->num_entry < CONFIG.max_concurrency) {
+	if (cnt < CONFIG.max_concurrency) {
 		fprintf(stderr, "[WARINING] Available # addresses (%d) is smaller than"
-				" the max concurrency (%d).\n", 
-				ap->num_entry, CONFIG.max_concurrency);
+				" the max concurrency (%d).\n",
+				cnt, CONFIG.max_concurrency);
 	}
-	
-	pthread_mutex_unlock(&ap->lock);
 
 	return ap;
 }
@@ -195,157 +427,97 @@ CreateAddressPoolPerCore(int core, int num_queues,
 void
 DestroyAddressPool(addr_pool_t ap)
 {
+	int core;
+
 	if (!ap)
 		return;
 
-	if (ap->pool) {
-		free(ap->pool);
-		ap->pool = NULL;
-	}
-
-	if (ap->mapper) {
-		free(ap->mapper);
-		ap->mapper = NULL;
+	for (core = 0; core < MAX_CPUS; core++) {
+		if (ap->cores[core])
+			DestroyAddressCore(ap->cores[core]);
 	}
 
-	pthread_mutex_destroy(&ap->lock);
-
 	free(ap);
 }
 /*----------------------------------------------------------------------------*/
-int 
-FetchAddress(addr_pool_t ap, int core, int num_queues, 
+int
+FetchAddress(addr_pool_t ap, int core, int num_queues,
 		const struct sockaddr_in *daddr, struct sockaddr_in *saddr)
 {
-	struct addr_entry *walk, *next;
-	int rss_core;
-	int ret = -1;
+	struct addr_core *ac;
+	struct port_set *ps;
+	uint32_t addr_h;
+	uint16_t port;
+	int i, idx;
 #if 0
 	uint8_t endian_check = (current_iomodule_func == &dpdk_module_func) ?
 		0 : 1;
 #else
-	uint8_t endian_check = FetchEndianType();	
+	uint8_t endian_check = FetchEndianType();
 #endif
 
 	if (!ap || !daddr || !saddr)
 		return -1;
 
-	pthread_mutex_lock(&ap->lock);
+	ac = GetAddressCore(ap, core);
+	if (!ac)
+		return -1;
 
-	walk = TAILQ_FIRST(&ap->free_list);
-	while (walk) {
-		next = TAILQ_NEXT(walk, addr_link);
+	/* stay on one source address until its ports run out */
+	for (i = 0; i < ap->num_addr; i++) {
+		idx = (ac->cur_addr + i) % ap->num_addr;
+		addr_h = ap->addr_base + idx;
 
 		if (saddr->sin_addr.s_addr != INADDR_ANY &&
-		    walk->addr.sin_addr.s_addr != saddr->sin_addr.s_addr) {
-			walk = next;
+		    saddr->sin_addr.s_addr != htonl(addr_h))
 			continue;
-		}
 
-		if (saddr->sin_port != INPORT_ANY &&
-		    walk->addr.sin_port != saddr->sin_port) {
-			walk = next;
-			continue;
+		ps = GetPortSet(ac, core, num_queues, endian_check, addr_h,
+				ntohl(daddr->sin_addr.s_addr), ntohs(daddr->sin_port));
+		if (!ps)
+			return -1;
+
+		port = TakePort(ps, ntohs(saddr->sin_port));
+		if (port) {
+			ac->cur_addr = idx;
+			saddr->sin_addr.s_addr = htonl(addr_h);
+			saddr->sin_port = htons(port);
+			return 0;
 		}
-
-		rss_core = GetRSSCPUCore(ntohl(walk->addr.sin_addr.s_addr), 
-					 ntohl(daddr->sin_addr.s_addr), ntohs(walk->addr.sin_port), 
-					 ntohs(daddr->sin_port), num_queues, endian_check);
-
-		if (core == rss_core)
-			break;
-
-		walk = next;
-	}
-
-	if (walk) {
-		*saddr = walk->addr;
-		TAILQ_REMOVE(&ap->free_list, walk, addr_link);
-		TAILQ_INSERT_TAIL(&ap->used_list, walk, addr_link);
-		ap->num_free--;
-		ap->num_used++;
-		ret = 0;
 	}
-	
-	pthread_mutex_unlock(&ap->lock);
 
-	return ret;
+	return -1;
 }
 /*----------------------------------------------------------------------------*/
-int 
-FetchAddressPerCore(addr_pool_t ap, int core, int num_queues,
-		    const struct sockaddr_in *daddr, struct sockaddr_in *saddr)
+int
+FreeAddress(addr_pool_t ap, int core,
+		const struct sockaddr_in *saddr, const struct sockaddr_in *daddr)
 {
-	struct addr_entry *walk;
-	int ret = -1;
+	struct addr_core *ac;
+	struct port_set *ps;
+	uint32_t tail;
 
-	if (!ap || !daddr || !saddr)
+	if (!ap || !saddr || !daddr)
 		return -1;
 
-	pthread_mutex_lock(&ap->lock);
-	
-	/* we don't need to calculate RSSCPUCore if mtcp_init_rss is called */
-	walk = TAILQ_FIRST(&ap->free_list);
-	if (walk) {
-		*saddr = walk->addr;
-		TAILQ_REMOVE(&ap->free_list, walk, addr_link);
-		TAILQ_INSERT_TAIL(&ap->used_list, walk, addr_link);
-		ap->num_free--;
-		ap->num_used++;
-		ret = 0;
-	}
-	
-	pthread_mutex_unlock(&ap->lock);
-	
-	return ret;
-}
-/*----------------------------------------------------------------------------*/
-int 
-FreeAddress(addr_pool_t ap, const struct sockaddr_in *addr)
-{
-	struct addr_entry *walk, *next;
-	int ret = -1;
-
-	if (!ap || !addr)
+	ac = GetAddressCore(ap, core);
+	if (!ac)
 		return -1;
 
-	pthread_mutex_lock(&ap->lock);
-
-	if (ap->mapper) {
-		uint32_t addr_h = ntohl(addr->sin_addr.s_addr);
-		uint16_t port_h = ntohs(addr->sin_port);
-		int index = addr_h - ap->addr_base;
-
-		if (index >= 0 && index < ap->num_addr) {
-			walk = ap->mapper[addr_h - ap->addr_base].addrmap[port_h];
-		} else {
-			walk = NULL;
-		}
-
-	} else {
-		walk = TAILQ_FIRST(&ap->used_list);
-		while (walk) {
-			next = TAILQ_NEXT(walk, addr_link);
-			if (addr->sin_port == walk->addr.sin_port && 
-					addr->sin_addr.s_addr == walk->addr.sin_addr.s_addr) {
-				break;
-			}
-
-			walk = next;
-		}
-
-	}
-
-	if (walk) {
-		TAILQ_REMOVE(&ap->used_list, walk, addr_link);
-		TAILQ_INSERT_TAIL(&ap->free_list, walk, addr_link);
-		ap->num_free++;
-		ap->num_used--;
-		ret = 0;
+	/* the application thread may be freeing sets or resizing the table */
+	pthread_spin_lock(&ac->lock);
+	ps = FindPortSet(ac, ntohl(saddr->sin_addr.s_addr),
+			ntohl(daddr->sin_addr.s_addr), ntohs(daddr->sin_port));
+	if (!ps) {
+		pthread_spin_unlock(&ac->lock);
+		return -1;
 	}
 
-	pthread_mutex_unlock(&ap->lock);
+	tail = ps->ret_tail;
+	ps->ret[tail & ps->ret_mask] = ntohs(saddr->sin_port);
+	__atomic_store_n(&ps->ret_tail, tail + 1, __ATOMIC_RELEASE);
+	pthread_spin_unlock(&ac->lock);
 
-	return ret;
+	return 0;
 }
 /*----------------------------------------------------------------------------*/
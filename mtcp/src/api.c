@@ -9,6 +9,8 @@
 #include "tcp_in.h"
 #include "tcp_stream.h"
 #include "tcp_out.h"
+#include "tcp_cc.h"
+#include "tcp_fastopen.h"
 #include "ip_out.h"
 #include "eventpoll.h"
 #include "pipe.h"
@@ -21,6 +23,23 @@
 #define MAX(a, b) ((a)>(b)?(a):(b))
 #define MIN(a, b) ((a)<(b)?(a):(b))
 
+#ifndef TCP_FASTOPEN_CONNECT
+#define TCP_FASTOPEN_CONNECT 30
+#endif
+
+/* mtcp_recvmmsg() and mtcp_sendmmsg() hand their requests to the mtcp 
+   thread in chunks of up to this many streams per queue */
+#define MMSG_BATCH 64
+
+/* send and window update requests collected over a batch of calls */
+struct api_batch
+{
+	int send_cnt;
+	int ack_cnt;
+	tcp_stream *send[MMSG_BATCH];
+	tcp_stream *ack[MMSG_BATCH];
+};
+
 /*----------------------------------------------------------------------------*/
 static inline int 
 mtcp_is_connected(mtcp_manager_t mtcp, tcp_stream *cur_stream)
@@ -114,6 +133,202 @@ GetSocketError(socket_map_t socket, void *optval, socklen_t *optlen)
 	return -1;
 }
 /*----------------------------------------------------------------------------*/
+static inline int 
+GetCongestionControlOpt(socket_map_t socket, void *optval, socklen_t *optlen)
+{
+	const struct tcp_cc_ops *cc = socket->cc;
+
+	if (socket->socktype == MTCP_SOCK_STREAM && socket->stream) {
+		cc = socket->stream->sndvar->cc_req ? 
+				socket->stream->sndvar->cc_req : socket->stream->sndvar->cc;
+	}
+	if (!cc) {
+		cc = GetDefaultCongestionControl();
+	}
+
+	if (*optlen <= 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	strncpy((char *)optval, cc->name, *optlen);
+	*optlen = MIN(*optlen, strlen(cc->name) + 1);
+
+	return 0;
+}
+/*----------------------------------------------------------------------------*/
+static inline int 
+SetCongestionControlOpt(socket_map_t socket, const void *optval, socklen_t optlen)
+{
+	const struct tcp_cc_ops *cc;
+	char name[CC_NAME];
+
+	if (!optval || optlen <= 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	optlen = MIN(optlen, sizeof(name) - 1);
+	memcpy(name, optval, optlen);
+	name[optlen] = '\0';
+
+	cc = GetCongestionControl(name);
+	if (!cc) {
+		TRACE_API("Unknown congestion control: %s\n", name);
+		errno = ENOENT;
+		return -1;
+	}
+
+	socket->cc = cc;
+	/* an existing stream switches at its next ack */
+	if (socket->socktype == MTCP_SOCK_STREAM && socket->stream) {
+		socket->stream->sndvar->cc_req = cc;
+	}
+
+	return 0;
+}
+/*----------------------------------------------------------------------------*/
+/* has the mtcp thread flush the send buffer of the stream; with a batch, 
+   the request waits there for FlushBatch() */
+static inline void
+RequestSend(mtcp_manager_t mtcp, tcp_stream *cur_stream, struct api_batch *batch)
+{
+	struct tcp_send_vars *sndvar = cur_stream->sndvar;
+
+	/* the first write of a fast open connect sends the SYN */
+	if (cur_stream->tfo & TFO_DEFERRED) {
+		cur_stream->tfo &= ~TFO_DEFERRED;
+		SQ_LOCK(&mtcp->ctx->connect_lock);
+		StreamEnqueue(mtcp->connectq, cur_stream);
+		SQ_UNLOCK(&mtcp->ctx->connect_lock);
+		WakeupMTCPThread(mtcp);
+		return;
+	}
+
+	if (!(sndvar->on_sendq || sndvar->on_send_list)) {
+		if (batch) {
+			sndvar->on_sendq = TRUE;
+			batch->send[batch->send_cnt++] = cur_stream;
+			return;
+		}
+		SQ_LOCK(&mtcp->ctx->sendq_lock);
+		sndvar->on_sendq = TRUE;
+		StreamEnqueue(mtcp->sendq, cur_stream);		/* this always success */
+		SQ_UNLOCK(&mtcp->ctx->sendq_lock);
+		WakeupMTCPThread(mtcp);
+	}
+}
+/*----------------------------------------------------------------------------*/
+/* queues the requests of a batch, one lock and one wakeup per queue */
+static inline void
+FlushBatch(mtcp_manager_t mtcp, struct api_batch *batch)
+{
+	if (batch->send_cnt > 0) {
+		SQ_LOCK(&mtcp->ctx->sendq_lock);
+		StreamEnqueueBatch(mtcp->sendq, batch->send, batch->send_cnt);
+		SQ_UNLOCK(&mtcp->ctx->sendq_lock);
+	}
+	if (batch->ack_cnt > 0) {
+		SQ_LOCK(&mtcp->ctx->ackq_lock);
+		StreamEnqueueBatch(mtcp->ackq, batch->ack, batch->ack_cnt);
+		SQ_UNLOCK(&mtcp->ctx->ackq_lock);
+	}
+	if (batch->send_cnt > 0 || batch->ack_cnt > 0)
+		WakeupMTCPThread(mtcp);
+
+	batch->send_cnt = 0;
+	batch->ack_cnt = 0;
+}
+/*----------------------------------------------------------------------------*/
+/* the batch goes out before a call that may block waiting for the mtcp 
+   thread, or that finds its stream already flagged on_sendq/on_ackq in 
+   the batch and so would rely on a request that is not queued yet */
+static inline int
+BatchNeedsFlush(mtcp_manager_t mtcp, struct api_batch *batch, int sockid)
+{
+	socket_map_t socket;
+	tcp_stream *cur_stream;
+	int i;
+
+	if (batch->send_cnt == 0 && batch->ack_cnt == 0)
+		return FALSE;
+	if (sockid < 0 || sockid >= CONFIG.max_concurrency)
+		return FALSE;
+
+	socket = &mtcp->smap[sockid];
+#if BLOCKING_SUPPORT
+	if (!(socket->opts & MTCP_NONBLOCK))
+		return TRUE;
+#endif
+	cur_stream = socket->stream;
+	if (socket->socktype != MTCP_SOCK_STREAM || !cur_stream)
+		return FALSE;
+	if (!cur_stream->sndvar->on_sendq && !cur_stream->sndvar->on_ackq)
+		return FALSE;
+
+	for (i = 0; i < batch->send_cnt; i++) {
+		if (batch->send[i] == cur_stream)
+			return TRUE;
+	}
+	for (i = 0; i < batch->ack_cnt; i++) {
+		if (batch->ack[i] == cur_stream)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+/*----------------------------------------------------------------------------*/
+static inline int 
+GetSocketFlagOpt(socket_map_t socket, uint32_t flag, 
+		void *optval, socklen_t *optlen)
+{
+	if (*optlen < sizeof(int)) {
+		errno = EINVAL;
+		return -1;
+	}
+	*(int *)optval = (socket->opts & flag) ? 1 : 0;
+	*optlen = sizeof(int);
+
+	return 0;
+}
+/*----------------------------------------------------------------------------*/
+/* TCP_NODELAY and TCP_CORK */
+static inline int 
+SetSocketFlagOpt(mtcp_manager_t mtcp, socket_map_t socket, uint32_t flag, 
+		const void *optval, socklen_t optlen)
+{
+	if (!optval || optlen < sizeof(int)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (*(const int *)optval) {
+		socket->opts |= flag;
+	} else {
+		socket->opts &= ~flag;
+	}
+
+	/* setting TCP_NODELAY or clearing TCP_CORK sends what was held back */
+	if (socket->socktype == MTCP_SOCK_STREAM && socket->stream && 
+			socket->stream->sndvar->sndbuf && 
+			(flag == MTCP_NODELAY) == ((socket->opts & flag) != 0)) {
+		RequestSend(mtcp, socket->stream, NULL);
+	}
+
+	return 0;
+}
+/*----------------------------------------------------------------------------*/
+static inline int 
+SetFastOpenOpt(socket_map_t socket, const void *optval, socklen_t optlen)
+{
+	if (!optval || optlen < sizeof(int) || *(const int *)optval < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	socket->tfo_qlen = *(const int *)optval;
+
+	return 0;
+}
+/*----------------------------------------------------------------------------*/
 int
 mtcp_getsockname(mctx_t mctx, int sockid, struct sockaddr *addr,
 		 socklen_t *addrlen)
@@ -251,6 +466,24 @@ mtcp_getsockopt(mctx_t mctx, int sockid, int level,
 				return GetSocketError(socket, optval, optlen);
 			}
 		}
+	} else if (level == IPPROTO_TCP) {
+		if (optname == TCP_CONGESTION) {
+			return GetCongestionControlOpt(socket, optval, optlen);
+		} else if (optname == TCP_NODELAY) {
+			return GetSocketFlagOpt(socket, MTCP_NODELAY, optval, optlen);
+		} else if (optname == TCP_CORK) {
+			return GetSocketFlagOpt(socket, MTCP_CORK, optval, optlen);
+		} else if (optname == TCP_FASTOPEN) {
+			if (*optlen < sizeof(int)) {
+				errno = EINVAL;
+				return -1;
+			}
+			*(int *)optval = socket->tfo_qlen;
+			*optlen = sizeof(int);
+			return 0;
+		} else if (optname == TCP_FASTOPEN_CONNECT) {
+			return GetSocketFlagOpt(socket, MTCP_FASTOPEN_CONNECT, optval, optlen);
+		}
 	}
 
 	errno = ENOSYS;
@@ -289,6 +522,29 @@ mtcp_setsockopt(mctx_t mctx, int sockid, int level,
 		return -1;
 	}
 
+	if (level == IPPROTO_TCP) {
+		if (optname == TCP_CONGESTION) {
+			return SetCongestionControlOpt(socket, optval, optlen);
+		} else if (optname == TCP_NODELAY) {
+			return SetSocketFlagOpt(mtcp, socket, MTCP_NODELAY, optval, optlen);
+		} else if (optname == TCP_CORK) {
+			return SetSocketFlagOpt(mtcp, socket, MTCP_CORK, optval, optlen);
+		} else if (optname == TCP_FASTOPEN) {
+			return SetFastOpenOpt(socket, optval, optlen);
+		} else if (optname == TCP_FASTOPEN_CONNECT) {
+			if (!optval || optlen < sizeof(int)) {
+				errno = EINVAL;
+				return -1;
+			}
+			if (*(const int *)optval) {
+				socket->opts |= MTCP_FASTOPEN_CONNECT;
+			} else {
+				socket->opts &= ~MTCP_FASTOPEN_CONNECT;
+			}
+			return 0;
+		}
+	}
+
 	return 0;
 }
 /*----------------------------------------------------------------------------*/
@@ -401,7 +657,7 @@ mtcp_socket(mctx_t mctx, int domain, int type, int protocol)
 		return -1;
 	}
 
-	socket = AllocateSocket(mctx, type, FALSE);
+	socket = AllocateSocket(mctx, type);
 	if (!socket) {
 		errno = ENFILE;
 		return -1;
@@ -544,6 +800,8 @@ mtcp_listen(mctx_t mctx, int sockid, int backlog)
 		return -1;
 	}
 	
+	InitTFOListenerKey(listener);
+
 	mtcp->smap[sockid].listener = listener;
 	ListenerHTInsert(mtcp->listeners, listener);
 
@@ -605,7 +863,7 @@ mtcp_accept(mctx_t mctx, int sockid, struct sockaddr *addr, socklen_t *addrlen)
 	}
 
 	if (!accepted->socket) {
-		socket = AllocateSocket(mctx, MTCP_SOCK_STREAM, FALSE);
+		socket = AllocateSocket(mctx, MTCP_SOCK_STREAM);
 		if (!socket) {
 			TRACE_ERROR("Failed to create new socket!\n");
 			/* TODO: destroy the stream */
@@ -616,6 +874,8 @@ mtcp_accept(mctx_t mctx, int sockid, struct sockaddr *addr, socklen_t *addrlen)
 		accepted->socket = socket;
 
 		/* set socket parameters */
+		socket->opts &= ~(MTCP_NODELAY | MTCP_CORK);
+		socket->opts |= listener->socket->opts & (MTCP_NODELAY | MTCP_CORK);
 		socket->saddr.sin_family = AF_INET;
 		socket->saddr.sin_port = accepted->dport;
 		socket->saddr.sin_addr.s_addr = accepted->daddr;
@@ -623,7 +883,7 @@ mtcp_accept(mctx_t mctx, int sockid, struct sockaddr *addr, socklen_t *addrlen)
 
 	if (!(listener->socket->epoll & MTCP_EPOLLET) &&
 	    !StreamQueueIsEmpty(listener->acceptq))
-		AddEpollEvent(mtcp->ep, 
+		AddEpollEvent(listener->socket->reg_ep, 
 			      USR_SHADOW_EVENT_QUEUE,
 			      listener->socket, MTCP_EPOLLIN);
 
@@ -641,6 +901,125 @@ mtcp_accept(mctx_t mctx, int sockid, struct sockaddr *addr, socklen_t *addrlen)
 }
 /*----------------------------------------------------------------------------*/
 int 
+mtcp_accept_batch(mctx_t mctx, int sockid, int *sockids, 
+		struct sockaddr_in *addrs, int max)
+{
+	mtcp_manager_t mtcp;
+	struct tcp_listener *listener;
+	socket_map_t socket;
+	socket_map_t socks[MMSG_BATCH];
+	tcp_stream *accepted;
+	int cnt, n, used, i;
+
+	mtcp = GetMTCPManager(mctx);
+	if (!mtcp) {
+		return -1;
+	}
+
+	if (sockid < 0 || sockid >= CONFIG.max_concurrency) {
+		TRACE_API("Socket id %d out of range.\n", sockid);
+		errno = EBADF;
+		return -1;
+	}
+
+	/* requires listening socket */
+	if (mtcp->smap[sockid].socktype != MTCP_SOCK_LISTENER) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (!sockids || max <= 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	listener = mtcp->smap[sockid].listener;
+
+	/* wait for the first connection as mtcp_accept() does */
+	if (StreamQueueIsEmpty(listener->acceptq)) {
+		if (listener->socket->opts & MTCP_NONBLOCK) {
+			errno = EAGAIN;
+			return -1;
+		}
+
+		pthread_mutex_lock(&listener->accept_lock);
+		while (StreamQueueIsEmpty(listener->acceptq)) {
+			pthread_cond_wait(&listener->accept_cond, &listener->accept_lock);
+
+			if (mtcp->ctx->done || mtcp->ctx->exit) {
+				pthread_mutex_unlock(&listener->accept_lock);
+				errno = EINTR;
+				return -1;
+			}
+		}
+		pthread_mutex_unlock(&listener->accept_lock);
+	}
+
+	cnt = 0;
+	while (cnt < max && !StreamQueueIsEmpty(listener->acceptq)) {
+		/* 
+		 * take the sockets before the streams, so that a full socket 
+		 * map leaves the connections queued instead of losing them 
+		 */
+		n = MIN(max - cnt, MMSG_BATCH);
+		for (i = 0; i < n; i++) {
+			socks[i] = AllocateSocket(mctx, MTCP_SOCK_STREAM);
+			if (!socks[i])
+				break;
+		}
+		n = i;
+		if (n == 0)
+			break;
+
+		used = 0;
+		while (cnt < max && used < n && 
+		       (accepted = StreamDequeue(listener->acceptq)) != NULL) {
+			if (!accepted->socket) {
+				socket = socks[used++];
+				socket->stream = accepted;
+				accepted->socket = socket;
+
+				/* set socket parameters */
+				socket->opts &= ~(MTCP_NODELAY | MTCP_CORK);
+				socket->opts |= listener->socket->opts & 
+						(MTCP_NODELAY | MTCP_CORK);
+				socket->saddr.sin_family = AF_INET;
+				socket->saddr.sin_port = accepted->dport;
+				socket->saddr.sin_addr.s_addr = accepted->daddr;
+			}
+
+			sockids[cnt] = accepted->socket->id;
+			if (addrs) {
+				addrs[cnt].sin_family = AF_INET;
+				addrs[cnt].sin_port = accepted->dport;
+				addrs[cnt].sin_addr.s_addr = accepted->daddr;
+			}
+			cnt++;
+		}
+
+		for (i = used; i < n; i++)
+			FreeSocket(mctx, socks[i]->id);
+	}
+
+	if (cnt == 0) {
+		TRACE_ERROR("Failed to create new socket!\n");
+		errno = ENFILE;
+		return -1;
+	}
+
+	/* one re-arm of the listener for the whole batch */
+	if (!(listener->socket->epoll & MTCP_EPOLLET) &&
+	    !StreamQueueIsEmpty(listener->acceptq))
+		AddEpollEvent(listener->socket->reg_ep, 
+			      USR_SHADOW_EVENT_QUEUE,
+			      listener->socket, MTCP_EPOLLIN);
+
+	TRACE_API("%d streams accepted on socket %d.\n", cnt, sockid);
+
+	return cnt;
+}
+/*----------------------------------------------------------------------------*/
+int 
 mtcp_init_rss(mctx_t mctx, in_addr_t saddr_base, int num_addr, 
 		in_addr_t daddr, in_addr_t dport)
 {
@@ -689,23 +1068,11 @@ mtcp_init_rss(mctx_t mctx, in_addr_t saddr_base, int num_addr,
 	return 0;
 }
 /*----------------------------------------------------------------------------*/
-int 
-mtcp_connect(mctx_t mctx, int sockid, 
+static int 
+CheckConnect(mtcp_manager_t mtcp, int sockid, 
 		const struct sockaddr *addr, socklen_t addrlen)
 {
-	mtcp_manager_t mtcp;
 	socket_map_t socket;
-	tcp_stream *cur_stream;
-	struct sockaddr_in *addr_in;
-	in_addr_t dip;
-	in_port_t dport;
-	int is_dyn_bound = FALSE;
-	int ret, nif;
-
-	mtcp = GetMTCPManager(mctx);
-	if (!mtcp) {
-		return -1;
-	}
 
 	if (sockid < 0 || sockid >= CONFIG.max_concurrency) {
 		TRACE_API("Socket id %d out of range.\n", sockid);
@@ -749,39 +1116,106 @@ mtcp_connect(mctx_t mctx, int sockid,
 		return -1;
 	}
 
+	return 0;
+}
+/*----------------------------------------------------------------------------*/
+static inline int 
+IsBoundForConnect(socket_map_t socket)
+{
+	return (socket->opts & MTCP_ADDR_BIND) && 
+		socket->saddr.sin_port != INPORT_ANY &&
+		socket->saddr.sin_addr.s_addr != INADDR_ANY;
+}
+/*----------------------------------------------------------------------------*/
+static int 
+CheckBoundRSS(mctx_t mctx, socket_map_t socket, in_addr_t dip, in_port_t dport)
+{
+	int rss_core;
+	uint8_t endian_check = FetchEndianType();
+
+	rss_core = GetRSSCPUCore(socket->saddr.sin_addr.s_addr, dip, 
+				 socket->saddr.sin_port, dport, num_queues, endian_check);
+
+	if (rss_core != mctx->cpu) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return 0;
+}
+/*----------------------------------------------------------------------------*/
+static tcp_stream *
+StartConnect(mtcp_manager_t mtcp, socket_map_t socket, 
+		in_addr_t dip, in_port_t dport, int is_dyn_bound)
+{
+	tcp_stream *cur_stream;
+
+	cur_stream = CreateTCPStream(mtcp, socket, socket->socktype, 
+			socket->saddr.sin_addr.s_addr, socket->saddr.sin_port, dip, dport);
+	if (!cur_stream) {
+		TRACE_ERROR("Socket %d: failed to create tcp_stream!\n", socket->id);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	if (is_dyn_bound)
+		cur_stream->is_bound_addr = TRUE;
+	cur_stream->sndvar->cwnd = 1;
+	cur_stream->sndvar->ssthresh = cur_stream->sndvar->mss * 10;
+
+	cur_stream->state = TCP_ST_SYN_SENT;
+	TRACE_STATE("Stream %d: TCP_ST_SYN_SENT\n", cur_stream->id);
+
+	/* 
+	 * fast open: the SYN goes with the first write, as if connected. 
+	 * Without a cached cookie it asks for one and the data waits for 
+	 * the handshake. 
+	 */
+	if ((socket->opts & MTCP_FASTOPEN_CONNECT) && 
+			(CONFIG.tcp_fastopen & TCP_FASTOPEN_CLIENT)) {
+		cur_stream->tfo = TFO_REQUESTED | TFO_DEFERRED;
+	}
+
+	return cur_stream;
+}
+/*----------------------------------------------------------------------------*/
+int 
+mtcp_connect(mctx_t mctx, int sockid, 
+		const struct sockaddr *addr, socklen_t addrlen)
+{
+	mtcp_manager_t mtcp;
+	socket_map_t socket;
+	tcp_stream *cur_stream;
+	struct sockaddr_in *addr_in;
+	in_addr_t dip;
+	in_port_t dport;
+	int is_dyn_bound = FALSE;
+	int ret;
+
+	mtcp = GetMTCPManager(mctx);
+	if (!mtcp) {
+		return -1;
+	}
+
+	if (CheckConnect(mtcp, sockid, addr, addrlen) < 0)
+		return -1;
+
+	socket = &mtcp->smap[sockid];
 	addr_in = (struct sockaddr_in *)addr;
 	dip = addr_in->sin_addr.s_addr;
 	dport = addr_in->sin_port;
 
 	/* address binding */
-	if ((socket->opts & MTCP_ADDR_BIND) && 
-	    socket->saddr.sin_port != INPORT_ANY &&
-	    socket->saddr.sin_addr.s_addr != INADDR_ANY) {
-		int rss_core;
-		uint8_t endian_check = FetchEndianType();
-		
-		rss_core = GetRSSCPUCore(socket->saddr.sin_addr.s_addr, dip, 
-					 socket->saddr.sin_port, dport, num_queues, endian_check);
-		
-		if (rss_core != mctx->cpu) {
-			errno = EINVAL;
+	if (IsBoundForConnect(socket)) {
+		if (CheckBoundRSS(mctx, socket, dip, dport) < 0)
 			return -1;
-		}
 	} else {
-		if (mtcp->ap) {
-			ret = FetchAddressPerCore(mtcp->ap, 
-						  mctx->cpu, num_queues, addr_in, &socket->saddr);
-		} else {
-			uint8_t is_external;
-			nif = GetOutputInterface(dip, &is_external);
-			if (nif < 0) {
-				errno = EINVAL;
-				return -1;
-			}
-			ret = FetchAddress(ap[nif], 
-					   mctx->cpu, num_queues, addr_in, &socket->saddr);
-			UNUSED(is_external);
+		addr_pool_t pool = GetAddressPool(mtcp, dip);
+		if (!pool) {
+			errno = EINVAL;
+			return -1;
 		}
+		ret = FetchAddress(pool, mctx->cpu, num_queues, addr_in, &socket->saddr);
 		if (ret < 0) {
 			errno = EAGAIN;
 			return -1;
@@ -790,26 +1224,16 @@ mtcp_connect(mctx_t mctx, int sockid,
 		is_dyn_bound = TRUE;
 	}
 
-	cur_stream = CreateTCPStream(mtcp, socket, socket->socktype, 
-			socket->saddr.sin_addr.s_addr, socket->saddr.sin_port, dip, dport);
-	if (!cur_stream) {
-		TRACE_ERROR("Socket %d: failed to create tcp_stream!\n", sockid);
-		errno = ENOMEM;
+	cur_stream = StartConnect(mtcp, socket, dip, dport, is_dyn_bound);
+	if (!cur_stream)
 		return -1;
-	}
-
-	if (is_dyn_bound)
-		cur_stream->is_bound_addr = TRUE;
-	cur_stream->sndvar->cwnd = 1;
-	cur_stream->sndvar->ssthresh = cur_stream->sndvar->mss * 10;
-
-	cur_stream->state = TCP_ST_SYN_SENT;
-	TRACE_STATE("Stream %d: TCP_ST_SYN_SENT\n", cur_stream->id);
+	if (cur_stream->tfo & TFO_DEFERRED)
+		return 0;
 
 	SQ_LOCK(&mtcp->ctx->connect_lock);
 	ret = StreamEnqueue(mtcp->connectq, cur_stream);
 	SQ_UNLOCK(&mtcp->ctx->connect_lock);
-	mtcp->wakeup_flag = TRUE;
+	WakeupMTCPThread(mtcp);
 	if (ret < 0) {
 		TRACE_ERROR("Socket %d: failed to enqueue to conenct queue!\n", sockid);
 		SQ_LOCK(&mtcp->ctx->destroyq_lock);
@@ -849,6 +1273,169 @@ mtcp_connect(mctx_t mctx, int sockid,
 	return 0;
 }
 /*----------------------------------------------------------------------------*/
+/* undoes the socket side of a connect request of mtcp_connect_batch() that 
+   failed; a dynamically bound address is given back by the caller, or by 
+   DestroyTCPStream() once a stream holds it */
+static void
+DropConnectRequest(mctx_t mctx, mtcp_manager_t mtcp, struct mtcp_connreq *req, 
+		int allocated, int dyn_bound)
+{
+	socket_map_t socket = &mtcp->smap[req->sockid];
+
+	if (dyn_bound) {
+		socket->opts &= ~MTCP_ADDR_BIND;
+		memset(&socket->saddr, 0, sizeof(struct sockaddr_in));
+	}
+	if (allocated) {
+		FreeSocket(mctx, req->sockid);
+		req->sockid = -1;
+	}
+}
+/*----------------------------------------------------------------------------*/
+int 
+mtcp_connect_batch(mctx_t mctx, struct mtcp_connreq *reqs, unsigned int cnt)
+{
+	mtcp_manager_t mtcp;
+	socket_map_t socket;
+	tcp_stream *cur_stream;
+	struct mtcp_connreq *req;
+	socket_map_t socks[MMSG_BATCH];
+	int allocated[MMSG_BATCH];
+	int dyn_bound[MMSG_BATCH];
+	tcp_stream *streams[MMSG_BATCH];
+	int idx[MMSG_BATCH];
+	addr_pool_t pool;
+	unsigned int base;
+	int n, i, j, k, queued;
+	int started = 0;
+
+	mtcp = GetMTCPManager(mctx);
+	if (!mtcp) {
+		return -1;
+	}
+
+	if (!reqs && cnt > 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (base = 0; base < cnt; base += n) {
+		n = MIN(cnt - base, MMSG_BATCH);
+
+		/* sockets and their source addresses */
+		for (i = 0; i < n; i++) {
+			req = &reqs[base + i];
+			socks[i] = NULL;
+			allocated[i] = FALSE;
+			dyn_bound[i] = FALSE;
+			req->err = 0;
+
+			if (req->sockid < 0) {
+				socket = AllocateSocket(mctx, MTCP_SOCK_STREAM);
+				if (!socket) {
+					req->err = ENFILE;
+					continue;
+				}
+				socket->opts |= MTCP_NONBLOCK;
+				req->sockid = socket->id;
+				allocated[i] = TRUE;
+			}
+
+			if (CheckConnect(mtcp, req->sockid, 
+					(const struct sockaddr *)&req->addr, 
+					sizeof(struct sockaddr_in)) < 0) {
+				req->err = errno;
+				if (allocated[i])
+					DropConnectRequest(mctx, mtcp, req, TRUE, FALSE);
+				continue;
+			}
+			socket = &mtcp->smap[req->sockid];
+
+			if (IsBoundForConnect(socket)) {
+				if (CheckBoundRSS(mctx, socket, req->addr.sin_addr.s_addr, 
+						  req->addr.sin_port) < 0) {
+					req->err = errno;
+					DropConnectRequest(mctx, mtcp, req, allocated[i], FALSE);
+					continue;
+				}
+			} else {
+				pool = GetAddressPool(mtcp, req->addr.sin_addr.s_addr);
+				if (!pool) {
+					req->err = EINVAL;
+					DropConnectRequest(mctx, mtcp, req, allocated[i], FALSE);
+					continue;
+				}
+				if (FetchAddress(pool, mctx->cpu, num_queues, 
+						 &req->addr, &socket->saddr) < 0) {
+					req->err = EAGAIN;
+					DropConnectRequest(mctx, mtcp, req, allocated[i], FALSE);
+					continue;
+				}
+				socket->opts |= MTCP_ADDR_BIND;
+				dyn_bound[i] = TRUE;
+			}
+			socks[i] = socket;
+		}
+
+		for (i = 0, k = 0; i < n; i++) {
+			if (!socks[i])
+				continue;
+			req = &reqs[base + i];
+
+			cur_stream = StartConnect(mtcp, socks[i], req->addr.sin_addr.s_addr, 
+						  req->addr.sin_port, dyn_bound[i]);
+			if (!cur_stream) {
+				req->err = errno;
+				if (dyn_bound[i]) {
+					FreeAddress(GetAddressPool(mtcp, req->addr.sin_addr.s_addr), 
+							mctx->cpu, &socks[i]->saddr, &req->addr);
+				}
+				DropConnectRequest(mctx, mtcp, req, allocated[i], dyn_bound[i]);
+				continue;
+			}
+			started++;
+
+			/* fast open: the first write sends the SYN */
+			if (cur_stream->tfo & TFO_DEFERRED)
+				continue;
+
+			req->err = EINPROGRESS;
+			streams[k] = cur_stream;
+			idx[k] = i;
+			k++;
+		}
+
+		/* publish the SYNs with a single tail update and wakeup */
+		if (k == 0)
+			continue;
+
+		SQ_LOCK(&mtcp->ctx->connect_lock);
+		queued = StreamEnqueueBatch(mtcp->connectq, streams, k);
+		SQ_UNLOCK(&mtcp->ctx->connect_lock);
+		WakeupMTCPThread(mtcp);
+		if (queued < k) {
+			TRACE_ERROR("Failed to enqueue %d streams to connect queue!\n", 
+					k - queued);
+			/* the sockets let go of the streams before they are destroyed; 
+			   DestroyTCPStream() gives the bound addresses back */
+			for (j = queued; j < k; j++) {
+				i = idx[j];
+				req = &reqs[base + i];
+				socks[i]->stream = NULL;
+				streams[j]->socket = NULL;
+				req->err = EAGAIN;
+				DropConnectRequest(mctx, mtcp, req, allocated[i], dyn_bound[i]);
+			}
+			SQ_LOCK(&mtcp->ctx->destroyq_lock);
+			StreamEnqueueBatch(mtcp->destroyq, streams + queued, k - queued);
+			SQ_UNLOCK(&mtcp->ctx->destroyq_lock);
+			started -= k - queued;
+		}
+	}
+
+	return started;
+}
+/*----------------------------------------------------------------------------*/
 static inline int 
 CloseStreamSocket(mctx_t mctx, int sockid)
 {
@@ -884,7 +1471,7 @@ CloseStreamSocket(mctx_t mctx, int sockid)
 				cur_stream->id);
 		SQ_LOCK(&mtcp->ctx->destroyq_lock);
 		StreamEnqueue(mtcp->destroyq, cur_stream);
-		mtcp->wakeup_flag = TRUE;
+		WakeupMTCPThread(mtcp);
 		SQ_UNLOCK(&mtcp->ctx->destroyq_lock);
 		return 0;
 
@@ -893,10 +1480,14 @@ CloseStreamSocket(mctx_t mctx, int sockid)
 		SQ_LOCK(&mtcp->ctx->destroyq_lock);
 		StreamEnqueue(mtcp->destroyq, cur_stream);
 		SQ_UNLOCK(&mtcp->ctx->destroyq_lock);
-		mtcp->wakeup_flag = TRUE;
+		WakeupMTCPThread(mtcp);
 #endif
 		return -1;
 
+	} else if (TFO_EARLY_CHILD(cur_stream)) {
+		/* closed once the handshake completes (Handle_TCP_ST_SYN_RCVD) */
+		return 0;
+
 	} else if (cur_stream->state != TCP_ST_ESTABLISHED && 
 			cur_stream->state != TCP_ST_CLOSE_WAIT) {
 		TRACE_API("Stream %d at state %s\n", 
@@ -908,7 +1499,7 @@ CloseStreamSocket(mctx_t mctx, int sockid)
 	SQ_LOCK(&mtcp->ctx->close_lock);
 	cur_stream->sndvar->on_closeq = TRUE;
 	ret = StreamEnqueue(mtcp->closeq, cur_stream);
-	mtcp->wakeup_flag = TRUE;
+	WakeupMTCPThread(mtcp);
 	SQ_UNLOCK(&mtcp->ctx->close_lock);
 
 	if (ret < 0) {
@@ -1003,7 +1594,7 @@ mtcp_close(mctx_t mctx, int sockid)
 		break;
 	}
 	
-	FreeSocket(mctx, sockid, FALSE);
+	FreeSocket(mctx, sockid);
 
 	return ret;
 }
@@ -1047,7 +1638,7 @@ mtcp_abort(mctx_t mctx, int sockid)
 
 	TRACE_API("Socket %d: mtcp_abort()\n", sockid);
 	
-	FreeSocket(mctx, sockid, FALSE);
+	FreeSocket(mctx, sockid);
 	cur_stream->socket = NULL;
 
 	if (cur_stream->state == TCP_ST_CLOSED) {
@@ -1062,7 +1653,7 @@ mtcp_abort(mctx_t mctx, int sockid)
 		SQ_LOCK(&mtcp->ctx->destroyq_lock);
 		StreamEnqueue(mtcp->destroyq, cur_stream);
 		SQ_UNLOCK(&mtcp->ctx->destroyq_lock);
-		mtcp->wakeup_flag = TRUE;
+		WakeupMTCPThread(mtcp);
 		return 0;
 
 	} else if (cur_stream->state == TCP_ST_CLOSING || 
@@ -1073,7 +1664,7 @@ mtcp_abort(mctx_t mctx, int sockid)
 		SQ_LOCK(&mtcp->ctx->destroyq_lock);
 		StreamEnqueue(mtcp->destroyq, cur_stream);
 		SQ_UNLOCK(&mtcp->ctx->destroyq_lock);
-		mtcp->wakeup_flag = TRUE;
+		WakeupMTCPThread(mtcp);
 		return 0;
 	}
 
@@ -1088,7 +1679,7 @@ mtcp_abort(mctx_t mctx, int sockid)
 	cur_stream->sndvar->on_resetq = TRUE;
 	ret = StreamEnqueue(mtcp->resetq, cur_stream);
 	SQ_UNLOCK(&mtcp->ctx->reset_lock);
-	mtcp->wakeup_flag = TRUE;
+	WakeupMTCPThread(mtcp);
 
 	if (ret < 0) {
 		TRACE_ERROR("(NEVER HAPPEN) Failed to enqueue the stream to close.\n");
@@ -1118,7 +1709,8 @@ PeekForUser(mtcp_manager_t mtcp, tcp_stream *cur_stream, char *buf, int len)
 }
 /*----------------------------------------------------------------------------*/
 static inline int
-CopyToUser(mtcp_manager_t mtcp, tcp_stream *cur_stream, char *buf, int len)
+CopyToUser(mtcp_manager_t mtcp, tcp_stream *cur_stream, char *buf, int len, 
+		struct api_batch *batch)
 {
 	struct tcp_recv_vars *rcvvar = cur_stream->rcvvar;
 	uint32_t prev_rcv_wnd;
@@ -1139,13 +1731,17 @@ CopyToUser(mtcp_manager_t mtcp, tcp_stream *cur_stream, char *buf, int len)
 	/* Advertise newly freed receive buffer */
 	if (cur_stream->need_wnd_adv) {
 		if (rcvvar->rcv_wnd > cur_stream->sndvar->eff_mss) {
-			if (!cur_stream->sndvar->on_ackq) {
+			if (!cur_stream->sndvar->on_ackq && batch) {
+				cur_stream->sndvar->on_ackq = TRUE;
+				cur_stream->need_wnd_adv = FALSE;
+				batch->ack[batch->ack_cnt++] = cur_stream;
+			} else if (!cur_stream->sndvar->on_ackq) {
 				SQ_LOCK(&mtcp->ctx->ackq_lock);
 				cur_stream->sndvar->on_ackq = TRUE;
 				StreamEnqueue(mtcp->ackq, cur_stream); /* this always success */
 				SQ_UNLOCK(&mtcp->ctx->ackq_lock);
 				cur_stream->need_wnd_adv = FALSE;
-				mtcp->wakeup_flag = TRUE;
+				WakeupMTCPThread(mtcp);
 			}
 		}
 	}
@@ -1154,21 +1750,16 @@ CopyToUser(mtcp_manager_t mtcp, tcp_stream *cur_stream, char *buf, int len)
 	return copylen;
 }
 /*----------------------------------------------------------------------------*/
-ssize_t
-mtcp_recv(mctx_t mctx, int sockid, char *buf, size_t len, int flags)
+static ssize_t
+RecvFromStream(mtcp_manager_t mtcp, mctx_t mctx, int sockid, 
+		char *buf, size_t len, int flags, struct api_batch *batch)
 {
-	mtcp_manager_t mtcp;
 	socket_map_t socket;
 	tcp_stream *cur_stream;
 	struct tcp_recv_vars *rcvvar;
 	int event_remaining;
 	int ret;
 	
-	mtcp = GetMTCPManager(mctx);
-        if (!mtcp) {
-		return -1;
-	}
-	
 	if (sockid < 0 || sockid >= CONFIG.max_concurrency) {
 		TRACE_API("Socket id %d out of range.\n", sockid);
 		errno = EBADF;
@@ -1195,8 +1786,9 @@ mtcp_recv(mctx_t mctx, int sockid, char *buf, size_t len, int flags)
 	/* stream should be in ESTABLISHED, FIN_WAIT_1, FIN_WAIT_2, CLOSE_WAIT */
 	cur_stream = socket->stream;
         if (!cur_stream || 
-	    !(cur_stream->state >= TCP_ST_ESTABLISHED && 
-	      cur_stream->state <= TCP_ST_CLOSE_WAIT)) {
+	    !((cur_stream->state >= TCP_ST_ESTABLISHED && 
+	       cur_stream->state <= TCP_ST_CLOSE_WAIT) || 
+	      TFO_EARLY_CHILD(cur_stream))) {
 		errno = ENOTCONN;
 		return -1;
 	}
@@ -1236,7 +1828,7 @@ mtcp_recv(mctx_t mctx, int sockid, char *buf, size_t len, int flags)
 
 	switch (flags) {
 	case 0:
-		ret = CopyToUser(mtcp, cur_stream, buf, len);
+		ret = CopyToUser(mtcp, cur_stream, buf, len, batch);
 		break;
 	case MSG_PEEK:
 		ret = PeekForUser(mtcp, cur_stream, buf, len);
@@ -1266,7 +1858,7 @@ mtcp_recv(mctx_t mctx, int sockid, char *buf, size_t len, int flags)
 	
 	if (event_remaining) {
 		if (socket->epoll) {
-			AddEpollEvent(mtcp->ep, 
+			AddEpollEvent(socket->reg_ep, 
 				      USR_SHADOW_EVENT_QUEUE, socket, MTCP_EPOLLIN);
 #if BLOCKING_SUPPORT
 		} else if (!(socket->opts & MTCP_NONBLOCK)) {
@@ -1284,6 +1876,54 @@ mtcp_recv(mctx_t mctx, int sockid, char *buf, size_t len, int flags)
         return ret;
 }
 /*----------------------------------------------------------------------------*/
+ssize_t
+mtcp_recv(mctx_t mctx, int sockid, char *buf, size_t len, int flags)
+{
+	mtcp_manager_t mtcp;
+
+	mtcp = GetMTCPManager(mctx);
+	if (!mtcp) {
+		return -1;
+	}
+
+	return RecvFromStream(mtcp, mctx, sockid, buf, len, flags, NULL);
+}
+/*----------------------------------------------------------------------------*/
+int
+mtcp_recvmmsg(mctx_t mctx, struct mtcp_mmsg *msgvec, unsigned int vlen, int flags)
+{
+	mtcp_manager_t mtcp;
+	struct api_batch batch;
+	unsigned int i;
+	int done;
+
+	mtcp = GetMTCPManager(mctx);
+	if (!mtcp) {
+		return -1;
+	}
+
+	if (!msgvec && vlen > 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	batch.send_cnt = batch.ack_cnt = 0;
+	for (i = 0, done = 0; i < vlen; i++) {
+		if (BatchNeedsFlush(mtcp, &batch, msgvec[i].sockid))
+			FlushBatch(mtcp, &batch);
+		msgvec[i].ret = RecvFromStream(mtcp, mctx, msgvec[i].sockid, 
+				msgvec[i].buf, msgvec[i].len, flags, &batch);
+		msgvec[i].err = (msgvec[i].ret < 0)? errno : 0;
+		if (msgvec[i].ret >= 0)
+			done++;
+		if (batch.ack_cnt == MMSG_BATCH)
+			FlushBatch(mtcp, &batch);
+	}
+	FlushBatch(mtcp, &batch);
+
+	return done;
+}
+/*----------------------------------------------------------------------------*/
 inline ssize_t
 mtcp_read(mctx_t mctx, int sockid, char *buf, size_t len)
 {
@@ -1327,8 +1967,9 @@ mtcp_readv(mctx_t mctx, int sockid, const struct iovec *iov, int numIOV)
 	/* stream should be in ESTABLISHED, FIN_WAIT_1, FIN_WAIT_2, CLOSE_WAIT */
 	cur_stream = socket->stream;
 	if (!cur_stream || 
-			!(cur_stream->state >= TCP_ST_ESTABLISHED && 
-			  cur_stream->state <= TCP_ST_CLOSE_WAIT)) {
+			!((cur_stream->state >= TCP_ST_ESTABLISHED && 
+			   cur_stream->state <= TCP_ST_CLOSE_WAIT) || 
+			  TFO_EARLY_CHILD(cur_stream))) {
 		errno = ENOTCONN;
 		return -1;
 	}
@@ -1372,7 +2013,7 @@ mtcp_readv(mctx_t mctx, int sockid, const struct iovec *iov, int numIOV)
 		if (iov[i].iov_len <= 0)
 			continue;
 
-		ret = CopyToUser(mtcp, cur_stream, iov[i].iov_base, iov[i].iov_len);
+		ret = CopyToUser(mtcp, cur_stream, iov[i].iov_base, iov[i].iov_len, NULL);
 		if (ret <= 0)
 			break;
 
@@ -1400,7 +2041,7 @@ mtcp_readv(mctx_t mctx, int sockid, const struct iovec *iov, int numIOV)
 
 	if(event_remaining) {
 		if ((socket->epoll & MTCP_EPOLLIN) && !(socket->epoll & MTCP_EPOLLET)) {
-			AddEpollEvent(mtcp->ep, 
+			AddEpollEvent(socket->reg_ep, 
 					USR_SHADOW_EVENT_QUEUE, socket, MTCP_EPOLLIN);
 #if BLOCKING_SUPPORT
 		} else if (!(socket->opts & MTCP_NONBLOCK)) {
@@ -1464,17 +2105,18 @@ CopyFromUser(mtcp_manager_t mtcp, tcp_stream *cur_stream, const char *buf, int l
 ssize_t
 mtcp_write(mctx_t mctx, int sockid, const char *buf, size_t len)
 {
-	mtcp_manager_t mtcp;
+	return mtcp_send(mctx, sockid, buf, len, 0);
+}
+/*----------------------------------------------------------------------------*/
+static ssize_t
+SendToStream(mtcp_manager_t mtcp, mctx_t mctx, int sockid, 
+		const char *buf, size_t len, int flags, struct api_batch *batch)
+{
 	socket_map_t socket;
 	tcp_stream *cur_stream;
 	struct tcp_send_vars *sndvar;
 	int ret;
 
-	mtcp = GetMTCPManager(mctx);
-	if (!mtcp) {
-		return -1;
-	}
-
 	if (sockid < 0 || sockid >= CONFIG.max_concurrency) {
 		TRACE_API("Socket id %d out of range.\n", sockid);
 		errno = EBADF;
@@ -1488,7 +2130,7 @@ mtcp_write(mctx_t mctx, int sockid, const char *buf, size_t len)
 		return -1;
 	}
 
-	if (socket->socktype == MTCP_SOCK_PIPE) {
+	if (socket->socktype == MTCP_SOCK_PIPE && flags == 0) {
 		return PipeWrite(mctx, sockid, buf, len);
 	}
 
@@ -1497,11 +2139,18 @@ mtcp_write(mctx_t mctx, int sockid, const char *buf, size_t len)
 		errno = ENOTSOCK;
 		return -1;
 	}
+
+	/* MSG_MORE: hold the tail until a write without it */
+	if (flags & ~MSG_MORE) {
+		errno = EINVAL;
+		return -1;
+	}
 	
 	cur_stream = socket->stream;
 	if (!cur_stream || 
 			!(cur_stream->state == TCP_ST_ESTABLISHED || 
-			  cur_stream->state == TCP_ST_CLOSE_WAIT)) {
+			  cur_stream->state == TCP_ST_CLOSE_WAIT || 
+			  TFO_EARLY_WRITE(cur_stream))) {
 		errno = ENOTCONN;
 		return -1;
 	}
@@ -1534,16 +2183,13 @@ mtcp_write(mctx_t mctx, int sockid, const char *buf, size_t len)
 	}
 #endif
 
+	sndvar->msg_more = (flags & MSG_MORE) ? TRUE : FALSE;
 	ret = CopyFromUser(mtcp, cur_stream, buf, len);
 
 	SBUF_UNLOCK(&sndvar->write_lock);
 
-	if (ret > 0 && !(sndvar->on_sendq || sndvar->on_send_list)) {
-		SQ_LOCK(&mtcp->ctx->sendq_lock);
-		sndvar->on_sendq = TRUE;
-		StreamEnqueue(mtcp->sendq, cur_stream);		/* this always success */
-		SQ_UNLOCK(&mtcp->ctx->sendq_lock);
-		mtcp->wakeup_flag = TRUE;
+	if (ret > 0) {
+		RequestSend(mtcp, cur_stream, batch);
 	}
 
 	if (ret == 0 && (socket->opts & MTCP_NONBLOCK)) {
@@ -1554,7 +2200,7 @@ mtcp_write(mctx_t mctx, int sockid, const char *buf, size_t len)
 	/* if there are remaining sending buffer, generate write event */
 	if (sndvar->snd_wnd > 0) {
 		if ((socket->epoll & MTCP_EPOLLOUT) && !(socket->epoll & MTCP_EPOLLET)) {
-			AddEpollEvent(mtcp->ep, 
+			AddEpollEvent(socket->reg_ep, 
 					USR_SHADOW_EVENT_QUEUE, socket, MTCP_EPOLLOUT);
 #if BLOCKING_SUPPORT
 		} else if (!(socket->opts & MTCP_NONBLOCK)) {
@@ -1568,10 +2214,58 @@ mtcp_write(mctx_t mctx, int sockid, const char *buf, size_t len)
 		}
 	}
 
-	TRACE_API("Stream %d: mtcp_write() returning %d\n", cur_stream->id, ret);
+	TRACE_API("Stream %d: mtcp_send() returning %d\n", cur_stream->id, ret);
 	return ret;
 }
 /*----------------------------------------------------------------------------*/
+ssize_t
+mtcp_send(mctx_t mctx, int sockid, const char *buf, size_t len, int flags)
+{
+	mtcp_manager_t mtcp;
+
+	mtcp = GetMTCPManager(mctx);
+	if (!mtcp) {
+		return -1;
+	}
+
+	return SendToStream(mtcp, mctx, sockid, buf, len, flags, NULL);
+}
+/*----------------------------------------------------------------------------*/
+int
+mtcp_sendmmsg(mctx_t mctx, struct mtcp_mmsg *msgvec, unsigned int vlen, int flags)
+{
+	mtcp_manager_t mtcp;
+	struct api_batch batch;
+	unsigned int i;
+	int done;
+
+	mtcp = GetMTCPManager(mctx);
+	if (!mtcp) {
+		return -1;
+	}
+
+	if (!msgvec && vlen > 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	batch.send_cnt = batch.ack_cnt = 0;
+	for (i = 0, done = 0; i < vlen; i++) {
+		if (BatchNeedsFlush(mtcp, &batch, msgvec[i].sockid))
+			FlushBatch(mtcp, &batch);
+		msgvec[i].ret = SendToStream(mtcp, mctx, msgvec[i].sockid, 
+				msgvec[i].buf, msgvec[i].len, flags, &batch);
+		msgvec[i].err = (msgvec[i].ret < 0)? errno : 0;
+		if (msgvec[i].ret >= 0)
+			done++;
+		if (batch.send_cnt == MMSG_BATCH)
+			FlushBatch(mtcp, &batch);
+	}
+	FlushBatch(mtcp, &batch);
+
+	return done;
+}
+/*----------------------------------------------------------------------------*/
 int
 mtcp_writev(mctx_t mctx, int sockid, const struct iovec *iov, int numIOV)
 {
@@ -1608,7 +2302,8 @@ mtcp_writev(mctx_t mctx, int sockid, const struct iovec *iov, int numIOV)
 	cur_stream = socket->stream;
 	if (!cur_stream || 
 			!(cur_stream->state == TCP_ST_ESTABLISHED || 
-			  cur_stream->state == TCP_ST_CLOSE_WAIT)) {
+			  cur_stream->state == TCP_ST_CLOSE_WAIT || 
+			  TFO_EARLY_WRITE(cur_stream))) {
 		errno = ENOTCONN;
 		return -1;
 	}
@@ -1632,6 +2327,7 @@ mtcp_writev(mctx_t mctx, int sockid, const struct iovec *iov, int numIOV)
 #endif
 
 	/* write from the vectored buffers */ 
+	sndvar->msg_more = FALSE;
 	to_write = 0;
 	for (i = 0; i < numIOV; i++) {
 		if (iov[i].iov_len <= 0)
@@ -1648,12 +2344,8 @@ mtcp_writev(mctx_t mctx, int sockid, const struct iovec *iov, int numIOV)
 	}
 	SBUF_UNLOCK(&sndvar->write_lock);
 
-	if (to_write > 0 && !(sndvar->on_sendq || sndvar->on_send_list)) {
-		SQ_LOCK(&mtcp->ctx->sendq_lock);
-		sndvar->on_sendq = TRUE;
-		StreamEnqueue(mtcp->sendq, cur_stream);		/* this always success */
-		SQ_UNLOCK(&mtcp->ctx->sendq_lock);
-		mtcp->wakeup_flag = TRUE;
+	if (to_write > 0) {
+		RequestSend(mtcp, cur_stream, NULL);
 	}
 
 	if (to_write == 0 && (socket->opts & MTCP_NONBLOCK)) {
@@ -1664,7 +2356,7 @@ mtcp_writev(mctx_t mctx, int sockid, const struct iovec *iov, int numIOV)
 	/* if there are remaining sending buffer, generate write event */
 	if (sndvar->snd_wnd > 0) {
 		if ((socket->epoll & MTCP_EPOLLOUT) && !(socket->epoll & MTCP_EPOLLET)) {
-			AddEpollEvent(mtcp->ep, 
+			AddEpollEvent(socket->reg_ep, 
 					USR_SHADOW_EVENT_QUEUE, socket, MTCP_EPOLLOUT);
 #if BLOCKING_SUPPORT
 		} else if (!(socket->opts & MTCP_NONBLOCK)) {
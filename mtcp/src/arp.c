@@ -85,7 +85,7 @@ GetHWaddr(uint32_t ip)
 	int i;
 	unsigned char *haddr = NULL;
 	for (i = 0; i < CONFIG.eths_num; i++) {
-		if (ip == CONFIG.eths[i].ip_addr) {
+		if (IsPortAddress(i, ip)) {
 			haddr = CONFIG.eths[i].haddr;
 			break;
 		}	
@@ -128,7 +128,7 @@ GetDestinationHWaddr(uint32_t dip, uint8_t is_gateway)
 }
 /*----------------------------------------------------------------------------*/
 static int 
-ARPOutput(struct mtcp_manager *mtcp, int nif, int opcode,
+ARPOutput(struct mtcp_manager *mtcp, int nif, int opcode, uint32_t src_ip, 
 		uint32_t dst_ip, unsigned char *dst_haddr, unsigned char *target_haddr)
 {
 	if (!dst_haddr)
@@ -149,7 +149,8 @@ ARPOutput(struct mtcp_manager *mtcp, int nif, int opcode,
 
 	/* Fill arp body */
 	int edix = CONFIG.nif_to_eidx[nif];
-	arph->ar_sip = CONFIG.eths[edix].ip_addr;
+	/* INADDR_ANY: the port's own address */
+	arph->ar_sip = src_ip? src_ip : CONFIG.eths[edix].ip_addr;
 	arph->ar_tip = dst_ip;
 
 	memcpy(arph->ar_sha, CONFIG.eths[edix].haddr, arph->ar_hln);
@@ -219,7 +220,7 @@ RequestARP(mtcp_manager_t mtcp, uint32_t ip, int nif, uint32_t cur_ts)
 	/* else, broadcast arp request */
 	memset(haddr, 0xFF, ETH_ALEN);
 	memset(taddr, 0x00, ETH_ALEN);
-	ARPOutput(mtcp, nif, arp_op_request, ip, haddr, taddr);
+	ARPOutput(mtcp, nif, arp_op_request, INADDR_ANY, ip, haddr, taddr);
 }
 /*----------------------------------------------------------------------------*/
 static int 
@@ -235,7 +236,9 @@ ProcessARPRequest(mtcp_manager_t mtcp,
 	}
 
 	/* send arp reply */
-	ARPOutput(mtcp, nif, arp_op_reply, arph->ar_sip, arph->ar_sha, NULL);
+	/* answer for whichever of the port's addresses was asked for */
+	ARPOutput(mtcp, nif, arp_op_reply, arph->ar_tip, 
+			arph->ar_sip, arph->ar_sha, NULL);
 
 	return 0;
 }
@@ -276,7 +279,7 @@ ProcessARPPacket(mtcp_manager_t mtcp, uint32_t cur_ts,
 	
 	/* process the arp messages destined to me */
 	for (i = 0; i < CONFIG.eths_num; i++) {
-		if (arph->ar_tip == CONFIG.eths[i].ip_addr) {
+		if (IsPortAddress(i, arph->ar_tip)) {
 			to_me = TRUE;
 		}
 	}
@@ -14,6 +14,7 @@
 #include "mtcp.h"
 #include "config.h"
 #include "tcp_in.h"
+#include "tcp_cc.h"
 #include "arp.h"
 #include "debug.h"
 /* for setting up io modules */
@@ -36,9 +37,23 @@ struct mtcp_config CONFIG = {
 	.sndbuf_size	  =			-1,
 	.tcp_timeout	  =			TCP_TIMEOUT,
 	.tcp_timewait	  =			TCP_TIMEWAIT,
+	.tcp_ecn	  =			TCP_ECN_PASSIVE,
+	.tcp_pacing	  =			TCP_PACING_CC,
+	.tcp_delayed_ack  =			TCP_DELAYED_ACK,
+	.tcp_fastopen	  =			TCP_FASTOPEN_CLIENT,
+	.tcp_syncookies	  =			TCP_SYNCOOKIES_ON,
+	.tcp_max_syn_backlog =			TCP_MAX_SYN_BACKLOG,
+	.tcp_tw_reuse	  =			1,
+	.tcp_max_tw_buckets =			TCP_MAX_TW_BUCKETS,
+	.inline_mode	  =			0,
+	.idle_sleep	  =			0,
+	.rx_interrupt	  =			0,
+	.src_addrs	  =			1,
 	.num_mem_ch	  =			0,
 #if USE_CCP
 	.cc           	  =         		"reno\n",
+#else
+	.cc		  =			"reno",
 #endif
 #ifdef ENABLE_ONVM
 	.onvm_inst	  =			(uint16_t) -1,
@@ -625,6 +640,69 @@ ParseConfiguration(char *line)
 		if (CONFIG.tcp_timewait > 0) {
 			CONFIG.tcp_timewait = SEC_TO_USEC(CONFIG.tcp_timewait) / TIME_TICK;
 		}
+	} else if (strcmp(p, "tcp_ecn") == 0) {
+		CONFIG.tcp_ecn = mystrtol(q, 10);
+		if (CONFIG.tcp_ecn < TCP_ECN_OFF || CONFIG.tcp_ecn > TCP_ECN_PASSIVE) {
+			TRACE_CONFIG("tcp_ecn should be 0 (off), 1 (on) or 2 (passive).\n");
+			return -1;
+		}
+	} else if (strcmp(p, "tcp_pacing") == 0) {
+		CONFIG.tcp_pacing = mystrtol(q, 10);
+		if (CONFIG.tcp_pacing < TCP_PACING_OFF || CONFIG.tcp_pacing > TCP_PACING_ALL) {
+			TRACE_CONFIG("tcp_pacing should be 0 (off), 1 (cc) or 2 (all).\n");
+			return -1;
+		}
+	} else if (strcmp(p, "tcp_delayed_ack") == 0) {
+		CONFIG.tcp_delayed_ack = mystrtol(q, 10) / TIME_TICK;
+		if (CONFIG.tcp_delayed_ack < 0 || 
+				CONFIG.tcp_delayed_ack > TCP_DELAYED_ACK_MAX) {
+			TRACE_CONFIG("tcp_delayed_ack should be between 0 and 500000 (us).\n");
+			return -1;
+		}
+	} else if (strcmp(p, "tcp_fastopen") == 0) {
+		CONFIG.tcp_fastopen = mystrtol(q, 10);
+		if (CONFIG.tcp_fastopen & ~(TCP_FASTOPEN_CLIENT | TCP_FASTOPEN_SERVER)) {
+			TRACE_CONFIG("tcp_fastopen should be 0 (off), 1 (client), "
+					"2 (server) or 3 (both).\n");
+			return -1;
+		}
+	} else if (strcmp(p, "tcp_syncookies") == 0) {
+		CONFIG.tcp_syncookies = mystrtol(q, 10);
+		if (CONFIG.tcp_syncookies < TCP_SYNCOOKIES_OFF || 
+				CONFIG.tcp_syncookies > TCP_SYNCOOKIES_ALWAYS) {
+			TRACE_CONFIG("tcp_syncookies should be 0 (off), 1 (on) or 2 (always).\n");
+			return -1;
+		}
+	} else if (strcmp(p, "tcp_max_syn_backlog") == 0) {
+		CONFIG.tcp_max_syn_backlog = mystrtol(q, 10);
+		if (CONFIG.tcp_max_syn_backlog <= 0) {
+			TRACE_CONFIG("tcp_max_syn_backlog should be larger than 0.\n");
+			return -1;
+		}
+	} else if (strcmp(p, "tcp_tw_reuse") == 0) {
+		CONFIG.tcp_tw_reuse = mystrtol(q, 10);
+	} else if (strcmp(p, "tcp_max_tw_buckets") == 0) {
+		CONFIG.tcp_max_tw_buckets = mystrtol(q, 10);
+		if (CONFIG.tcp_max_tw_buckets <= 0) {
+			TRACE_CONFIG("tcp_max_tw_buckets should be larger than 0.\n");
+			return -1;
+		}
+	} else if (strcmp(p, "inline_mode") == 0) {
+		CONFIG.inline_mode = mystrtol(q, 10)? TRUE : FALSE;
+	} else if (strcmp(p, "idle_sleep") == 0) {
+		CONFIG.idle_sleep = mystrtol(q, 10);
+		if (CONFIG.idle_sleep < 0) {
+			TRACE_CONFIG("idle_sleep should be 0 or larger.\n");
+			return -1;
+		}
+	} else if (strcmp(p, "rx_interrupt") == 0) {
+		CONFIG.rx_interrupt = mystrtol(q, 10)? TRUE : FALSE;
+	} else if (strcmp(p, "src_addrs") == 0) {
+		CONFIG.src_addrs = mystrtol(q, 10);
+		if (CONFIG.src_addrs <= 0) {
+			TRACE_CONFIG("src_addrs should be larger than 0.\n");
+			return -1;
+		}
 	} else if (strcmp(p, "stat_print") == 0) {
 		SaveInterfaceStatList(line + strlen(p) + 1);
 	} else if (strcmp(p, "port") == 0) {
@@ -656,8 +734,12 @@ ParseConfiguration(char *line)
         *strchr(q, '\0') = ' ';
         strcpy(CONFIG.cc, q);
 #else
-        TRACE_CONFIG("[WARNING] 'cc' option provided, but CCP not enabled. define USE_CCP!\n");
-        exit(EXIT_FAILURE);
+		if (SetDefaultCongestionControl(q) < 0) {
+			TRACE_CONFIG("Unknown congestion control: %s "
+					"(reno, cubic, dctcp or bbr)\n", q);
+			return -1;
+		}
+		strncpy(CONFIG.cc, q, CC_NAME - 1);
 #endif
 
     } else {
@@ -762,6 +844,27 @@ PrintConfiguration()
 	}
 	TRACE_CONFIG("TCP timewait seconds: %d\n", 
 			USEC_TO_SEC(CONFIG.tcp_timewait * TIME_TICK));
+#if !USE_CCP
+	TRACE_CONFIG("Congestion control: %s\n", CONFIG.cc);
+#endif
+	TRACE_CONFIG("TCP ECN: %s\n", (CONFIG.tcp_ecn == TCP_ECN_ON)? "on" : 
+			(CONFIG.tcp_ecn == TCP_ECN_PASSIVE)? "passive" : "off");
+	TRACE_CONFIG("TCP pacing: %s\n", (CONFIG.tcp_pacing == TCP_PACING_ALL)? "all" : 
+			(CONFIG.tcp_pacing == TCP_PACING_CC)? "cc" : "off");
+	TRACE_CONFIG("TCP delayed ack: %d us\n", CONFIG.tcp_delayed_ack * TIME_TICK);
+	TRACE_CONFIG("TCP fast open: client %s, server %s\n", 
+			(CONFIG.tcp_fastopen & TCP_FASTOPEN_CLIENT)? "on" : "off", 
+			(CONFIG.tcp_fastopen & TCP_FASTOPEN_SERVER)? "on" : "off");
+	TRACE_CONFIG("TCP SYN cookies: %s, max SYN backlog: %d\n", 
+			(CONFIG.tcp_syncookies == TCP_SYNCOOKIES_ALWAYS)? "always" : 
+			(CONFIG.tcp_syncookies == TCP_SYNCOOKIES_ON)? "on" : "off", 
+			CONFIG.tcp_max_syn_backlog);
+	TRACE_CONFIG("TCP TIME_WAIT reuse: %s, max TIME_WAIT buckets: %d\n", 
+			CONFIG.tcp_tw_reuse? "on" : "off", CONFIG.tcp_max_tw_buckets);
+	TRACE_CONFIG("Inline mode: %s\n", CONFIG.inline_mode? "on" : "off");
+	TRACE_CONFIG("Idle sleep: %d us, rx interrupts: %s\n", CONFIG.idle_sleep, 
+			CONFIG.rx_interrupt? "on" : "off");
+	TRACE_CONFIG("Source addresses per port: %d\n", CONFIG.src_addrs);
 	TRACE_CONFIG("NICs to print statistics:");
 	for (i = 0; i < CONFIG.eths_num; i++) {
 		if (CONFIG.eths[i].stat_print) {
@@ -9,6 +9,8 @@
 #include <signal.h>
 #include <assert.h>
 #include <sched.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 
 #include "cpu.h"
 #include "ps.h"
@@ -27,6 +29,10 @@
 #include "arp.h"
 #include "ip_out.h"
 #include "timer.h"
+#include "tcp_fastopen.h"
+#include "tcp_syncookie.h"
+#include "tcp_minisock.h"
+#include "tcp_timewait.h"
 #include "debug.h"
 #if USE_CCP
 #include "ccp.h"
@@ -134,6 +140,7 @@ HandleSignal(int signal)
 		}
 	}
 
+	/* SIGUSR1 only wakes up a psio thread from ps_select() */
 	if (signal != SIGUSR1) {
 		if (app_signal_handler) {
 			app_signal_handler(signal);
@@ -246,6 +253,27 @@ PrintThreadRoundStats(mtcp_manager_t mtcp, struct run_stat *rs)
 }
 #endif /* ROUND_STAT */
 /*----------------------------------------------------------------------------*/
+static inline void 
+PrintThreadIdleStats(mtcp_manager_t mtcp, uint32_t elapsed)
+{
+	struct idle_stat is;
+	double sleep_pct;
+
+	is.sleep_us = mtcp->istat.sleep_us - mtcp->p_istat.sleep_us;
+	is.sleeps = mtcp->istat.sleeps - mtcp->p_istat.sleeps;
+	is.wakes_io = mtcp->istat.wakes_io - mtcp->p_istat.wakes_io;
+	is.wakes_app = mtcp->istat.wakes_app - mtcp->p_istat.wakes_app;
+	mtcp->p_istat = mtcp->istat;
+
+	sleep_pct = (elapsed > 0)? 100.0 * is.sleep_us / TS_TO_USEC(elapsed) : 0;
+	if (sleep_pct > 100.0)
+		sleep_pct = 100.0;
+	fprintf(stderr, "[CPU%2d] poll: %5.1lf%%, sleep: %5.1lf%% "
+			"(sleeps: %lu, woken by io: %lu, app: %lu)\n", 
+			mtcp->ctx->cpu, 100.0 - sleep_pct, sleep_pct, 
+			is.sleeps, is.wakes_io, is.wakes_app);
+}
+/*----------------------------------------------------------------------------*/
 #endif /* NETSTAT */
 /*----------------------------------------------------------------------------*/
 #if EVENT_STAT
@@ -266,6 +294,7 @@ PrintNetworkStats(mtcp_manager_t mtcp, uint32_t cur_ts)
 {
 #define TIMEOUT 1
 	int i;
+	uint32_t elapsed;
 	struct net_stat ns;
 #if ROUND_STAT
 	struct run_stat rs;
@@ -283,6 +312,7 @@ PrintNetworkStats(mtcp_manager_t mtcp, uint32_t cur_ts)
 		return;
 	}
 
+	elapsed = cur_ts - mtcp->p_nstat_ts;
 	mtcp->p_nstat_ts = cur_ts;
 	gflow_cnt = 0;
 	memset(&g_nstat, 0, sizeof(struct net_stat));
@@ -351,11 +381,22 @@ PrintNetworkStats(mtcp_manager_t mtcp, uint32_t cur_ts)
 #endif
 #endif /* ROUND_STAT */
 
+	/* share of time each thread polled and slept */
+	if (CONFIG.idle_sleep > 0) {
+		for (i = 0; i < CONFIG.num_cores; i++) {
+			if (running[i])
+				PrintThreadIdleStats(g_mtcp[i], elapsed);
+		}
+	}
+
 #if EVENT_STAT
 	for (i = 0; i < CONFIG.num_cores; i++) {
-		if (running[i] && g_mtcp[i]->ep) {
-			PrintEventStat(i, &g_mtcp[i]->ep->stat);
-		}
+		struct mtcp_epoll *ep;
+
+		if (!running[i])
+			continue;
+		for (ep = g_mtcp[i]->ep_list; ep; ep = ep->next)
+			PrintEventStat(i, &ep->stat);
 	}
 #endif
 
@@ -448,41 +489,25 @@ FlushReadEvents(mtcp_manager_t mtcp, int thresh)
 #endif
 /*----------------------------------------------------------------------------*/
 static inline void 
-FlushEpollEvents(mtcp_manager_t mtcp, uint32_t cur_ts)
+FlushEpollEvents(mtcp_manager_t mtcp, struct mtcp_epoll *ep, uint32_t cur_ts)
 {
-	struct mtcp_epoll *ep = mtcp->ep;
-	struct event_queue *usrq = ep->usr_queue;
-	struct event_queue *mtcpq = ep->mtcp_queue;
-
-	pthread_mutex_lock(&ep->epoll_lock);
-	if (ep->mtcp_queue->num_events > 0) {
-		/* while mtcp_queue have events */
-		/* and usr_queue is not full */
-		while (mtcpq->num_events > 0 && usrq->num_events < usrq->size) {
-			/* copy the event from mtcp_queue to usr_queue */
-			usrq->events[usrq->end++] = mtcpq->events[mtcpq->start++];
-
-			if (usrq->end >= usrq->size)
-				usrq->end = 0;
-			usrq->num_events++;
-
-			if (mtcpq->start >= mtcpq->size)
-				mtcpq->start = 0;
-			mtcpq->num_events--;
-		}
-	}
+	struct event_ring *ring = ep->ring;
+
+	/* publish the sockets raised in this round to the application at once */
+	if (ring->end != ring->tail)
+		__atomic_store_n(&ring->end, ring->tail, __ATOMIC_SEQ_CST);
 
-	/* if there are pending events, wake up user */
-	if (ep->waiting && (ep->usr_queue->num_events > 0 || 
-				ep->usr_shadow_queue->num_events > 0)) {
+	/* if there are pending events, wake up user (see mtcp_epoll_wait()) */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ep->waiting, __ATOMIC_RELAXED) && 
+			ring->end != __atomic_load_n(&ring->start, __ATOMIC_RELAXED)) {
 		STAT_COUNT(mtcp->runstat.rounds_epoll);
-		TRACE_EPOLL("Broadcasting events. num: %d, cur_ts: %u, prev_ts: %u\n", 
-				ep->usr_queue->num_events, cur_ts, mtcp->ts_last_event);
+		TRACE_EPOLL("Broadcasting events. num: %u, cur_ts: %u, prev_ts: %u\n", 
+				ring->end - ring->start, cur_ts, mtcp->ts_last_event);
 		mtcp->ts_last_event = cur_ts;
 		ep->stat.wakes++;
-		pthread_cond_signal(&ep->epoll_cond);
+		WakeupEpoll(ep);
 	}
-	pthread_mutex_unlock(&ep->epoll_lock);
 }
 /*----------------------------------------------------------------------------*/
 static inline void 
@@ -493,8 +518,15 @@ HandleApplicationCalls(mtcp_manager_t mtcp, uint32_t cur_ts)
 	int handled, delayed;
 	int control, send, ack;
 
+	/* cleared before the queues are read: calls queued from here on 
+	   set it again, so MTCPIdleSleep() does not miss them */
+	__atomic_store_n(&mtcp->wakeup_flag, FALSE, __ATOMIC_SEQ_CST);
+
 	/* connect handling */
 	while ((stream = StreamDequeue(mtcp->connectq))) {
+		/* the 4-tuple may come from an entry still in TIME_WAIT */
+		ReuseTimewait(mtcp, stream->saddr, stream->sport, 
+				stream->daddr, stream->dport);
 		AddtoControlList(mtcp, stream, cur_ts);
 	}
 
@@ -669,8 +701,6 @@ HandleApplicationCalls(mtcp_manager_t mtcp, uint32_t cur_ts)
 	while ((stream = StreamDequeue(mtcp->destroyq))) {
 		DestroyTCPStream(mtcp, stream);
 	}
-
-	mtcp->wakeup_flag = FALSE;
 }
 /*----------------------------------------------------------------------------*/
 static inline void 
@@ -732,16 +762,16 @@ DestroyRemainingFlows(mtcp_manager_t mtcp)
 static void 
 InterruptApplication(mtcp_manager_t mtcp)
 {
+	struct mtcp_epoll *ep;
 	int i;
 	struct tcp_listener *listener = NULL;
 
 	/* interrupt if the mtcp_epoll_wait() is waiting */
-	if (mtcp->ep) {
-		pthread_mutex_lock(&mtcp->ep->epoll_lock);
-		if (mtcp->ep->waiting) {
-			pthread_cond_signal(&mtcp->ep->epoll_cond);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	for (ep = __atomic_load_n(&mtcp->ep_list, __ATOMIC_ACQUIRE); ep; ep = ep->next) {
+		if (ep->waiting) {
+			WakeupEpoll(ep);
 		}
-		pthread_mutex_unlock(&mtcp->ep->epoll_lock);
 	}
 
 	/* interrupt if the accept() is waiting */
@@ -758,104 +788,202 @@ InterruptApplication(mtcp_manager_t mtcp)
 	}
 }
 /*----------------------------------------------------------------------------*/
-static void 
-RunMainLoop(struct mtcp_thread_context *ctx)
+void 
+RunMainLoopRound(struct mtcp_thread_context *ctx)
 {
 	mtcp_manager_t mtcp = ctx->mtcp_manager;
+	struct mtcp_epoll *ep;
 	int i;
 	int recv_cnt;
 	int rx_inf, tx_inf;
-	struct timeval cur_ts = {0};
-	uint32_t ts, ts_prev;
+	struct timespec cur_ts = {0};
+	uint32_t ts;
 	int thresh;
 
-	gettimeofday(&cur_ts, NULL);
-	TRACE_DBG("CPU %d: mtcp thread running.\n", ctx->cpu);
-
-	ts = ts_prev = 0;
-	while ((!ctx->done || mtcp->flow_cnt) && !ctx->exit) {
+	STAT_COUNT(mtcp->runstat.rounds);
+	recv_cnt = 0;
 		
-		STAT_COUNT(mtcp->runstat.rounds);
-		recv_cnt = 0;
-			
-		gettimeofday(&cur_ts, NULL);
-		ts = TIMEVAL_TO_TS(&cur_ts);
-		mtcp->cur_ts = ts;
+	/* the clock is read only once per round (precision: 1 us) */
+	clock_gettime(CLOCK_MONOTONIC, &cur_ts);
+	ts = TIMESPEC_TO_TS(&cur_ts);
+	mtcp->cur_ts = ts;
+
+	/* nothing from the last round refers to a closed epoll any more */
+	FreeClosedEpolls(mtcp);
 
-		for (rx_inf = 0; rx_inf < CONFIG.eths_num; rx_inf++) {
+	for (rx_inf = 0; rx_inf < CONFIG.eths_num; rx_inf++) {
 
-			static uint16_t len;
-			static uint8_t *pktbuf;
-			recv_cnt = mtcp->iom->recv_pkts(ctx, rx_inf);
-			STAT_COUNT(mtcp->runstat.rounds_rx_try);
+		static uint16_t len;
+		static uint8_t *pktbuf;
+		recv_cnt = mtcp->iom->recv_pkts(ctx, rx_inf);
+		STAT_COUNT(mtcp->runstat.rounds_rx_try);
 
-			for (i = 0; i < recv_cnt; i++) {
-				pktbuf = mtcp->iom->get_rptr(mtcp->ctx, rx_inf, i, &len);
-				if (pktbuf != NULL)
-					ProcessPacket(mtcp, rx_inf, ts, pktbuf, len);
+		for (i = 0; i < recv_cnt; i++) {
+			pktbuf = mtcp->iom->get_rptr(mtcp->ctx, rx_inf, i, &len);
+			if (pktbuf != NULL)
+				ProcessPacket(mtcp, rx_inf, ts, pktbuf, len);
 #ifdef NETSTAT
-				else
-					mtcp->nstat.rx_errors[rx_inf]++;
+			else
+				mtcp->nstat.rx_errors[rx_inf]++;
 #endif
-			}
 		}
-		STAT_COUNT(mtcp->runstat.rounds_rx);
+	}
+	STAT_COUNT(mtcp->runstat.rounds_rx);
 
-		/* interaction with application */
-		if (mtcp->flow_cnt > 0) {
-			
-			/* check retransmission timeout and timewait expire */
+	/* interaction with application */
+	if (mtcp->flow_cnt > 0) {
+		
+		/* fire expired timers (rto, timewait, timeout, delayed ack) */
 #if 0
-			thresh = (int)mtcp->flow_cnt / (TS_TO_USEC(PER_STREAM_TCHECK));
-			assert(thresh >= 0);
-			if (thresh == 0)
-				thresh = 1;
-			if (recv_cnt > 0 && thresh > recv_cnt)
-				thresh = recv_cnt;
+		thresh = (int)mtcp->flow_cnt / (TS_TO_USEC(PER_STREAM_TCHECK));
+		assert(thresh >= 0);
+		if (thresh == 0)
+			thresh = 1;
+		if (recv_cnt > 0 && thresh > recv_cnt)
+			thresh = recv_cnt;
 #endif
+		thresh = CONFIG.max_concurrency;
+
+		/* Eunyoung, you may fix this later 
+		 * if there is no rcv packet, we will send as much as possible
+		 */
+		if (thresh == -1)
 			thresh = CONFIG.max_concurrency;
 
-			/* Eunyoung, you may fix this later 
-			 * if there is no rcv packet, we will send as much as possible
-			 */
-			if (thresh == -1)
-				thresh = CONFIG.max_concurrency;
+		CheckTimers(mtcp, ts, thresh);
+	}
+	CheckMinisockTimers(mtcp, ts);
+	CheckTimewaitTimers(mtcp, ts);
 
-			CheckRtmTimeout(mtcp, ts, thresh);
-			CheckTimewaitExpire(mtcp, ts, CONFIG.max_concurrency);
+	/* if epoll is in use, flush all the queued events */
+	for (ep = __atomic_load_n(&mtcp->ep_list, __ATOMIC_ACQUIRE); ep; ep = ep->next) {
+		FlushEpollEvents(mtcp, ep, ts);
+	}
 
-			if (CONFIG.tcp_timeout > 0 && ts != ts_prev) {
-				CheckConnectionTimeout(mtcp, ts, thresh);
-			}
-		}
+	if (mtcp->flow_cnt > 0 || mtcp->wakeup_flag) {
+		/* hadnle stream queues  */
+		HandleApplicationCalls(mtcp, ts);
+	}
+
+	WritePacketsToChunks(mtcp, ts);
+
+	/* send packets from write buffer */
+	/* send until tx is available */
+	for (tx_inf = 0; tx_inf < CONFIG.eths_num; tx_inf++) {
+		mtcp->iom->send_pkts(ctx, tx_inf);
+	}
 
-		/* if epoll is in use, flush all the queued events */
-		if (mtcp->ep) {
-			FlushEpollEvents(mtcp, ts);
+	if ((uint32_t)(ts - mtcp->ts_last_tick) >= MSEC_TO_TS(1)) {
+		mtcp->ts_last_tick = ts;
+		if (ctx->cpu == mtcp_master) {
+			ARPTimer(mtcp, ts);
+#ifdef NETSTAT
+			PrintNetworkStats(mtcp, ts);
+#endif
+		}
+	}
+}
+/*----------------------------------------------------------------------------*/
+void 
+WakeupMTCPThread(mtcp_manager_t mtcp)
+{
+	uint64_t one = 1;
+
+	__atomic_store_n(&mtcp->wakeup_flag, TRUE, __ATOMIC_SEQ_CST);
+#if INTR_SLEEPING_MTCP
+	/* only the caller that takes is_sleeping down pays for the write */
+	if (__atomic_load_n(&mtcp->is_sleeping, __ATOMIC_SEQ_CST) && 
+			__atomic_exchange_n(&mtcp->is_sleeping, FALSE, __ATOMIC_SEQ_CST)) {
+		/* ps_select() cannot wait on the eventfd, but a signal ends it */
+		if (current_iomodule_func == &ps_module_func) {
+			pthread_kill(mtcp->ctx->thread, SIGUSR1);
+		} else if (write(mtcp->wakeup_fd, &one, sizeof(one)) < 0) {
+			TRACE_ERROR("Failed to wake up mtcp thread %d: %s\n", 
+					mtcp->ctx->cpu, strerror(errno));
 		}
+	}
+#else
+	UNUSED(one);
+#endif
+}
+/*----------------------------------------------------------------------------*/
+int 
+MTCPIdleSleep(mtcp_manager_t mtcp, struct pollfd *pfd, int nfds, int timeout_us)
+{
+	struct timespec ts;
+	uint32_t slept = 0;
+	uint32_t limit;
+	uint64_t cnt;
+	int ret;
 
-		if (mtcp->flow_cnt > 0) {
-			/* hadnle stream queues  */
-			HandleApplicationCalls(mtcp, ts);
+	/* do not sleep past the next stream, SYN/ACK or TIME_WAIT timer */
+	limit = TimerIdleTicks(mtcp->timer_wheel, mtcp->cur_ts, USEC_TO_TS(timeout_us));
+	limit = MinisockIdleTicks(mtcp, mtcp->cur_ts, limit);
+	limit = TimewaitIdleTicks(mtcp, mtcp->cur_ts, limit);
+	timeout_us = TS_TO_USEC(limit);
+
+	/* WakeupMTCPThread() raises wakeup_flag before it reads is_sleeping, 
+	   and we raise is_sleeping before we read wakeup_flag, so either it 
+	   sees us sleeping and kicks the eventfd or we see its calls */
+	__atomic_store_n(&mtcp->is_sleeping, TRUE, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&mtcp->wakeup_flag, __ATOMIC_SEQ_CST) || 
+			mtcp->ctx->done || mtcp->ctx->exit) {
+		timeout_us = 0;
+	}
+
+	pfd[nfds].fd = mtcp->wakeup_fd;
+	pfd[nfds].events = POLLIN;
+	pfd[nfds].revents = 0;
+	if (timeout_us > 0) {
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		slept = TIMESPEC_TO_TS(&ts);
+	}
+	ts.tv_sec = timeout_us / 1000000;
+	ts.tv_nsec = (timeout_us % 1000000) * 1000;
+	ret = ppoll(pfd, nfds + 1, &ts, NULL);
+	if (ret < 0 && errno == EINTR) {
+		STAT_COUNT(mtcp->runstat.rounds_select_intr);
+		ret = 0;
+	}
+
+	/* is_sleeping already down means a wakeup was sent: consume it 
+	   so that the next sleep blocks again */
+	if (!__atomic_exchange_n(&mtcp->is_sleeping, FALSE, __ATOMIC_SEQ_CST) || 
+			(pfd[nfds].revents & POLLIN)) {
+		if (read(mtcp->wakeup_fd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN) {
+			TRACE_ERROR("Failed to read the wakeup eventfd: %s\n", 
+					strerror(errno));
 		}
+		if (ret > 0 && (pfd[nfds].revents & POLLIN))
+			ret--;
+		if (timeout_us > 0)
+			mtcp->istat.wakes_app++;
+	}
 
-		WritePacketsToChunks(mtcp, ts);
+	if (timeout_us > 0) {
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		mtcp->istat.sleep_us += TS_TO_USEC((uint32_t)(TIMESPEC_TO_TS(&ts) - slept));
+		mtcp->istat.sleeps++;
+		if (ret > 0)
+			mtcp->istat.wakes_io++;
+	}
 
-		/* send packets from write buffer */
-		/* send until tx is available */
-		for (tx_inf = 0; tx_inf < CONFIG.eths_num; tx_inf++) {
-			mtcp->iom->send_pkts(ctx, tx_inf);
-		}
+	return ret;
+}
+/*----------------------------------------------------------------------------*/
+static void 
+RunMainLoop(struct mtcp_thread_context *ctx)
+{
+	mtcp_manager_t mtcp = ctx->mtcp_manager;
+	struct timespec ts_start, ts_end;
+	uint64_t run_us;
 
-		if (ts != ts_prev) {
-			ts_prev = ts;
-			if (ctx->cpu == mtcp_master) {
-				ARPTimer(mtcp, ts);
-#ifdef NETSTAT
-				PrintNetworkStats(mtcp, ts);
-#endif
-			}
-		}
+	TRACE_DBG("CPU %d: mtcp thread running.\n", ctx->cpu);
+	clock_gettime(CLOCK_MONOTONIC, &ts_start);
+
+	while ((!ctx->done || mtcp->flow_cnt) && !ctx->exit) {
+
+		RunMainLoopRound(ctx);
 
 		mtcp->iom->select(ctx);
 
@@ -869,6 +997,18 @@ RunMainLoop(struct mtcp_thread_context *ctx)
 #endif
 
 	TRACE_DBG("MTCP thread %d out of main loop.\n", ctx->cpu);
+	if (mtcp->istat.sleeps > 0) {
+		clock_gettime(CLOCK_MONOTONIC, &ts_end);
+		run_us = (ts_end.tv_sec - ts_start.tv_sec) * 1000000 + 
+				(ts_end.tv_nsec - ts_start.tv_nsec) / 1000;
+		if (run_us < mtcp->istat.sleep_us)
+			run_us = mtcp->istat.sleep_us;
+		TRACE_INFO("MTCP thread %d polled for %lu ms and slept for %lu ms "
+				"(sleeps: %lu, woken by io: %lu, app: %lu).\n", ctx->cpu, 
+				(run_us - mtcp->istat.sleep_us) / 1000, 
+				mtcp->istat.sleep_us / 1000, mtcp->istat.sleeps, 
+				mtcp->istat.wakes_io, mtcp->istat.wakes_app);
+	}
 	/* flush logs */
 	flush_log_data(mtcp);
 	TRACE_DBG("MTCP thread %d flushed logs.\n", ctx->cpu);
@@ -910,6 +1050,7 @@ InitializeMTCPManager(struct mtcp_thread_context* ctx)
 {
 	mtcp_manager_t mtcp;
 	char log_name[MAX_FILE_NAME];
+	struct timespec cur_ts;
 	int i;
 
 	mtcp = (mtcp_manager_t)calloc(1, sizeof(struct mtcp_manager));
@@ -1004,16 +1145,24 @@ InitializeMTCPManager(struct mtcp_thread_context* ctx)
 		CTRACE_ERROR("Failed to allocate memory for stream map.\n");
 		return NULL;
 	}
-	TAILQ_INIT(&mtcp->free_smap);
+	mtcp->free_smap = (int *)calloc(CONFIG.max_concurrency, sizeof(int));
+	if (!mtcp->free_smap) {
+		perror("calloc");
+		CTRACE_ERROR("Failed to allocate memory for free socket ids.\n");
+		return NULL;
+	}
+	/* lower ids on top, handed out first */
+	mtcp->free_smap_top = CONFIG.max_concurrency;
 	for (i = 0; i < CONFIG.max_concurrency; i++) {
 		mtcp->smap[i].id = i;
 		mtcp->smap[i].socktype = MTCP_SOCK_UNUSED;
 		memset(&mtcp->smap[i].saddr, 0, sizeof(struct sockaddr_in));
 		mtcp->smap[i].stream = NULL;
-		TAILQ_INSERT_TAIL(&mtcp->free_smap, &mtcp->smap[i], free_smap_link);
+		mtcp->free_smap[CONFIG.max_concurrency - 1 - i] = i;
 	}
 
-	mtcp->ep = NULL;
+	mtcp->ep_list = NULL;
+	mtcp->ep_free = NULL;
 
 	snprintf(log_name, MAX_FILE_NAME, LOG_FILE_NAME"_%d", ctx->cpu);
 	mtcp->log_fp = fopen(log_name, "w");
@@ -1079,9 +1228,37 @@ InitializeMTCPManager(struct mtcp_thread_context* ctx)
 		}
 	}
 		
-	mtcp->rto_store = InitRTOHashstore();
-	TAILQ_INIT(&mtcp->timewait_list);
-	TAILQ_INIT(&mtcp->timeout_list);
+	clock_gettime(CLOCK_MONOTONIC, &cur_ts);
+	mtcp->timer_wheel = InitTimerWheel(TIMESPEC_TO_TS(&cur_ts));
+	if (!mtcp->timer_wheel) {
+		CTRACE_ERROR("Failed to create timer wheel.\n");
+		return NULL;
+	}
+
+	mtcp->tfo_cache = CreateTFOCache();
+	if (!mtcp->tfo_cache) {
+		CTRACE_ERROR("Failed to allocate fast open cookie cache.\n");
+		return NULL;
+	}
+
+	mtcp->minisocks = CreateMinisockTable(CONFIG.tcp_max_syn_backlog);
+	if (!mtcp->minisocks) {
+		CTRACE_ERROR("Failed to allocate minisock table.\n");
+		return NULL;
+	}
+
+	mtcp->timewait = CreateTimewaitTable(CONFIG.tcp_max_tw_buckets);
+	if (!mtcp->timewait) {
+		CTRACE_ERROR("Failed to allocate TIME_WAIT table.\n");
+		return NULL;
+	}
+
+	mtcp->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (mtcp->wakeup_fd < 0) {
+		perror("eventfd");
+		CTRACE_ERROR("Failed to create the wakeup eventfd.\n");
+		return NULL;
+	}
 
 #if BLOCKING_SUPPORT
 	TAILQ_INIT(&mtcp->rcv_br_list);
@@ -1150,10 +1327,9 @@ CCPRecvLoopThread(void *arg) {
 }
 #endif
 /*----------------------------------------------------------------------------*/
-static void *
-MTCPRunThread(void *arg)
+static struct mtcp_thread_context *
+InitializeMTCPThread(mctx_t mctx)
 {
-	mctx_t mctx = (mctx_t)arg;
 	int cpu = mctx->cpu;
 	int working;
 	struct mtcp_manager *mtcp;
@@ -1189,11 +1365,6 @@ MTCPRunThread(void *arg)
 	/* I/O initializing */
 	mtcp->iom->init_handle(ctx);
 
-	if (pthread_mutex_init(&ctx->smap_lock, NULL)) {
-		perror("pthread_mutex_init of ctx->smap_lock\n");
-		exit(-1);
-	}
-
 	if (pthread_mutex_init(&ctx->flow_pool_lock, NULL)) {
 		perror("pthread_mutex_init of ctx->flow_pool_lock\n");
 		exit(-1);
@@ -1241,7 +1412,15 @@ MTCPRunThread(void *arg)
 	
 	sem_post(&g_init_sem[ctx->cpu]);
 
-	/* start the main loop */
+	return ctx;
+}
+/*----------------------------------------------------------------------------*/
+static void 
+FinishMTCPThread(struct mtcp_thread_context *ctx)
+{
+	int cpu = ctx->cpu;
+
+	/* run until the remaining flows are gone */
 	RunMainLoop(ctx);
 
 	struct mtcp_context m;
@@ -1254,7 +1433,20 @@ MTCPRunThread(void *arg)
 #endif
 	DestroyHashtable(g_mtcp[cpu]->listeners);
 	
-	TRACE_DBG("MTCP thread %d finished.\n", ctx->cpu);
+	TRACE_DBG("MTCP thread %d finished.\n", cpu);
+}
+/*----------------------------------------------------------------------------*/
+static void *
+MTCPRunThread(void *arg)
+{
+	struct mtcp_thread_context *ctx;
+
+	ctx = InitializeMTCPThread((mctx_t)arg);
+	if (!ctx)
+		return NULL;
+
+	/* start the main loop */
+	FinishMTCPThread(ctx);
 	
 	return 0;
 }
@@ -1322,6 +1514,15 @@ mtcp_create_context(int cpu)
 		return NULL;
 	}
 #endif
+	if (CONFIG.inline_mode) {
+		/* no mtcp thread: the caller sets up the context on its own 
+		   core and drives the loop from mtcp_epoll_wait() */
+		g_thread[cpu] = pthread_self();
+		if (!InitializeMTCPThread(mctx)) {
+			TRACE_ERROR("Failed to initialize inline mtcp context!\n");
+			return NULL;
+		}
+	} else
 #ifndef DISABLE_DPDK
 	/* Wake up mTCP threads (wake up I/O threads) */
 	if (current_iomodule_func == &dpdk_module_func) {
@@ -1366,8 +1567,13 @@ void
 mtcp_destroy_context(mctx_t mctx)
 {
   	struct mtcp_thread_context *ctx = g_pctx[mctx->cpu];
-  	if (ctx != NULL)
+  	if (ctx != NULL) {
     		ctx->done = 1;
+		WakeupMTCPThread(ctx->mtcp_manager);
+		/* inline mode: tear the context down on the caller's thread */
+		if (CONFIG.inline_mode)
+			FinishMTCPThread(ctx);
+	}
 	free(mctx);
 }
 /*----------------------------------------------------------------------------*/
@@ -1473,6 +1679,21 @@ mtcp_free_context(mctx_t mctx)
 	MPDestroy(mtcp->rv_pool);
 	MPDestroy(mtcp->sv_pool);
 	MPDestroy(mtcp->flow_pool);
+
+	FreeClosedEpolls(mtcp);
+
+	DestroyTimerWheel(mtcp->timer_wheel);
+	mtcp->timer_wheel = NULL;
+
+	DestroyTFOCache(mtcp->tfo_cache);
+	mtcp->tfo_cache = NULL;
+	DestroyMinisockTable(mtcp->minisocks);
+	mtcp->minisocks = NULL;
+	DestroyTimewaitTable(mtcp->timewait);
+	mtcp->timewait = NULL;
+
+	close(mtcp->wakeup_fd);
+	mtcp->wakeup_fd = -1;
 	
 	if (mtcp->ap) {
 		DestroyAddressPool(mtcp->ap);
@@ -1530,6 +1751,8 @@ mtcp_getconf(struct mtcp_conf *conf)
 	conf->tcp_timewait = CONFIG.tcp_timewait;
 	conf->tcp_timeout = CONFIG.tcp_timeout;
 
+	conf->inline_mode = CONFIG.inline_mode;
+
 	return 0;
 }
 /*----------------------------------------------------------------------------*/
@@ -1555,6 +1778,9 @@ mtcp_setconf(const struct mtcp_conf *conf)
 	if (conf->tcp_timeout > 0)
 		CONFIG.tcp_timeout = conf->tcp_timeout;
 
+	if (conf->inline_mode > 0)
+		CONFIG.inline_mode = TRUE;
+
 	TRACE_CONFIG("Configuration updated by mtcp_setconf().\n");
 	//PrintConfiguration();
 
@@ -1604,8 +1830,11 @@ mtcp_init(const char *config_file)
 	}
 	PrintConfiguration();
 
+	InitFastOpen();
+	InitSYNCookies();
+
 	for (i = 0; i < CONFIG.eths_num; i++) {
-		ap[i] = CreateAddressPool(CONFIG.eths[i].ip_addr, 1);
+		ap[i] = CreateAddressPool(CONFIG.eths[i].ip_addr, CONFIG.src_addrs);
 		if (!ap[i]) {
 			TRACE_CONFIG("Error occured while create address pool[%d]\n",
 				     i);
@@ -1625,14 +1854,15 @@ mtcp_init(const char *config_file)
 	LoadARPTable();
 	PrintARPTable();
 
-	if (signal(SIGUSR1, HandleSignal) == SIG_ERR) {
-		perror("signal, SIGUSR1");
-		return -1;
-	}
 	if (signal(SIGINT, HandleSignal) == SIG_ERR) {
 		perror("signal, SIGINT");
 		return -1;
 	}
+	if (current_iomodule_func == &ps_module_func && 
+			signal(SIGUSR1, HandleSignal) == SIG_ERR) {
+		perror("signal, SIGUSR1");
+		return -1;
+	}
 	app_signal_handler = NULL;
 
 	/* load system-wide io module specs */
@@ -1650,7 +1880,7 @@ mtcp_destroy()
 #endif
 	/* wait until all threads are closed */
 	for (i = 0; i < num_cpus; i++) {
-		if (running[i]) {
+		if (running[i] && !CONFIG.inline_mode) {
 #ifndef DISABLE_DPDK
 			if (master != i)
 				rte_eal_wait_lcore(i);
@@ -9,6 +9,8 @@
 #include "debug.h"
 /* for num_devices_* */
 #include "config.h"
+/* for USEC_TO_TS */
+#include "tcp_in.h"
 /* for rte_max_eth_ports */
 #include <rte_common.h>
 /* for rte_eth_rxconf */
@@ -53,6 +55,18 @@
 #define RX_IDLE_ENABLE			1
 #define RX_IDLE_TIMEOUT			1	/* in micro-seconds */
 #endif
+#ifndef RX_IDLE_THRESH
+#define RX_IDLE_THRESH			64	/* empty rx rounds before idle_sleep */
+#endif
+/* 
+ * With idle_sleep, a thread busy-polls until rx has been quiet for 
+ * rx_idle_us, then sleeps (on the rx interrupts with rx_interrupt). 
+ * rx_idle_us doubles when traffic comes back right after a sleep and 
+ * halves when a sleep passes without any, so that bursty traffic keeps 
+ * the thread polling while a really idle core keeps sleeping.
+ */
+#define RX_IDLE_USEC_MIN		50
+#define RX_IDLE_USEC_MAX		10000
 
 /*
  * RX and TX Prefetch, Host, and Write-back threshold values should be
@@ -191,9 +205,12 @@ struct dpdk_private_context {
 	struct mbuf_table wmbufs[RTE_MAX_ETHPORTS];
 	struct rte_mempool *pktmbuf_pool;
 	struct rte_mbuf *pkts_burst[MAX_PKT_BURST];
-#ifdef RX_IDLE_ENABLE
-	uint8_t rx_idle;
-#endif
+	uint32_t rx_idle;		/* rx rounds without packets */
+	uint32_t rx_last_ts;		/* last round with packets */
+	uint32_t rx_idle_us;		/* quiet time before sleeping */
+	uint8_t slept;			/* no packets since the last sleep */
+	uint8_t rx_intr;		/* rx interrupts are set up */
+	int intr_epfd;			/* this thread's interrupt epoll fd */
 #ifdef IP_DEFRAG
 	struct rte_ip_frag_tbl *frag_tbl;
 	struct rte_ip_frag_death_row death_row;
@@ -265,6 +282,26 @@ dpdk_init_handle(struct mtcp_thread_context *ctxt)
 		dpc->wmbufs[j].len = 0;
 	}
 
+	dpc->rx_idle_us = RX_IDLE_USEC_MIN;
+	dpc->intr_epfd = -1;
+	if (port_conf.intr_conf.rxq) {
+		/* route this thread's rx queue interrupts to its own epoll fd */
+		for (i = 0; i < CONFIG.eths_num; i++) {
+			if (rte_eth_dev_rx_intr_ctl_q(CONFIG.eths[i].ifindex, ctxt->cpu, 
+						      RTE_EPOLL_PER_THREAD, 
+						      RTE_INTR_EVENT_ADD, NULL)) {
+				TRACE_ERROR("No rx interrupts on port %d queue %d, "
+					    "idle sleeps will only be timed.\n", 
+					    CONFIG.eths[i].ifindex, ctxt->cpu);
+				break;
+			}
+		}
+		if (i == CONFIG.eths_num) {
+			dpc->intr_epfd = rte_intr_tls_epfd();
+			dpc->rx_intr = (dpc->intr_epfd >= 0);
+		}
+	}
+
 #ifdef IP_DEFRAG
 	int max_flows;
 	int socket;
@@ -344,7 +381,7 @@ dpdk_send_pkts(struct mtcp_thread_context *ctxt, int ifidx)
 		mtcp->nstat.tx_packets[ifidx] += cnt;
 #ifdef ENABLE_STATS_IOCTL
 		/* only pass stats after >= 1 sec interval */
-		if (abs(mtcp->cur_ts - dpc->cur_ts) >= 1000 &&
+		if (abs(mtcp->cur_ts - dpc->cur_ts) >= 1000000 /* 1 sec in us */ &&
 		    likely(dpc->fd >= 0)) {
 			/* rte_get_stats is global func, use only for 1 core */
 			if (ctxt->cpu == 0) {
@@ -463,9 +500,17 @@ dpdk_recv_pkts(struct mtcp_thread_context *ctxt, int ifidx)
 	int portid = CONFIG.eths[ifidx].ifindex;
 	ret = rte_eth_rx_burst((uint8_t)portid, ctxt->cpu,
 			       dpc->pkts_burst, MAX_PKT_BURST);
-#ifdef RX_IDLE_ENABLE
-	dpc->rx_idle = (likely(ret != 0)) ? 0 : dpc->rx_idle + 1;
-#endif
+	if (likely(ret != 0)) {
+		dpc->rx_idle = 0;
+		dpc->rx_last_ts = ctxt->mtcp_manager->cur_ts;
+		if (unlikely(dpc->slept)) {
+			/* traffic right after a sleep: poll longer next time */
+			dpc->slept = FALSE;
+			dpc->rx_idle_us = RTE_MIN(dpc->rx_idle_us << 1, RX_IDLE_USEC_MAX);
+		}
+	} else {
+		dpc->rx_idle++;
+	}
 	dpc->rmbufs[ifidx].len = ret;
 
 	return ret;
@@ -547,18 +592,73 @@ dpdk_get_rptr(struct mtcp_thread_context *ctxt, int ifidx, int index, uint16_t *
 	return pktbuf;
 }
 /*----------------------------------------------------------------------------*/
+static void
+dpdk_set_rx_intr(struct mtcp_thread_context *ctxt, int on)
+{
+	int i, portid;
+
+	for (i = 0; i < CONFIG.eths_num; i++) {
+		portid = CONFIG.eths[i].ifindex;
+		if (on)
+			rte_eth_dev_rx_intr_enable(portid, ctxt->cpu);
+		else
+			rte_eth_dev_rx_intr_disable(portid, ctxt->cpu);
+	}
+}
+/*----------------------------------------------------------------------------*/
 int32_t
 dpdk_select(struct mtcp_thread_context *ctxt)
 {
-#ifdef RX_IDLE_ENABLE
 	struct dpdk_private_context *dpc;
+	mtcp_manager_t mtcp = ctxt->mtcp_manager;
+	struct rte_epoll_event ev[RTE_MAX_ETHPORTS];
+	struct pollfd pfd[2];
+	int timeout = CONFIG.idle_sleep;
+	int i, nfds, ret;
 
 	dpc = (struct dpdk_private_context *) ctxt->io_private_context;
-	if (dpc->rx_idle > RX_IDLE_THRESH) {
-		dpc->rx_idle = 0;
-		usleep(RX_IDLE_TIMEOUT);
-	}
+#ifdef RX_IDLE_ENABLE
+	if (timeout == 0)
+		timeout = RX_IDLE_TIMEOUT;
 #endif
+	if (timeout == 0 || dpc->rx_idle <= RX_IDLE_THRESH)
+		return 0;
+
+	/* keep polling while traffic is around */
+	if ((uint32_t)(mtcp->cur_ts - dpc->rx_last_ts) < USEC_TO_TS(dpc->rx_idle_us))
+		return 0;
+
+	/* a whole sleep went by without packets: sleep sooner next time */
+	if (dpc->slept)
+		dpc->rx_idle_us = RTE_MAX(dpc->rx_idle_us >> 1, RX_IDLE_USEC_MIN);
+	dpc->rx_idle = 0;
+
+	nfds = 0;
+	if (dpc->rx_intr) {
+		/* arm the interrupts first, then look for packets that came 
+		   in before, since those would not raise one */
+		dpdk_set_rx_intr(ctxt, TRUE);
+		for (i = 0; i < CONFIG.eths_num; i++) {
+			if (rte_eth_rx_queue_count(CONFIG.eths[i].ifindex, ctxt->cpu) > 0) {
+				dpdk_set_rx_intr(ctxt, FALSE);
+				return 0;
+			}
+		}
+		pfd[0].fd = dpc->intr_epfd;
+		pfd[0].events = POLLIN;
+		nfds = 1;
+	}
+
+	ret = MTCPIdleSleep(mtcp, pfd, nfds, timeout);
+	dpc->slept = TRUE;
+
+	if (dpc->rx_intr) {
+		/* let the eal read (and so acknowledge) the interrupts */
+		if (ret > 0)
+			rte_epoll_wait(RTE_EPOLL_PER_THREAD, ev, RTE_MAX_ETHPORTS, 0);
+		dpdk_set_rx_intr(ctxt, FALSE);
+	}
+
 	return 0;
 }
 /*----------------------------------------------------------------------------*/
@@ -658,6 +758,9 @@ dpdk_load_module(void)
 	port_conf.rx_adv_conf.rss_conf.rss_key = (uint8_t *)key;
 	port_conf.rx_adv_conf.rss_conf.rss_key_len = sizeof(key);
 
+	/* idle threads wait on rx interrupts */
+	port_conf.intr_conf.rxq = (CONFIG.rx_interrupt && CONFIG.idle_sleep > 0);
+
 	if (!CONFIG.multi_process || (CONFIG.multi_process && CONFIG.multi_process_is_master)) {
 		for (rxlcore_id = 0; rxlcore_id < CONFIG.num_cores; rxlcore_id++) {
 			char name[RTE_MEMPOOL_NAMESIZE];
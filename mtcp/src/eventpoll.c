@@ -4,19 +4,26 @@
 #include <signal.h>
 #include <assert.h>
 #include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 
 #include "mtcp.h"
 #include "tcp_stream.h"
 #include "eventpoll.h"
 #include "tcp_in.h"
+#include "tcp_fastopen.h"
+#include "tcp_stream_queue.h"
+#include "tcp_ring_buffer.h"
 #include "pipe.h"
 #include "debug.h"
 
 #define MAX(a, b) ((a)>(b)?(a):(b))
 #define MIN(a, b) ((a)<(b)?(a):(b))
 
-#define SPIN_BEFORE_SLEEP FALSE
-#define SPIN_THRESH 10000000
+/* mtcp_epoll_wait() polls this many rounds before it sleeps; the budget 
+   doubles when polling caught an event and halves when it did not */
+#define EPOLL_SPIN_MIN 64
+#define EPOLL_SPIN_MAX 16384
 
 /*----------------------------------------------------------------------------*/
 char *event_str[] = {"NONE", "IN", "PRI", "OUT", "ERR", "HUP", "RDHUP"};
@@ -54,36 +61,92 @@ EventToString(uint32_t event)
 	return NULL;
 }
 /*----------------------------------------------------------------------------*/
-struct event_queue *
-CreateEventQueue(int size)
+static struct event_ring *
+CreateEventRing(int size)
 {
-	struct event_queue *eq;
+	struct event_ring *ring;
+	uint32_t nslots = 1;
 
-	eq = (struct event_queue *)calloc(1, sizeof(struct event_queue));
-	if (!eq)
+	ring = (struct event_ring *)calloc(1, sizeof(struct event_ring));
+	if (!ring)
 		return NULL;
 
-	eq->start = 0;
-	eq->end = 0;
-	eq->size = size;
-	eq->events = (struct mtcp_epoll_event_int *)
-			calloc(size, sizeof(struct mtcp_epoll_event_int));
-	if (!eq->events) {
-		free(eq);
+	/* slots the application has taken out but not yet handed back 
+	   may be queued again, so leave room for every socket twice */
+	while (nslots < 2 * (uint32_t)size)
+		nslots <<= 1;
+	ring->mask = nslots - 1;
+	ring->descs = (sockdesc_t *)calloc(nslots, sizeof(sockdesc_t));
+	if (!ring->descs) {
+		free(ring);
 		return NULL;
 	}
-	eq->num_events = 0;
 
-	return eq;
+	return ring;
 }
 /*----------------------------------------------------------------------------*/
-void 
-DestroyEventQueue(struct event_queue *eq)
+static void 
+DestroyEventRing(struct event_ring *ring)
 {
-	if (eq->events)
-		free(eq->events);
+	free(ring->descs);
+	free(ring);
+}
+/*----------------------------------------------------------------------------*/
+static inline void
+SpinPause(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#else
+	__asm__ __volatile__("" ::: "memory");
+#endif
+}
+/*----------------------------------------------------------------------------*/
+static inline int
+FutexWait(uint32_t *uaddr, uint32_t val, const struct timespec *timeout)
+{
+	return syscall(SYS_futex, uaddr, FUTEX_WAIT_PRIVATE, val, timeout, NULL, 0);
+}
+/*----------------------------------------------------------------------------*/
+/* FUTEX_WAIT measures its relative timeout on the monotonic clock too */
+static inline uint64_t
+MonotonicUsec(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+/*----------------------------------------------------------------------------*/
+/* wakes mtcp_epoll_wait() up; the caller has seen ep->waiting set */
+void
+WakeupEpoll(struct mtcp_epoll *ep)
+{
+	__atomic_fetch_add(&ep->wakeup_seq, 1, __ATOMIC_RELEASE);
+	syscall(SYS_futex, &ep->wakeup_seq, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+/*----------------------------------------------------------------------------*/
+static inline void
+RemoveFromReadyList(socket_map_t socket)
+{
+	struct mtcp_epoll *ep = socket->ready_ep;
 
-	free(eq);
+	TAILQ_REMOVE(&ep->ready_list, socket, ready_link);
+	ep->num_ready--;
+	socket->ready_ep = NULL;
+}
+/*----------------------------------------------------------------------------*/
+static inline void
+AddToReadyList(struct mtcp_epoll *ep, socket_map_t socket)
+{
+	if (socket->ready_ep == ep)
+		return;
+	/* left over from an epoll the socket was moved away from */
+	if (socket->ready_ep)
+		RemoveFromReadyList(socket);
+	socket->ready_ep = ep;
+	TAILQ_INSERT_TAIL(&ep->ready_list, socket, ready_link);
+	ep->num_ready++;
 }
 /*----------------------------------------------------------------------------*/
 int
@@ -128,7 +191,7 @@ mtcp_epoll_create(mctx_t mctx, int size)
 		return -1;
 	}
 
-	epsocket = AllocateSocket(mctx, MTCP_SOCK_EPOLL, FALSE);
+	epsocket = AllocateSocket(mctx, MTCP_SOCK_EPOLL);
 	if (!epsocket) {
 		errno = ENFILE;
 		return -1;
@@ -136,56 +199,29 @@ mtcp_epoll_create(mctx_t mctx, int size)
 
 	ep = (struct mtcp_epoll *)calloc(1, sizeof(struct mtcp_epoll));
 	if (!ep) {
-		FreeSocket(mctx, epsocket->id, FALSE);
-		return -1;
-	}
-
-	/* create event queues */
-	ep->usr_queue = CreateEventQueue(size);
-	if (!ep->usr_queue) {
-		FreeSocket(mctx, epsocket->id, FALSE);
-		free(ep);
+		FreeSocket(mctx, epsocket->id);
 		return -1;
 	}
 
-	ep->usr_shadow_queue = CreateEventQueue(size);
-	if (!ep->usr_shadow_queue) {
-		DestroyEventQueue(ep->usr_queue);
-		FreeSocket(mctx, epsocket->id, FALSE);
-		free(ep);
-		return -1;
-	}
-
-	ep->mtcp_queue = CreateEventQueue(size);
-	if (!ep->mtcp_queue) {
-		DestroyEventQueue(ep->usr_shadow_queue);
-		DestroyEventQueue(ep->usr_queue);
-		FreeSocket(mctx, epsocket->id, FALSE);
+	/* size is only a hint, as with epoll_create(2): 
+	   the ring holds every socket of the context */
+	ep->ring = CreateEventRing(CONFIG.max_concurrency);
+	if (!ep->ring) {
+		FreeSocket(mctx, epsocket->id);
 		free(ep);
 		return -1;
 	}
+	TAILQ_INIT(&ep->ready_list);
 
 	TRACE_EPOLL("epoll structure of size %d created.\n", size);
 
-	mtcp->ep = ep;
+	ep->spin = EPOLL_SPIN_MIN;
+
 	epsocket->ep = ep;
 
-	if (pthread_mutex_init(&ep->epoll_lock, NULL)) {
-		DestroyEventQueue(ep->mtcp_queue);
-		DestroyEventQueue(ep->usr_shadow_queue);
-		DestroyEventQueue(ep->usr_queue);
-		FreeSocket(mctx, epsocket->id, FALSE);
-		free(ep);
-		return -1;
-	}
-	if (pthread_cond_init(&ep->epoll_cond, NULL)) {
-		DestroyEventQueue(ep->mtcp_queue);
-		DestroyEventQueue(ep->usr_shadow_queue);
-		DestroyEventQueue(ep->usr_queue);
-		FreeSocket(mctx, epsocket->id, FALSE);
-		free(ep);
-		return -1;
-	}
+	/* the mtcp thread walks the list without locking */
+	ep->next = mtcp->ep_list;
+	__atomic_store_n(&mtcp->ep_list, ep, __ATOMIC_RELEASE);
 
 	return epsocket->id;
 }
@@ -195,6 +231,10 @@ CloseEpollSocket(mctx_t mctx, int epid)
 {
 	mtcp_manager_t mtcp;
 	struct mtcp_epoll *ep;
+	struct mtcp_epoll **pp;
+	struct mtcp_epoll *head;
+	socket_map_t socket;
+	uint32_t i;
 
 	mtcp = GetMTCPManager(mctx);
 	if (!mtcp) {
@@ -207,23 +247,67 @@ CloseEpollSocket(mctx_t mctx, int epid)
 		return -1;
 	}
 
-	DestroyEventQueue(ep->usr_queue);
-	DestroyEventQueue(ep->usr_shadow_queue);
-	DestroyEventQueue(ep->mtcp_queue);
-
-	pthread_mutex_lock(&ep->epoll_lock);
-	mtcp->ep = NULL;
+	for (pp = &mtcp->ep_list; *pp != ep; pp = &(*pp)->next)
+		;
+	__atomic_store_n(pp, ep->next, __ATOMIC_RELEASE);
 	mtcp->smap[epid].ep = NULL;
-	pthread_cond_signal(&ep->epoll_cond);
-	pthread_mutex_unlock(&ep->epoll_lock);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (ep->waiting)
+		WakeupEpoll(ep);
+
+	/* closing an epoll takes its sockets out of it, as close(2) does */
+	for (i = 0; i < (uint32_t)CONFIG.max_concurrency; i++) {
+		socket = &mtcp->smap[i];
+		if (socket->reg_ep == ep) {
+			socket->epoll = MTCP_EPOLLNONE;
+			socket->reg_ep = NULL;
+			socket->events = 0;
+		}
+	}
+	while ((socket = TAILQ_FIRST(&ep->ready_list)))
+		RemoveFromReadyList(socket);
 
-	pthread_cond_destroy(&ep->epoll_cond);
-	pthread_mutex_destroy(&ep->epoll_lock);
-	free(ep);
+	/* the mtcp thread may still be walking ep_list or hold the epoll 
+	   through reg_ep, so it frees the epoll at the start of its next round */
+	head = __atomic_load_n(&mtcp->ep_free, __ATOMIC_RELAXED);
+	do {
+		ep->free_next = head;
+	} while (!__atomic_compare_exchange_n(&mtcp->ep_free, &head, ep, 
+				TRUE, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	WakeupMTCPThread(mtcp);
 
 	return 0;
 }
 /*----------------------------------------------------------------------------*/
+/* called by the mtcp thread between rounds, when it holds no epoll */
+void
+FreeClosedEpolls(mtcp_manager_t mtcp)
+{
+	struct mtcp_epoll *ep, *next;
+	struct mtcp_epoll *queued_ep;
+	socket_map_t socket;
+	uint32_t i;
+
+	if (!__atomic_load_n(&mtcp->ep_free, __ATOMIC_RELAXED))
+		return;
+
+	ep = __atomic_exchange_n(&mtcp->ep_free, NULL, __ATOMIC_ACQUIRE);
+	for (; ep; ep = next) {
+		next = ep->free_next;
+
+		/* let the sockets still listed be raised to another epoll */
+		for (i = ep->ring->start; i != ep->ring->tail; i++) {
+			socket = &mtcp->smap[SOCKDESC_ID(ep->ring->descs[i & ep->ring->mask])];
+			queued_ep = ep;
+			__atomic_compare_exchange_n(&socket->queued_ep, &queued_ep, NULL, 
+					FALSE, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+		}
+
+		DestroyEventRing(ep->ring);
+		free(ep);
+	}
+}
+/*----------------------------------------------------------------------------*/
 static int 
 RaisePendingStreamEvents(mtcp_manager_t mtcp, 
 		struct mtcp_epoll *ep, socket_map_t socket)
@@ -232,7 +316,7 @@ RaisePendingStreamEvents(mtcp_manager_t mtcp,
 
 	if (!stream)
 		return -1;
-	if (stream->state < TCP_ST_ESTABLISHED)
+	if (stream->state < TCP_ST_ESTABLISHED && !TFO_EARLY_WRITE(stream))
 		return -1;
 
 	TRACE_EPOLL("Stream %d at state %s\n", 
@@ -317,6 +401,7 @@ mtcp_epoll_ctl(mctx_t mctx, int epid,
 		events = event->events;
 		events |= (MTCP_EPOLLERR | MTCP_EPOLLHUP);
 		socket->ep_data = event->data;
+		socket->reg_ep = ep;
 		socket->epoll = events;
 
 		TRACE_EPOLL("Adding epoll socket %d(type %d) ET: %u, IN: %u, OUT: %u\n", 
@@ -330,8 +415,7 @@ mtcp_epoll_ctl(mctx_t mctx, int epid,
 		}
 
 	} else if (op == MTCP_EPOLL_CTL_MOD) {
-		if (!socket->epoll) {
-			pthread_mutex_unlock(&ep->epoll_lock);
+		if (!socket->epoll || socket->reg_ep != ep) {
 			errno = ENOENT;
 			return -1;
 		}
@@ -348,29 +432,189 @@ mtcp_epoll_ctl(mctx_t mctx, int epid,
 		}
 
 	} else if (op == MTCP_EPOLL_CTL_DEL) {
-		if (!socket->epoll) {
+		if (!socket->epoll || socket->reg_ep != ep) {
 			errno = ENOENT;
 			return -1;
 		}
 
 		socket->epoll = MTCP_EPOLLNONE;
+		socket->reg_ep = NULL;
+		if (socket->ready_ep)
+			RemoveFromReadyList(socket);
+		__atomic_store_n(&socket->events, 0, __ATOMIC_SEQ_CST);
 	}
 
 	return 0;
 }
 /*----------------------------------------------------------------------------*/
+static inline int
+EpollHasEvents(struct mtcp_epoll *ep)
+{
+	return !TAILQ_EMPTY(&ep->ready_list) || 
+			ep->ring->start != __atomic_load_n(&ep->ring->end, __ATOMIC_ACQUIRE);
+}
+/*----------------------------------------------------------------------------*/
+/* moves the sockets published by the mtcp thread to the ready list */
+static inline void
+DrainEventRing(mtcp_manager_t mtcp, struct mtcp_epoll *ep)
+{
+	struct event_ring *ring = ep->ring;
+	uint32_t start = ring->start;
+	uint32_t end = __atomic_load_n(&ring->end, __ATOMIC_ACQUIRE);
+	struct mtcp_epoll *queued_ep;
+	socket_map_t socket;
+	sockdesc_t desc;
+
+	for (; start != end; start++) {
+		desc = ring->descs[start & ring->mask];
+		socket = &mtcp->smap[SOCKDESC_ID(desc)];
+		/* from here on, a new event queues the socket again; 
+		   HarvestReadyList() takes the bits only after this. If the 
+		   socket was queued to another epoll since, that one has it */
+		queued_ep = ep;
+		if (!__atomic_compare_exchange_n(&socket->queued_ep, &queued_ep, NULL, 
+					FALSE, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+			continue;
+		/* raised before a close: unless the socket reusing the id 
+		   has raised something since, there is nothing to report */
+		if (SOCKDESC_GEN(desc) != socket->gen && 
+				!__atomic_load_n(&socket->events, __ATOMIC_SEQ_CST)) {
+			ep->stat.invalidated++;
+			continue;
+		}
+		/* raised just before it moved to another epoll: hand it over */
+		if (socket->reg_ep)
+			AddToReadyList(socket->reg_ep, socket);
+	}
+
+	/* give the slots back to the mtcp thread in one go */
+	__atomic_store_n(&ring->start, start, __ATOMIC_RELEASE);
+}
+/*----------------------------------------------------------------------------*/
+/* the events a level-triggered socket has right now */
+static inline uint32_t
+GetLevelEvents(socket_map_t socket)
+{
+	tcp_stream *stream;
+	uint32_t events = 0;
+
+	if (socket->socktype == MTCP_SOCK_LISTENER) {
+		if (!StreamQueueIsEmpty(socket->listener->acceptq))
+			events |= MTCP_EPOLLIN;
+	} else if (socket->socktype == MTCP_SOCK_STREAM && (stream = socket->stream)) {
+		if (stream->state < TCP_ST_ESTABLISHED && !TFO_EARLY_WRITE(stream))
+			return 0;
+		if ((stream->rcvvar->rcvbuf && stream->rcvvar->rcvbuf->merged_len > 0) || 
+				stream->state == TCP_ST_CLOSE_WAIT)
+			events |= MTCP_EPOLLIN;
+		if (!stream->sndvar->sndbuf || stream->sndvar->snd_wnd > 0)
+			events |= MTCP_EPOLLOUT;
+	}
+
+	return events;
+}
+/*----------------------------------------------------------------------------*/
+/* 
+ * reports the ready sockets, each once per call. Edge-triggered sockets 
+ * report the events raised since the last call and leave the list; 
+ * level-triggered ones also report what their state says and stay until 
+ * there is nothing to report.
+ */
+static inline int
+HarvestReadyList(struct mtcp_epoll *ep, 
+		struct mtcp_epoll_event *events, int maxevents)
+{
+	socket_map_t socket;
+	uint32_t pending;
+	int n = ep->num_ready;
+	int cnt = 0;
+
+	while (n-- > 0 && cnt < maxevents) {
+		socket = TAILQ_FIRST(&ep->ready_list);
+		TAILQ_REMOVE(&ep->ready_list, socket, ready_link);
+
+		if (socket->reg_ep != ep)
+			pending = 0;
+		else
+			pending = __atomic_exchange_n(&socket->events, 0, __ATOMIC_SEQ_CST);
+		if (socket->socktype == MTCP_SOCK_UNUSED)
+			pending = 0;
+		else if (socket->reg_ep == ep && socket->epoll && 
+				!(socket->epoll & MTCP_EPOLLET))
+			pending |= GetLevelEvents(socket);
+		pending &= socket->epoll;
+
+		if (!pending) {
+			TRACE_EPOLL("Socket %d: nothing to report.\n", socket->id);
+			socket->ready_ep = NULL;
+			ep->num_ready--;
+			ep->stat.invalidated++;
+			continue;
+		}
+
+		events[cnt].events = pending;
+		events[cnt].data = socket->ep_data;
+		cnt++;
+		TRACE_EPOLL("Socket %d: Handled event. event: %u\n", socket->id, pending);
+		ep->stat.handled++;
+
+		/* one report disables a one-shot socket until MTCP_EPOLL_CTL_MOD */
+		if (socket->epoll & MTCP_EPOLLONESHOT)
+			socket->epoll &= MTCP_EPOLLONESHOT;
+
+		if (socket->epoll & (MTCP_EPOLLET | MTCP_EPOLLONESHOT)) {
+			socket->ready_ep = NULL;
+			ep->num_ready--;
+		} else {
+			TAILQ_INSERT_TAIL(&ep->ready_list, socket, ready_link);
+		}
+	}
+
+	return cnt;
+}
+/*----------------------------------------------------------------------------*/
+/* inline mode: there is no mtcp thread to wait for, so the caller runs 
+   rounds of the main loop until an event shows up or the timeout passes */
+static int 
+InlineEpollWait(mtcp_manager_t mtcp, struct mtcp_epoll *ep, 
+		struct mtcp_epoll_event *events, int maxevents, int timeout)
+{
+	struct mtcp_thread_context *ctx = mtcp->ctx;
+	uint32_t deadline;
+	int cnt;
+
+	RunMainLoopRound(ctx);
+	deadline = mtcp->cur_ts + MSEC_TO_TS(timeout);
+
+	while (1) {
+		DrainEventRing(mtcp, ep);
+		cnt = HarvestReadyList(ep, events, maxevents);
+		if (cnt > 0 || timeout == 0)
+			return cnt;
+		if (timeout > 0 && (int32_t)(mtcp->cur_ts - deadline) >= 0)
+			return 0;
+
+		if (ctx->done || ctx->exit || ctx->interrupt) {
+			ctx->interrupt = FALSE;
+			errno = EINTR;
+			return -1;
+		}
+		ep->stat.waits++;
+
+		RunMainLoopRound(ctx);
+	}
+}
+/*----------------------------------------------------------------------------*/
 int 
 mtcp_epoll_wait(mctx_t mctx, int epid, 
 		struct mtcp_epoll_event *events, int maxevents, int timeout)
 {
 	mtcp_manager_t mtcp;
 	struct mtcp_epoll *ep;
-	struct event_queue *eq;
-	struct event_queue *eq_shadow;
-	socket_map_t event_socket;
-	int validity;
-	int i, cnt, ret;
-	int num_events;
+	struct timespec ts;
+	uint64_t deadline = 0, now;
+	uint32_t seq;
+	int cnt, ret, spin;
 
 	mtcp = GetMTCPManager(mctx);
 	if (!mtcp) {
@@ -401,167 +645,73 @@ mtcp_epoll_wait(mctx_t mctx, int epid,
 
 	ep->stat.calls++;
 
-#if SPIN_BEFORE_SLEEP
-	int spin = 0;
-	while (ep->num_events == 0 && spin < SPIN_THRESH) {
-		spin++;
-	}
-#endif /* SPIN_BEFORE_SLEEP */
+	if (CONFIG.inline_mode)
+		return InlineEpollWait(mtcp, ep, events, maxevents, timeout);
 
-	if (pthread_mutex_lock(&ep->epoll_lock)) {
-		if (errno == EDEADLK)
-			perror("mtcp_epoll_wait: epoll_lock blocked\n");
-		assert(0);
-	}
+	if (timeout > 0)
+		deadline = MonotonicUsec() + (uint64_t)timeout * 1000;
 
 wait:
-	eq = ep->usr_queue;
-	eq_shadow = ep->usr_shadow_queue;
-
 	/* wait until event occurs */
-	while (eq->num_events == 0 && eq_shadow->num_events == 0 && timeout != 0) {
+	while (!EpollHasEvents(ep) && timeout != 0) {
 
-#if INTR_SLEEPING_MTCP
-		/* signal to mtcp thread if it is sleeping */
-		if (mtcp->wakeup_flag && mtcp->is_sleeping) {
-			pthread_kill(mtcp->ctx->thread, SIGUSR1);
+		/* events often follow shortly: poll a while before sleeping */
+		for (spin = 0; spin < ep->spin && !EpollHasEvents(ep); spin++)
+			SpinPause();
+		if (spin < ep->spin) {
+			ep->spin = MIN(ep->spin << 1, EPOLL_SPIN_MAX);
+			break;
 		}
-#endif
-		ep->stat.waits++;
-		ep->waiting = TRUE;
-		if (timeout > 0) {
-			struct timespec deadline;
-
-			clock_gettime(CLOCK_REALTIME, &deadline);
-			if (timeout >= 1000) {
-				int sec;
-				sec = timeout / 1000;
-				deadline.tv_sec += sec;
-				timeout -= sec * 1000;
-			}
+		ep->spin = MAX(ep->spin >> 1, EPOLL_SPIN_MIN);
 
-			deadline.tv_nsec += timeout * 1000000;
+		ep->stat.waits++;
 
-			if (deadline.tv_nsec >= 1000000000) {
-				deadline.tv_sec++;
-				deadline.tv_nsec -= 1000000000;
+		/* FlushEpollEvents() publishes events before it reads waiting, 
+		   and we set waiting before we look at the queues again, so 
+		   either it sees us waiting or we see its events */
+		seq = __atomic_load_n(&ep->wakeup_seq, __ATOMIC_ACQUIRE);
+		__atomic_store_n(&ep->waiting, TRUE, __ATOMIC_SEQ_CST);
+		ret = 0;
+		if (!EpollHasEvents(ep) && !mtcp->ctx->done && 
+				!mtcp->ctx->exit && !mtcp->ctx->interrupt) {
+			if (timeout > 0) {
+				/* sleep for what is left until the deadline */
+				now = MonotonicUsec();
+				if (now >= deadline) {
+					timeout = 0;
+				} else {
+					ts.tv_sec = (deadline - now) / 1000000;
+					ts.tv_nsec = (deadline - now) % 1000000 * 1000;
+					ret = FutexWait(&ep->wakeup_seq, seq, &ts);
+					if (ret < 0 && errno == ETIMEDOUT)
+						timeout = 0;
+				}
+			} else {
+				ret = FutexWait(&ep->wakeup_seq, seq, NULL);
 			}
+		}
+		__atomic_store_n(&ep->waiting, FALSE, __ATOMIC_RELAXED);
 
-			//deadline.tv_sec = mtcp->cur_tv.tv_sec;
-			//deadline.tv_nsec = (mtcp->cur_tv.tv_usec + timeout * 1000) * 1000;
-			ret = pthread_cond_timedwait(&ep->epoll_cond, 
-					&ep->epoll_lock, &deadline);
-			if (ret && ret != ETIMEDOUT) {
-				/* errno set by pthread_cond_timedwait() */
-				pthread_mutex_unlock(&ep->epoll_lock);
-				TRACE_ERROR("pthread_cond_timedwait failed. ret: %d, error: %s\n", 
-						ret, strerror(errno));
-				return -1;
-			}
-			timeout = 0;
-		} else if (timeout < 0) {
-			ret = pthread_cond_wait(&ep->epoll_cond, &ep->epoll_lock);
-			if (ret) {
-				/* errno set by pthread_cond_wait() */
-				pthread_mutex_unlock(&ep->epoll_lock);
-				TRACE_ERROR("pthread_cond_wait failed. ret: %d, error: %s\n", 
-						ret, strerror(errno));
-				return -1;
-			}
+		if (ret < 0 && errno != EAGAIN && errno != EINTR && errno != ETIMEDOUT) {
+			/* errno set by futex() */
+			TRACE_ERROR("futex wait failed. error: %s\n", strerror(errno));
+			return -1;
 		}
-		ep->waiting = FALSE;
 
 		if (mtcp->ctx->done || mtcp->ctx->exit || mtcp->ctx->interrupt) {
 			mtcp->ctx->interrupt = FALSE;
-			//ret = pthread_cond_signal(&ep->epoll_cond);
-			pthread_mutex_unlock(&ep->epoll_lock);
 			errno = EINTR;
 			return -1;
 		}
 	
 	}
 	
-	/* fetch events from the user event queue */
-	cnt = 0;
-	num_events = eq->num_events;
-	for (i = 0; i < num_events && cnt < maxevents; i++) {
-		event_socket = &mtcp->smap[eq->events[eq->start].sockid];
-		validity = TRUE;
-		if (event_socket->socktype == MTCP_SOCK_UNUSED)
-			validity = FALSE;
-		if (!(event_socket->epoll & eq->events[eq->start].ev.events))
-			validity = FALSE;
-		if (!(event_socket->events & eq->events[eq->start].ev.events))
-			validity = FALSE;
-
-		if (validity) {
-			events[cnt++] = eq->events[eq->start].ev;
-			assert(eq->events[eq->start].sockid >= 0);
-
-			TRACE_EPOLL("Socket %d: Handled event. event: %s, "
-					"start: %u, end: %u, num: %u\n", 
-					event_socket->id, 
-					EventToString(eq->events[eq->start].ev.events), 
-					eq->start, eq->end, eq->num_events);
-			ep->stat.handled++;
-		} else {
-			TRACE_EPOLL("Socket %d: event %s invalidated.\n", 
-					eq->events[eq->start].sockid, 
-					EventToString(eq->events[eq->start].ev.events));
-			ep->stat.invalidated++;
-		}
-		event_socket->events &= (~eq->events[eq->start].ev.events);
-
-		eq->start++;
-		eq->num_events--;
-		if (eq->start >= eq->size) {
-			eq->start = 0;
-		}
-	}
-
-	/* fetch eventes from user shadow event queue */
-	eq = ep->usr_shadow_queue;
-	num_events = eq->num_events;
-	for (i = 0; i < num_events && cnt < maxevents; i++) {
-		event_socket = &mtcp->smap[eq->events[eq->start].sockid];
-		validity = TRUE;
-		if (event_socket->socktype == MTCP_SOCK_UNUSED)
-			validity = FALSE;
-		if (!(event_socket->epoll & eq->events[eq->start].ev.events))
-			validity = FALSE;
-		if (!(event_socket->events & eq->events[eq->start].ev.events))
-			validity = FALSE;
-
-		if (validity) {
-			events[cnt++] = eq->events[eq->start].ev;
-			assert(eq->events[eq->start].sockid >= 0);
-
-			TRACE_EPOLL("Socket %d: Handled event. event: %s, "
-					"start: %u, end: %u, num: %u\n", 
-					event_socket->id, 
-					EventToString(eq->events[eq->start].ev.events), 
-					eq->start, eq->end, eq->num_events);
-			ep->stat.handled++;
-		} else {
-			TRACE_EPOLL("Socket %d: event %s invalidated.\n", 
-					eq->events[eq->start].sockid, 
-					EventToString(eq->events[eq->start].ev.events));
-			ep->stat.invalidated++;
-		}
-		event_socket->events &= (~eq->events[eq->start].ev.events);
-
-		eq->start++;
-		eq->num_events--;
-		if (eq->start >= eq->size) {
-			eq->start = 0;
-		}
-	}
+	DrainEventRing(mtcp, ep);
+	cnt = HarvestReadyList(ep, events, maxevents);
 
 	if (cnt == 0 && timeout != 0)
 		goto wait;
 
-	pthread_mutex_unlock(&ep->epoll_lock);
-
 	return cnt;
 }
 /*----------------------------------------------------------------------------*/
@@ -569,60 +719,35 @@ inline int
 AddEpollEvent(struct mtcp_epoll *ep, 
 		int queue_type, socket_map_t socket, uint32_t event)
 {
-	struct event_queue *eq;
-	int index;
+	struct event_ring *ring;
 
 	if (!ep || !socket || !event)
 		return -1;
 	
 	ep->stat.issued++;
 
-	if (socket->events & event) {
+	/* raised before and not reported yet: the socket is listed already */
+	if (__atomic_fetch_or(&socket->events, event, __ATOMIC_SEQ_CST) & event) {
 		return 0;
 	}
 
 	if (queue_type == MTCP_EVENT_QUEUE) {
-		eq = ep->mtcp_queue;
-	} else if (queue_type == USR_EVENT_QUEUE) {
-		eq = ep->usr_queue;
-		pthread_mutex_lock(&ep->epoll_lock);
+		if (__atomic_exchange_n(&socket->queued_ep, ep, __ATOMIC_SEQ_CST) == ep)
+			return 0;
+		ring = ep->ring;
+		if (ring->tail - __atomic_load_n(&ring->start, __ATOMIC_ACQUIRE) > ring->mask) {
+			TRACE_ERROR("(NEVER HAPPEN) Epoll event ring is full!\n");
+			socket->queued_ep = NULL;
+			return -1;
+		}
+		ring->descs[ring->tail++ & ring->mask] = SOCKDESC(socket);
 	} else if (queue_type == USR_SHADOW_EVENT_QUEUE) {
-		eq = ep->usr_shadow_queue;
+		AddToReadyList(ep, socket);
 	} else {
 		TRACE_ERROR("Non-existing event queue type!\n");
 		return -1;
 	}
 
-	if (eq->num_events >= eq->size) {
-		TRACE_ERROR("Exceeded epoll event queue! num_events: %d, size: %d\n", 
-				eq->num_events, eq->size);
-		if (queue_type == USR_EVENT_QUEUE)
-			pthread_mutex_unlock(&ep->epoll_lock);
-		return -1;
-	}
-
-	index = eq->end++;
-
-	socket->events |= event;
-	eq->events[index].sockid = socket->id;
-	eq->events[index].ev.events = event;
-	eq->events[index].ev.data = socket->ep_data;
-
-	if (eq->end >= eq->size) {
-		eq->end = 0;
-	}
-	eq->num_events++;
-
-#if 0
-	TRACE_EPOLL("Socket %d New event: %s, start: %u, end: %u, num: %u\n",
-			ep->events[index].sockid, 
-			EventToString(ep->events[index].ev.events), 
-			ep->start, ep->end, ep->num_events);
-#endif
-
-	if (queue_type == USR_EVENT_QUEUE)
-		pthread_mutex_unlock(&ep->epoll_lock);
-
 	ep->stat.registered++;
 
 	return 0;
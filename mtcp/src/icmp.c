@@ -111,7 +111,7 @@ ProcessICMPPacket(mtcp_manager_t mtcp, struct iphdr *iph, int len)
 	
 	/* process the icmp messages destined to me */
 	for (i = 0; i < CONFIG.eths_num; i++) {
-		if (iph->daddr == CONFIG.eths[i].ip_addr) {
+		if (IsPortAddress(i, iph->daddr)) {
 			to_me = TRUE;
 		}
 	}
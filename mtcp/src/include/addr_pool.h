@@ -18,7 +18,8 @@ addr_pool_t
 CreateAddressPool(in_addr_t addr_base, int num_addr);
 /*----------------------------------------------------------------------------*/
 /* CreateAddressPoolPerCore()                                                 */
-/* Create address pool only for the given core number.                        */
+/* Create address pool only for the given core number, with the ports         */
+/* towards the given destination ready.                                       */
 /* All addresses and port numbers should be in network order.                 */
 /*----------------------------------------------------------------------------*/
 addr_pool_t 
@@ -28,16 +29,23 @@ CreateAddressPoolPerCore(int core, int num_queues,
 void
 DestroyAddressPool(addr_pool_t ap);
 /*----------------------------------------------------------------------------*/
+/* FetchAddress()                                                             */
+/* Take a source address towards daddr whose packets come in on core.         */
+/* A non-zero address or port in saddr restricts the choice. Called only      */
+/* from the application thread of the core.                                   */
+/*----------------------------------------------------------------------------*/
 int 
 FetchAddress(addr_pool_t ap, int core, int num_queues, 
 		const struct sockaddr_in *daddr, struct sockaddr_in *saddr);
 /*----------------------------------------------------------------------------*/
-int 
-FetchAddressPerCore(addr_pool_t ap, int core, int num_queues, 
-		    const struct sockaddr_in *daddr, struct sockaddr_in *saddr);
+/* FreeAddress()                                                              */
+/* Give back a source address FetchAddress() took towards daddr. Called from  */
+/* the mtcp thread of the core, or from its application thread to undo a      */
+/* FetchAddress() whose connect could not start.                              */
 /*----------------------------------------------------------------------------*/
 int 
-FreeAddress(addr_pool_t ap, const struct sockaddr_in *addr);
+FreeAddress(addr_pool_t ap, int core, 
+		const struct sockaddr_in *saddr, const struct sockaddr_in *daddr);
 /*----------------------------------------------------------------------------*/
 
 #endif /* ADDR_POOL_H */
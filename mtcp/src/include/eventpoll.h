@@ -1,6 +1,8 @@
 #ifndef EVENTPOLL_H
 #define EVENTPOLL_H
 
+#include <sys/queue.h>
+
 #include "mtcp_api.h"
 #include "mtcp_epoll.h"
 
@@ -17,44 +19,66 @@ struct mtcp_epoll_stat
 	uint64_t handled;
 };
 /*----------------------------------------------------------------------------*/
-struct mtcp_epoll_event_int
-{
-	struct mtcp_epoll_event ev;
-	int sockid;
-};
-/*----------------------------------------------------------------------------*/
 enum event_queue_type
 {
-	USR_EVENT_QUEUE = 0, 
-	USR_SHADOW_EVENT_QUEUE = 1, 
-	MTCP_EVENT_QUEUE = 2
+	USR_SHADOW_EVENT_QUEUE = 1, 	// raised by the application thread
+	MTCP_EVENT_QUEUE = 2			// raised by the mtcp thread
 };
 /*----------------------------------------------------------------------------*/
-struct event_queue
+#define EPOLL_CACHE_LINE	64
+/*----------------------------------------------------------------------------*/
+/*
+ * Sockets the mtcp thread found ready, on their way to the application. 
+ * This is a lock-free single producer, single consumer ring: the mtcp 
+ * thread fills slots at tail and publishes them all at once by moving end 
+ * (FlushEpollEvents()); the application takes them out at start. The 
+ * indices run free and are masked on access. A socket is in the ring at 
+ * most once at a time (socket->queued_ep), so it can never fill up.
+ */
+struct event_ring
 {
-	struct mtcp_epoll_event_int *events;
-	int start;			// starting index
-	int end;			// ending index
-	
-	int size;			// max size
-	int num_events;		// number of events
+	uint64_t *descs;		/* sockdesc_t, generation-tagged socket ids */
+	uint32_t mask;
+
+	uint32_t start __attribute__((aligned(EPOLL_CACHE_LINE)));	// application
+	uint32_t end __attribute__((aligned(EPOLL_CACHE_LINE)));	// published
+	uint32_t tail;													// mtcp thread
 };
 /*----------------------------------------------------------------------------*/
+/*
+ * Raising an event sets its bit in socket->events and puts the socket on 
+ * the ready list unless it is there already. mtcp_epoll_wait() walks the 
+ * ready list and works out what to report from the bits, the registered 
+ * events and, for level-triggered sockets, the current socket state, so 
+ * events are never dropped and a socket costs one ready list entry no 
+ * matter how many events it raises.
+ */
 struct mtcp_epoll
 {
-	struct event_queue *usr_queue;
-	struct event_queue *usr_shadow_queue;
-	struct event_queue *mtcp_queue;
+	struct mtcp_epoll *next;				// in mtcp->ep_list
+	struct mtcp_epoll *free_next;			// in mtcp->ep_free once closed
+
+	struct event_ring *ring;				// from the mtcp thread
+	TAILQ_HEAD(, socket_map) ready_list;	// owned by the application
+	int num_ready;
 
-	uint8_t waiting;
 	struct mtcp_epoll_stat stat;
-	
-	pthread_cond_t epoll_cond;
-	pthread_mutex_t epoll_lock;
+	int spin;			// adaptive spin budget of mtcp_epoll_wait()
+
+	/* mtcp_epoll_wait() parks on wakeup_seq (futex) while waiting is set */
+	uint32_t waiting __attribute__((aligned(EPOLL_CACHE_LINE)));
+	uint32_t wakeup_seq;
 };
 /*----------------------------------------------------------------------------*/
 
 int 
 CloseEpollSocket(mctx_t mctx, int epid);
 
+void
+WakeupEpoll(struct mtcp_epoll *ep);
+
+struct mtcp_manager;
+void
+FreeClosedEpolls(struct mtcp_manager *mtcp);
+
 #endif /* EVENTPOLL_H */
@@ -15,6 +15,6 @@ IPOutputStandalone(struct mtcp_manager *mtcp, uint8_t protocol,
 		uint16_t ip_id, uint32_t saddr, uint32_t daddr, uint16_t tcplen);
 
 uint8_t *
-IPOutput(struct mtcp_manager *mtcp, tcp_stream *stream, uint16_t tcplen);
+IPOutput(struct mtcp_manager *mtcp, tcp_stream *stream, uint16_t tcplen, uint8_t tos);
 
 #endif /* IP_OUT_H */
@@ -6,6 +6,7 @@
 #include <sys/time.h>
 #include <sys/queue.h>
 #include <pthread.h>
+#include <poll.h>
 #ifndef DISABLE_DPDK
 #include <gmp.h>
 #endif
@@ -50,19 +51,22 @@
 #define ETH_NUM                         MAX_DEVICES
 
 #define TCP_OPT_TIMESTAMP_ENABLED       TRUE   // enabled for rtt measure
-#define TCP_OPT_SACK_ENABLED            TRUE   // only recv-side implemented
+#define TCP_OPT_SACK_ENABLED            TRUE   // SACK-based loss recovery
+#define TCP_RACK_TLP_ENABLED            TCP_OPT_SACK_ENABLED	// RACK-TLP loss detection (needs SACK)
 
 /* Only use rate limiting if using CCP */
 #if USE_CCP
 #undef  RATE_LIMIT_ENABLED
 #define RATE_LIMIT_ENABLED              TRUE
 #define PACING_ENABLED                  FALSE
+#undef  TCP_RACK_TLP_ENABLED
+#define TCP_RACK_TLP_ENABLED            FALSE
 // The following two logs are for debugging / experiments only, should be turned
 // off for production use
 // #define DBGCCP                                 // ccp debug messages
 // #define PROBECCP                               // print all cwnd changes, similar to tcpprobe output
-#define CC_NAME				20
 #endif
+#define CC_NAME				20		// max length of the congestion control name
 
 #define LOCK_STREAM_QUEUE               FALSE
 #define USE_SPIN_LOCK                   TRUE
@@ -83,6 +87,10 @@
 #endif /* NETSTAT */
 #define RTM_STAT			FALSE
 /*----------------------------------------------------------------------------*/
+/* In inline mode the application thread runs the stack itself, so the 
+   buffer and stream queue locks have nothing to exclude */
+#define INLINE_MODE()			(CONFIG.inline_mode)
+
 /* Lock definitions for socket buffer */
 #if USE_SPIN_LOCK
 #define SBUF_LOCK_INIT(lock, errmsg, action);		\
@@ -91,8 +99,8 @@
 		action;										\
 	}
 #define SBUF_LOCK_DESTROY(lock)	pthread_spin_destroy(lock)
-#define SBUF_LOCK(lock)			pthread_spin_lock(lock)
-#define SBUF_UNLOCK(lock)		pthread_spin_unlock(lock)
+#define SBUF_LOCK(lock)			(INLINE_MODE()? 0 : pthread_spin_lock(lock))
+#define SBUF_UNLOCK(lock)		(INLINE_MODE()? 0 : pthread_spin_unlock(lock))
 #else
 #define SBUF_LOCK_INIT(lock, errmsg, action);		\
 	if (pthread_mutex_init(lock, NULL)) {			\
@@ -100,8 +108,8 @@
 		action;										\
 	}
 #define SBUF_LOCK_DESTROY(lock)	pthread_mutex_destroy(lock)
-#define SBUF_LOCK(lock)			pthread_mutex_lock(lock)
-#define SBUF_UNLOCK(lock)		pthread_mutex_unlock(lock)
+#define SBUF_LOCK(lock)			(INLINE_MODE()? 0 : pthread_mutex_lock(lock))
+#define SBUF_UNLOCK(lock)		(INLINE_MODE()? 0 : pthread_mutex_unlock(lock))
 #endif /* USE_SPIN_LOCK */
 
 /* add macro if it is not defined in /usr/include/sys/queue.h */
@@ -176,6 +184,18 @@ struct mtcp_config
 	
 	int tcp_timewait;
 	int tcp_timeout;
+	int tcp_ecn;		/* TCP_ECN_OFF, TCP_ECN_ON or TCP_ECN_PASSIVE */
+	int tcp_pacing;		/* TCP_PACING_OFF, TCP_PACING_CC or TCP_PACING_ALL */
+	int tcp_delayed_ack;	/* delayed ack timeout, 0 to ack right away */
+	int tcp_fastopen;	/* TCP_FASTOPEN_CLIENT | TCP_FASTOPEN_SERVER */
+	int tcp_syncookies;	/* TCP_SYNCOOKIES_OFF, TCP_SYNCOOKIES_ON or TCP_SYNCOOKIES_ALWAYS */
+	int tcp_max_syn_backlog;	/* half-open connections before SYN cookies */
+	int tcp_tw_reuse;	/* reuse local ports in TIME_WAIT once timestamps allow */
+	int tcp_max_tw_buckets;	/* TIME_WAIT connections per core */
+	int inline_mode;	/* no mtcp thread: mtcp_epoll_wait() runs the loop */
+	int idle_sleep;		/* longest sleep of an idle mtcp thread in us */
+	int rx_interrupt;	/* idle dpdk threads wait for rx interrupts */
+	int src_addrs;		/* addresses of each port, from its own one up */
 
 	/* adding multi-process support */
 	uint8_t multi_process;
@@ -188,9 +208,7 @@ struct mtcp_config
   	uint16_t onvm_inst;
   	uint16_t onvm_dest;
 #endif
-#if USE_CCP
-    char     cc[CC_NAME];
-#endif
+	char cc[CC_NAME];		/* congestion control algorithm */
 };
 /*----------------------------------------------------------------------------*/
 struct mtcp_context
@@ -229,7 +247,8 @@ struct mtcp_manager
 
 	uint32_t s_index:24;		/* stream index */
 	socket_map_t smap;
-	TAILQ_HEAD (, socket_map) free_smap;
+	int *free_smap;			/* stack of unused socket ids (application side) */
+	int free_smap_top;
 
 	addr_pool_t ap;			/* address pool */
 
@@ -245,7 +264,8 @@ struct mtcp_manager
 	FILE *log_fp;
 
 	/* variables related to event */
-	struct mtcp_epoll *ep;
+	struct mtcp_epoll *ep_list;		/* epoll instances, linked by next */
+	struct mtcp_epoll *ep_free;		/* closed epolls, freed by the mtcp thread */
 	uint32_t ts_last_event;
 
 	struct hashtable *listeners;
@@ -264,10 +284,16 @@ struct mtcp_manager
 	struct mtcp_sender *g_sender;
 	struct mtcp_sender *n_sender[ETH_NUM];
 
-	/* lists related to timeout */
-	struct rto_hashstore* rto_store;
-	TAILQ_HEAD (timewait_head, tcp_stream) timewait_list;
-	TAILQ_HEAD (timeout_head, tcp_stream) timeout_list;
+	/* timer wheel holding all the tcp timers */
+	struct timer_wheel *timer_wheel;
+
+	struct tfo_cache *tfo_cache;		/* fast open cookies of the servers */
+
+	struct minisock_table *minisocks;	/* passive opens waiting for the final ack */
+	int half_open_cnt;					/* minisocks and streams in TCP_ST_SYN_RCVD */
+	uint32_t last_syncookie_ts;			/* when we last answered with a cookie */
+
+	struct timewait_table *timewait;	/* connections in TIME_WAIT */
 
 	int rto_list_cnt;
 	int timewait_list_cnt;
@@ -281,9 +307,13 @@ struct mtcp_manager
 #endif
 
 	uint32_t cur_ts;
+	uint32_t ts_last_tick;		/* last round that ran the 1 ms jobs */
 
-	int wakeup_flag;
-	int is_sleeping;
+	int wakeup_flag;		/* application calls are queued */
+	int is_sleeping;		/* sleeping in MTCPIdleSleep() */
+	int wakeup_fd;			/* eventfd that ends the sleep */
+	struct idle_stat istat;
+	struct idle_stat p_istat;
 
 	/* statistics */
 	struct bcast_stat bstat;
@@ -322,7 +352,6 @@ struct mtcp_thread_context
 	struct mtcp_manager* mtcp_manager;
 
 	void *io_private_context;
-	pthread_mutex_t smap_lock;
 	pthread_mutex_t flow_pool_lock;
 	pthread_mutex_t socket_pool_lock;
 
@@ -351,5 +380,28 @@ extern struct mtcp_manager *g_mtcp[MAX_CPUS];
 extern struct mtcp_config CONFIG;
 extern addr_pool_t ap[ETH_NUM];
 /*----------------------------------------------------------------------------*/
+/* whether ip (network order) is one of the src_addrs addresses of port eidx */
+static inline int 
+IsPortAddress(int eidx, uint32_t ip)
+{
+	return ntohl(ip) - ntohl(CONFIG.eths[eidx].ip_addr) < (uint32_t)CONFIG.src_addrs;
+}
+/*----------------------------------------------------------------------------*/
+/* one round of rx, timers, application calls and tx; the mtcp thread 
+   loops over it, inline mode runs it from mtcp_epoll_wait() */
+void 
+RunMainLoopRound(struct mtcp_thread_context *ctx);
+/*----------------------------------------------------------------------------*/
+/* marks queued application calls and wakes the mtcp thread if it sleeps */
+void 
+WakeupMTCPThread(mtcp_manager_t mtcp);
+/*----------------------------------------------------------------------------*/
+/* for the I/O modules' select(): sleeps in poll() on pfd[0..nfds-1] and 
+   the wakeup eventfd for at most timeout_us, or until the next stream 
+   timer is due; pfd needs room for nfds + 1 entries. returns the number 
+   of the caller's descriptors that are ready */
+int 
+MTCPIdleSleep(mtcp_manager_t mtcp, struct pollfd *pfd, int nfds, int timeout_us);
+/*----------------------------------------------------------------------------*/
 
 #endif /* MTCP_H */
@@ -38,6 +38,8 @@ struct mtcp_conf
 
 	int tcp_timewait;
 	int tcp_timeout;
+
+	int inline_mode;	/* run the stack on the application thread */
 };
 
 typedef struct mtcp_context *mctx_t;
@@ -100,6 +102,12 @@ mtcp_listen(mctx_t mctx, int sockid, int backlog);
 int 
 mtcp_accept(mctx_t mctx, int sockid, struct sockaddr *addr, socklen_t *addrlen);
 
+/* accepts up to max connections at once into sockids (and their peers into 
+   addrs, if given). returns the number accepted, or -1 on error */
+int 
+mtcp_accept_batch(mctx_t mctx, int sockid, int *sockids, 
+		struct sockaddr_in *addrs, int max);
+
 int 
 mtcp_init_rss(mctx_t mctx, in_addr_t saddr_base, int num_addr, 
 		in_addr_t daddr, in_addr_t dport);
@@ -108,6 +116,21 @@ int
 mtcp_connect(mctx_t mctx, int sockid, 
 		const struct sockaddr *addr, socklen_t addrlen);
 
+/* one connection of mtcp_connect_batch() */
+struct mtcp_connreq
+{
+	int sockid;	/* -1 opens a new nonblocking socket, returned here 
+				   unless the connect fails */
+	struct sockaddr_in addr;
+
+	int err;	/* EINPROGRESS once the SYN is queued, 0 for fast open */
+};
+
+/* starts the connects of reqs together, never waiting for the handshake. 
+   returns the number of connects started, or -1 on error */
+int 
+mtcp_connect_batch(mctx_t mctx, struct mtcp_connreq *reqs, unsigned int cnt);
+
 int 
 mtcp_close(mctx_t mctx, int sockid);
 
@@ -137,10 +160,34 @@ mtcp_readv(mctx_t mctx, int sockid, const struct iovec *iov, int numIOV);
 ssize_t
 mtcp_write(mctx_t mctx, int sockid, const char *buf, size_t len);
 
+/* only MSG_MORE is supported in flags */
+ssize_t
+mtcp_send(mctx_t mctx, int sockid, const char *buf, size_t len, int flags);
+
 /* writev should work in atomic */
 int
 mtcp_writev(mctx_t mctx, int sockid, const struct iovec *iov, int numIOV);
 
+/* one operation of mtcp_recvmmsg()/mtcp_sendmmsg(), each on its own socket */
+struct mtcp_mmsg
+{
+	int sockid;
+	void *buf;
+	size_t len;
+
+	ssize_t ret;	/* what mtcp_recv()/mtcp_send() would have returned */
+	int err;	/* errno of the operation when ret is -1 */
+};
+
+/* mtcp_recv() (resp. mtcp_send()) on every entry of msgvec, handing the 
+   resulting window updates (resp. sends) to the mtcp thread together. 
+   returns the number of entries that did not fail, or -1 on error */
+int
+mtcp_recvmmsg(mctx_t mctx, struct mtcp_mmsg *msgvec, unsigned int vlen, int flags);
+
+int
+mtcp_sendmmsg(mctx_t mctx, struct mtcp_mmsg *msgvec, unsigned int vlen, int flags);
+
 #ifdef __cplusplus
 };
 #endif
@@ -1,11 +1,23 @@
 #ifndef RSS_H
 #define RSS_H
 
+#include <stdint.h>
 #include <netinet/in.h>
 
+/* values GetRSSHashBits() can return */
+#define RSS_HASH_BITS	512
+
 /* sip, dip, sp, dp: in network byte order */
 int GetRSSCPUCore(in_addr_t sip, in_addr_t dip, 
 		  in_port_t sp, in_port_t dp, int num_queues,
 		  uint8_t endian_check);
 
+/* the bits of the hash the rx queue is picked from. The hash is linear: 
+   the bits of a tuple are the XOR of those of its fields alone (the 
+   others 0), so they can be precomputed per field */
+uint32_t GetRSSHashBits(in_addr_t sip, in_addr_t dip, 
+		        in_port_t sp, in_port_t dp);
+
+int RSSHashBitsToCPUCore(uint32_t bits, int num_queues, uint8_t endian_check);
+
 #endif /* RSS_H */
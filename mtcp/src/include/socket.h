@@ -9,8 +9,13 @@ enum socket_opts
 {
 	MTCP_NONBLOCK		= 0x01,
 	MTCP_ADDR_BIND		= 0x02, 
+	MTCP_NODELAY		= 0x04,		/* TCP_NODELAY: no Nagle */
+	MTCP_CORK			= 0x08,		/* TCP_CORK: full segments only */
+	MTCP_FASTOPEN_CONNECT	= 0x10,	/* TCP_FASTOPEN_CONNECT: data on the SYN */
 };
 /*----------------------------------------------------------------------------*/
+struct tcp_cc_ops;
+
 struct socket_map
 {
 	int id;
@@ -27,20 +32,33 @@ struct socket_map
 	};
 
 	uint32_t epoll;			/* registered events */
-	uint32_t events;		/* available events */
+	uint32_t events;		/* raised events not reported yet */
 	mtcp_epoll_data_t ep_data;
+	struct mtcp_epoll *reg_ep;		/* epoll the socket is registered with */
+	struct mtcp_epoll *queued_ep;	/* epoll whose event ring has the socket */
+	struct mtcp_epoll *ready_ep;	/* epoll whose ready list has the socket */
+	TAILQ_ENTRY (socket_map) ready_link;
 
-	TAILQ_ENTRY (socket_map) free_smap_link;
+	const struct tcp_cc_ops *cc;	/* congestion control set by setsockopt() */
+	int tfo_qlen;			/* TCP_FASTOPEN: max fast opens pending the handshake */
 
+	uint32_t gen;			/* bumped on every close of the id */
 };
 /*----------------------------------------------------------------------------*/
 typedef struct socket_map * socket_map_t;
 /*----------------------------------------------------------------------------*/
+/* a socket id tagged with the generation of the socket it referred to */
+typedef uint64_t sockdesc_t;
+
+#define SOCKDESC(s)			(((uint64_t)(s)->gen << 32) | (uint32_t)(s)->id)
+#define SOCKDESC_ID(d)		((int)(uint32_t)(d))
+#define SOCKDESC_GEN(d)		((uint32_t)((d) >> 32))
+/*----------------------------------------------------------------------------*/
 socket_map_t 
-AllocateSocket(mctx_t mctx, int socktype, int need_lock);
+AllocateSocket(mctx_t mctx, int socktype);
 /*----------------------------------------------------------------------------*/
 void 
-FreeSocket(mctx_t mctx, int sockid, int need_lock); 
+FreeSocket(mctx_t mctx, int sockid); 
 /*----------------------------------------------------------------------------*/
 socket_map_t 
 GetSocket(mctx_t mctx, int sockid);
@@ -56,6 +74,9 @@ struct tcp_listener
 	pthread_mutex_t accept_lock;
 	pthread_cond_t accept_cond;
 
+	uint64_t tfo_key[2];	/* fast open cookie key */
+	int tfo_pending;		/* accepted fast opens before the handshake */
+
 	TAILQ_ENTRY(tcp_listener) he_link;	/* hash table entry link */
 };
 /*----------------------------------------------------------------------------*/
@@ -24,6 +24,14 @@ struct run_stat
 	uint64_t rounds_tocheck;
 };
 
+struct idle_stat
+{
+	uint64_t sleep_us;		/* time spent in MTCPIdleSleep() */
+	uint64_t sleeps;
+	uint64_t wakes_io;		/* ended by the I/O module (e.g., an rx interrupt) */
+	uint64_t wakes_app;		/* ended by an application call */
+};
+
 struct stat_counter
 {
 	uint64_t cnt;
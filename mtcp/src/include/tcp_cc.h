@@ -0,0 +1,89 @@
+#ifndef TCP_CC_H
+#define TCP_CC_H
+
+#include "mtcp.h"
+#include "tcp_stream.h"
+
+/*
+ * Pluggable congestion control. Each stream points to an ops table
+ * (sndvar->cc) and keeps the algorithm state in sndvar->cc_priv.
+ * All the callbacks run inline in the mTCP thread.
+ */
+
+enum cc_event
+{
+	CC_EVENT_TX_START = 0,		/* first transmission after being idle */
+	CC_EVENT_RECOVERY_EXIT,		/* loss recovery is over */
+};
+
+/* information about an incoming ack */
+struct cc_ack_sample
+{
+	uint32_t acked;			/* newly acked bytes */
+	uint16_t packets;		/* newly acked segments */
+	uint32_t rtt;			/* rtt sample in ticks, 0 if none */
+	uint32_t inflight;		/* bytes in flight after this ack */
+	uint8_t ece;			/* ECN-Echo was set */
+	uint8_t in_recovery;	/* the sender is in loss recovery */
+};
+
+/* 
+ * tcp_cc_ops.flags 
+ * TCP_CC_FLAG_ECN: always negotiates ECN, reacts to ECN-Echo by itself 
+ * and wants the peer's CE marks echoed per segment (dctcp)
+ */
+#define TCP_CC_FLAG_ECN		0x01
+
+struct tcp_cc_ops
+{
+	const char *name;
+	uint32_t flags;
+
+	/* the connection is established */
+	void (*init)(tcp_stream *cur_stream, uint32_t cur_ts);
+	/* new data is acked */
+	void (*on_ack)(tcp_stream *cur_stream, uint32_t cur_ts,
+			const struct cc_ack_sample *rs);
+	/* fast retransmit: sets ssthresh and cwnd */
+	void (*on_loss)(tcp_stream *cur_stream, uint32_t cur_ts);
+	/* retransmission timeout: sets ssthresh and cwnd */
+	void (*on_rto)(tcp_stream *cur_stream, uint32_t cur_ts);
+	/* bytes per second, 0 if not paced (optional) */
+	uint64_t (*pacing_rate)(tcp_stream *cur_stream);
+	/* enum cc_event (optional) */
+	void (*cwnd_event)(tcp_stream *cur_stream, uint32_t cur_ts, int event);
+};
+
+#define CC_PRIV(stream)		((void *)(stream)->sndvar->cc_priv)
+
+extern const struct tcp_cc_ops reno_cc_ops;
+extern const struct tcp_cc_ops cubic_cc_ops;
+extern const struct tcp_cc_ops dctcp_cc_ops;
+extern const struct tcp_cc_ops bbr_cc_ops;
+
+const struct tcp_cc_ops *
+GetCongestionControl(const char *name);
+
+const struct tcp_cc_ops *
+GetDefaultCongestionControl();
+
+int
+SetDefaultCongestionControl(const char *name);
+
+void
+InitCongestionControl(tcp_stream *cur_stream, uint32_t cur_ts);
+
+extern inline void
+CCEvent(tcp_stream *cur_stream, uint32_t cur_ts, int event);
+
+extern inline uint64_t
+CCPacingRate(tcp_stream *cur_stream);
+
+/* helpers shared by the algorithms */
+extern inline uint32_t
+CCRenoSSThresh(tcp_stream *cur_stream);
+
+extern inline void
+CCRenoIncrease(tcp_stream *cur_stream, const struct cc_ack_sample *rs);
+
+#endif /* TCP_CC_H */
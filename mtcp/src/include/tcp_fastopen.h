@@ -0,0 +1,57 @@
+#ifndef TCP_FASTOPEN_H
+#define TCP_FASTOPEN_H
+
+#include "mtcp.h"
+#include "tcp_stream.h"
+#include "socket.h"
+#include "tcp_in.h"
+
+/*
+ * TCP fast open (RFC 7413). A client that has a cookie from an earlier
+ * connection sends its first data on the SYN, and a server that finds the
+ * cookie valid hands the data and the connection to the application
+ * before the handshake completes, saving a round trip on short requests.
+ */
+
+/* fast open streams the application can use before the handshake completes */
+#define TFO_EARLY_CHILD(s) \
+	((s)->state == TCP_ST_SYN_RCVD && ((s)->tfo & TFO_ACCEPTED))
+#define TFO_EARLY_WRITE(s) \
+	(TFO_EARLY_CHILD(s) || \
+	 ((s)->state == TCP_ST_SYN_SENT && ((s)->tfo & TFO_REQUESTED)))
+
+void
+InitFastOpen(void);
+
+void
+InitTFOListenerKey(struct tcp_listener *listener);
+
+struct tfo_cache *
+CreateTFOCache(void);
+
+void
+DestroyTFOCache(struct tfo_cache *cache);
+
+void
+ParseTFOOption(tcp_stream *cur_stream, uint8_t *cookie, int len);
+
+uint16_t
+TFOOptionLength(tcp_stream *cur_stream, uint8_t flags);
+
+int
+GenerateTFOOption(tcp_stream *cur_stream, uint8_t flags, uint8_t *tcpopt);
+
+int
+TFOAcceptSYN(mtcp_manager_t mtcp, struct tcp_listener *listener,
+		tcp_stream *cur_stream, int payloadlen);
+
+void
+TFOReleasePending(mtcp_manager_t mtcp, tcp_stream *cur_stream);
+
+int
+TFOSendSYN(mtcp_manager_t mtcp, tcp_stream *cur_stream, uint32_t cur_ts);
+
+void
+TFOHandleSYNACK(mtcp_manager_t mtcp, tcp_stream *cur_stream, uint32_t ack_seq);
+
+#endif /* TCP_FASTOPEN_H */
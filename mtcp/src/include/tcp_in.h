@@ -31,7 +31,10 @@
 #define TCP_OPT_WSCALE_LEN		3
 #define TCP_OPT_SACK_PERMIT_LEN	2
 #define TCP_OPT_SACK_LEN		10
+#define TCP_OPT_SACK_BLOCK_LEN	8
 #define TCP_OPT_TIMESTAMP_LEN	10
+#define TCP_OPT_FASTOPEN_LEN	2		// without the cookie
+#define TCP_FASTOPEN_COOKIE_LEN	8		// cookies we hand out
 
 #define TCP_DEFAULT_MSS			1460
 #define TCP_DEFAULT_WSCALE		7
@@ -43,35 +46,61 @@
 #define TCP_SEQ_GEQ(a,b)		((int32_t)((a)-(b)) >= 0)
 #define TCP_SEQ_BETWEEN(a,b,c)	(TCP_SEQ_GEQ(a,b) && TCP_SEQ_LEQ(a,c))
 
-/* convert timeval to timestamp (precision: 1 ms) */
-#define HZ						1000
+/* convert timeval/timespec to timestamp (precision: 1 us) */
+#define HZ						1000000
 #define TIME_TICK				(1000000/HZ)		// in us
 #define TIMEVAL_TO_TS(t)		(uint32_t)((t)->tv_sec * HZ + \
 								((t)->tv_usec / TIME_TICK))
+#define TIMESPEC_TO_TS(t)		(uint32_t)((t)->tv_sec * HZ + \
+								((t)->tv_nsec / (TIME_TICK * 1000)))
 
 #define TS_TO_USEC(t)			((t) * TIME_TICK)
 #define TS_TO_MSEC(t)			(TS_TO_USEC(t) / 1000)
 
 #define USEC_TO_TS(t)			((t) / TIME_TICK)
 #define MSEC_TO_TS(t)			(USEC_TO_TS((t) * 1000))
-#define SEC_TO_TS(t)			(t * HZ)
+#define SEC_TO_TS(t)			((t) * HZ)
 
 #define SEC_TO_USEC(t)			((t) * 1000000)
 #define SEC_TO_MSEC(t)			((t) * 1000)
 #define MSEC_TO_USEC(t)			((t) * 1000)
 #define USEC_TO_SEC(t)			((t) / 1000000)
-//#define TCP_TIMEWAIT			(MSEC_TO_USEC(5000) / TIME_TICK)	// 5s
-#define TCP_TIMEWAIT			0
+#define TCP_TIMEWAIT			(MSEC_TO_USEC(60000) / TIME_TICK)	// 60s, 2MSL
 #define TCP_INITIAL_RTO			(MSEC_TO_USEC(500) / TIME_TICK)		// 500ms
 #define TCP_FIN_RTO				(MSEC_TO_USEC(500) / TIME_TICK)		// 500ms
 #define TCP_TIMEOUT				(MSEC_TO_USEC(30000) / TIME_TICK)	// 30s
+#define TCP_RTO_MIN				(200 / TIME_TICK)					// 200us
+#define TCP_RTO_MAX				(MSEC_TO_USEC(60000) / TIME_TICK)	// 60s
 
 #define TCP_MAX_RTX				16
 #define TCP_MAX_SYN_RETRY		7
 #define TCP_MAX_BACKOFF			7
+#define TCP_DUPTHRESH			3
+#define TCP_DELAYED_ACK			(100 / TIME_TICK)					// 100us, below the peer's TCP_RTO_MIN
+#define TCP_DELAYED_ACK_MAX		(MSEC_TO_USEC(500) / TIME_TICK)		// 500ms (RFC 1122)
+#define TCP_MAX_QUICKACKS		16
+#define TCP_TLP_WCDELACK		(MSEC_TO_USEC(200) / TIME_TICK)		// 200ms, peer's delayed ack
 
 #define TCP_INIT_CWND                   2
 
+#define TCP_ECN_OFF				0
+#define TCP_ECN_ON				1		// request ECN on active opens
+#define TCP_ECN_PASSIVE			2		// only if the peer requests it
+
+#define TCP_PACING_OFF			0
+#define TCP_PACING_CC			1		// only at the rate set by the cc (bbr)
+#define TCP_PACING_ALL			2		// others at cwnd/srtt
+#define TCP_PACING_BURST		(50 / TIME_TICK)	// 50us of unused rate can be sent at once
+
+#define TCP_FASTOPEN_CLIENT		0x01	// TCP_FASTOPEN_CONNECT sockets use it
+#define TCP_FASTOPEN_SERVER		0x02	// TCP_FASTOPEN listeners accept it
+
+#define TCP_SYNCOOKIES_OFF		0
+#define TCP_SYNCOOKIES_ON		1		// once tcp_max_syn_backlog are half-open
+#define TCP_SYNCOOKIES_ALWAYS	2
+#define TCP_MAX_SYN_BACKLOG		1024
+#define TCP_MAX_TW_BUCKETS		65536
+
 enum tcp_state
 {
 	TCP_ST_CLOSED		= 0, 
@@ -95,7 +124,8 @@ enum tcp_option
 	TCP_OPT_WSCALE		= 3,
 	TCP_OPT_SACK_PERMIT	= 4, 
 	TCP_OPT_SACK		= 5,
-	TCP_OPT_TIMESTAMP	= 8
+	TCP_OPT_TIMESTAMP	= 8,
+	TCP_OPT_FASTOPEN	= 34
 };
 
 enum tcp_close_reason
@@ -123,6 +153,11 @@ ProcessTCPUplink(mtcp_manager_t mtcp, uint32_t cur_ts, tcp_stream *cur_stream,
 int
 ProcessTCPPacket(struct mtcp_manager *mtcp, uint32_t cur_ts, const int ifidx,
 					const struct iphdr* iph, int ip_len);
+#if TCP_OPT_SACK_ENABLED
+void
+EnterSACKRecovery(mtcp_manager_t mtcp, tcp_stream *cur_stream, uint32_t cur_ts);
+#endif
+
 uint16_t 
 TCPCalcChecksum(uint16_t *buf, uint16_t len, uint32_t saddr, uint32_t daddr);
 
@@ -0,0 +1,93 @@
+#ifndef TCP_MINISOCK_H
+#define TCP_MINISOCK_H
+
+#include <netinet/ip.h>
+#include <linux/tcp.h>
+#include <sys/queue.h>
+
+#include "mtcp.h"
+#include "tcp_stream.h"
+
+/*
+ * Passive opens wait for the final ACK of the handshake in a minisock, a
+ * compact per-core entry holding just what the SYN/ACK and the stream
+ * created on that ACK need. Half-open connections then take neither a
+ * tcp_stream with its send and receive variables nor a slot in the flow
+ * table. The table holds tcp_max_syn_backlog minisocks; beyond that, SYN
+ * cookies take over (see tcp_syncookie.c).
+ */
+
+/* handshake options of a passive open, as minisocks and SYN cookies keep them */
+#define SYN_OPT_WSCALE			0x0f	/* peer's window scale, 0x0f if none */
+#define SYN_OPT_SACK			0x10
+#define SYN_OPT_ECN				0x20
+#define SYN_OPT_TIMESTAMP		0x40
+
+struct tcp_syn_options
+{
+	uint16_t mss;			/* peer's mss */
+	uint8_t opts;			/* SYN_OPT_* */
+	uint8_t fastopen;		/* the SYN has a fast open option */
+	uint32_t ts_val;		/* peer's timestamp */
+};
+
+struct tcp_minisock
+{
+	uint32_t saddr;			/* in network order */
+	uint32_t daddr;			/* in network order */
+	uint16_t sport;			/* in network order */
+	uint16_t dport;			/* in network order */
+	uint32_t irs;
+	uint32_t iss;
+	uint32_t ts_recent;
+	uint32_t expire;		/* next SYN/ACK retransmission */
+	uint16_t mss;
+	uint8_t opts;			/* SYN_OPT_* */
+	uint8_t nrtx;
+
+	struct tcp_minisock *hash_next;
+	TAILQ_ENTRY(tcp_minisock) timer_link;
+};
+
+struct minisock_table *
+CreateMinisockTable(int size);
+
+void
+DestroyMinisockTable(struct minisock_table *table);
+
+void
+ParseSYNOptions(mtcp_manager_t mtcp, const struct tcphdr *tcph,
+		struct tcp_syn_options *syn);
+
+int
+SendSYNACKStandalone(mtcp_manager_t mtcp, uint32_t cur_ts,
+		uint32_t saddr, uint16_t sport, uint32_t daddr, uint16_t dport,
+		uint32_t iss, uint32_t ack_seq, uint8_t opts,
+		uint32_t ts_val, uint32_t ts_ecr);
+
+tcp_stream *
+CreateStreamFromSYN(mtcp_manager_t mtcp, uint32_t cur_ts,
+		uint32_t saddr, uint16_t sport, uint32_t daddr, uint16_t dport,
+		uint32_t iss, uint32_t irs, uint16_t mss, uint8_t opts,
+		uint32_t ts_recent);
+
+int
+MinisockSYN(mtcp_manager_t mtcp, uint32_t cur_ts,
+		const struct iphdr *iph, const struct tcphdr *tcph, uint32_t seq);
+
+int
+MinisockACK(mtcp_manager_t mtcp, uint32_t cur_ts,
+		const struct iphdr *iph, const struct tcphdr *tcph,
+		uint32_t seq, uint32_t ack_seq, tcp_stream **cur_stream);
+
+void
+MinisockRST(mtcp_manager_t mtcp,
+		const struct iphdr *iph, const struct tcphdr *tcph, uint32_t seq);
+
+void
+CheckMinisockTimers(mtcp_manager_t mtcp, uint32_t cur_ts);
+
+uint32_t
+MinisockIdleTicks(mtcp_manager_t mtcp, uint32_t cur_ts, uint32_t limit);
+
+#endif /* TCP_MINISOCK_H */
@@ -18,6 +18,9 @@ SendTCPPacketStandalone(struct mtcp_manager *mtcp,
 		uint8_t *payload, uint16_t payloadlen, 
 		uint32_t cur_ts, uint32_t echo_ts);
 
+extern inline uint16_t
+CalculateOptionLength(uint8_t flags, int nsacks);
+
 int
 SendTCPPacket(struct mtcp_manager *mtcp, tcp_stream *cur_stream,
 		uint32_t cur_ts, uint8_t flags, uint8_t *payload, uint16_t payloadlen);
@@ -0,0 +1,41 @@
+#ifndef TCP_RACK_H
+#define TCP_RACK_H
+
+#include "mtcp.h"
+#include "tcp_stream.h"
+
+#if TCP_RACK_TLP_ENABLED
+/*
+ * RACK-TLP (RFC 8985). RACK deems a segment lost when data sent after it
+ * is delivered and a reordering window has passed since, instead of
+ * counting duplicate acks. TLP retransmits the tail of a flight after
+ * about two rtts without acks, so that tail losses are repaired by the
+ * SACK recovery instead of the retransmission timeout.
+ * Both need SACK and are only used if the peer permits it.
+ */
+
+enum rack_timer_mode
+{
+	RACK_TIMER_REO = 0,		/* reordering window of a segment expires */
+	RACK_TIMER_TLP,			/* probe timeout */
+};
+
+extern inline void
+RACKOnTransmit(tcp_stream *cur_stream, uint32_t cur_ts,
+		uint32_t seq, uint32_t len);
+
+int
+RACKOnAck(mtcp_manager_t mtcp, tcp_stream *cur_stream,
+		uint32_t cur_ts, uint32_t ack_seq);
+
+void
+RACKScheduleTLP(mtcp_manager_t mtcp, tcp_stream *cur_stream, uint32_t cur_ts);
+
+void
+RACKOnRTO(mtcp_manager_t mtcp, tcp_stream *cur_stream);
+
+void
+HandleRACKTimer(mtcp_manager_t mtcp, uint32_t cur_ts, tcp_stream *cur_stream);
+#endif /* TCP_RACK_TLP_ENABLED */
+
+#endif /* TCP_RACK_H */
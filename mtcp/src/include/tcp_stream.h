@@ -26,6 +26,15 @@ struct rtm_stat
 	uint32_t rto_bytes;
 };
 
+/* fast open state of a stream (see tcp_fastopen.c) */
+#define TFO_REQUESTED			0x01	/* our SYN has the option */
+#define TFO_DEFERRED			0x02	/* the SYN waits for the first write */
+#define TFO_SEEN				0x04	/* the peer's SYN or SYN/ACK has the option */
+#define TFO_SEND_COOKIE			0x08	/* our SYN/ACK hands out a cookie */
+#define TFO_ACCEPTED			0x10	/* took the SYN data, queued before the handshake */
+
+#define TCP_FASTOPEN_COOKIE_MAX	16
+
 #if TCP_OPT_SACK_ENABLED
 struct sack_entry
 {
@@ -35,6 +44,49 @@ struct sack_entry
 };
 #endif /* TCP_OPT_SACK_ENABLED */
 
+#if TCP_RACK_TLP_ENABLED
+/* transmission record of a range of outstanding data (see tcp_rack.c) */
+struct rack_seg
+{
+	uint32_t end_seq;		/* covers [end_seq of the previous one, end_seq) */
+	uint32_t first_ts;		/* earliest and latest transmission time */
+	uint32_t last_ts;		/*   of the bytes in the range */
+	uint8_t rxt;			/* has been retransmitted */
+};
+
+#define RACK_MAX_SEGS 32
+
+struct rack_state
+{
+	struct rack_seg seg[RACK_MAX_SEGS];	/* outstanding data, sorted by seq */
+	uint8_t segs;			/* number of entries in seg */
+
+	uint8_t has_sample;		/* xmit_ts, end_seq and rtt are valid */
+	uint32_t xmit_ts;		/* send time of the most recently sent data */
+	uint32_t end_seq;		/*   that is delivered, its end */
+	uint32_t rtt;			/*   and the rtt it measured */
+	uint32_t min_rtt;		/* minimum rtt seen, 0 if none */
+	uint32_t lost_seq;		/* unsacked data below is deemed lost */
+
+	uint8_t timer_mode;		/* RACK_TIMER_REO or RACK_TIMER_TLP */
+	uint8_t tlp_out;		/* a tail loss probe is unacked */
+	uint8_t tlp_rxt;		/* the probe was a retransmission */
+	uint32_t tlp_end_seq;	/* snd_max after sending the probe */
+};
+#endif /* TCP_RACK_TLP_ENABLED */
+
+struct tcp_cc_ops;
+
+/* an entry of the per-core timer wheel (see timer.c) */
+struct tcp_timer
+{
+	TAILQ_ENTRY(tcp_timer) link;
+	struct tcp_stream *stream;	/* owner of this timer */
+	uint32_t expire;			/* absolute expiration time */
+	int16_t slot;				/* wheel slot index, -1 if not armed */
+	uint8_t type;				/* TIMER_RTO, TIMER_TIMEWAIT, ... */
+};
+
 struct tcp_recv_vars
 {
 	/* receiver variables */
@@ -61,11 +113,31 @@ struct tcp_recv_vars
 	uint32_t rttvar;		/* smoothed mdev_max */
 	uint32_t rtt_seq;		/* sequence number to update rttvar */
 
-#if TCP_OPT_SACK_ENABLED		/* currently not used */
-#define MAX_SACK_ENTRY 8
+	/* RTT sampling for peers without timestamps (Karn's algorithm) */
+	uint32_t rtt_sample_seq;	/* ack_seq that completes the sample */
+	uint32_t rtt_sample_ts;		/* send time of the sampled segment */
+	uint8_t rtt_sampling;		/* whether a sample is in flight */
+
+	/* ECN (RFC 3168) */
+	uint8_t ece_pending;		/* set ECN-Echo on outgoing acks */
+
+	/* delayed acks (RFC 1122 4.2.3.2, RFC 5681 4.2) */
+	uint32_t dack_bytes;		/* in-order bytes not acked yet */
+	uint32_t last_data_ts;		/* arrival time of the last data */
+	uint16_t rcv_mss;			/* largest segment received, up to mss */
+	uint8_t quickacks;			/* segments left to ack right away */
+
+#if TCP_OPT_SACK_ENABLED		/* sender-side SACK scoreboard */
+#define MAX_SACK_ENTRY 16
 	uint32_t sacked_pkts;
-	struct sack_entry sack_table[MAX_SACK_ENTRY];
-	uint8_t sacks:3;
+	uint32_t sacked_bytes;	/* total bytes in sack_table */
+	struct sack_entry sack_table[MAX_SACK_ENTRY];	/* sorted by seq */
+	uint8_t sacks;			/* number of blocks in sack_table */
+
+							/* receiver-side SACK blocks */
+#define MAX_RCV_SACK_ENTRY 4
+	struct sack_entry rcv_sack[MAX_RCV_SACK_ENTRY];	/* most recent first */
+	uint8_t rcv_sacks;		/* number of blocks in rcv_sack */
 #endif /* TCP_OPT_SACK_ENABLED */
 
 	struct tcp_ring_buffer *rcvbuf;
@@ -103,6 +175,7 @@ struct tcp_send_vars
 	//uint32_t snd_up;		/* send urgent pointer (not used) */
 	uint32_t iss;			/* initial sending sequence */
 	uint32_t fss;			/* final sending sequence */
+	uint32_t snd_max;		/* highest sequence sent so far */
 
 	/* retransmission timeout variables */
 	uint8_t nrtx;			/* number of retransmission */
@@ -113,6 +186,24 @@ struct tcp_send_vars
 	/* congestion control variables */
 	uint32_t cwnd;				/* congestion window */
 	uint32_t ssthresh;			/* slow start threshold */
+	const struct tcp_cc_ops *cc;	/* congestion control algorithm */
+	const struct tcp_cc_ops * volatile cc_req;	/* set by setsockopt() */
+#define TCP_CC_PRIV_SIZE 128
+	uint64_t cc_priv[TCP_CC_PRIV_SIZE / sizeof(uint64_t)];	/* algorithm state */
+	uint32_t pace_ts;			/* departure time of the next paced packet */
+	uint32_t ecn_recover;		/* no further ECE reaction until acked */
+	uint8_t ecn_cwr;			/* send CWR with the next new data */
+	uint8_t tfo_cookie_len;		/* fast open cookie to send, 0 if none */
+	uint8_t tfo_cookie[TCP_FASTOPEN_COOKIE_MAX];
+#if TCP_OPT_SACK_ENABLED
+	/* SACK-based loss recovery (RFC 6675) */
+	uint8_t in_recovery;		/* in fast recovery */
+	uint32_t recovery_point;	/* snd_max when entered fast recovery */
+	uint32_t high_rxt;			/* highest retransmitted seq in recovery */
+#endif
+#if TCP_RACK_TLP_ENABLED
+	struct rack_state rack;		/* time-based loss detection */
+#endif
 #if USE_CCP
 	uint32_t missing_seq;
 #endif
@@ -130,6 +221,7 @@ struct tcp_send_vars
 	uint8_t on_ackq;
 	uint8_t on_closeq;
 	uint8_t on_resetq;
+	uint8_t msg_more;		/* the last write was with MSG_MORE (application) */
 
 	uint8_t on_closeq_int:1, 
 			on_resetq_int:1, 
@@ -140,8 +232,13 @@ struct tcp_send_vars
 	TAILQ_ENTRY(tcp_stream) send_link;
 	TAILQ_ENTRY(tcp_stream) ack_link;
 
-	TAILQ_ENTRY(tcp_stream) timer_link;		/* timer link (rto list, tw list) */
-	TAILQ_ENTRY(tcp_stream) timeout_link;	/* connection timeout link */
+	struct tcp_timer timer;			/* rto or timewait timer */
+	struct tcp_timer to_timer;		/* connection timeout timer */
+	struct tcp_timer dack_timer;	/* delayed ack timer */
+	struct tcp_timer pace_timer;	/* pacing timer */
+#if TCP_RACK_TLP_ENABLED
+	struct tcp_timer rack_timer;	/* reordering or tail loss probe timer */
+#endif
 
 	struct tcp_send_buffer *sndbuf;
 #if USE_SPIN_LOCK
@@ -180,13 +277,19 @@ typedef struct tcp_stream
 	uint8_t closed;
 	uint8_t is_bound_addr;
 	uint8_t need_wnd_adv;
-	int16_t on_rto_idx;
+	uint8_t tfo;			/* fast open state, TFO_* */
 
-	uint16_t on_timeout_list:1, 
+	uint16_t on_rto_list:1, 
+			on_timeout_list:1, 
+			on_dack_timer:1, 
+			on_rack_timer:1, 
+			on_pace_timer:1, 
 			on_rcv_br_list:1, 
 			on_snd_br_list:1, 
 			saw_timestamp:1,	/* whether peer sends timestamp */
 			sack_permit:1,		/* whether peer permits SACK */
+			ecn_ok:1,			/* whether ECN is negotiated */
+			half_open:1,		/* counted in mtcp->half_open_cnt */
 			control_list_waiting:1, 
 			have_reset:1,
 			is_external:1,		/* the peer node is locate outside of lan */
@@ -253,6 +356,13 @@ tcp_stream *
 CreateTCPStream(mtcp_manager_t mtcp, socket_map_t socket, int type, 
 		uint32_t saddr, uint16_t sport, uint32_t daddr, uint16_t dport);
 
+addr_pool_t
+GetAddressPool(mtcp_manager_t mtcp, in_addr_t daddr);
+
+void
+ReleaseBoundAddress(mtcp_manager_t mtcp, 
+		const struct sockaddr_in *saddr, const struct sockaddr_in *daddr);
+
 void
 DestroyTCPStream(mtcp_manager_t mtcp, tcp_stream *stream);
 
@@ -262,4 +372,7 @@ DumpStream(mtcp_manager_t mtcp, tcp_stream *stream);
 extern inline void
 InitializeTCPStreamManager();
 
+uint32_t
+GenerateISS();
+
 #endif /* TCP_STREAM_H */
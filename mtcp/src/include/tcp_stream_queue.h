@@ -13,8 +13,8 @@
 		action;									\
 	}
 #define SQ_LOCK_DESTROY(lock)	pthread_spin_destroy(lock)
-#define SQ_LOCK(lock)			pthread_spin_lock(lock)
-#define SQ_UNLOCK(lock)			pthread_spin_unlock(lock)
+#define SQ_LOCK(lock)			(INLINE_MODE()? 0 : pthread_spin_lock(lock))
+#define SQ_UNLOCK(lock)			(INLINE_MODE()? 0 : pthread_spin_unlock(lock))
 #else
 #define SQ_LOCK_INIT(lock, errmsg, action);		\
 	if (pthread_mutex_init(lock, NULL)) {		\
@@ -22,8 +22,8 @@
 		action;									\
 	}
 #define SQ_LOCK_DESTROY(lock)	pthread_mutex_destroy(lock)
-#define SQ_LOCK(lock)			pthread_mutex_lock(lock)
-#define SQ_UNLOCK(lock)			pthread_mutex_unlock(lock)
+#define SQ_LOCK(lock)			(INLINE_MODE()? 0 : pthread_mutex_lock(lock))
+#define SQ_UNLOCK(lock)			(INLINE_MODE()? 0 : pthread_mutex_unlock(lock))
 #endif /* USE_SPIN_LOCK */
 
 #else /* LOCK_STREAM_QUEUE */
@@ -68,6 +68,9 @@ DestroyStreamQueue(stream_queue_t sq);
 int 
 StreamEnqueue(stream_queue_t sq, struct tcp_stream *stream);
 /*---------------------------------------------------------------------------*/
+int 
+StreamEnqueueBatch(stream_queue_t sq, struct tcp_stream **streams, int cnt);
+/*---------------------------------------------------------------------------*/
 struct tcp_stream *
 StreamDequeue(stream_queue_t sq);
 /*---------------------------------------------------------------------------*/
@@ -0,0 +1,35 @@
+#ifndef TCP_SYNCOOKIE_H
+#define TCP_SYNCOOKIE_H
+
+#include <netinet/ip.h>
+#include <linux/tcp.h>
+
+#include "mtcp.h"
+#include "tcp_stream.h"
+
+/*
+ * SYN cookies (RFC 4987). Once too many connections are half-open, a SYN
+ * is answered with a SYN/ACK whose sequence number encodes the connection
+ * instead of taking a minisock or a stream for it. The stream is created
+ * only when the final ACK of the handshake returns a valid cookie.
+ */
+
+void
+InitSYNCookies(void);
+
+int
+SYNCookieNeeded(mtcp_manager_t mtcp);
+
+int
+SendSYNCookie(mtcp_manager_t mtcp, uint32_t cur_ts,
+		const struct iphdr *iph, const struct tcphdr *tcph, uint32_t seq);
+
+tcp_stream *
+CreateStreamFromCookie(mtcp_manager_t mtcp, uint32_t cur_ts,
+		const struct iphdr *iph, const struct tcphdr *tcph,
+		uint32_t seq, uint32_t ack_seq);
+
+void
+ReleaseHalfOpen(mtcp_manager_t mtcp, tcp_stream *cur_stream);
+
+#endif /* TCP_SYNCOOKIE_H */
@@ -0,0 +1,69 @@
+#ifndef TCP_TIMEWAIT_H
+#define TCP_TIMEWAIT_H
+
+#include <netinet/ip.h>
+#include <linux/tcp.h>
+#include <sys/queue.h>
+
+#include "mtcp.h"
+#include "tcp_stream.h"
+
+/*
+ * Connections spend TIME_WAIT in a compact per-core entry instead of a
+ * tcp_stream: the 4-tuple plus what is needed to ack a retransmitted FIN
+ * and to tell old duplicates from a new incarnation. The stream, its
+ * buffers and its flow table slot are released as soon as the final ack
+ * is out. An entry ignores RSTs (RFC 1337), yields to a SYN with a newer
+ * timestamp or sequence number (RFC 6191) and, with tcp_tw_reuse, gives
+ * the local port of an active close back to the address pool once the
+ * peer's timestamps make reusing the 4-tuple safe.
+ */
+
+#define TW_TIMESTAMP			0x01	/* the peer sent timestamps */
+#define TW_BOUND_ADDR			0x02	/* owns the local address of a connect() */
+#define TW_REUSE_PENDING		0x04	/* on the reuse list, not the expire list */
+
+struct tcp_tw_sock
+{
+	uint32_t saddr;			/* in network order */
+	uint32_t daddr;			/* in network order */
+	uint16_t sport;			/* in network order */
+	uint16_t dport;			/* in network order */
+	uint32_t snd_nxt;
+	uint32_t rcv_nxt;		/* past the peer's FIN */
+	uint32_t ts_recent;		/* peer's last timestamp */
+	uint32_t ts_recent_upd;	/* when it was taken */
+	uint32_t expire;		/* end of TIME_WAIT */
+	uint32_t reuse;			/* when the local address may be reused */
+	uint16_t window;		/* scaled, as advertised */
+	uint8_t flags;			/* TW_* */
+
+	struct tcp_tw_sock *hash_next;
+	TAILQ_ENTRY(tcp_tw_sock) timer_link;
+};
+
+struct timewait_table *
+CreateTimewaitTable(int size);
+
+void
+DestroyTimewaitTable(struct timewait_table *table);
+
+int
+EnterTimewait(mtcp_manager_t mtcp, tcp_stream *cur_stream, uint32_t cur_ts);
+
+void
+ReuseTimewait(mtcp_manager_t mtcp, uint32_t saddr, uint16_t sport, 
+		uint32_t daddr, uint16_t dport);
+
+int
+TimewaitSegment(mtcp_manager_t mtcp, uint32_t cur_ts,
+		const struct iphdr *iph, const struct tcphdr *tcph,
+		uint32_t seq, int payloadlen);
+
+void
+CheckTimewaitTimers(mtcp_manager_t mtcp, uint32_t cur_ts);
+
+uint32_t
+TimewaitIdleTicks(mtcp_manager_t mtcp, uint32_t cur_ts, uint32_t limit);
+
+#endif /* TCP_TIMEWAIT_H */
@@ -30,9 +30,31 @@ ParseTCPTimestamp(tcp_stream *cur_stream,
 		        struct tcp_timestamp *ts, uint8_t *tcpopt, int len);
 
 #if TCP_OPT_SACK_ENABLED
+uint32_t
+GetSACKedRightEdge(tcp_stream *cur_stream, uint32_t seq);
+
 int
 SeqIsSacked(tcp_stream *cur_stream, uint32_t seq);
 
+void
+RemoveAckedSACKBlocks(tcp_stream *cur_stream, uint32_t ack_seq);
+
+void
+ResetSACKScoreboard(tcp_stream *cur_stream);
+
+int
+GetNextLostSeq(tcp_stream *cur_stream, uint32_t seq, 
+		uint32_t *hole_seq, uint32_t *hole_len);
+
+uint32_t
+GetSACKPipe(tcp_stream *cur_stream);
+
+void
+UpdateSACKBlocks(tcp_stream *cur_stream, uint32_t seq);
+
+int
+GenerateSACKOption(tcp_stream *cur_stream, uint8_t *tcpopt, int nblocks);
+
 void
 ParseSACKOption(tcp_stream *cur_stream,
 		        uint32_t ack_seq, uint8_t *tcpopt, int len);
@@ -44,4 +66,10 @@ TCPCalcChecksum(uint16_t *buf, uint16_t len, uint32_t saddr, uint32_t daddr);
 void
 PrintTCPOptions(uint8_t *tcpopt, int len);
 
+uint64_t
+SipHash24(const uint64_t key[2], const uint64_t *m, int nwords);
+
+int
+GenerateSecretKey(uint64_t key[2]);
+
 #endif /* TCP_UTIL_H */	
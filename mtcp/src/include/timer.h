@@ -4,51 +4,97 @@
 #include "mtcp.h"
 #include "tcp_stream.h"
 
-#define RTO_HASH 3000
+/*
+ * Hierarchical timer wheel. Level 0 has one slot per tick (1 us), and
+ * each upper level covers TW_SLOTS slots of the level below, so that
+ * TW_LEVELS levels cover the whole 32-bit timestamp space.
+ */
+#define TW_BITS			8
+#define TW_SLOTS		(1 << TW_BITS)
+#define TW_MASK			(TW_SLOTS - 1)
+#define TW_LEVELS		4
+#define TW_EXPIRED		(TW_LEVELS * TW_SLOTS)	/* timers being fired */
+#define TW_NUM_SLOTS	(TW_EXPIRED + 1)
+
+enum timer_type
+{
+	TIMER_RTO = 0,
+	TIMER_TIMEWAIT,
+	TIMER_TIMEOUT,
+	TIMER_DELAYED_ACK,
+	TIMER_RACK,
+	TIMER_PACE,
+};
 
-struct rto_hashstore 
+TAILQ_HEAD(timer_head, tcp_timer);
+
+struct timer_wheel
 {
-	uint32_t rto_now_idx; // pointing the hs_table_s index
-	uint32_t rto_now_ts; // 
-	
-	TAILQ_HEAD(rto_head , tcp_stream) rto_list[RTO_HASH+1];
+	uint32_t now;				/* next tick to be processed */
+	int cnt;					/* number of armed timers */
+	int level_cnt[TW_LEVELS + 1];	/* number of timers per level */
+
+	struct timer_head slot[TW_NUM_SLOTS];
 };
 
-struct rto_hashstore* 
-InitRTOHashstore();
+struct timer_wheel *
+InitTimerWheel(uint32_t cur_ts);
+
+void
+DestroyTimerWheel(struct timer_wheel *tw);
+
+extern inline void
+InitStreamTimers(tcp_stream *cur_stream);
 
-extern inline void 
+extern inline void
 AddtoRTOList(mtcp_manager_t mtcp, tcp_stream *cur_stream);
 
-extern inline void 
+extern inline void
 RemoveFromRTOList(mtcp_manager_t mtcp, tcp_stream *cur_stream);
 
-extern inline void 
+extern inline void
 AddtoTimewaitList(mtcp_manager_t mtcp, tcp_stream *cur_stream, uint32_t cur_ts);
 
-extern inline void 
+extern inline void
 RemoveFromTimewaitList(mtcp_manager_t mtcp, tcp_stream *cur_stream);
 
-extern inline void 
+extern inline void
 AddtoTimeoutList(mtcp_manager_t mtcp, tcp_stream *cur_stream);
 
-extern inline void 
+extern inline void
 RemoveFromTimeoutList(mtcp_manager_t mtcp, tcp_stream *cur_stream);
 
-extern inline void 
+extern inline void
 UpdateTimeoutList(mtcp_manager_t mtcp, tcp_stream *cur_stream);
 
 extern inline void
-UpdateRetransmissionTimer(mtcp_manager_t mtcp, 
+AddtoDelayedACKTimer(mtcp_manager_t mtcp, tcp_stream *cur_stream, uint32_t expire);
+
+extern inline void
+RemoveFromDelayedACKTimer(mtcp_manager_t mtcp, tcp_stream *cur_stream);
+
+extern inline void
+AddtoPaceTimer(mtcp_manager_t mtcp, tcp_stream *cur_stream, uint32_t expire);
+
+extern inline void
+RemoveFromPaceTimer(mtcp_manager_t mtcp, tcp_stream *cur_stream);
+
+#if TCP_RACK_TLP_ENABLED
+extern inline void
+AddtoRACKTimer(mtcp_manager_t mtcp, tcp_stream *cur_stream, uint32_t expire);
+
+extern inline void
+RemoveFromRACKTimer(mtcp_manager_t mtcp, tcp_stream *cur_stream);
+#endif
+
+extern inline void
+UpdateRetransmissionTimer(mtcp_manager_t mtcp,
 		tcp_stream *cur_stream, uint32_t cur_ts);
 
 void
-CheckRtmTimeout(mtcp_manager_t mtcp, uint32_t cur_ts, int thresh);
-
-void 
-CheckTimewaitExpire(mtcp_manager_t mtcp, uint32_t cur_ts, int thresh);
+CheckTimers(mtcp_manager_t mtcp, uint32_t cur_ts, int thresh);
 
-void 
-CheckConnectionTimeout(mtcp_manager_t mtcp, uint32_t cur_ts, int thresh);
+uint32_t
+TimerIdleTicks(struct timer_wheel *tw, uint32_t cur_ts, uint32_t limit);
 
 #endif /* TIMER_H */
@@ -38,7 +38,7 @@ ProcessIPv4Packet(mtcp_manager_t mtcp, uint32_t cur_ts,
 
 #if !PROMISCUOUS_MODE
 	/* if not promiscuous mode, drop if the destination is not myself */
-	if (iph->daddr != CONFIG.eths[ifidx].ip_addr)
+	if (!IsPortAddress(ifidx, iph->daddr))
 		//DumpIPPacketToFile(stderr, iph, ip_len);
 		return TRUE;
 #endif
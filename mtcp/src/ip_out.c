@@ -104,7 +104,7 @@ IPOutputStandalone(struct mtcp_manager *mtcp, uint8_t protocol,
 }
 /*----------------------------------------------------------------------------*/
 uint8_t *
-IPOutput(struct mtcp_manager *mtcp, tcp_stream *stream, uint16_t tcplen)
+IPOutput(struct mtcp_manager *mtcp, tcp_stream *stream, uint16_t tcplen, uint8_t tos)
 {
 	struct iphdr *iph;
 	int nif;
@@ -142,7 +142,7 @@ IPOutput(struct mtcp_manager *mtcp, tcp_stream *stream, uint16_t tcplen)
 
 	iph->ihl = IP_HEADER_LEN >> 2;
 	iph->version = 4;
-	iph->tos = 0;
+	iph->tos = tos;
 	iph->tot_len = htons(IP_HEADER_LEN + tcplen);
 	iph->id = htons(stream->sndvar->ip_id++);
 	iph->frag_off = htons(0x4000);	// no fragmentation
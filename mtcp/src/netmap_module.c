@@ -212,8 +212,8 @@ netmap_get_rptr(struct mtcp_thread_context *ctxt, int ifidx, int index, uint16_t
 int32_t
 netmap_select(struct mtcp_thread_context *ctxt)
 {
-	int i, rc;
-	struct pollfd pfd[MAX_DEVICES];
+	int i, rc, timeout;
+	struct pollfd pfd[MAX_DEVICES + 1];
 	struct netmap_private_context *npc = 
 		(struct netmap_private_context *)ctxt->io_private_context;
 	
@@ -228,7 +228,10 @@ netmap_select(struct mtcp_thread_context *ctxt)
 
 #ifndef CONST_POLLING	
 	if (npc->idle_poll_count >= IDLE_POLL_COUNT) {
-		rc = poll(pfd, num_devices_attached, IDLE_POLL_WAIT);
+		/* rx or an application call ends the sleep */
+		timeout = CONFIG.idle_sleep? CONFIG.idle_sleep : IDLE_POLL_WAIT * 1000;
+		rc = MTCPIdleSleep(ctxt->mtcp_manager, 
+				pfd, num_devices_attached, timeout);
 	} else
 #endif
 		{
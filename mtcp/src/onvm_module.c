@@ -78,9 +78,7 @@ struct dpdk_private_context {
 	struct mbuf_table wmbufs[RTE_MAX_ETHPORTS];
 	struct rte_mempool *pktmbuf_pool;
 	struct rte_mbuf *pkts_burst[MAX_PKT_BURST];
-#ifdef RX_IDLE_ENABLE
-	uint8_t rx_idle;
-#endif
+	uint32_t rx_idle;
 #ifdef ENABLELRO
 	struct rte_mbuf *cur_rx_m;
 #endif
@@ -211,7 +209,7 @@ onvm_send_pkts(struct mtcp_thread_context *ctxt, int nif)
 		mtcp->nstat.tx_packets[nif] += cnt;
 #ifdef ENABLE_STATS_IOCTL
 		/* only pass stats after >= 1 sec interval */
-		if (abs(mtcp->cur_ts - dpc->cur_ts) >= 1000 &&
+		if (abs(mtcp->cur_ts - dpc->cur_ts) >= 1000000 /* 1 sec in us */ &&
 		    likely(dpc->fd >= 0)) {
 			/* rte_get_stats is global func, use only for 1 core */
 			if (ctxt->cpu == 0) {
@@ -341,9 +339,7 @@ onvm_recv_pkts(struct mtcp_thread_context *ctxt, int ifidx)
 		dpc->pkts_burst[i] = (struct rte_mbuf*)pkts[i];
 	}
 	
-#ifdef RX_IDLE_ENABLE	
 	dpc->rx_idle = (likely(ret != 0)) ? 0 : dpc->rx_idle + 1;
-#endif
 	dpc->rmbufs[ifidx].len = ret;
 
 	return ret;
@@ -383,15 +379,19 @@ onvm_get_rptr(struct mtcp_thread_context *ctxt, int ifidx, int index, uint16_t *
 int32_t
 onvm_select(struct mtcp_thread_context *ctxt)
 {
-#ifdef RX_IDLE_ENABLE
 	struct dpdk_private_context *dpc;
+	struct pollfd pfd[1];
+	int timeout = CONFIG.idle_sleep;
 	
 	dpc = (struct dpdk_private_context *) ctxt->io_private_context;
-	if (dpc->rx_idle > RX_IDLE_THRESH) {
+#ifdef RX_IDLE_ENABLE
+	if (timeout == 0)
+		timeout = RX_IDLE_TIMEOUT;
+#endif
+	if (timeout > 0 && dpc->rx_idle > RX_IDLE_THRESH) {
 		dpc->rx_idle = 0;
-		usleep(RX_IDLE_TIMEOUT);
+		MTCPIdleSleep(ctxt->mtcp_manager, pfd, 0, timeout);
 	}
-#endif
 	return 0;
 }
 /*----------------------------------------------------------------------------*/
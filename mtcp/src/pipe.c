@@ -42,14 +42,14 @@ mtcp_pipe(mctx_t mctx, int pipeid[2])
 	struct pipe *pp;
 	int ret;
 	
-	socket[0] = AllocateSocket(mctx, MTCP_SOCK_PIPE, FALSE);
+	socket[0] = AllocateSocket(mctx, MTCP_SOCK_PIPE);
 	if (!socket[0]) {
 		errno = ENFILE;
 		return -1;
 	}
-	socket[1] = AllocateSocket(mctx, MTCP_SOCK_PIPE, FALSE);
+	socket[1] = AllocateSocket(mctx, MTCP_SOCK_PIPE);
 	if (!socket[1]) {
-		FreeSocket(mctx, socket[0]->id, FALSE);
+		FreeSocket(mctx, socket[0]->id);
 		errno = ENFILE;
 		return -1;
 	}
@@ -57,8 +57,8 @@ mtcp_pipe(mctx_t mctx, int pipeid[2])
 	pp = (struct pipe *)calloc(1, sizeof(struct pipe));
 	if (!pp) {
 		/* errno set by calloc() */
-		FreeSocket(mctx, socket[0]->id, FALSE);
-		FreeSocket(mctx, socket[1]->id, FALSE);
+		FreeSocket(mctx, socket[0]->id);
+		FreeSocket(mctx, socket[1]->id);
 		return -1;
 	}
 
@@ -66,8 +66,8 @@ mtcp_pipe(mctx_t mctx, int pipeid[2])
 	pp->buf = (char *)malloc(pp->buf_size);
 	if (!pp->buf) {
 		/* errno set by malloc() */
-		FreeSocket(mctx, socket[0]->id, FALSE);
-		FreeSocket(mctx, socket[1]->id, FALSE);
+		FreeSocket(mctx, socket[0]->id);
+		FreeSocket(mctx, socket[1]->id);
 		free(pp);
 		return -1;
 	}
@@ -75,8 +75,8 @@ mtcp_pipe(mctx_t mctx, int pipeid[2])
 	ret = pthread_mutex_init(&pp->pipe_lock, NULL);
 	if (ret) {
 		/* errno set by pthread_mutex_init() */
-		FreeSocket(mctx, socket[0]->id, FALSE);
-		FreeSocket(mctx, socket[1]->id, FALSE);
+		FreeSocket(mctx, socket[0]->id);
+		FreeSocket(mctx, socket[1]->id);
 		free(pp->buf);
 		free(pp);
 		return -1;
@@ -85,8 +85,8 @@ mtcp_pipe(mctx_t mctx, int pipeid[2])
 	ret = pthread_cond_init(&pp->pipe_cond, NULL);
 	if (ret) {
 		/* errno set by pthread_cond_init() */
-		FreeSocket(mctx, socket[0]->id, FALSE);
-		FreeSocket(mctx, socket[1]->id, FALSE);
+		FreeSocket(mctx, socket[0]->id);
+		FreeSocket(mctx, socket[1]->id);
 		free(pp->buf);
 		pthread_mutex_destroy(&pp->pipe_lock);
 		free(pp);
@@ -119,7 +119,7 @@ RaiseEventToPair(mtcp_manager_t mtcp, socket_map_t socket, uint32_t event)
 
 	if (pair_socket->opts & MTCP_NONBLOCK) {
 		if (pair_socket->epoll) {
-			AddEpollEvent(mtcp->ep, USR_EVENT_QUEUE, pair_socket, event);
+			AddEpollEvent(pair_socket->reg_ep, USR_SHADOW_EVENT_QUEUE, pair_socket, event);
 		}
 	} else {
 		pthread_cond_signal(&pp->pipe_cond);
@@ -219,11 +219,11 @@ PipeRead(mctx_t mctx, int pipeid, char *buf, int len)
 	/* if level triggered, raise event for remainig buffer */
 	if (pp->buf_len > 0) {
 		if ((socket->epoll & MTCP_EPOLLIN) && !(socket->epoll & MTCP_EPOLLET)) {
-			AddEpollEvent(mtcp->ep, 
+			AddEpollEvent(socket->reg_ep, 
 					USR_SHADOW_EVENT_QUEUE, socket, MTCP_EPOLLIN);
 		}
 	} else if (pp->state == PIPE_CLOSE_WAIT && pp->buf_len == 0) {
-		AddEpollEvent(mtcp->ep, USR_SHADOW_EVENT_QUEUE, socket, MTCP_EPOLLIN);
+		AddEpollEvent(socket->reg_ep, USR_SHADOW_EVENT_QUEUE, socket, MTCP_EPOLLIN);
 	}
 
 	return to_read;
@@ -321,7 +321,7 @@ PipeWrite(mctx_t mctx, int pipeid, const char *buf, int len)
 	/* if level triggered, raise event for remainig buffer */
 	if (pp->buf_len < pp->buf_size) {
 		if ((socket->epoll & MTCP_EPOLLOUT) && !(socket->epoll & MTCP_EPOLLET)) {
-			AddEpollEvent(mtcp->ep, 
+			AddEpollEvent(socket->reg_ep, 
 					USR_SHADOW_EVENT_QUEUE, socket, MTCP_EPOLLOUT);
 		}
 	}
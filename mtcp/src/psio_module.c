@@ -318,9 +318,14 @@ psio_select(struct mtcp_thread_context *ctxt)
 		
 		TRACE_SELECT("BEFORE: rx_avail: %d, tx_avail: %d, event.rx_nids: %0x, event.tx_nids: %0x\n", 
 			     ppc->rx_avail, ppc->tx_avail, ppc->event.rx_nids, ppc->event.tx_nids);
-		mtcp->is_sleeping = TRUE;
+		/* ps_select() cannot wait on the wakeup eventfd: 
+		   WakeupMTCPThread() interrupts it with SIGUSR1 instead, and 
+		   it does not sleep while application calls are pending */
+		__atomic_store_n(&mtcp->is_sleeping, TRUE, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&mtcp->wakeup_flag, __ATOMIC_SEQ_CST))
+			ppc->event.timeout = 0;
 		ret = ps_select(&ppc->handle, &ppc->event);
-		mtcp->is_sleeping = FALSE;
+		__atomic_store_n(&mtcp->is_sleeping, FALSE, __ATOMIC_SEQ_CST);
 #if TIME_STAT
 		gettimeofday(&select_ts, NULL);
 		UpdateStatCounter(&mtcp->rtstat.select, 
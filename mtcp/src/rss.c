@@ -94,22 +94,35 @@ GetRSSHash(in_addr_t sip, in_addr_t dip, in_port_t sp, in_port_t dp)
 #define RSS_BIT_MASK_IXGBE		0x0000007F
 #define RSS_BIT_MASK_I40E		0x000001FF
 
+uint32_t
+GetRSSHashBits(in_addr_t sip, in_addr_t dip, in_port_t sp, in_port_t dp)
+{
+	return GetRSSHash(sip, dip, sp, dp) & RSS_BIT_MASK_I40E;
+}
+/*-------------------------------------------------------------------*/ 
 int
-GetRSSCPUCore(in_addr_t sip, in_addr_t dip, 
-	      in_port_t sp, in_port_t dp, int num_queues, uint8_t endian_check)
+RSSHashBitsToCPUCore(uint32_t bits, int num_queues, uint8_t endian_check)
 {
 	uint32_t masked;
 
 	if (endian_check) {
 		/* i40e */
 		static const uint32_t off[] = {3, 1, -1, -3};
-		masked = GetRSSHash(sip, dip, sp, dp) & RSS_BIT_MASK_I40E; 
+		masked = bits & RSS_BIT_MASK_I40E; 
 		masked += off[masked & 0x3];
 	} else {
 		/* ixgbe or mlx* */
-		masked = GetRSSHash(sip, dip, sp, dp) & RSS_BIT_MASK_IXGBE;
+		masked = bits & RSS_BIT_MASK_IXGBE;
 	}
 
 	return (masked % num_queues);
 }
 /*-------------------------------------------------------------------*/ 
+int
+GetRSSCPUCore(in_addr_t sip, in_addr_t dip, 
+	      in_port_t sp, in_port_t dp, int num_queues, uint8_t endian_check)
+{
+	return RSSHashBitsToCPUCore(GetRSSHashBits(sip, dip, sp, dp), 
+				    num_queues, endian_check);
+}
+/*-------------------------------------------------------------------*/ 
@@ -3,45 +3,47 @@
 #include "debug.h"
 
 /*---------------------------------------------------------------------------*/
+/*
+ * Only the application thread allocates and frees sockets (the mtcp 
+ * thread just drops its stream->socket reference), so the free ids are 
+ * a plain stack owned by that thread and need no lock. Popping the most 
+ * recently closed id keeps its socket_map entry cache-hot; references 
+ * to the old socket that are still in flight carry its generation 
+ * (SOCKDESC()) and are told apart from the new one by it.
+ */
 socket_map_t 
-AllocateSocket(mctx_t mctx, int socktype, int need_lock)
+AllocateSocket(mctx_t mctx, int socktype)
 {
 	mtcp_manager_t mtcp = g_mtcp[mctx->cpu];
 	socket_map_t socket = NULL;
+	int i;
 
-	if (need_lock)
-		pthread_mutex_lock(&mtcp->ctx->smap_lock);
-
-	while (socket == NULL) {
-		socket = TAILQ_FIRST(&mtcp->free_smap);
-		if (!socket) {
-			if (need_lock)
-				pthread_mutex_unlock(&mtcp->ctx->smap_lock);
-
-			TRACE_ERROR("The concurrent sockets are at maximum.\n");
-			return NULL;
-		}
-
-		TAILQ_REMOVE(&mtcp->free_smap, socket, free_smap_link);
-
-		/* if there is not invalidated events, insert the socket to the end */
-		/* and find another socket in the free smap list */
-		if (socket->events) {
-			TRACE_INFO("There are still not invalidate events remaining.\n");
-			TRACE_DBG("There are still not invalidate events remaining.\n");
-			TAILQ_INSERT_TAIL(&mtcp->free_smap, socket, free_smap_link);
-			socket = NULL;
-		}
+	for (i = mtcp->free_smap_top - 1; i >= 0; i--) {
+		socket = &mtcp->smap[mtcp->free_smap[i]];
+		/* an event raised after the close has not been invalidated yet */
+		if (!socket->events)
+			break;
+		TRACE_DBG("There are still not invalidate events remaining.\n");
 	}
-
-	if (need_lock)
-		pthread_mutex_unlock(&mtcp->ctx->smap_lock);
+	if (i < 0) {
+		TRACE_ERROR("The concurrent sockets are at maximum.\n");
+		return NULL;
+	}
+	/* the top fills the hole */
+	mtcp->free_smap[i] = mtcp->free_smap[--mtcp->free_smap_top];
 	
 	socket->socktype = socktype;
-	socket->opts = 0;
+	/* nothing runs the stack while an inline caller blocks */
+	socket->opts = CONFIG.inline_mode? MTCP_NONBLOCK : 0;
+	/* small writes go out at once unless TCP_NODELAY is cleared (Nagle) */
+	if (socktype == MTCP_SOCK_STREAM || socktype == MTCP_SOCK_LISTENER)
+		socket->opts |= MTCP_NODELAY;
 	socket->stream = NULL;
 	socket->epoll = 0;
 	socket->events = 0;
+	socket->reg_ep = NULL;
+	socket->cc = NULL;
+	socket->tfo_qlen = 0;
 
 	/* 
 	 * reset a few fields (needed for client socket) 
@@ -54,7 +56,7 @@ AllocateSocket(mctx_t mctx, int socktype, int need_lock)
 }
 /*---------------------------------------------------------------------------*/
 void 
-FreeSocket(mctx_t mctx, int sockid, int need_lock)
+FreeSocket(mctx_t mctx, int sockid)
 {
 	mtcp_manager_t mtcp = g_mtcp[mctx->cpu];
 	socket_map_t socket = &mtcp->smap[sockid];
@@ -66,16 +68,13 @@ FreeSocket(mctx_t mctx, int sockid, int need_lock)
 	socket->socktype = MTCP_SOCK_UNUSED;
 	socket->epoll = MTCP_EPOLLNONE;
 	socket->events = 0;
+	socket->reg_ep = NULL;
+	/* references taken before the close are stale from now on */
+	socket->gen++;
 
-	if (need_lock)
-		pthread_mutex_lock(&mtcp->ctx->smap_lock);
-
-	/* insert into free stream map */
+	/* push onto the free stack */
 	mtcp->smap[sockid].stream = NULL;
-	TAILQ_INSERT_TAIL(&mtcp->free_smap, socket, free_smap_link);
-
-	if (need_lock)
-		pthread_mutex_unlock(&mtcp->ctx->smap_lock);
+	mtcp->free_smap[mtcp->free_smap_top++] = sockid;
 }
 /*---------------------------------------------------------------------------*/
 socket_map_t 
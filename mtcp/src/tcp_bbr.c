@@ -0,0 +1,353 @@
+#include "tcp_cc.h"
+#include "tcp_in.h"
+#include "debug.h"
+
+#define MAX(a, b) ((a)>(b)?(a):(b))
+#define MIN(a, b) ((a)<(b)?(a):(b))
+
+/*
+ * BBR (v1). Models the path by its bottleneck bandwidth (max delivery
+ * rate over the last 10 rounds) and its propagation delay (min rtt over
+ * the last 10 seconds), paces at gain * bw and caps the data in flight
+ * at cwnd_gain * bw * min_rtt. The delivery rate is sampled once per
+ * round trip from the bytes acked during that round.
+ */
+#define BBR_SCALE			8		/* gains are scaled by 256 */
+#define BBR_UNIT			(1 << BBR_SCALE)
+#define BBR_BW_SCALE		16		/* bw is in bytes per tick << 16 */
+#define BBR_BW_RTTS			10		/* window of the max bw filter (rounds) */
+#define BBR_MIN_RTT_WIN		SEC_TO_TS(10)
+#define BBR_PROBE_RTT_TIME	(MSEC_TO_USEC(200) / TIME_TICK)
+#define BBR_HIGH_GAIN		(BBR_UNIT * 2885 / 1000 + 1)	/* 2/ln(2) */
+#define BBR_DRAIN_GAIN		(BBR_UNIT * 1000 / 2885)
+#define BBR_CWND_GAIN		(BBR_UNIT * 2)
+#define BBR_FULL_BW_THRESH	(BBR_UNIT * 5 / 4)
+#define BBR_FULL_BW_CNT		3
+#define BBR_MIN_CWND_SEGS	4
+#define BBR_CYCLE_LEN		8
+
+enum bbr_mode
+{
+	BBR_STARTUP,
+	BBR_DRAIN,
+	BBR_PROBE_BW,
+	BBR_PROBE_RTT,
+};
+
+static const uint32_t bbr_pacing_gain[BBR_CYCLE_LEN] = {
+	BBR_UNIT * 5 / 4, BBR_UNIT * 3 / 4,
+	BBR_UNIT, BBR_UNIT, BBR_UNIT, BBR_UNIT, BBR_UNIT, BBR_UNIT
+};
+
+struct bbr
+{
+	uint32_t bw[BBR_BW_RTTS];	/* delivery rate of the last rounds */
+	uint32_t min_rtt;			/* ticks */
+	uint32_t min_rtt_stamp;		/* when min_rtt was measured */
+	uint32_t delivered;			/* total bytes delivered */
+	uint32_t round_delivered;	/* delivered at the start of the round */
+	uint32_t next_round_delivered;	/* delivered at the end of the round */
+	uint32_t round_start_ts;
+	uint32_t round_count;
+	uint32_t full_bw;			/* bw at the last startup growth check */
+	uint32_t cycle_stamp;		/* start of the current gain phase */
+	uint32_t prior_cwnd;		/* cwnd before loss recovery or probe_rtt */
+	uint32_t probe_rtt_done_stamp;
+	uint32_t probe_rtt_round;
+	uint8_t mode;
+	uint8_t cycle_idx;
+	uint8_t full_bw_cnt;
+	uint8_t full_bw_reached;
+};
+/*----------------------------------------------------------------------------*/
+static inline uint32_t
+BBRMaxBw(struct bbr *bbr)
+{
+	uint32_t bw = 0;
+	int i;
+
+	for (i = 0; i < BBR_BW_RTTS; i++)
+		bw = MAX(bw, bbr->bw[i]);
+	return bw;
+}
+/*----------------------------------------------------------------------------*/
+static inline uint32_t
+BBRPacingGain(struct bbr *bbr)
+{
+	switch (bbr->mode) {
+	case BBR_STARTUP:
+		return BBR_HIGH_GAIN;
+	case BBR_DRAIN:
+		return BBR_DRAIN_GAIN;
+	case BBR_PROBE_BW:
+		return bbr_pacing_gain[bbr->cycle_idx];
+	default:
+		return BBR_UNIT;
+	}
+}
+/*----------------------------------------------------------------------------*/
+/* gain * bdp plus some room for delayed and stretched acks */
+static inline uint32_t
+BBRTarget(tcp_stream *cur_stream, struct bbr *bbr, uint32_t gain)
+{
+	struct tcp_send_vars *sndvar = cur_stream->sndvar;
+	uint32_t bw = BBRMaxBw(bbr);
+	uint64_t bdp;
+
+	/* no model yet */
+	if (bw == 0 || bbr->min_rtt == UINT32_MAX)
+		return TCP_INIT_CWND * sndvar->mss;
+
+	bdp = (uint64_t)bw * bbr->min_rtt >> BBR_BW_SCALE;
+	bdp = (bdp * gain >> BBR_SCALE) + 3 * sndvar->mss;
+
+	return MAX(MIN(bdp, UINT32_MAX), BBR_MIN_CWND_SEGS * sndvar->mss);
+}
+/*----------------------------------------------------------------------------*/
+static inline void
+BBRResetProbeBw(tcp_stream *cur_stream, struct bbr *bbr, uint32_t cur_ts)
+{
+	bbr->mode = BBR_PROBE_BW;
+	/* start at a random phase, but not in the draining one */
+	bbr->cycle_idx = BBR_CYCLE_LEN - 1 -
+			(cur_stream->id % (BBR_CYCLE_LEN - 1));
+	bbr->cycle_stamp = cur_ts;
+}
+/*----------------------------------------------------------------------------*/
+static void
+BBRInit(tcp_stream *cur_stream, uint32_t cur_ts)
+{
+	struct bbr *bbr = CC_PRIV(cur_stream);
+
+	bbr->mode = BBR_STARTUP;
+	bbr->min_rtt = UINT32_MAX;
+	bbr->min_rtt_stamp = cur_ts;
+	bbr->round_start_ts = cur_ts;
+	bbr->next_round_delivered = 0;
+	/* bbr does not use slow start */
+	cur_stream->sndvar->ssthresh = UINT32_MAX;
+}
+/*----------------------------------------------------------------------------*/
+/* returns TRUE at the start of a new round trip */
+static inline int
+BBRUpdateBw(struct bbr *bbr, uint32_t cur_ts, const struct cc_ack_sample *rs)
+{
+	uint32_t elapsed;
+
+	bbr->delivered += rs->acked;
+	if (TCP_SEQ_LT(bbr->delivered, bbr->next_round_delivered))
+		return FALSE;
+
+	/* the data in flight at the start of this round is acked */
+	elapsed = cur_ts - bbr->round_start_ts;
+	if (elapsed > 0) {
+		bbr->bw[bbr->round_count % BBR_BW_RTTS] = MIN(UINT32_MAX,
+				((uint64_t)(bbr->delivered - bbr->round_delivered) <<
+				 BBR_BW_SCALE) / elapsed);
+	}
+	bbr->round_count++;
+	bbr->bw[bbr->round_count % BBR_BW_RTTS] = 0;
+
+	bbr->round_delivered = bbr->delivered;
+	bbr->round_start_ts = cur_ts;
+	bbr->next_round_delivered = bbr->delivered + MAX(rs->inflight, 1);
+
+	return TRUE;
+}
+/*----------------------------------------------------------------------------*/
+static inline void
+BBRCheckFullBw(struct bbr *bbr)
+{
+	uint32_t bw = BBRMaxBw(bbr);
+
+	if (bbr->full_bw_reached)
+		return;
+
+	if ((uint64_t)bw >= (uint64_t)bbr->full_bw * BBR_FULL_BW_THRESH >> BBR_SCALE) {
+		/* still growing */
+		bbr->full_bw = bw;
+		bbr->full_bw_cnt = 0;
+		return;
+	}
+	if (++bbr->full_bw_cnt >= BBR_FULL_BW_CNT)
+		bbr->full_bw_reached = TRUE;
+}
+/*----------------------------------------------------------------------------*/
+static inline void
+BBRUpdateCycle(tcp_stream *cur_stream, struct bbr *bbr,
+		uint32_t cur_ts, const struct cc_ack_sample *rs)
+{
+	uint32_t gain = bbr_pacing_gain[bbr->cycle_idx];
+	int full_length = (cur_ts - bbr->cycle_stamp > bbr->min_rtt);
+	int next;
+
+	if (gain > BBR_UNIT) {
+		/* probe until the pipe holds gain * bdp */
+		next = full_length &&
+				rs->inflight >= BBRTarget(cur_stream, bbr, gain);
+	} else if (gain < BBR_UNIT) {
+		/* drain the queue built by probing */
+		next = full_length ||
+				rs->inflight <= BBRTarget(cur_stream, bbr, BBR_UNIT);
+	} else {
+		next = full_length;
+	}
+
+	if (next) {
+		bbr->cycle_idx = (bbr->cycle_idx + 1) % BBR_CYCLE_LEN;
+		bbr->cycle_stamp = cur_ts;
+	}
+}
+/*----------------------------------------------------------------------------*/
+static inline void
+BBRUpdateMinRtt(tcp_stream *cur_stream, struct bbr *bbr,
+		uint32_t cur_ts, const struct cc_ack_sample *rs)
+{
+	struct tcp_send_vars *sndvar = cur_stream->sndvar;
+	uint32_t min_cwnd = BBR_MIN_CWND_SEGS * sndvar->mss;
+	int expired;
+
+	expired = TCP_SEQ_GT(cur_ts, bbr->min_rtt_stamp + BBR_MIN_RTT_WIN);
+	if (rs->rtt && (rs->rtt <= bbr->min_rtt || expired)) {
+		bbr->min_rtt = rs->rtt;
+		bbr->min_rtt_stamp = cur_ts;
+	}
+
+	if (expired && bbr->mode != BBR_PROBE_RTT) {
+		/* drain the queue to measure the propagation delay */
+		bbr->mode = BBR_PROBE_RTT;
+		bbr->prior_cwnd = MAX(bbr->prior_cwnd, sndvar->cwnd);
+		bbr->probe_rtt_done_stamp = 0;
+		TRACE_CONG("Stream %d: bbr probe_rtt\n", cur_stream->id);
+	}
+
+	if (bbr->mode != BBR_PROBE_RTT)
+		return;
+
+	if (bbr->probe_rtt_done_stamp == 0) {
+		if (rs->inflight <= min_cwnd) {
+			bbr->probe_rtt_done_stamp = (cur_ts + BBR_PROBE_RTT_TIME) | 1;
+			bbr->probe_rtt_round = bbr->round_count;
+		}
+	} else if (bbr->round_count != bbr->probe_rtt_round &&
+			TCP_SEQ_GEQ(cur_ts, bbr->probe_rtt_done_stamp)) {
+		bbr->min_rtt_stamp = cur_ts;
+		sndvar->cwnd = MAX(sndvar->cwnd, bbr->prior_cwnd);
+		bbr->prior_cwnd = 0;
+		if (bbr->full_bw_reached) {
+			BBRResetProbeBw(cur_stream, bbr, cur_ts);
+		} else {
+			bbr->mode = BBR_STARTUP;
+		}
+	}
+}
+/*----------------------------------------------------------------------------*/
+static void
+BBROnAck(tcp_stream *cur_stream, uint32_t cur_ts,
+		const struct cc_ack_sample *rs)
+{
+	struct tcp_send_vars *sndvar = cur_stream->sndvar;
+	struct bbr *bbr = CC_PRIV(cur_stream);
+	uint32_t min_cwnd = BBR_MIN_CWND_SEGS * sndvar->mss;
+	uint32_t target;
+
+	if (BBRUpdateBw(bbr, cur_ts, rs) && bbr->mode == BBR_STARTUP) {
+		BBRCheckFullBw(bbr);
+		if (bbr->full_bw_reached) {
+			bbr->mode = BBR_DRAIN;
+			TRACE_CONG("Stream %d: bbr drain\n", cur_stream->id);
+		}
+	}
+
+	if (bbr->mode == BBR_DRAIN &&
+			rs->inflight <= BBRTarget(cur_stream, bbr, BBR_UNIT)) {
+		BBRResetProbeBw(cur_stream, bbr, cur_ts);
+	}
+	if (bbr->mode == BBR_PROBE_BW)
+		BBRUpdateCycle(cur_stream, bbr, cur_ts, rs);
+
+	BBRUpdateMinRtt(cur_stream, bbr, cur_ts, rs);
+
+	/* grow cwnd toward the target, or freely until the pipe is full */
+	target = BBRTarget(cur_stream, bbr,
+			bbr->full_bw_reached ? BBR_CWND_GAIN : BBR_HIGH_GAIN);
+	if (bbr->full_bw_reached) {
+		sndvar->cwnd = MIN(sndvar->cwnd + rs->acked, target);
+	} else if (sndvar->cwnd < target ||
+			bbr->delivered < TCP_INIT_CWND * sndvar->mss) {
+		sndvar->cwnd += rs->acked;
+	}
+	sndvar->cwnd = MAX(sndvar->cwnd, min_cwnd);
+
+	if (bbr->mode == BBR_PROBE_RTT)
+		sndvar->cwnd = MIN(sndvar->cwnd, min_cwnd);
+}
+/*----------------------------------------------------------------------------*/
+static void
+BBROnLoss(tcp_stream *cur_stream, uint32_t cur_ts)
+{
+	struct tcp_send_vars *sndvar = cur_stream->sndvar;
+	struct bbr *bbr = CC_PRIV(cur_stream);
+	uint32_t inflight = sndvar->snd_max - sndvar->snd_una;
+
+#if TCP_OPT_SACK_ENABLED
+	inflight -= MIN(inflight, cur_stream->rcvvar->sacked_bytes);
+#endif
+	/* packet conservation; the model is not changed by losses */
+	bbr->prior_cwnd = MAX(bbr->prior_cwnd, sndvar->cwnd);
+	sndvar->cwnd = MAX(inflight + sndvar->mss,
+			BBR_MIN_CWND_SEGS * sndvar->mss);
+}
+/*----------------------------------------------------------------------------*/
+static void
+BBROnRTO(tcp_stream *cur_stream, uint32_t cur_ts)
+{
+	struct bbr *bbr = CC_PRIV(cur_stream);
+
+	bbr->prior_cwnd = MAX(bbr->prior_cwnd, cur_stream->sndvar->cwnd);
+	cur_stream->sndvar->cwnd = cur_stream->sndvar->mss;
+}
+/*----------------------------------------------------------------------------*/
+static void
+BBRCwndEvent(tcp_stream *cur_stream, uint32_t cur_ts, int event)
+{
+	struct bbr *bbr = CC_PRIV(cur_stream);
+
+	if (event == CC_EVENT_RECOVERY_EXIT) {
+		cur_stream->sndvar->cwnd = MAX(cur_stream->sndvar->cwnd,
+				bbr->prior_cwnd);
+		bbr->prior_cwnd = 0;
+	}
+}
+/*----------------------------------------------------------------------------*/
+static uint64_t
+BBRPacingRate(tcp_stream *cur_stream)
+{
+	struct bbr *bbr = CC_PRIV(cur_stream);
+	uint32_t bw = BBRMaxBw(bbr);
+	uint64_t rate;
+
+	if (bw == 0) {
+		/* no sample yet: high_gain * cwnd / srtt */
+		if (cur_stream->rcvvar->srtt == 0)
+			return 0;
+		rate = (uint64_t)cur_stream->sndvar->cwnd * HZ /
+				MAX(cur_stream->rcvvar->srtt >> 3, 1);
+		return rate * BBR_HIGH_GAIN >> BBR_SCALE;
+	}
+
+	/* pace 1% below the estimated rate to keep the queue small */
+	rate = ((uint64_t)bw * BBRPacingGain(bbr) >> BBR_SCALE) * HZ >> BBR_BW_SCALE;
+	return rate * 99 / 100;
+}
+/*----------------------------------------------------------------------------*/
+const struct tcp_cc_ops bbr_cc_ops = {
+	.name = "bbr",
+	.init = BBRInit,
+	.on_ack = BBROnAck,
+	.on_loss = BBROnLoss,
+	.on_rto = BBROnRTO,
+	.pacing_rate = BBRPacingRate,
+	.cwnd_event = BBRCwndEvent,
+};
+/*----------------------------------------------------------------------------*/
@@ -0,0 +1,158 @@
+#include <string.h>
+
+#include "tcp_cc.h"
+#include "tcp_in.h"
+#include "debug.h"
+
+#define MAX(a, b) ((a)>(b)?(a):(b))
+#define MIN(a, b) ((a)<(b)?(a):(b))
+
+static const struct tcp_cc_ops *cc_list[] = {
+	&reno_cc_ops,
+	&cubic_cc_ops,
+	&dctcp_cc_ops,
+	&bbr_cc_ops,
+	NULL
+};
+
+static const struct tcp_cc_ops *default_cc = &reno_cc_ops;
+/*----------------------------------------------------------------------------*/
+const struct tcp_cc_ops *
+GetCongestionControl(const char *name)
+{
+	int i;
+
+	for (i = 0; cc_list[i] != NULL; i++) {
+		if (strcmp(cc_list[i]->name, name) == 0)
+			return cc_list[i];
+	}
+
+	return NULL;
+}
+/*----------------------------------------------------------------------------*/
+const struct tcp_cc_ops *
+GetDefaultCongestionControl()
+{
+	return default_cc;
+}
+/*----------------------------------------------------------------------------*/
+int
+SetDefaultCongestionControl(const char *name)
+{
+	const struct tcp_cc_ops *cc = GetCongestionControl(name);
+
+	if (!cc)
+		return -1;
+
+	default_cc = cc;
+	return 0;
+}
+/*----------------------------------------------------------------------------*/
+/*
+ * (Re)initializes the congestion control of the stream, switching to
+ * the algorithm requested by setsockopt() if any.
+ */
+void
+InitCongestionControl(tcp_stream *cur_stream, uint32_t cur_ts)
+{
+	struct tcp_send_vars *sndvar = cur_stream->sndvar;
+	const struct tcp_cc_ops *cc;
+
+	if (sndvar->cc_req) {
+		cc = __sync_lock_test_and_set(&sndvar->cc_req, NULL);
+		if (cc)
+			sndvar->cc = cc;
+	}
+
+	memset(sndvar->cc_priv, 0, sizeof(sndvar->cc_priv));
+	if (sndvar->cc->init)
+		sndvar->cc->init(cur_stream, cur_ts);
+
+	TRACE_CONG("Stream %d: congestion control %s\n",
+			cur_stream->id, sndvar->cc->name);
+}
+/*----------------------------------------------------------------------------*/
+inline void
+CCEvent(tcp_stream *cur_stream, uint32_t cur_ts, int event)
+{
+	if (cur_stream->sndvar->cc->cwnd_event)
+		cur_stream->sndvar->cc->cwnd_event(cur_stream, cur_ts, event);
+}
+/*----------------------------------------------------------------------------*/
+inline uint64_t
+CCPacingRate(tcp_stream *cur_stream)
+{
+	if (cur_stream->sndvar->cc->pacing_rate)
+		return cur_stream->sndvar->cc->pacing_rate(cur_stream);
+	return 0;
+}
+/*----------------------------------------------------------------------------*/
+inline uint32_t
+CCRenoSSThresh(tcp_stream *cur_stream)
+{
+	struct tcp_send_vars *sndvar = cur_stream->sndvar;
+
+	/* ssthresh to half of min of cwnd and peer wnd */
+	return MAX(MIN(sndvar->cwnd, sndvar->peer_wnd) / 2, 2 * sndvar->mss);
+}
+/*----------------------------------------------------------------------------*/
+inline void
+CCRenoIncrease(tcp_stream *cur_stream, const struct cc_ack_sample *rs)
+{
+	struct tcp_send_vars *sndvar = cur_stream->sndvar;
+
+	if (sndvar->cwnd < sndvar->ssthresh) {
+		if ((sndvar->cwnd + sndvar->mss) > sndvar->cwnd) {
+			sndvar->cwnd += (sndvar->mss * rs->packets);
+		}
+		TRACE_CONG("slow start cwnd: %u, ssthresh: %u\n",
+				sndvar->cwnd, sndvar->ssthresh);
+	} else {
+		uint32_t new_cwnd = sndvar->cwnd +
+				rs->packets * sndvar->mss * sndvar->mss /
+				sndvar->cwnd;
+		if (new_cwnd > sndvar->cwnd) {
+			sndvar->cwnd = new_cwnd;
+		}
+	}
+}
+/*----------------------------------------------------------------------------*/
+/* NewReno                                                                    */
+/*----------------------------------------------------------------------------*/
+static void
+RenoOnAck(tcp_stream *cur_stream, uint32_t cur_ts,
+		const struct cc_ack_sample *rs)
+{
+	if (!rs->in_recovery)
+		CCRenoIncrease(cur_stream, rs);
+}
+/*----------------------------------------------------------------------------*/
+static void
+RenoOnLoss(tcp_stream *cur_stream, uint32_t cur_ts)
+{
+	cur_stream->sndvar->ssthresh = CCRenoSSThresh(cur_stream);
+	cur_stream->sndvar->cwnd = cur_stream->sndvar->ssthresh;
+}
+/*----------------------------------------------------------------------------*/
+static void
+RenoOnRTO(tcp_stream *cur_stream, uint32_t cur_ts)
+{
+	cur_stream->sndvar->ssthresh = CCRenoSSThresh(cur_stream);
+	cur_stream->sndvar->cwnd = cur_stream->sndvar->mss;
+}
+/*----------------------------------------------------------------------------*/
+static void
+RenoCwndEvent(tcp_stream *cur_stream, uint32_t cur_ts, int event)
+{
+	if (event == CC_EVENT_RECOVERY_EXIT)
+		cur_stream->sndvar->cwnd = cur_stream->sndvar->ssthresh;
+}
+/*----------------------------------------------------------------------------*/
+const struct tcp_cc_ops reno_cc_ops = {
+	.name = "reno",
+	.on_ack = RenoOnAck,
+	.on_loss = RenoOnLoss,
+	.on_rto = RenoOnRTO,
+	.cwnd_event = RenoCwndEvent,
+};
+/*----------------------------------------------------------------------------*/
@@ -0,0 +1,179 @@
+#include "tcp_cc.h"
+#include "tcp_in.h"
+#include "debug.h"
+
+#define MAX(a, b) ((a)>(b)?(a):(b))
+#define MIN(a, b) ((a)<(b)?(a):(b))
+
+/*
+ * CUBIC (RFC 8312). The window grows as W(t) = C * (t - K)^3 + W_max
+ * with C = 0.4 segments/s^3, t in seconds since the last reduction.
+ * Integer arithmetic with t in milliseconds.
+ */
+#define CUBIC_BETA			717		/* 0.7 << 10 */
+#define CUBIC_BETA_FC		870		/* (1 + 0.7) / 2 << 10, fast convergence */
+#define CUBIC_MAX_DELTA_MS	100000	/* clamp |t - K| to avoid overflows */
+
+struct cubic
+{
+	uint32_t w_max;			/* cwnd before the last reduction */
+	uint32_t last_w_max;	/* previous w_max, for fast convergence */
+	uint32_t origin;		/* cwnd at the plateau of the curve */
+	uint32_t k;				/* ms from the epoch start to the plateau */
+	uint32_t epoch_start;	/* start of the growth epoch, 0 if none */
+	uint32_t w_est;			/* reno-friendly window estimate */
+	uint32_t min_rtt;		/* minimum rtt seen (ticks), 0 if none */
+	uint32_t last_ack_ts;	/* last time new data was acked */
+};
+/*----------------------------------------------------------------------------*/
+static inline uint32_t
+CubicRoot(uint64_t a)
+{
+	uint64_t lo = 0, hi = 2642245, mid;
+
+	/* 2642245 is the cube root of 2^64, rounded down */
+	while (lo < hi) {
+		mid = (lo + hi + 1) >> 1;
+		if (mid * mid * mid <= a)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	return (uint32_t)lo;
+}
+/*----------------------------------------------------------------------------*/
+static void
+CubicInit(tcp_stream *cur_stream, uint32_t cur_ts)
+{
+	struct cubic *ca = CC_PRIV(cur_stream);
+
+	ca->last_ack_ts = cur_ts;
+}
+/*----------------------------------------------------------------------------*/
+static inline void
+CubicStartEpoch(tcp_stream *cur_stream, struct cubic *ca, uint32_t cur_ts)
+{
+	struct tcp_send_vars *sndvar = cur_stream->sndvar;
+
+	ca->epoch_start = cur_ts ? cur_ts : 1;
+	ca->w_est = sndvar->cwnd;
+	if (sndvar->cwnd < ca->w_max) {
+		/* K = cbrt((W_max - cwnd) / C) with W in segments */
+		ca->k = CubicRoot((uint64_t)(ca->w_max - sndvar->cwnd) *
+				2500000000ULL / sndvar->mss);
+		ca->origin = ca->w_max;
+	} else {
+		ca->k = 0;
+		ca->origin = sndvar->cwnd;
+	}
+}
+/*----------------------------------------------------------------------------*/
+static void
+CubicOnAck(tcp_stream *cur_stream, uint32_t cur_ts,
+		const struct cc_ack_sample *rs)
+{
+	struct tcp_send_vars *sndvar = cur_stream->sndvar;
+	struct cubic *ca = CC_PRIV(cur_stream);
+	uint64_t d, delta, inc, est_inc;
+	uint32_t t, target;
+
+	if (rs->rtt && (ca->min_rtt == 0 || rs->rtt < ca->min_rtt))
+		ca->min_rtt = rs->rtt;
+	ca->last_ack_ts = cur_ts;
+
+	if (rs->in_recovery)
+		return;
+
+	if (sndvar->cwnd < sndvar->ssthresh) {
+		CCRenoIncrease(cur_stream, rs);
+		return;
+	}
+
+	if (ca->epoch_start == 0)
+		CubicStartEpoch(cur_stream, ca, cur_ts);
+
+	/* the window we should have one rtt from now */
+	t = TS_TO_MSEC(cur_ts - ca->epoch_start + ca->min_rtt);
+	d = (t > ca->k) ? t - ca->k : ca->k - t;
+	d = MIN(d, CUBIC_MAX_DELTA_MS);
+	delta = (4 * d * d * d / 10000) * sndvar->mss / 1000000;
+	if (t > ca->k)
+		target = ca->origin + MIN(delta, 0xffffffffU - ca->origin);
+	else
+		target = (delta < ca->origin) ? ca->origin - delta : 0;
+
+	if (target > sndvar->cwnd) {
+		inc = (uint64_t)(target - sndvar->cwnd) * rs->acked / sndvar->cwnd;
+	} else {
+		/* plateau: grow very slowly */
+		inc = (uint64_t)rs->acked * sndvar->mss / (100 * sndvar->cwnd);
+	}
+
+	/* never be slower than reno: 3 * (1 - beta) / (1 + beta) = 9 / 17 */
+	ca->w_est += (uint64_t)rs->acked * sndvar->mss * 9 / 17 / sndvar->cwnd;
+	if (ca->w_est > sndvar->cwnd) {
+		est_inc = (uint64_t)(ca->w_est - sndvar->cwnd) * rs->acked /
+				sndvar->cwnd;
+		inc = MAX(inc, est_inc);
+	}
+
+	/* at most 1.5x per rtt */
+	inc = MIN(inc, rs->acked / 2);
+	if (sndvar->cwnd + inc > sndvar->cwnd)
+		sndvar->cwnd += inc;
+}
+/*----------------------------------------------------------------------------*/
+static inline void
+CubicReduce(tcp_stream *cur_stream, struct cubic *ca)
+{
+	struct tcp_send_vars *sndvar = cur_stream->sndvar;
+
+	ca->epoch_start = 0;
+	if (sndvar->cwnd < ca->last_w_max)
+		ca->w_max = (uint64_t)sndvar->cwnd * CUBIC_BETA_FC >> 10;
+	else
+		ca->w_max = sndvar->cwnd;
+	ca->last_w_max = sndvar->cwnd;
+
+	sndvar->ssthresh = MAX((uint64_t)sndvar->cwnd * CUBIC_BETA >> 10,
+			2 * sndvar->mss);
+}
+/*----------------------------------------------------------------------------*/
+static void
+CubicOnLoss(tcp_stream *cur_stream, uint32_t cur_ts)
+{
+	CubicReduce(cur_stream, CC_PRIV(cur_stream));
+	cur_stream->sndvar->cwnd = cur_stream->sndvar->ssthresh;
+}
+/*----------------------------------------------------------------------------*/
+static void
+CubicOnRTO(tcp_stream *cur_stream, uint32_t cur_ts)
+{
+	CubicReduce(cur_stream, CC_PRIV(cur_stream));
+	cur_stream->sndvar->cwnd = cur_stream->sndvar->mss;
+}
+/*----------------------------------------------------------------------------*/
+static void
+CubicCwndEvent(tcp_stream *cur_stream, uint32_t cur_ts, int event)
+{
+	struct cubic *ca = CC_PRIV(cur_stream);
+
+	if (event == CC_EVENT_TX_START) {
+		/* do not count the idle period as growth time */
+		if (ca->epoch_start && TCP_SEQ_GT(cur_ts, ca->last_ack_ts))
+			ca->epoch_start += cur_ts - ca->last_ack_ts;
+		ca->last_ack_ts = cur_ts;
+	} else if (event == CC_EVENT_RECOVERY_EXIT) {
+		cur_stream->sndvar->cwnd = cur_stream->sndvar->ssthresh;
+	}
+}
+/*----------------------------------------------------------------------------*/
+const struct tcp_cc_ops cubic_cc_ops = {
+	.name = "cubic",
+	.init = CubicInit,
+	.on_ack = CubicOnAck,
+	.on_loss = CubicOnLoss,
+	.on_rto = CubicOnRTO,
+	.cwnd_event = CubicCwndEvent,
+};
+/*----------------------------------------------------------------------------*/
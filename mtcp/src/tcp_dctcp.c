@@ -0,0 +1,112 @@
+#include "tcp_cc.h"
+#include "tcp_in.h"
+#include "debug.h"
+
+#define MAX(a, b) ((a)>(b)?(a):(b))
+
+/*
+ * DCTCP (RFC 8257). alpha estimates the fraction of bytes acked with
+ * ECN-Echo over each window of data, and the window is reduced by
+ * alpha / 2 at most once per window. Losses are handled as in reno.
+ * Needs ECN to be negotiated with the peer.
+ */
+#define DCTCP_MAX_ALPHA		1024	/* alpha is scaled by 1024 */
+#define DCTCP_SHIFT_G		4		/* g = 1/16 */
+
+struct dctcp
+{
+	uint32_t alpha;			/* fraction of marked bytes << 10 */
+	uint32_t acked_bytes;	/* bytes acked in this window */
+	uint32_t ece_bytes;		/* bytes acked with ECN-Echo in this window */
+	uint32_t next_seq;		/* end of this observation window */
+	uint32_t cwr_seq;		/* no further reduction until acked */
+	uint8_t in_cwr;			/* the window was reduced for this data */
+};
+/*----------------------------------------------------------------------------*/
+static void
+DCTCPInit(tcp_stream *cur_stream, uint32_t cur_ts)
+{
+	struct dctcp *ca = CC_PRIV(cur_stream);
+
+	/* start conservatively, as if every byte was marked */
+	ca->alpha = DCTCP_MAX_ALPHA;
+	ca->next_seq = cur_stream->sndvar->snd_max;
+}
+/*----------------------------------------------------------------------------*/
+static void
+DCTCPOnAck(tcp_stream *cur_stream, uint32_t cur_ts,
+		const struct cc_ack_sample *rs)
+{
+	struct tcp_send_vars *sndvar = cur_stream->sndvar;
+	struct dctcp *ca = CC_PRIV(cur_stream);
+
+	ca->acked_bytes += rs->acked;
+	if (rs->ece)
+		ca->ece_bytes += rs->acked;
+
+	/* a window of data is acked: alpha = (1 - g) * alpha + g * F */
+	if (TCP_SEQ_GEQ(sndvar->snd_una, ca->next_seq)) {
+		uint32_t f = 0;
+
+		if (ca->acked_bytes > 0)
+			f = (uint64_t)ca->ece_bytes * DCTCP_MAX_ALPHA / ca->acked_bytes;
+		ca->alpha = ca->alpha - (ca->alpha >> DCTCP_SHIFT_G) +
+				(f >> DCTCP_SHIFT_G);
+		if (ca->alpha > DCTCP_MAX_ALPHA)
+			ca->alpha = DCTCP_MAX_ALPHA;
+
+		ca->acked_bytes = 0;
+		ca->ece_bytes = 0;
+		ca->next_seq = sndvar->snd_max;
+		TRACE_CONG("Stream %d: dctcp alpha: %u\n", cur_stream->id, ca->alpha);
+	}
+
+	if (ca->in_cwr && TCP_SEQ_GEQ(sndvar->snd_una, ca->cwr_seq))
+		ca->in_cwr = FALSE;
+
+	if (rs->ece && !ca->in_cwr) {
+		/* cwnd = cwnd * (1 - alpha / 2) */
+		sndvar->ssthresh = MAX(sndvar->cwnd -
+				(uint32_t)((uint64_t)sndvar->cwnd * ca->alpha >> 11),
+				2 * sndvar->mss);
+		sndvar->cwnd = sndvar->ssthresh;
+		ca->in_cwr = TRUE;
+		ca->cwr_seq = sndvar->snd_max;
+		return;
+	}
+
+	if (!rs->in_recovery)
+		CCRenoIncrease(cur_stream, rs);
+}
+/*----------------------------------------------------------------------------*/
+static void
+DCTCPOnLoss(tcp_stream *cur_stream, uint32_t cur_ts)
+{
+	cur_stream->sndvar->ssthresh = CCRenoSSThresh(cur_stream);
+	cur_stream->sndvar->cwnd = cur_stream->sndvar->ssthresh;
+}
+/*----------------------------------------------------------------------------*/
+static void
+DCTCPOnRTO(tcp_stream *cur_stream, uint32_t cur_ts)
+{
+	cur_stream->sndvar->ssthresh = CCRenoSSThresh(cur_stream);
+	cur_stream->sndvar->cwnd = cur_stream->sndvar->mss;
+}
+/*----------------------------------------------------------------------------*/
+static void
+DCTCPCwndEvent(tcp_stream *cur_stream, uint32_t cur_ts, int event)
+{
+	if (event == CC_EVENT_RECOVERY_EXIT)
+		cur_stream->sndvar->cwnd = cur_stream->sndvar->ssthresh;
+}
+/*----------------------------------------------------------------------------*/
+const struct tcp_cc_ops dctcp_cc_ops = {
+	.name = "dctcp",
+	.flags = TCP_CC_FLAG_ECN,
+	.init = DCTCPInit,
+	.on_ack = DCTCPOnAck,
+	.on_loss = DCTCPOnLoss,
+	.on_rto = DCTCPOnRTO,
+	.cwnd_event = DCTCPCwndEvent,
+};
+/*----------------------------------------------------------------------------*/
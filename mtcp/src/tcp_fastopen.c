@@ -0,0 +1,269 @@
+#include <string.h>
+
+#include "tcp_fastopen.h"
+#include "tcp_in.h"
+#include "tcp_out.h"
+#include "tcp_util.h"
+#include "tcp_send_buffer.h"
+#include "fhash.h"
+#include "debug.h"
+
+#define MIN(a, b) ((a)<(b)?(a):(b))
+
+/*
+ * Server cookies are a SipHash-2-4 MAC of the client and the server
+ * addresses. The key of a listener is derived from a per-process secret
+ * and the port, so that all the cores listening on a port hand out and
+ * accept the same cookies whichever core RSS steers a SYN to.
+ *
+ * Clients keep the cookies in a direct-mapped per-core cache indexed by
+ * the server address; a collision just costs a cookie request.
+ */
+#define TFO_CACHE_SIZE		1024		/* power of two */
+
+struct tfo_cache_entry
+{
+	uint32_t daddr;
+	uint8_t cookie_len;
+	uint8_t cookie[TCP_FASTOPEN_COOKIE_MAX];
+};
+
+struct tfo_cache
+{
+	struct tfo_cache_entry entry[TFO_CACHE_SIZE];
+};
+
+static uint64_t tfo_secret[2];
+/*----------------------------------------------------------------------------*/
+void
+InitFastOpen(void)
+{
+	if (!GenerateSecretKey(tfo_secret)) {
+		TRACE_ERROR("Failed to read /dev/urandom, "
+				"fast open cookies are predictable.\n");
+	}
+}
+/*----------------------------------------------------------------------------*/
+void
+InitTFOListenerKey(struct tcp_listener *listener)
+{
+	uint64_t m = listener->socket->saddr.sin_port;
+
+	listener->tfo_key[0] = SipHash24(tfo_secret, &m, 1);
+	m |= 1ULL << 32;
+	listener->tfo_key[1] = SipHash24(tfo_secret, &m, 1);
+}
+/*----------------------------------------------------------------------------*/
+static inline void
+GenerateCookie(struct tcp_listener *listener,
+		uint32_t client, uint32_t server, uint8_t *cookie)
+{
+	uint64_t m = ((uint64_t)client << 32) | server;
+	uint64_t mac = SipHash24(listener->tfo_key, &m, 1);
+
+	memcpy(cookie, &mac, TCP_FASTOPEN_COOKIE_LEN);
+}
+/*----------------------------------------------------------------------------*/
+struct tfo_cache *
+CreateTFOCache(void)
+{
+	return (struct tfo_cache *)calloc(1, sizeof(struct tfo_cache));
+}
+/*----------------------------------------------------------------------------*/
+void
+DestroyTFOCache(struct tfo_cache *cache)
+{
+	free(cache);
+}
+/*----------------------------------------------------------------------------*/
+static inline struct tfo_cache_entry *
+TFOCacheEntry(struct tfo_cache *cache, uint32_t daddr)
+{
+	return &cache->entry[(daddr * 2654435761U) >> 22 & (TFO_CACHE_SIZE - 1)];
+}
+/*----------------------------------------------------------------------------*/
+/*
+ * Takes the cookie of the peer's SYN or SYN/ACK. Malformed ones are
+ * taken as a cookie request.
+ */
+void
+ParseTFOOption(tcp_stream *cur_stream, uint8_t *cookie, int len)
+{
+	struct tcp_send_vars *sndvar = cur_stream->sndvar;
+
+	if (len < 4 || len > TCP_FASTOPEN_COOKIE_MAX || len % 2)
+		len = 0;
+
+	cur_stream->tfo |= TFO_SEEN;
+	sndvar->tfo_cookie_len = len;
+	memcpy(sndvar->tfo_cookie, cookie, len);
+}
+/*----------------------------------------------------------------------------*/
+/* space for the option on a SYN or SYN/ACK, padded to 4 bytes with NOPs */
+uint16_t
+TFOOptionLength(tcp_stream *cur_stream, uint8_t flags)
+{
+	if (!(flags & TCP_FLAG_SYN))
+		return 0;
+	if (!(cur_stream->tfo &
+			((flags & TCP_FLAG_ACK) ? TFO_SEND_COOKIE : TFO_REQUESTED)))
+		return 0;
+
+	return (TCP_OPT_FASTOPEN_LEN + cur_stream->sndvar->tfo_cookie_len + 3) & ~3;
+}
+/*----------------------------------------------------------------------------*/
+int
+GenerateTFOOption(tcp_stream *cur_stream, uint8_t flags, uint8_t *tcpopt)
+{
+	struct tcp_send_vars *sndvar = cur_stream->sndvar;
+	int optlen = TFOOptionLength(cur_stream, flags);
+	int i = 0;
+
+	if (optlen == 0)
+		return 0;
+
+	while (i < optlen - TCP_OPT_FASTOPEN_LEN - sndvar->tfo_cookie_len)
+		tcpopt[i++] = TCP_OPT_NOP;
+	tcpopt[i++] = TCP_OPT_FASTOPEN;
+	tcpopt[i++] = TCP_OPT_FASTOPEN_LEN + sndvar->tfo_cookie_len;
+	memcpy(tcpopt + i, sndvar->tfo_cookie, sndvar->tfo_cookie_len);
+
+	return optlen;
+}
+/*----------------------------------------------------------------------------*/
+/*
+ * Checks the cookie of a SYN to a listener. Returns TRUE if the data on
+ * the SYN can be accepted, FALSE to fall back to the regular handshake.
+ * A cookie request or a stale cookie gets a fresh one on the SYN/ACK.
+ */
+int
+TFOAcceptSYN(mtcp_manager_t mtcp, struct tcp_listener *listener,
+		tcp_stream *cur_stream, int payloadlen)
+{
+	struct tcp_send_vars *sndvar = cur_stream->sndvar;
+	uint8_t cookie[TCP_FASTOPEN_COOKIE_LEN];
+
+	if (!(cur_stream->tfo & TFO_SEEN) ||
+			!(CONFIG.tcp_fastopen & TCP_FASTOPEN_SERVER) ||
+			!listener->socket || listener->socket->tfo_qlen <= 0) {
+		sndvar->tfo_cookie_len = 0;
+		return FALSE;
+	}
+
+	GenerateCookie(listener, cur_stream->daddr, cur_stream->saddr, cookie);
+	if (sndvar->tfo_cookie_len != TCP_FASTOPEN_COOKIE_LEN ||
+			memcmp(sndvar->tfo_cookie, cookie, TCP_FASTOPEN_COOKIE_LEN)) {
+		memcpy(sndvar->tfo_cookie, cookie, TCP_FASTOPEN_COOKIE_LEN);
+		sndvar->tfo_cookie_len = TCP_FASTOPEN_COOKIE_LEN;
+		cur_stream->tfo |= TFO_SEND_COOKIE;
+		return FALSE;
+	}
+	sndvar->tfo_cookie_len = 0;
+
+	if (payloadlen <= 0 || listener->tfo_pending >= listener->socket->tfo_qlen) {
+		TRACE_DBG("Stream %d: fast open without data or over the limit.\n",
+				cur_stream->id);
+		return FALSE;
+	}
+
+	listener->tfo_pending++;
+	cur_stream->tfo |= TFO_ACCEPTED;
+
+	return TRUE;
+}
+/*----------------------------------------------------------------------------*/
+/* the handshake of an accepted fast open is over, or it is gone */
+void
+TFOReleasePending(mtcp_manager_t mtcp, tcp_stream *cur_stream)
+{
+	struct tcp_listener *listener;
+
+	if (!(cur_stream->tfo & TFO_ACCEPTED))
+		return;
+	cur_stream->tfo &= ~TFO_ACCEPTED;
+
+	listener = (struct tcp_listener *)ListenerHTSearch(mtcp->listeners,
+			&cur_stream->sport);
+	if (listener && listener->tfo_pending > 0)
+		listener->tfo_pending--;
+}
+/*----------------------------------------------------------------------------*/
+/*
+ * Sends the SYN of an active open. A fast open one carries the cached
+ * cookie and as much of the written data as fits, or asks for a cookie.
+ * Retransmitted SYNs go without data in case the path drops it.
+ */
+int
+TFOSendSYN(mtcp_manager_t mtcp, tcp_stream *cur_stream, uint32_t cur_ts)
+{
+	struct tcp_send_vars *sndvar = cur_stream->sndvar;
+	struct tfo_cache_entry *entry;
+	int len, ret;
+
+	if (!(cur_stream->tfo & TFO_REQUESTED))
+		return SendTCPPacket(mtcp, cur_stream, cur_ts, TCP_FLAG_SYN, NULL, 0);
+
+	if (sndvar->nrtx == 0) {
+		entry = TFOCacheEntry(mtcp->tfo_cache, cur_stream->daddr);
+		if (entry->daddr == cur_stream->daddr) {
+			sndvar->tfo_cookie_len = entry->cookie_len;
+			memcpy(sndvar->tfo_cookie, entry->cookie, entry->cookie_len);
+		} else {
+			sndvar->tfo_cookie_len = 0;
+		}
+	}
+
+	if (sndvar->tfo_cookie_len == 0 || sndvar->nrtx > 0 ||
+			!sndvar->sndbuf || sndvar->sndbuf->len == 0) {
+		return SendTCPPacket(mtcp, cur_stream, cur_ts, TCP_FLAG_SYN, NULL, 0);
+	}
+
+	SBUF_LOCK(&sndvar->write_lock);
+	len = MIN(sndvar->sndbuf->len, sndvar->mss -
+			CalculateOptionLength(TCP_FLAG_SYN, 0) -
+			TFOOptionLength(cur_stream, TCP_FLAG_SYN));
+	ret = SendTCPPacket(mtcp, cur_stream, cur_ts,
+			TCP_FLAG_SYN, sndvar->sndbuf->head, len);
+	SBUF_UNLOCK(&sndvar->write_lock);
+
+	return ret;
+}
+/*----------------------------------------------------------------------------*/
+/*
+ * SYN/ACK to a fast open SYN: caches the cookie handed out, drops the
+ * data the server took from the send buffer and sends the rest.
+ */
+void
+TFOHandleSYNACK(mtcp_manager_t mtcp, tcp_stream *cur_stream, uint32_t ack_seq)
+{
+	struct tcp_send_vars *sndvar = cur_stream->sndvar;
+	struct tfo_cache_entry *entry;
+
+	if (!(cur_stream->tfo & TFO_REQUESTED))
+		return;
+
+	/* a server that took our cookie does not send it back */
+	if ((cur_stream->tfo & TFO_SEEN) && sndvar->tfo_cookie_len > 0) {
+		entry = TFOCacheEntry(mtcp->tfo_cache, cur_stream->daddr);
+		entry->daddr = cur_stream->daddr;
+		entry->cookie_len = sndvar->tfo_cookie_len;
+		memcpy(entry->cookie, sndvar->tfo_cookie, sndvar->tfo_cookie_len);
+	}
+
+	if (!sndvar->sndbuf)
+		return;
+
+	if (TCP_SEQ_GT(ack_seq, sndvar->snd_una)) {
+		TRACE_DBG("Stream %d: %u bytes of fast open data acked.\n",
+				cur_stream->id, ack_seq - sndvar->snd_una);
+		SBUF_LOCK(&sndvar->write_lock);
+		SBRemove(mtcp->rbm_snd, sndvar->sndbuf, ack_seq - sndvar->snd_una);
+		sndvar->snd_una = ack_seq;
+		sndvar->snd_wnd = sndvar->sndbuf->size - sndvar->sndbuf->len;
+		SBUF_UNLOCK(&sndvar->write_lock);
+	}
+
+	if (sndvar->sndbuf->len > 0)
+		AddtoSendList(mtcp, cur_stream);
+}
+/*----------------------------------------------------------------------------*/
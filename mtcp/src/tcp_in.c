@@ -10,6 +10,12 @@
 #include "debug.h"
 #include "timer.h"
 #include "ip_in.h"
+#include "tcp_cc.h"
+#include "tcp_rack.h"
+#include "tcp_fastopen.h"
+#include "tcp_syncookie.h"
+#include "tcp_minisock.h"
+#include "tcp_timewait.h"
 #include "clock.h"
 #if USE_CCP
 #include "ccp.h"
@@ -47,7 +53,7 @@ FilterSYNPacket(mtcp_manager_t mtcp, uint32_t ip, uint16_t port)
 			int i;
 
 			for (i = 0; i < CONFIG.eths_num; i++) {
-				if (ip == CONFIG.eths[i].ip_addr) {
+				if (IsPortAddress(i, ip)) {
 					return TRUE;
 				}
 			}
@@ -63,6 +69,7 @@ HandlePassiveOpen(mtcp_manager_t mtcp, uint32_t cur_ts, const struct iphdr *iph,
 		const struct tcphdr *tcph, uint32_t seq, uint16_t window)
 {
 	tcp_stream *cur_stream = NULL;
+	struct tcp_listener *listener;
 
 	/* create new stream and add to flow hash table */
 	cur_stream = CreateTCPStream(mtcp, NULL, MTCP_SOCK_STREAM, 
@@ -75,9 +82,22 @@ HandlePassiveOpen(mtcp_manager_t mtcp, uint32_t cur_ts, const struct iphdr *iph,
 	cur_stream->sndvar->peer_wnd = window;
 	cur_stream->rcv_nxt = cur_stream->rcvvar->irs;
 	cur_stream->sndvar->cwnd = 1;
+	cur_stream->half_open = TRUE;
+	mtcp->half_open_cnt++;
 	ParseTCPOptions(cur_stream, cur_ts, (uint8_t *)tcph + TCP_HEADER_LEN, 
 			(tcph->doff << 2) - TCP_HEADER_LEN);
 
+	/* inherit the congestion control of the listening socket */
+	listener = (struct tcp_listener *)ListenerHTSearch(mtcp->listeners, &tcph->dest);
+	if (listener && listener->socket && listener->socket->cc)
+		cur_stream->sndvar->cc = listener->socket->cc;
+
+	/* ECN-setup SYN (RFC 3168 6.1.1) */
+	if (tcph->ece && tcph->cwr && (CONFIG.tcp_ecn != TCP_ECN_OFF || 
+				(cur_stream->sndvar->cc->flags & TCP_CC_FLAG_ECN))) {
+		cur_stream->ecn_ok = TRUE;
+	}
+
 	return cur_stream;
 }
 /*----------------------------------------------------------------------------*/
@@ -93,9 +113,14 @@ HandleActiveOpen(mtcp_manager_t mtcp, tcp_stream *cur_stream, uint32_t cur_ts,
 	cur_stream->rcvvar->last_ack_seq = ack_seq;
 	ParseTCPOptions(cur_stream, cur_ts, (uint8_t *)tcph + TCP_HEADER_LEN, 
 			(tcph->doff << 2) - TCP_HEADER_LEN);
+	TFOHandleSYNACK(mtcp, cur_stream, ack_seq);
+	/* ECN-setup SYN-ACK */
+	if (!tcph->ece || tcph->cwr)
+		cur_stream->ecn_ok = FALSE;
 	cur_stream->sndvar->cwnd = ((cur_stream->sndvar->cwnd == 1)? 
 			(cur_stream->sndvar->mss * TCP_INIT_CWND): cur_stream->sndvar->mss);
 	cur_stream->sndvar->ssthresh = cur_stream->sndvar->mss * 10;
+	InitCongestionControl(cur_stream, cur_ts);
 	UpdateRetransmissionTimer(mtcp, cur_stream, cur_ts);
 
 	return TRUE;
@@ -214,7 +239,12 @@ ProcessRST(mtcp_manager_t mtcp, tcp_stream *cur_stream, uint32_t ack_seq)
 		if (ack_seq == cur_stream->snd_nxt) {
 			cur_stream->state = TCP_ST_CLOSED;
 			cur_stream->close_reason = TCP_RESET;
-			DestroyTCPStream(mtcp, cur_stream);
+			/* an accepted fast open may already have a socket */
+			if (cur_stream->socket) {
+				RaiseErrorEvent(mtcp, cur_stream);
+			} else {
+				DestroyTCPStream(mtcp, cur_stream);
+			}
 		}
 		return TRUE;
 	}
@@ -255,8 +285,6 @@ inline void
 EstimateRTT(mtcp_manager_t mtcp, tcp_stream *cur_stream, uint32_t mrtt)
 {
 	/* This function should be called for not retransmitted packets */
-	/* TODO: determine tcp_rto_min */
-#define TCP_RTO_MIN 0
 	long m = mrtt;
 	uint32_t tcp_rto_min = TCP_RTO_MIN;
 	struct tcp_recv_vars *rcvvar = cur_stream->rcvvar;
@@ -305,6 +333,33 @@ EstimateRTT(mtcp_manager_t mtcp, tcp_stream *cur_stream, uint32_t mrtt)
 			rcvvar->mdev_max, rcvvar->rttvar, rcvvar->rtt_seq);
 }
 
+/*----------------------------------------------------------------------------*/
+#if TCP_OPT_SACK_ENABLED
+/* starts retransmitting the holes deemed lost, see FlushTCPSendingBuffer() */
+void
+EnterSACKRecovery(mtcp_manager_t mtcp, tcp_stream *cur_stream, uint32_t cur_ts)
+{
+	struct tcp_send_vars *sndvar = cur_stream->sndvar;
+
+	sndvar->in_recovery = TRUE;
+	sndvar->recovery_point = sndvar->snd_max;
+	sndvar->high_rxt = sndvar->snd_una;
+	sndvar->cc->on_loss(cur_stream, cur_ts);
+
+	if (sndvar->nrtx < TCP_MAX_RTX) {
+		sndvar->nrtx++;
+	}
+	/* Karn's algorithm: no rtt sample across retransmissions */
+	cur_stream->rcvvar->rtt_sampling = FALSE;
+#if TCP_RACK_TLP_ENABLED
+	sndvar->rack.tlp_out = FALSE;
+	if (sndvar->rack.timer_mode == RACK_TIMER_TLP)
+		RemoveFromRACKTimer(mtcp, cur_stream);
+#endif
+
+	AddtoSendList(mtcp, cur_stream);
+}
+#endif /* TCP_OPT_SACK_ENABLED */
 /*----------------------------------------------------------------------------*/
 static inline void
 ProcessACK(mtcp_manager_t mtcp, tcp_stream *cur_stream, uint32_t cur_ts, 
@@ -316,7 +371,10 @@ ProcessACK(mtcp_manager_t mtcp, tcp_stream *cur_stream, uint32_t cur_ts,
 	uint32_t rmlen;
 	uint32_t snd_wnd_prev;
 	uint32_t right_wnd_edge;
+	uint32_t mrtt;
 	uint8_t dup;
+	uint8_t rtt_valid;
+	struct cc_ack_sample rs;
 	int ret;
 
 	cwindow = window;
@@ -370,6 +428,22 @@ ProcessACK(mtcp_manager_t mtcp, tcp_stream *cur_stream, uint32_t cur_ts,
 		}
 	}
 
+#if TCP_OPT_SACK_ENABLED
+	/* update the scoreboard before making loss recovery decisions */
+	ParseSACKOption(cur_stream, ack_seq, (uint8_t *)tcph + TCP_HEADER_LEN, 
+			(tcph->doff << 2) - TCP_HEADER_LEN);
+#endif /* TCP_OPT_SACK_ENABLED */
+#if TCP_RACK_TLP_ENABLED
+	/* time-based loss detection, no need to wait for duplicated acks */
+	if (cur_stream->sack_permit && TCP_SEQ_GEQ(ack_seq, sndvar->snd_una) &&
+			RACKOnAck(mtcp, cur_stream, cur_ts, ack_seq) &&
+			!sndvar->in_recovery) {
+		TRACE_LOSS("Stream %d: RACK detected a loss. ack_seq: %u\n",
+				cur_stream->id, ack_seq);
+		EnterSACKRecovery(mtcp, cur_stream, cur_ts);
+	}
+#endif /* TCP_RACK_TLP_ENABLED */
+
 	/* Check duplicated ack count */
 	/* Duplicated ack if 
 	   1) ack_seq is old
@@ -414,7 +488,11 @@ ProcessACK(mtcp_manager_t mtcp, tcp_stream *cur_stream, uint32_t cur_ts,
 	}
 #endif
 	/* Fast retransmission */
-	if (dup && cur_stream->rcvvar->dup_acks == 3) {
+	if (dup && cur_stream->rcvvar->dup_acks == TCP_DUPTHRESH
+#if TCP_OPT_SACK_ENABLED
+			&& !sndvar->in_recovery
+#endif
+			) {
 		TRACE_LOSS("Triple duplicated ACKs!! ack_seq: %u\n", ack_seq);
 		TRACE_CCP("tridup ack %u (%u)!\n", ack_seq - cur_stream->sndvar->iss, ack_seq);
 		if (TCP_SEQ_LT(ack_seq, cur_stream->snd_nxt)) {
@@ -438,17 +516,25 @@ ProcessACK(mtcp_manager_t mtcp, tcp_stream *cur_stream, uint32_t cur_ts,
 #if USE_CCP
 			sndvar->missing_seq = ack_seq;
 #else
+#if TCP_OPT_SACK_ENABLED
+			if (cur_stream->sack_permit) {
+				/* retransmit only the holes, see FlushTCPSendingBuffer() */
+				sndvar->in_recovery = TRUE;
+				sndvar->recovery_point = sndvar->snd_max;
+				sndvar->high_rxt = ack_seq;
+			} else
+#endif
 			cur_stream->snd_nxt = ack_seq;
 #endif
 		}
 
 		/* update congestion control variables */
-		/* ssthresh to half of min of cwnd and peer wnd */
-		sndvar->ssthresh = MIN(sndvar->cwnd, sndvar->peer_wnd) / 2;
-		if (sndvar->ssthresh < 2 * sndvar->mss) {
-			sndvar->ssthresh = 2 * sndvar->mss;
-		}
-		sndvar->cwnd = sndvar->ssthresh + 3 * sndvar->mss;
+		sndvar->cc->on_loss(cur_stream, cur_ts);
+#if TCP_OPT_SACK_ENABLED
+		/* with sack, the pipe already discounts the sacked segments */
+		if (!sndvar->in_recovery)
+#endif
+		sndvar->cwnd += 3 * sndvar->mss;
 
 		TRACE_CONG("fast retrans: cwnd = ssthresh(%u)+3*mss = %u\n",
                                 sndvar->ssthresh / sndvar->mss,
@@ -460,10 +546,16 @@ ProcessACK(mtcp_manager_t mtcp, tcp_stream *cur_stream, uint32_t cur_ts,
 		} else {
 			TRACE_DBG("Exceed MAX_RTX.\n");
 		}
+		/* Karn's algorithm: no rtt sample across retransmissions */
+		cur_stream->rcvvar->rtt_sampling = FALSE;
 
 		AddtoSendList(mtcp, cur_stream);
 
-	} else if (cur_stream->rcvvar->dup_acks > 3) {
+	} else if (cur_stream->rcvvar->dup_acks > TCP_DUPTHRESH
+#if TCP_OPT_SACK_ENABLED
+			&& !sndvar->in_recovery
+#endif
+			) {
 		/* Inflate congestion window until before overflow */
 		if ((uint32_t)(sndvar->cwnd + sndvar->mss) > sndvar->cwnd) {
 			sndvar->cwnd += sndvar->mss;
@@ -473,9 +565,11 @@ ProcessACK(mtcp_manager_t mtcp, tcp_stream *cur_stream, uint32_t cur_ts,
 	}
 
 #if TCP_OPT_SACK_ENABLED
-	ParseSACKOption(cur_stream, ack_seq, (uint8_t *)tcph + TCP_HEADER_LEN, 
-			(tcph->doff << 2) - TCP_HEADER_LEN);
-#endif /* TCP_OPT_SACK_ENABLED */
+	/* new sack or ack info may open the pipe for more retransmissions */
+	if (sndvar->in_recovery) {
+		AddtoSendList(mtcp, cur_stream);
+	}
+#endif
 
 #if RECOVERY_AFTER_LOSS
 #if USE_CCP
@@ -494,8 +588,8 @@ ProcessACK(mtcp_manager_t mtcp, tcp_stream *cur_stream, uint32_t cur_ts,
 		sndvar->rstat.ack_upd_cnt++;
 		sndvar->rstat.ack_upd_bytes += (ack_seq - cur_stream->snd_nxt);
 #endif
-		// fast retransmission exit: cwnd=ssthresh
-		cur_stream->sndvar->cwnd = cur_stream->sndvar->ssthresh;
+		// fast retransmission exit
+		CCEvent(cur_stream, cur_ts, CC_EVENT_RECOVERY_EXIT);
 
 		TRACE_LOSS("Updating snd_nxt from %u to %u\n", cur_stream->snd_nxt, ack_seq);
 #if USE_CCP
@@ -536,37 +630,38 @@ ProcessACK(mtcp_manager_t mtcp, tcp_stream *cur_stream, uint32_t cur_ts,
 		/* Routine goes here only if there is new payload (not retransmitted) */
 		
 		/* Estimate RTT and calculate rto */
+		mrtt = 0;
 		if (cur_stream->saw_timestamp) {
-			EstimateRTT(mtcp, cur_stream, 
-					cur_ts - cur_stream->rcvvar->ts_lastack_rcvd);
-			sndvar->rto = (cur_stream->rcvvar->srtt >> 3) + cur_stream->rcvvar->rttvar;
-			assert(sndvar->rto > 0);
+			mrtt = cur_ts - cur_stream->rcvvar->ts_lastack_rcvd;
+			rtt_valid = TRUE;
+		} else if (cur_stream->rcvvar->rtt_sampling && 
+				TCP_SEQ_GEQ(ack_seq, cur_stream->rcvvar->rtt_sample_seq)) {
+			/* the sampled segment is acked without being retransmitted */
+			cur_stream->rcvvar->rtt_sampling = FALSE;
+			mrtt = cur_ts - cur_stream->rcvvar->rtt_sample_ts;
+			rtt_valid = TRUE;
 		} else {
-			//TODO: Need to implement timestamp estimation without timestamp
-			TRACE_RTT("NOT IMPLEMENTED.\n");
+			rtt_valid = FALSE;
 		}
 
-		// TODO CCP should comment this out? 
-		/* Update congestion control variables */
-		if (cur_stream->state >= TCP_ST_ESTABLISHED) {
-			if (sndvar->cwnd < sndvar->ssthresh) {
-				if ((sndvar->cwnd + sndvar->mss) > sndvar->cwnd) {
-					sndvar->cwnd += (sndvar->mss * packets);
-				}
-				TRACE_CONG("slow start cwnd: %u, ssthresh: %u\n", 
-						sndvar->cwnd, sndvar->ssthresh);
-			} else {
-				uint32_t new_cwnd = sndvar->cwnd + 
-						packets * sndvar->mss * sndvar->mss / 
-						sndvar->cwnd;
-				if (new_cwnd > sndvar->cwnd) {
-					sndvar->cwnd = new_cwnd;
-				}
-				//TRACE_CONG("congestion avoidance cwnd: %u, ssthresh: %u\n", 
-				//		sndvar->cwnd, sndvar->ssthresh);
-			}
+		if (rtt_valid) {
+			EstimateRTT(mtcp, cur_stream, mrtt);
+			sndvar->rto = (cur_stream->rcvvar->srtt >> 3) + cur_stream->rcvvar->rttvar;
+			if (sndvar->rto > TCP_RTO_MAX)
+				sndvar->rto = TCP_RTO_MAX;
+			assert(sndvar->rto > 0);
 		}
 
+		rs.acked = rmlen;
+		rs.packets = packets;
+		rs.rtt = rtt_valid ? mrtt : 0;
+		rs.ece = cur_stream->ecn_ok && tcph->ece;
+#if TCP_OPT_SACK_ENABLED
+		rs.in_recovery = sndvar->in_recovery;
+#else
+		rs.in_recovery = FALSE;
+#endif
+
 		if (SBUF_LOCK(&sndvar->write_lock)) {
 			if (errno == EDEADLK)
 				perror("ProcessACK: write_lock blocked\n");
@@ -574,6 +669,20 @@ ProcessACK(mtcp_manager_t mtcp, tcp_stream *cur_stream, uint32_t cur_ts,
 		}
 		ret = SBRemove(mtcp->rbm_snd, sndvar->sndbuf, rmlen);
 		sndvar->snd_una = ack_seq;
+#if TCP_OPT_SACK_ENABLED
+		RemoveAckedSACKBlocks(cur_stream, ack_seq);
+		if (sndvar->in_recovery) {
+			if (TCP_SEQ_GEQ(ack_seq, sndvar->recovery_point)) {
+				/* full ack: leave fast recovery */
+				sndvar->in_recovery = FALSE;
+				CCEvent(cur_stream, cur_ts, CC_EVENT_RECOVERY_EXIT);
+				TRACE_LOSS("Stream %d: recovery done. cwnd: %u\n", 
+						cur_stream->id, sndvar->cwnd);
+			} else if (TCP_SEQ_LT(sndvar->high_rxt, ack_seq)) {
+				sndvar->high_rxt = ack_seq;
+			}
+		}
+#endif
 		snd_wnd_prev = sndvar->snd_wnd;
 		sndvar->snd_wnd = sndvar->sndbuf->size - sndvar->sndbuf->len;
 
@@ -587,13 +696,82 @@ ProcessACK(mtcp_manager_t mtcp, tcp_stream *cur_stream, uint32_t cur_ts,
 		}
 #endif /* SELECTIVE_WRITE_EVENT_NOTIFY */
 
+		/* a small segment may have been held for this ack (Nagle) */
+		if (sndvar->sndbuf->len > cur_stream->snd_nxt - sndvar->sndbuf->head_seq)
+			AddtoSendList(mtcp, cur_stream);
+
 		SBUF_UNLOCK(&sndvar->write_lock);
 		UpdateRetransmissionTimer(mtcp, cur_stream, cur_ts);
+#if TCP_RACK_TLP_ENABLED
+		RACKScheduleTLP(mtcp, cur_stream, cur_ts);
+#endif
+
+		/* update congestion control variables */
+		if (cur_stream->state >= TCP_ST_ESTABLISHED) {
+			if (sndvar->cc_req)
+				InitCongestionControl(cur_stream, cur_ts);
+			rs.inflight = sndvar->snd_max - sndvar->snd_una;
+#if TCP_OPT_SACK_ENABLED
+			rs.inflight -= MIN(rs.inflight, cur_stream->rcvvar->sacked_bytes);
+#endif
+			sndvar->cc->on_ack(cur_stream, cur_ts, &rs);
+
+			/* ECN-Echo: reduce at most once per window (RFC 3168 6.1.2) */
+			if (rs.ece && TCP_SEQ_GEQ(ack_seq, sndvar->ecn_recover)) {
+				if (!(sndvar->cc->flags & TCP_CC_FLAG_ECN) && !rs.in_recovery) {
+					/* same reduction as a loss, without the retransmission */
+					sndvar->cc->on_loss(cur_stream, cur_ts);
+					CCEvent(cur_stream, cur_ts, CC_EVENT_RECOVERY_EXIT);
+				}
+				sndvar->ecn_recover = sndvar->snd_max;
+				sndvar->ecn_cwr = TRUE;
+				TRACE_CONG("Stream %d: ECN-Echo. cwnd: %u, ssthresh: %u\n", 
+						cur_stream->id, sndvar->cwnd, sndvar->ssthresh);
+			}
+		}
 	}
 
 	UNUSED(ret);
 }
 /*----------------------------------------------------------------------------*/
+/* ProcessECN: tracks the CE marks of the incoming data to be echoed back     */
+/*----------------------------------------------------------------------------*/
+static inline void 
+ProcessECN(mtcp_manager_t mtcp, tcp_stream *cur_stream, uint32_t cur_ts, 
+		const struct iphdr *iph, const struct tcphdr *tcph)
+{
+	struct tcp_recv_vars *rcvvar = cur_stream->rcvvar;
+	uint8_t ce = ((iph->tos & IPTOS_ECN_MASK) == IPTOS_ECN_CE);
+
+	if (cur_stream->sndvar->cc->flags & TCP_CC_FLAG_ECN) {
+		/* 
+		 * echo the CE state of every segment (RFC 8257 3.2). 
+		 * when it changes, the segments not acked yet are acked 
+		 * right away with the previous state.
+		 */
+		if (ce != rcvvar->ece_pending) {
+			if ((cur_stream->sndvar->ack_cnt > 0 || cur_stream->on_dack_timer) && 
+					SendTCPPacket(mtcp, cur_stream, cur_ts, 
+						TCP_FLAG_ACK, NULL, 0) >= 0 && 
+					cur_stream->sndvar->ack_cnt > 0) {
+				cur_stream->sndvar->ack_cnt--;
+			}
+			rcvvar->ece_pending = ce;
+		}
+	} else {
+		/* echo until the sender confirms with CWR (RFC 3168 6.1.3) */
+		if (tcph->cwr)
+			rcvvar->ece_pending = FALSE;
+		if (ce)
+			rcvvar->ece_pending = TRUE;
+	}
+
+	if (ce) {
+		TRACE_CONG("Stream %d: CE received. seq: %u\n", 
+				cur_stream->id, ntohl(tcph->seq));
+	}
+}
+/*----------------------------------------------------------------------------*/
 /* ProcessTCPPayload: merges TCP payload using receive ring buffer            */
 /* Return: TRUE (1) in normal case, FALSE (0) if immediate ACK is required    */
 /* CAUTION: should only be called at ESTABLISHED, FIN_WAIT_1, FIN_WAIT_2      */
@@ -651,11 +829,20 @@ ProcessTCPPayload(mtcp_manager_t mtcp, tcp_stream *cur_stream,
 	}
 	cur_stream->rcv_nxt = rcvvar->rcvbuf->head_seq + rcvvar->rcvbuf->merged_len;
 	rcvvar->rcv_wnd = rcvvar->rcvbuf->size - rcvvar->rcvbuf->merged_len;
+#if TCP_OPT_SACK_ENABLED
+	/* refresh the SACK blocks if there is (or was) out-of-order data */
+	if (cur_stream->sack_permit && 
+			(rcvvar->rcv_sacks > 0 || TCP_SEQ_GT(seq, prev_rcv_nxt))) {
+		UpdateSACKBlocks(cur_stream, seq);
+	}
+#endif
 
 	SBUF_UNLOCK(&rcvvar->read_lock);
 
 	if (TCP_SEQ_LEQ(cur_stream->rcv_nxt, prev_rcv_nxt)) {
 		/* There are some lost packets */
+		/* ack every segment until the hole is filled */
+		rcvvar->quickacks = TCP_MAX_QUICKACKS;
 		return FALSE;
 	}
 
@@ -673,6 +860,44 @@ ProcessTCPPayload(mtcp_manager_t mtcp, tcp_stream *cur_stream,
 	return TRUE;
 }
 /*----------------------------------------------------------------------------*/
+/* 
+ * Acks in-order data right away in quick ack mode and for every second 
+ * full-sized segment, from the delayed ack timer otherwise. Any packet 
+ * sent in between carries the ack, see SendTCPPacket().
+ */
+static inline void
+ScheduleACK(mtcp_manager_t mtcp, tcp_stream *cur_stream, 
+		uint32_t cur_ts, int payloadlen)
+{
+	struct tcp_recv_vars *rcvvar = cur_stream->rcvvar;
+
+	if (CONFIG.tcp_delayed_ack == 0) {
+		EnqueueACK(mtcp, cur_stream, cur_ts, ACK_OPT_AGGREGATE);
+		return;
+	}
+
+	/* 
+	 * segments merged by LRO are larger than mss and acked right away, 
+	 * with a single (stretch) ack for all of them
+	 */
+	if (payloadlen > rcvvar->rcv_mss && payloadlen <= cur_stream->sndvar->mss)
+		rcvvar->rcv_mss = payloadlen;
+
+	/* the sender may restart from slow start after idle */
+	if (cur_ts - rcvvar->last_data_ts > cur_stream->sndvar->rto)
+		rcvvar->quickacks = TCP_MAX_QUICKACKS;
+	rcvvar->last_data_ts = cur_ts;
+
+	rcvvar->dack_bytes += payloadlen;
+	if (rcvvar->quickacks > 0 || rcvvar->dack_bytes >= 2 * rcvvar->rcv_mss) {
+		if (rcvvar->quickacks > 0)
+			rcvvar->quickacks--;
+		EnqueueACK(mtcp, cur_stream, cur_ts, ACK_OPT_AGGREGATE);
+	} else {
+		AddtoDelayedACKTimer(mtcp, cur_stream, cur_ts + CONFIG.tcp_delayed_ack);
+	}
+}
+/*----------------------------------------------------------------------------*/
 static inline tcp_stream *
 CreateNewFlowHTEntry(mtcp_manager_t mtcp, uint32_t cur_ts, const struct iphdr *iph, 
 		int ip_len, const struct tcphdr* tcph, uint32_t seq, uint32_t ack_seq,
@@ -697,6 +922,16 @@ CreateNewFlowHTEntry(mtcp_manager_t mtcp, uint32_t cur_ts, const struct iphdr *i
 			return NULL;
 		}
 
+		/* a minisock holds it until the handshake completes */
+		if (MinisockSYN(mtcp, cur_ts, iph, tcph, seq))
+			return NULL;
+
+		/* too many half-open: answer statelessly */
+		if (SYNCookieNeeded(mtcp)) {
+			SendSYNCookie(mtcp, cur_ts, iph, tcph, seq);
+			return NULL;
+		}
+
 		/* now accept the connection */
 		cur_stream = HandlePassiveOpen(mtcp, 
 				cur_ts, iph, tcph, seq, window);
@@ -705,6 +940,10 @@ CreateNewFlowHTEntry(mtcp_manager_t mtcp, uint32_t cur_ts, const struct iphdr *i
 #ifdef DBGMSG
 			DumpIPPacket(mtcp, iph, ip_len);
 #endif
+			if (CONFIG.tcp_syncookies != TCP_SYNCOOKIES_OFF) {
+				SendSYNCookie(mtcp, cur_ts, iph, tcph, seq);
+				return NULL;
+			}
 			SendTCPPacketStandalone(mtcp, 
 					iph->daddr, tcph->dest, iph->saddr, tcph->source, 
 					0, seq + payloadlen + 1, 0, TCP_FLAG_RST | TCP_FLAG_ACK, 
@@ -719,8 +958,17 @@ CreateNewFlowHTEntry(mtcp_manager_t mtcp, uint32_t cur_ts, const struct iphdr *i
 #ifdef DBGMSG
 		DumpIPPacket(mtcp, iph, ip_len);
 #endif
-		/* for the reset packet, just discard */
+		/* for the reset packet, just discard (with its minisock, if any) */
+		MinisockRST(mtcp, iph, tcph, seq);
 		return NULL;
+	} else if (tcph->ack && !tcph->syn && 
+			FilterSYNPacket(mtcp, iph->daddr, tcph->dest) && 
+			(MinisockACK(mtcp, cur_ts, iph, tcph, seq, ack_seq, &cur_stream) || 
+			 (cur_stream = CreateStreamFromCookie(mtcp, cur_ts, 
+					iph, tcph, seq, ack_seq)))) {
+		/* the final ACK of a handshake held in a minisock, 
+		   or answered with a SYN cookie */
+		return cur_stream;
 	} else {
 		TRACE_DBG("Weird packet comes.\n");
 #ifdef DBGMSG
@@ -746,16 +994,63 @@ CreateNewFlowHTEntry(mtcp_manager_t mtcp, uint32_t cur_ts, const struct iphdr *i
 	}
 }
 /*----------------------------------------------------------------------------*/
+/* 
+ * Fast open: takes the data on a SYN with a valid cookie and queues the 
+ * stream to the listener without waiting for the rest of the handshake. 
+ */
+static inline void
+AcceptFastOpen(mtcp_manager_t mtcp, uint32_t cur_ts, tcp_stream *cur_stream, 
+		struct tcphdr *tcph, uint32_t seq, uint8_t *payload, int payloadlen)
+{
+	struct tcp_send_vars *sndvar = cur_stream->sndvar;
+	struct tcp_listener *listener;
+
+	listener = (struct tcp_listener *)ListenerHTSearch(mtcp->listeners, &tcph->dest);
+	if (!listener || !TFOAcceptSYN(mtcp, listener, cur_stream, payloadlen))
+		return;
+
+	/* the data follows the SYN */
+	if (ProcessTCPPayload(mtcp, cur_stream, 
+				cur_ts, payload, seq + 1, payloadlen) == ERROR) {
+		return;
+	}
+
+	if (StreamEnqueue(listener->acceptq, cur_stream) < 0) {
+		TRACE_ERROR("Stream %d: Failed to enqueue to "
+				"the listen backlog!\n", cur_stream->id);
+		cur_stream->close_reason = TCP_NOT_ACCEPTED;
+		cur_stream->state = TCP_ST_CLOSED;
+		TRACE_STATE("Stream %d: TCP_ST_CLOSED\n", cur_stream->id);
+		return;
+	}
+
+	/* the application may send before the handshake completes */
+	sndvar->cwnd = sndvar->mss * TCP_INIT_CWND;
+	sndvar->ssthresh = sndvar->mss * 10;
+	InitCongestionControl(cur_stream, cur_ts);
+
+	if (listener->socket && (listener->socket->epoll & MTCP_EPOLLIN)) {
+		AddEpollEvent(listener->socket->reg_ep, 
+				MTCP_EVENT_QUEUE, listener->socket, MTCP_EPOLLIN);
+	}
+}
+/*----------------------------------------------------------------------------*/
 static inline void 
 Handle_TCP_ST_LISTEN (mtcp_manager_t mtcp, uint32_t cur_ts, 
-		tcp_stream* cur_stream, struct tcphdr* tcph) {
+		tcp_stream* cur_stream, struct tcphdr* tcph, uint32_t seq, 
+		uint8_t *payload, int payloadlen) {
 	
 	if (tcph->syn) {
-		if (cur_stream->state == TCP_ST_LISTEN)
+		int first_syn = (cur_stream->state == TCP_ST_LISTEN);
+
+		if (first_syn)
 			cur_stream->rcv_nxt++;
 		cur_stream->state = TCP_ST_SYN_RCVD;
 		TRACE_STATE("Stream %d: TCP_ST_SYN_RCVD\n", cur_stream->id);
 		AddtoControlList(mtcp, cur_stream, cur_ts);
+		if (first_syn)
+			AcceptFastOpen(mtcp, cur_ts, cur_stream, 
+					tcph, seq, payload, payloadlen);
 	} else {
 		CTRACE_ERROR("Stream %d (TCP_ST_LISTEN): "
 				"Packet without SYN.\n", cur_stream->id);
@@ -772,7 +1067,7 @@ Handle_TCP_ST_SYN_SENT (mtcp_manager_t mtcp, uint32_t cur_ts,
 	if (tcph->ack) {
 		/* filter the unacceptable acks */
 		if (TCP_SEQ_LEQ(ack_seq, cur_stream->sndvar->iss) || 
-				TCP_SEQ_GT(ack_seq, cur_stream->snd_nxt)) {
+				TCP_SEQ_GT(ack_seq, cur_stream->sndvar->snd_max)) {
 			if (!tcph->rst) {
 				SendTCPPacketStandalone(mtcp, 
 						iph->daddr, tcph->dest, iph->saddr, tcph->source, 
@@ -809,6 +1104,7 @@ Handle_TCP_ST_SYN_SENT (mtcp_manager_t mtcp, uint32_t cur_ts,
 			cur_stream->rcv_nxt = cur_stream->rcvvar->irs + 1;
 			RemoveFromRTOList(mtcp, cur_stream);
 			cur_stream->state = TCP_ST_ESTABLISHED;
+			cur_stream->sndvar->pace_ts = cur_ts;
 			TRACE_STATE("Stream %d: TCP_ST_ESTABLISHED\n", cur_stream->id);
 
 			if (cur_stream->socket) {
@@ -828,6 +1124,9 @@ Handle_TCP_ST_SYN_SENT (mtcp_manager_t mtcp, uint32_t cur_ts,
 				AddtoTimeoutList(mtcp, cur_stream);
 
 		} else {
+			/* simultaneous open */
+			if (!tcph->ece || !tcph->cwr)
+				cur_stream->ecn_ok = FALSE;
 			cur_stream->state = TCP_ST_SYN_RCVD;
 			TRACE_STATE("Stream %d: TCP_ST_SYN_RCVD\n", cur_stream->id);
 			cur_stream->snd_nxt = cur_stream->sndvar->iss;
@@ -845,8 +1144,8 @@ Handle_TCP_ST_SYN_RCVD (mtcp_manager_t mtcp, uint32_t cur_ts,
 	if (tcph->ack) {
 		struct tcp_listener *listener;
 		uint32_t prior_cwnd;
-		/* check if ACK of SYN */
-		if (ack_seq != sndvar->iss + 1) {
+		/* check if ACK of SYN (or of the data sent after it on a fast open) */
+		if (!TCP_SEQ_BETWEEN(ack_seq, sndvar->iss + 1, sndvar->snd_max)) {
 			CTRACE_ERROR("Stream %d (TCP_ST_SYN_RCVD): "
 					"weird ack_seq: %u, iss: %u\n", 
 					cur_stream->id, ack_seq, sndvar->iss);
@@ -857,20 +1156,49 @@ Handle_TCP_ST_SYN_RCVD (mtcp_manager_t mtcp, uint32_t cur_ts,
 		}
 
 		sndvar->snd_una++;
-		cur_stream->snd_nxt = ack_seq;
+		if (TCP_SEQ_LT(cur_stream->snd_nxt, ack_seq))
+			cur_stream->snd_nxt = ack_seq;
+		if (TFO_EARLY_CHILD(cur_stream)) {
+			/* already accepted and running, see AcceptFastOpen() */
+			sndvar->nrtx = 0;
+			if (TCP_SEQ_GEQ(ack_seq, sndvar->snd_max))
+				RemoveFromRTOList(mtcp, cur_stream);
+			TFOReleasePending(mtcp, cur_stream);
+			ReleaseHalfOpen(mtcp, cur_stream);
+			cur_stream->state = TCP_ST_ESTABLISHED;
+			cur_stream->sndvar->pace_ts = cur_ts;
+			TRACE_STATE("Stream %d: TCP_ST_ESTABLISHED\n", cur_stream->id);
+			if (CONFIG.tcp_timeout > 0)
+				AddtoTimeoutList(mtcp, cur_stream);
+
+			/* closed by the application before the handshake completed */
+			if (cur_stream->closed && !sndvar->on_closeq) {
+				SQ_LOCK(&mtcp->ctx->close_lock);
+				sndvar->on_closeq = TRUE;
+				StreamEnqueue(mtcp->closeq, cur_stream);
+				SQ_UNLOCK(&mtcp->ctx->close_lock);
+			}
+			return;
+		}
+
 		prior_cwnd = sndvar->cwnd;
 		sndvar->cwnd = ((prior_cwnd == 1)? 
 				(sndvar->mss * TCP_INIT_CWND): sndvar->mss);
+		sndvar->ssthresh = sndvar->mss * 10;
 		TRACE_DBG("sync_recvd: updating cwnd from %u to %u\n", prior_cwnd, sndvar->cwnd);
 		
 		//UpdateRetransmissionTimer(mtcp, cur_stream, cur_ts);
 		sndvar->nrtx = 0;
 		cur_stream->rcv_nxt = cur_stream->rcvvar->irs + 1;
 		RemoveFromRTOList(mtcp, cur_stream);
+		ReleaseHalfOpen(mtcp, cur_stream);
 
 		cur_stream->state = TCP_ST_ESTABLISHED;
+		cur_stream->sndvar->pace_ts = cur_ts;
 		TRACE_STATE("Stream %d: TCP_ST_ESTABLISHED\n", cur_stream->id);
 
+		InitCongestionControl(cur_stream, cur_ts);
+
 		/* update listening socket */
 		listener = (struct tcp_listener *)ListenerHTSearch(mtcp->listeners, &tcph->dest);
 
@@ -889,7 +1217,7 @@ Handle_TCP_ST_SYN_RCVD (mtcp_manager_t mtcp, uint32_t cur_ts,
 
 		/* raise an event to the listening socket */
 		if (listener->socket && (listener->socket->epoll & MTCP_EPOLLIN)) {
-			AddEpollEvent(mtcp->ep, 
+			AddEpollEvent(listener->socket->reg_ep, 
 					MTCP_EVENT_QUEUE, listener->socket, MTCP_EPOLLIN);
 		}
 
@@ -921,7 +1249,7 @@ Handle_TCP_ST_ESTABLISHED (mtcp_manager_t mtcp, uint32_t cur_ts,
 		if (ProcessTCPPayload(mtcp, cur_stream, 
 				cur_ts, payload, seq, payloadlen)) {
 			/* if return is TRUE, send ACK */
-			EnqueueACK(mtcp, cur_stream, cur_ts, ACK_OPT_AGGREGATE);
+			ScheduleACK(mtcp, cur_stream, cur_ts, payloadlen);
 		} else {
 			EnqueueACK(mtcp, cur_stream, cur_ts, ACK_OPT_NOW);
 		}
@@ -1076,7 +1404,7 @@ Handle_TCP_ST_FIN_WAIT_1 (mtcp_manager_t mtcp, uint32_t cur_ts,
 		if (ProcessTCPPayload(mtcp, cur_stream, 
 				cur_ts, payload, seq, payloadlen)) {
 			/* if return is TRUE, send ACK */
-			EnqueueACK(mtcp, cur_stream, cur_ts, ACK_OPT_AGGREGATE);
+			ScheduleACK(mtcp, cur_stream, cur_ts, payloadlen);
 		} else {
 			EnqueueACK(mtcp, cur_stream, cur_ts, ACK_OPT_NOW);
 		}
@@ -1122,7 +1450,7 @@ Handle_TCP_ST_FIN_WAIT_2 (mtcp_manager_t mtcp, uint32_t cur_ts,
 		if (ProcessTCPPayload(mtcp, cur_stream, 
 				cur_ts, payload, seq, payloadlen)) {
 			/* if return is TRUE, send ACK */
-			EnqueueACK(mtcp, cur_stream, cur_ts, ACK_OPT_AGGREGATE);
+			ScheduleACK(mtcp, cur_stream, cur_ts, payloadlen);
 		} else {
 			EnqueueACK(mtcp, cur_stream, cur_ts, ACK_OPT_NOW);
 		}
@@ -1251,6 +1579,8 @@ ProcessTCPPacket(mtcp_manager_t mtcp,
 
 	if (!(cur_stream = StreamHTSearch(mtcp->tcp_flow_table, &s_stream))) {
 		/* not found in flow table */
+		if (TimewaitSegment(mtcp, cur_ts, iph, tcph, seq, payloadlen))
+			return TRUE;
 		cur_stream = CreateNewFlowHTEntry(mtcp, cur_ts, iph, ip_len, tcph, 
 				seq, ack_seq, payloadlen, window);
 		if (!cur_stream)
@@ -1295,9 +1625,15 @@ ProcessTCPPacket(mtcp_manager_t mtcp,
 		}
 	}
 
+	if (cur_stream->ecn_ok && payloadlen > 0 && 
+			cur_stream->state >= TCP_ST_SYN_RCVD) {
+		ProcessECN(mtcp, cur_stream, cur_ts, iph, tcph);
+	}
+
 	switch (cur_stream->state) {
 	case TCP_ST_LISTEN:
-		Handle_TCP_ST_LISTEN(mtcp, cur_ts, cur_stream, tcph);
+		Handle_TCP_ST_LISTEN(mtcp, cur_ts, cur_stream, tcph, 
+				seq, payload, payloadlen);
 		break;
 
 	case TCP_ST_SYN_SENT:
@@ -1308,10 +1644,14 @@ ProcessTCPPacket(mtcp_manager_t mtcp,
 	case TCP_ST_SYN_RCVD:
 		/* SYN retransmit implies our SYN/ACK was lost. Resend */
 		if (tcph->syn && seq == cur_stream->rcvvar->irs)
-			Handle_TCP_ST_LISTEN(mtcp, cur_ts, cur_stream, tcph);
+			Handle_TCP_ST_LISTEN(mtcp, cur_ts, cur_stream, tcph, 
+					seq, payload, payloadlen);
 		else {
 			Handle_TCP_ST_SYN_RCVD(mtcp, cur_ts, cur_stream, tcph, ack_seq);
-			if (payloadlen > 0 && cur_stream->state == TCP_ST_ESTABLISHED) {
+			/* data, or an ack of the data sent on a fast open */
+			if ((payloadlen > 0 || 
+					TCP_SEQ_GT(ack_seq, cur_stream->sndvar->iss + 1)) && 
+					cur_stream->state == TCP_ST_ESTABLISHED) {
 				Handle_TCP_ST_ESTABLISHED(mtcp, cur_ts, cur_stream, tcph,
 							  seq, ack_seq, payload,
 							  payloadlen, window);
@@ -1353,7 +1693,6 @@ ProcessTCPPacket(mtcp_manager_t mtcp,
 		/* the only thing that can arrive in this state is a retransmission 
 		   of the remote FIN. Acknowledge it, and restart the 2 MSL timeout */
 		if (cur_stream->on_timewait_list) {
-			RemoveFromTimewaitList(mtcp, cur_stream);
 			AddtoTimewaitList(mtcp, cur_stream, cur_ts);
 		}
 		AddtoControlList(mtcp, cur_stream, cur_ts);
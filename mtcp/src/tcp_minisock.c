@@ -0,0 +1,498 @@
+#include <string.h>
+
+#include "tcp_minisock.h"
+#include "tcp_syncookie.h"
+#include "tcp_in.h"
+#include "tcp_out.h"
+#include "tcp_util.h"
+#include "tcp_cc.h"
+#include "ip_out.h"
+#include "fhash.h"
+#include "debug.h"
+
+#define MIN(a, b) ((a)<(b)?(a):(b))
+
+TAILQ_HEAD(minisock_head, tcp_minisock);
+
+struct minisock_table
+{
+	struct tcp_minisock *pool;
+	struct tcp_minisock *free_list;		/* linked by hash_next */
+	struct tcp_minisock **bucket;
+	uint32_t mask;
+	int cnt;
+
+	/* SYN/ACKs all start with the same rto, so appending keeps this
+	   nearly sorted by expire; retransmissions are inserted in order */
+	struct minisock_head timer_list;
+};
+/*----------------------------------------------------------------------------*/
+struct minisock_table *
+CreateMinisockTable(int size)
+{
+	struct minisock_table *table;
+	uint32_t nbuckets = 1;
+	int i;
+
+	table = (struct minisock_table *)calloc(1, sizeof(struct minisock_table));
+	if (!table)
+		return NULL;
+
+	while (nbuckets < (uint32_t)size)
+		nbuckets <<= 1;
+	table->mask = nbuckets - 1;
+
+	table->pool = (struct tcp_minisock *)calloc(size, sizeof(struct tcp_minisock));
+	table->bucket = (struct tcp_minisock **)
+			calloc(nbuckets, sizeof(struct tcp_minisock *));
+	if (!table->pool || !table->bucket) {
+		DestroyMinisockTable(table);
+		return NULL;
+	}
+
+	for (i = size - 1; i >= 0; i--) {
+		table->pool[i].hash_next = table->free_list;
+		table->free_list = &table->pool[i];
+	}
+	TAILQ_INIT(&table->timer_list);
+
+	return table;
+}
+/*----------------------------------------------------------------------------*/
+void
+DestroyMinisockTable(struct minisock_table *table)
+{
+	if (!table)
+		return;
+	free(table->bucket);
+	free(table->pool);
+	free(table);
+}
+/*----------------------------------------------------------------------------*/
+static inline struct tcp_minisock **
+MinisockBucket(struct minisock_table *table, uint32_t saddr, uint16_t sport,
+		uint32_t daddr, uint16_t dport)
+{
+	uint32_t hash = (saddr ^ daddr ^ ((uint32_t)sport << 16 | dport)) * 2654435761U;
+
+	return &table->bucket[(hash >> 16) & table->mask];
+}
+/*----------------------------------------------------------------------------*/
+/* finds the minisock of a segment, keyed the same way as the flow table */
+static inline struct tcp_minisock *
+MinisockSearch(struct minisock_table *table,
+		const struct iphdr *iph, const struct tcphdr *tcph)
+{
+	struct tcp_minisock *msk;
+
+	msk = *MinisockBucket(table, iph->daddr, tcph->dest, iph->saddr, tcph->source);
+	for (; msk; msk = msk->hash_next) {
+		if (msk->saddr == iph->daddr && msk->sport == tcph->dest &&
+				msk->daddr == iph->saddr && msk->dport == tcph->source)
+			return msk;
+	}
+	return NULL;
+}
+/*----------------------------------------------------------------------------*/
+static inline void
+InsertMinisockTimer(struct minisock_table *table, struct tcp_minisock *msk)
+{
+	struct tcp_minisock *prev;
+
+	TAILQ_FOREACH_REVERSE(prev, &table->timer_list, minisock_head, timer_link) {
+		if (TCP_SEQ_LEQ(prev->expire, msk->expire))
+			break;
+	}
+	if (prev)
+		TAILQ_INSERT_AFTER(&table->timer_list, prev, msk, timer_link);
+	else
+		TAILQ_INSERT_HEAD(&table->timer_list, msk, timer_link);
+}
+/*----------------------------------------------------------------------------*/
+static void
+FreeMinisock(mtcp_manager_t mtcp, struct tcp_minisock *msk)
+{
+	struct minisock_table *table = mtcp->minisocks;
+	struct tcp_minisock **pp;
+
+	pp = MinisockBucket(table, msk->saddr, msk->sport, msk->daddr, msk->dport);
+	while (*pp != msk)
+		pp = &(*pp)->hash_next;
+	*pp = msk->hash_next;
+	TAILQ_REMOVE(&table->timer_list, msk, timer_link);
+
+	msk->hash_next = table->free_list;
+	table->free_list = msk;
+	table->cnt--;
+	mtcp->half_open_cnt--;
+}
+/*----------------------------------------------------------------------------*/
+void
+ParseSYNOptions(mtcp_manager_t mtcp, const struct tcphdr *tcph,
+		struct tcp_syn_options *syn)
+{
+	struct tcp_listener *listener;
+	const struct tcp_cc_ops *cc;
+	uint8_t *tcpopt = (uint8_t *)tcph + TCP_HEADER_LEN;
+	int len = (tcph->doff << 2) - TCP_HEADER_LEN;
+	unsigned int opt, optlen;
+	int i;
+
+	syn->mss = 536;		/* RFC 1122 default */
+	syn->opts = SYN_OPT_WSCALE;
+	syn->fastopen = FALSE;
+	syn->ts_val = 0;
+
+	for (i = 0; i < len; ) {
+		opt = tcpopt[i++];
+		if (opt == TCP_OPT_END) {
+			break;
+		} else if (opt == TCP_OPT_NOP) {
+			continue;
+		}
+
+		if (i >= len)
+			break;
+		optlen = tcpopt[i++];
+		if (optlen < 2 || i + optlen - 2 > len)
+			break;
+
+		if (opt == TCP_OPT_MSS && optlen == TCP_OPT_MSS_LEN) {
+			syn->mss = (tcpopt[i] << 8) | tcpopt[i + 1];
+		} else if (opt == TCP_OPT_WSCALE && optlen == TCP_OPT_WSCALE_LEN) {
+			syn->opts = (syn->opts & ~SYN_OPT_WSCALE) | MIN(tcpopt[i], 14);
+#if TCP_OPT_SACK_ENABLED
+		} else if (opt == TCP_OPT_SACK_PERMIT) {
+			syn->opts |= SYN_OPT_SACK;
+#endif
+#if TCP_OPT_TIMESTAMP_ENABLED
+		} else if (opt == TCP_OPT_TIMESTAMP &&
+				optlen == TCP_OPT_TIMESTAMP_LEN) {
+			syn->opts |= SYN_OPT_TIMESTAMP;
+			syn->ts_val = ntohl(*(uint32_t *)(tcpopt + i));
+#endif
+		} else if (opt == TCP_OPT_FASTOPEN) {
+			syn->fastopen = TRUE;
+		}
+		i += optlen - 2;
+	}
+
+	/* ECN-setup SYN (RFC 3168 6.1.1), as in HandlePassiveOpen() */
+	listener = (struct tcp_listener *)ListenerHTSearch(mtcp->listeners, &tcph->dest);
+	cc = (listener && listener->socket && listener->socket->cc) ?
+			listener->socket->cc : GetDefaultCongestionControl();
+	if (tcph->ece && tcph->cwr &&
+			(CONFIG.tcp_ecn != TCP_ECN_OFF || (cc->flags & TCP_CC_FLAG_ECN))) {
+		syn->opts |= SYN_OPT_ECN;
+	}
+}
+/*----------------------------------------------------------------------------*/
+/*
+ * Sends a SYN/ACK on behalf of a stream that does not exist yet, with the
+ * options of GenerateTCPOptions() that opts says the peer offered.
+ */
+int
+SendSYNACKStandalone(mtcp_manager_t mtcp, uint32_t cur_ts,
+		uint32_t saddr, uint16_t sport, uint32_t daddr, uint16_t dport,
+		uint32_t iss, uint32_t ack_seq, uint8_t opts,
+		uint32_t ts_val, uint32_t ts_ecr)
+{
+	struct tcphdr *tcph;
+	uint8_t *tcpopt;
+	uint32_t *ts;
+	uint16_t optlen = TCP_OPT_MSS_LEN;
+	int rc = -1;
+
+	if (opts & SYN_OPT_TIMESTAMP)
+		optlen += TCP_OPT_TIMESTAMP_LEN + 2;
+	else if (opts & SYN_OPT_SACK)
+		optlen += TCP_OPT_SACK_PERMIT_LEN + 2;
+	if ((opts & SYN_OPT_WSCALE) != SYN_OPT_WSCALE)
+		optlen += TCP_OPT_WSCALE_LEN + 1;
+
+	tcph = (struct tcphdr *)IPOutputStandalone(mtcp, IPPROTO_TCP, 0,
+			saddr, daddr, TCP_HEADER_LEN + optlen);
+	if (tcph == NULL) {
+		return ERROR;
+	}
+	memset(tcph, 0, TCP_HEADER_LEN);
+
+	tcph->source = sport;
+	tcph->dest = dport;
+	tcph->seq = htonl(iss);
+	tcph->ack_seq = htonl(ack_seq);
+	tcph->syn = TRUE;
+	tcph->ack = TRUE;
+	tcph->ece = !!(opts & SYN_OPT_ECN);
+	tcph->window = htons(TCP_INITIAL_WINDOW);
+	tcph->doff = (TCP_HEADER_LEN + optlen) >> 2;
+
+	tcpopt = (uint8_t *)tcph + TCP_HEADER_LEN;
+	tcpopt[0] = TCP_OPT_MSS;
+	tcpopt[1] = TCP_OPT_MSS_LEN;
+	tcpopt[2] = TCP_DEFAULT_MSS >> 8;
+	tcpopt[3] = TCP_DEFAULT_MSS % 256;
+	tcpopt += TCP_OPT_MSS_LEN;
+
+	/* SACK permit, or the padding in its place */
+	if (opts & SYN_OPT_SACK) {
+		if (!(opts & SYN_OPT_TIMESTAMP)) {
+			*tcpopt++ = TCP_OPT_NOP;
+			*tcpopt++ = TCP_OPT_NOP;
+		}
+		*tcpopt++ = TCP_OPT_SACK_PERMIT;
+		*tcpopt++ = TCP_OPT_SACK_PERMIT_LEN;
+	} else if (opts & SYN_OPT_TIMESTAMP) {
+		*tcpopt++ = TCP_OPT_NOP;
+		*tcpopt++ = TCP_OPT_NOP;
+	}
+
+	if (opts & SYN_OPT_TIMESTAMP) {
+		ts = (uint32_t *)(tcpopt + 2);
+		tcpopt[0] = TCP_OPT_TIMESTAMP;
+		tcpopt[1] = TCP_OPT_TIMESTAMP_LEN;
+		ts[0] = htonl(ts_val);
+		ts[1] = htonl(ts_ecr);
+		tcpopt += TCP_OPT_TIMESTAMP_LEN;
+	}
+
+	if ((opts & SYN_OPT_WSCALE) != SYN_OPT_WSCALE) {
+		*tcpopt++ = TCP_OPT_NOP;
+		*tcpopt++ = TCP_OPT_WSCALE;
+		*tcpopt++ = TCP_OPT_WSCALE_LEN;
+		*tcpopt++ = TCP_DEFAULT_WSCALE;
+	}
+
+#ifndef DISABLE_HWCSUM
+	uint8_t is_external;
+	if (mtcp->iom->dev_ioctl != NULL)
+		rc = mtcp->iom->dev_ioctl(mtcp->ctx,
+				GetOutputInterface(daddr, &is_external),
+				PKT_TX_TCPIP_CSUM, NULL);
+	UNUSED(is_external);
+#endif
+	if (rc == -1)
+		tcph->check = TCPCalcChecksum((uint16_t *)tcph,
+				TCP_HEADER_LEN + optlen, saddr, daddr);
+
+	return 0;
+}
+/*----------------------------------------------------------------------------*/
+/*
+ * Creates the stream of a passive open whose SYN/ACK went out without
+ * one, in TCP_ST_SYN_RCVD as if it had sent the SYN/ACK itself. The
+ * caller then completes the handshake with Handle_TCP_ST_SYN_RCVD().
+ */
+tcp_stream *
+CreateStreamFromSYN(mtcp_manager_t mtcp, uint32_t cur_ts,
+		uint32_t saddr, uint16_t sport, uint32_t daddr, uint16_t dport,
+		uint32_t iss, uint32_t irs, uint16_t mss, uint8_t opts,
+		uint32_t ts_recent)
+{
+	tcp_stream *cur_stream;
+	struct tcp_send_vars *sndvar;
+	struct tcp_listener *listener;
+
+	cur_stream = CreateTCPStream(mtcp, NULL, MTCP_SOCK_STREAM,
+			saddr, sport, daddr, dport);
+	if (!cur_stream) {
+		TRACE_ERROR("INFO: Could not allocate tcp_stream!\n");
+		return NULL;
+	}
+	sndvar = cur_stream->sndvar;
+
+	sndvar->iss = iss;
+	sndvar->snd_una = iss;
+	sndvar->snd_max = iss + 1;
+	sndvar->ecn_recover = iss;
+#if TCP_RACK_TLP_ENABLED
+	sndvar->rack.lost_seq = iss;
+#endif
+	cur_stream->snd_nxt = iss + 1;
+	cur_stream->rcvvar->irs = irs;
+	cur_stream->rcv_nxt = irs + 1;
+	sndvar->cwnd = 1;
+
+	sndvar->mss = MIN(mss, TCP_DEFAULT_MSS);
+	sndvar->eff_mss = sndvar->mss;
+	if (opts & SYN_OPT_TIMESTAMP) {
+		cur_stream->saw_timestamp = TRUE;
+		cur_stream->rcvvar->ts_recent = ts_recent;
+		cur_stream->rcvvar->ts_last_ts_upd = cur_ts;
+		sndvar->eff_mss -= (TCP_OPT_TIMESTAMP_LEN + 2);
+	}
+	if ((opts & SYN_OPT_WSCALE) != SYN_OPT_WSCALE)
+		sndvar->wscale_peer = opts & SYN_OPT_WSCALE;
+	else
+		sndvar->wscale_mine = 0;
+	cur_stream->sack_permit = !!(opts & SYN_OPT_SACK);
+	cur_stream->ecn_ok = !!(opts & SYN_OPT_ECN);
+
+	/* inherit the congestion control of the listening socket */
+	listener = (struct tcp_listener *)ListenerHTSearch(mtcp->listeners, &sport);
+	if (listener && listener->socket && listener->socket->cc)
+		sndvar->cc = listener->socket->cc;
+
+	cur_stream->state = TCP_ST_SYN_RCVD;
+	TRACE_STATE("Stream %d: TCP_ST_SYN_RCVD\n", cur_stream->id);
+
+	return cur_stream;
+}
+/*----------------------------------------------------------------------------*/
+/*
+ * Takes a SYN to a listener into a minisock and answers it. Returns FALSE
+ * if the SYN needs a stream or a SYN cookie instead.
+ */
+int
+MinisockSYN(mtcp_manager_t mtcp, uint32_t cur_ts,
+		const struct iphdr *iph, const struct tcphdr *tcph, uint32_t seq)
+{
+	struct minisock_table *table = mtcp->minisocks;
+	struct tcp_syn_options syn;
+	struct tcp_minisock *msk, **bucket;
+
+	msk = MinisockSearch(table, iph, tcph);
+	if (msk && msk->irs == seq) {
+		/* our SYN/ACK was lost */
+		SendSYNACKStandalone(mtcp, cur_ts, msk->saddr, msk->sport,
+				msk->daddr, msk->dport, msk->iss, msk->irs + 1,
+				msk->opts, cur_ts, msk->ts_recent);
+		return TRUE;
+	}
+
+	ParseSYNOptions(mtcp, tcph, &syn);
+	/* fast open takes the data on the SYN into a stream */
+	if (syn.fastopen && (CONFIG.tcp_fastopen & TCP_FASTOPEN_SERVER)) {
+		if (msk)
+			FreeMinisock(mtcp, msk);
+		return FALSE;
+	}
+
+	if (!msk) {
+		if (!table->free_list || SYNCookieNeeded(mtcp))
+			return FALSE;
+
+		msk = table->free_list;
+		table->free_list = msk->hash_next;
+		table->cnt++;
+		mtcp->half_open_cnt++;
+
+		msk->saddr = iph->daddr;
+		msk->sport = tcph->dest;
+		msk->daddr = iph->saddr;
+		msk->dport = tcph->source;
+		bucket = MinisockBucket(table, msk->saddr, msk->sport,
+				msk->daddr, msk->dport);
+		msk->hash_next = *bucket;
+		*bucket = msk;
+	} else {
+		/* a new SYN from the same peer replaces the old one */
+		TAILQ_REMOVE(&table->timer_list, msk, timer_link);
+	}
+
+	msk->irs = seq;
+	msk->iss = GenerateISS();
+	msk->ts_recent = syn.ts_val;
+	msk->mss = syn.mss;
+	msk->opts = syn.opts;
+	msk->nrtx = 0;
+	msk->expire = cur_ts + TCP_INITIAL_RTO;
+	InsertMinisockTimer(table, msk);
+
+	SendSYNACKStandalone(mtcp, cur_ts, msk->saddr, msk->sport,
+			msk->daddr, msk->dport, msk->iss, msk->irs + 1,
+			msk->opts, cur_ts, msk->ts_recent);
+
+	return TRUE;
+}
+/*----------------------------------------------------------------------------*/
+/*
+ * Completes the handshake of a minisock on the ACK of its SYN/ACK,
+ * creating the stream. Returns FALSE if the segment is not for a
+ * minisock; TRUE with a NULL stream if it is, but no stream could be
+ * made (the peer retries on the SYN/ACK retransmission).
+ */
+int
+MinisockACK(mtcp_manager_t mtcp, uint32_t cur_ts,
+		const struct iphdr *iph, const struct tcphdr *tcph,
+		uint32_t seq, uint32_t ack_seq, tcp_stream **cur_stream)
+{
+	struct tcp_minisock *msk;
+	struct tcp_timestamp ts;
+
+	*cur_stream = NULL;
+	if (mtcp->minisocks->cnt == 0)
+		return FALSE;
+
+	msk = MinisockSearch(mtcp->minisocks, iph, tcph);
+	if (!msk || ack_seq != msk->iss + 1)
+		return FALSE;
+
+	if ((msk->opts & SYN_OPT_TIMESTAMP) &&
+			ParseTCPTimestamp(NULL, &ts, (uint8_t *)tcph + TCP_HEADER_LEN,
+					(tcph->doff << 2) - TCP_HEADER_LEN)) {
+		msk->ts_recent = ts.ts_val;
+	}
+
+	*cur_stream = CreateStreamFromSYN(mtcp, cur_ts, msk->saddr, msk->sport,
+			msk->daddr, msk->dport, msk->iss, msk->irs, msk->mss,
+			msk->opts, msk->ts_recent);
+	if (*cur_stream)
+		FreeMinisock(mtcp, msk);
+
+	return TRUE;
+}
+/*----------------------------------------------------------------------------*/
+void
+MinisockRST(mtcp_manager_t mtcp,
+		const struct iphdr *iph, const struct tcphdr *tcph, uint32_t seq)
+{
+	struct tcp_minisock *msk;
+
+	if (mtcp->minisocks->cnt == 0)
+		return;
+
+	msk = MinisockSearch(mtcp->minisocks, iph, tcph);
+	if (msk && seq == msk->irs + 1) {
+		TRACE_DBG("Half-open connection reset by peer.\n");
+		FreeMinisock(mtcp, msk);
+	}
+}
+/*----------------------------------------------------------------------------*/
+/* retransmits the SYN/ACKs that timed out, and drops the ones given up on */
+void
+CheckMinisockTimers(mtcp_manager_t mtcp, uint32_t cur_ts)
+{
+	struct minisock_table *table = mtcp->minisocks;
+	struct tcp_minisock *msk;
+
+	while ((msk = TAILQ_FIRST(&table->timer_list)) &&
+			TCP_SEQ_LEQ(msk->expire, cur_ts)) {
+		if (++msk->nrtx > TCP_MAX_SYN_RETRY) {
+			FreeMinisock(mtcp, msk);
+			continue;
+		}
+
+		TAILQ_REMOVE(&table->timer_list, msk, timer_link);
+		msk->expire = cur_ts + MIN(TCP_INITIAL_RTO << msk->nrtx, TCP_RTO_MAX);
+		InsertMinisockTimer(table, msk);
+
+		SendSYNACKStandalone(mtcp, cur_ts, msk->saddr, msk->sport,
+				msk->daddr, msk->dport, msk->iss, msk->irs + 1,
+				msk->opts, cur_ts, msk->ts_recent);
+	}
+}
+/*----------------------------------------------------------------------------*/
+/* ticks from cur_ts until the next SYN/ACK retransmission, at most limit */
+uint32_t
+MinisockIdleTicks(mtcp_manager_t mtcp, uint32_t cur_ts, uint32_t limit)
+{
+	struct tcp_minisock *msk = TAILQ_FIRST(&mtcp->minisocks->timer_list);
+
+	if (!msk)
+		return limit;
+	if (TCP_SEQ_LEQ(msk->expire, cur_ts))
+		return 0;
+	return MIN(msk->expire - cur_ts, limit);
+}
+/*----------------------------------------------------------------------------*/
@@ -5,6 +5,9 @@
 #include "ip_out.h"
 #include "tcp_in.h"
 #include "tcp_stream.h"
+#include "tcp_cc.h"
+#include "tcp_rack.h"
+#include "tcp_fastopen.h"
 #include "eventpoll.h"
 #include "timer.h"
 #include "debug.h"
@@ -17,10 +20,11 @@
 #define TRY_SEND_BEFORE_QUEUE		FALSE
 
 #define TCP_MAX_WINDOW 65535
+#define TCP_MAX_OPTLEN 40
 
 /*----------------------------------------------------------------------------*/
-static inline uint16_t
-CalculateOptionLength(uint8_t flags)
+inline uint16_t
+CalculateOptionLength(uint8_t flags, int nsacks)
 {
 	uint16_t optlen = 0;
 
@@ -50,7 +54,8 @@ CalculateOptionLength(uint8_t flags)
 
 #if TCP_OPT_SACK_ENABLED
 		if (flags & TCP_FLAG_SACK) {
-			optlen += TCP_OPT_SACK_LEN + 2;
+			/* 2 NOPs, kind, length and the blocks */
+			optlen += 4 + nsacks * TCP_OPT_SACK_BLOCK_LEN;
 		}
 #endif
 	}
@@ -73,7 +78,7 @@ GenerateTCPTimestamp(tcp_stream *cur_stream, uint8_t *tcpopt, uint32_t cur_ts)
 /*----------------------------------------------------------------------------*/
 static inline void
 GenerateTCPOptions(tcp_stream *cur_stream, uint32_t cur_ts, 
-		uint8_t flags, uint8_t *tcpopt, uint16_t optlen)
+		uint8_t flags, uint8_t *tcpopt, uint16_t optlen, int nsacks)
 {
 	int i = 0;
 
@@ -114,6 +119,9 @@ GenerateTCPOptions(tcp_stream *cur_stream, uint32_t cur_ts,
 		tcpopt[i++] = TCP_OPT_WSCALE_LEN;
 		tcpopt[i++] = cur_stream->sndvar->wscale_mine;
 
+		/* Fast open cookie or cookie request */
+		i += GenerateTFOOption(cur_stream, flags, tcpopt + i);
+
 	} else {
 
 #if TCP_OPT_TIMESTAMP_ENABLED
@@ -124,8 +132,8 @@ GenerateTCPOptions(tcp_stream *cur_stream, uint32_t cur_ts,
 #endif
 
 #if TCP_OPT_SACK_ENABLED
-		if (flags & TCP_OPT_SACK) {
-			// i += GenerateSACKOption(cur_stream, tcpopt + i);
+		if (flags & TCP_FLAG_SACK) {
+			i += GenerateSACKOption(cur_stream, tcpopt + i, nsacks);
 		}
 #endif
 	}
@@ -146,7 +154,7 @@ SendTCPPacketStandalone(struct mtcp_manager *mtcp,
 	uint16_t optlen;
 	int rc = -1;
 
-	optlen = CalculateOptionLength(flags);
+	optlen = CalculateOptionLength(flags, 0);
 	if (payloadlen + optlen > TCP_DEFAULT_MSS) {
 		TRACE_ERROR("Payload size exceeds MSS.\n");
 		assert(0);
@@ -228,16 +236,42 @@ SendTCPPacket(struct mtcp_manager *mtcp, tcp_stream *cur_stream,
 	uint16_t optlen;
 	uint8_t wscale = 0;
 	uint32_t window32 = 0;
+	int nsacks = 0;
+	uint8_t tos = 0;
 	int rc = -1;
 
-	optlen = CalculateOptionLength(flags);
+	optlen = CalculateOptionLength(flags, 0);
+	if (flags & TCP_FLAG_SYN)
+		optlen += TFOOptionLength(cur_stream, flags);
 	if (payloadlen + optlen > cur_stream->sndvar->mss) {
 		TRACE_ERROR("Payload size exceeds MSS\n");
 		return ERROR;
 	}
 
+#if TCP_OPT_SACK_ENABLED
+	/* advertise as many SACK blocks as fit in the remaining space */
+	if (cur_stream->rcvvar->rcv_sacks > 0 && 
+			(flags & TCP_FLAG_ACK) && !(flags & TCP_FLAG_SYN)) {
+		int room = MIN(TCP_MAX_OPTLEN - optlen, 
+				cur_stream->sndvar->mss - payloadlen - optlen) - 4;
+
+		if (room >= TCP_OPT_SACK_BLOCK_LEN) {
+			nsacks = MIN(cur_stream->rcvvar->rcv_sacks, 
+					room / TCP_OPT_SACK_BLOCK_LEN);
+			flags |= TCP_FLAG_SACK;
+			optlen = CalculateOptionLength(flags, nsacks);
+		}
+	}
+#endif
+
+	/* only new data is sent ECN-capable (RFC 3168 6.1.5) */
+	if (cur_stream->ecn_ok && payloadlen > 0 && 
+			TCP_SEQ_GEQ(cur_stream->snd_nxt, cur_stream->sndvar->snd_max)) {
+		tos = IPTOS_ECN_ECT0;
+	}
+
 	tcph = (struct tcphdr *)IPOutput(mtcp, cur_stream, 
-			TCP_HEADER_LEN + optlen + payloadlen);
+			TCP_HEADER_LEN + optlen + payloadlen, tos);
 	if (tcph == NULL) {
 		return -2;
 	}
@@ -291,10 +325,34 @@ SendTCPPacket(struct mtcp_manager *mtcp, tcp_stream *cur_stream,
 		tcph->ack = TRUE;
 		tcph->ack_seq = htonl(cur_stream->rcv_nxt);
 		cur_stream->sndvar->ts_lastack_sent = cur_ts;
+		/* carries the delayed ack, if any */
+		cur_stream->rcvvar->dack_bytes = 0;
+		RemoveFromDelayedACKTimer(mtcp, cur_stream);
 		cur_stream->last_active_ts = cur_ts;
 		UpdateTimeoutList(mtcp, cur_stream);
 	}
 
+	if (flags & TCP_FLAG_SYN) {
+		if (!(flags & TCP_FLAG_ACK)) {
+			/* ECN-setup SYN, not repeated on retransmission in case 
+			   the path drops them (RFC 3168 6.1.1.1) */
+			cur_stream->ecn_ok = (cur_stream->sndvar->nrtx == 0 && 
+					(CONFIG.tcp_ecn == TCP_ECN_ON || 
+					 (cur_stream->sndvar->cc->flags & TCP_CC_FLAG_ECN)));
+			tcph->ece = tcph->cwr = cur_stream->ecn_ok;
+		} else if (cur_stream->ecn_ok) {
+			/* ECN-setup SYN-ACK */
+			tcph->ece = TRUE;
+		}
+	} else if (cur_stream->ecn_ok) {
+		if ((flags & TCP_FLAG_ACK) && cur_stream->rcvvar->ece_pending)
+			tcph->ece = TRUE;
+		if (tos == IPTOS_ECN_ECT0 && cur_stream->sndvar->ecn_cwr) {
+			tcph->cwr = TRUE;
+			cur_stream->sndvar->ecn_cwr = FALSE;
+		}
+	}
+
 	if (flags & TCP_FLAG_SYN) {
 		wscale = 0;
 	} else {
@@ -309,7 +367,7 @@ SendTCPPacket(struct mtcp_manager *mtcp, tcp_stream *cur_stream,
 	}
 
 	GenerateTCPOptions(cur_stream, cur_ts, flags, 
-			(uint8_t *)tcph + TCP_HEADER_LEN, optlen);
+			(uint8_t *)tcph + TCP_HEADER_LEN, optlen, nsacks);
 	
 	tcph->doff = (TCP_HEADER_LEN + optlen) >> 2;
 	// copy payload if exist
@@ -332,6 +390,24 @@ SendTCPPacket(struct mtcp_manager *mtcp, tcp_stream *cur_stream,
 					      cur_stream->saddr, cur_stream->daddr);
 #endif
 	
+	/* 
+	 * Without timestamps, time one new data segment per RTT. 
+	 * Retransmitted data is never sampled (Karn's algorithm).
+	 */
+	if (payloadlen > 0 && !cur_stream->saw_timestamp && 
+			!cur_stream->rcvvar->rtt_sampling && 
+			TCP_SEQ_GEQ(cur_stream->snd_nxt, cur_stream->sndvar->snd_max)) {
+		cur_stream->rcvvar->rtt_sampling = TRUE;
+		cur_stream->rcvvar->rtt_sample_seq = cur_stream->snd_nxt + payloadlen;
+		cur_stream->rcvvar->rtt_sample_ts = cur_ts;
+	}
+
+#if TCP_RACK_TLP_ENABLED
+	if (payloadlen > 0 && cur_stream->sack_permit) {
+		RACKOnTransmit(cur_stream, cur_ts, cur_stream->snd_nxt, payloadlen);
+	}
+#endif
+
 	cur_stream->snd_nxt += payloadlen;
 
 	if (tcph->syn || tcph->fin) {
@@ -339,6 +415,10 @@ SendTCPPacket(struct mtcp_manager *mtcp, tcp_stream *cur_stream,
 		payloadlen++;
 	}
 
+	if (TCP_SEQ_GT(cur_stream->snd_nxt, cur_stream->sndvar->snd_max)) {
+		cur_stream->sndvar->snd_max = cur_stream->snd_nxt;
+	}
+
 	if (payloadlen > 0) {
 		if (cur_stream->state > TCP_ST_ESTABLISHED) {
 			TRACE_FIN("Payload after ESTABLISHED: length: %d, snd_nxt: %u\n", 
@@ -351,17 +431,100 @@ SendTCPPacket(struct mtcp_manager *mtcp, tcp_stream *cur_stream,
 				"cur_ts: %u, rto: %u, ts_rto: %u\n", 
 				cur_ts, cur_stream->sndvar->rto, cur_stream->sndvar->ts_rto);
 		AddtoRTOList(mtcp, cur_stream);
+#if TCP_RACK_TLP_ENABLED
+		RACKScheduleTLP(mtcp, cur_stream, cur_ts);
+#endif
 	}
 		
 	return payloadlen;
 }
 /*----------------------------------------------------------------------------*/
+#if TCP_OPT_SACK_ENABLED
+/* 
+ * Retransmits the lost holes in the SACK scoreboard while the pipe 
+ * allows (RFC 6675 NextSeg() rule 1). Returns the number of packets sent, 
+ * or -1 if the tx buffer is full.
+ */
+static inline int
+RetransmitLostSegments(mtcp_manager_t mtcp, tcp_stream *cur_stream, uint32_t cur_ts)
+{
+	struct tcp_send_vars *sndvar = cur_stream->sndvar;
+	const uint32_t maxlen = sndvar->mss - CalculateOptionLength(TCP_FLAG_ACK, 0);
+	uint32_t snd_nxt = cur_stream->snd_nxt;
+	uint32_t seq, len;
+	int packets = 0;
+	int ret;
+
+	while (GetSACKPipe(cur_stream) + maxlen <= sndvar->cwnd) {
+		if (!GetNextLostSeq(cur_stream, sndvar->high_rxt, &seq, &len))
+			break;
+		len = MIN(len, maxlen);
+
+		/* SendTCPPacket() sends from snd_nxt */
+		cur_stream->snd_nxt = seq;
+		ret = SendTCPPacket(mtcp, cur_stream, cur_ts, TCP_FLAG_ACK, 
+				sndvar->sndbuf->head + (seq - sndvar->sndbuf->head_seq), len);
+		cur_stream->snd_nxt = snd_nxt;
+		if (ret < 0)
+			return -1;
+
+		TRACE_LOSS("Stream %d: retransmit hole. seq: %u, len: %u\n", 
+				cur_stream->id, seq - sndvar->iss, len);
+		sndvar->high_rxt = seq + len;
+		packets++;
+	}
+
+	return packets;
+}
+#endif /* TCP_OPT_SACK_ENABLED */
+/*----------------------------------------------------------------------------*/
+/* 
+ * Whether to hold back the sub-mss tail of the new data: while corked 
+ * (TCP_CORK or MSG_MORE) and, once the application clears TCP_NODELAY 
+ * (set by default), while some sent data is not acked yet (Nagle, 
+ * RFC 896). Nothing is held after close.
+ */
+static inline int
+HoldSmallSegment(tcp_stream *cur_stream)
+{
+	uint32_t opts = cur_stream->socket ? cur_stream->socket->opts : MTCP_NODELAY;
+
+	if (cur_stream->closed)
+		return FALSE;
+	if ((opts & MTCP_CORK) || cur_stream->sndvar->msg_more)
+		return TRUE;
+	return !(opts & MTCP_NODELAY) && 
+			cur_stream->snd_nxt != cur_stream->sndvar->snd_una;
+}
+/*----------------------------------------------------------------------------*/
+/* bytes per second to pace the stream at, 0 if not paced */
+static inline uint64_t
+GetPacingRate(tcp_stream *cur_stream)
+{
+	struct tcp_send_vars *sndvar = cur_stream->sndvar;
+	uint64_t rate;
+
+	if (CONFIG.tcp_pacing == TCP_PACING_OFF || !sndvar->cc)
+		return 0;
+
+	rate = CCPacingRate(cur_stream);
+	if (rate > 0 || CONFIG.tcp_pacing == TCP_PACING_CC || 
+			cur_stream->rcvvar->srtt == 0)
+		return rate;
+
+	/* cwnd per srtt (kept << 3), doubled in slow start and 1.2x after */
+	rate = (uint64_t)sndvar->cwnd * HZ * 8 / cur_stream->rcvvar->srtt;
+	if (sndvar->cwnd < sndvar->ssthresh)
+		return rate * 2;
+	return rate * 12 / 10;
+}
+/*----------------------------------------------------------------------------*/
 static int
 FlushTCPSendingBuffer(mtcp_manager_t mtcp, tcp_stream *cur_stream, uint32_t cur_ts)
 {
 #if 0
 	struct tcp_send_vars *sndvar = cur_stream->sndvar;
-	const uint32_t maxlen = sndvar->mss - CalculateOptionLength(TCP_FLAG_ACK);
+	const uint32_t maxlen = sndvar->mss - CalculateOptionLength(TCP_FLAG_ACK, 0);
 	uint8_t *data;
 	uint32_t buffered_len;
 	uint32_t seq;
@@ -468,6 +631,7 @@ FlushTCPSendingBuffer(mtcp_manager_t mtcp, tcp_stream *cur_stream, uint32_t cur_
 	int sndlen;
 	int packets = 0;
 	uint8_t wack_sent = 0;
+	uint64_t rate;
 	
 	if (!sndvar->sndbuf) {
 		TRACE_ERROR("Stream %d: No send buffer available.\n", cur_stream->id);
@@ -482,6 +646,22 @@ FlushTCPSendingBuffer(mtcp_manager_t mtcp, tcp_stream *cur_stream, uint32_t cur_
 		goto out;
 	}
 	
+#if TCP_OPT_SACK_ENABLED
+	if (sndvar->in_recovery) {
+		packets = RetransmitLostSegments(mtcp, cur_stream, cur_ts);
+		if (packets < 0) {
+			packets = -3;
+			goto out;
+		}
+	}
+#endif
+
+	/* restarting after an idle period */
+	if (sndvar->snd_una == sndvar->snd_max && sndvar->cc)
+		CCEvent(cur_stream, cur_ts, CC_EVENT_TX_START);
+
+	rate = GetPacingRate(cur_stream);
+
 	while (1) {
 #if USE_CCP
 		if (sndvar->missing_seq) {
@@ -531,15 +711,29 @@ FlushTCPSendingBuffer(mtcp_manager_t mtcp, tcp_stream *cur_stream, uint32_t cur_
 			break;
 
 #if TCP_OPT_SACK_ENABLED
+		/* skip the block already received by the peer */
 		if (SeqIsSacked(cur_stream, seq)) {
 			TRACE_DBG("!! SKIPPING %u\n", seq - sndvar->iss);
-			cur_stream->snd_nxt += len;
+			cur_stream->snd_nxt = GetSACKedRightEdge(cur_stream, seq);
 			continue;
 		}
 #endif
 
+		/* the ack of the sent data brings it back, see ProcessACK() */
+		if (TCP_SEQ_GEQ(seq, sndvar->snd_max) && 
+				len < sndvar->mss - CalculateOptionLength(TCP_FLAG_ACK, 0) && 
+				HoldSmallSegment(cur_stream))
+			break;
+
 		remaining_window = MIN(sndvar->cwnd, sndvar->peer_wnd)
 			               - (seq - sndvar->snd_una);
+#if TCP_OPT_SACK_ENABLED
+		/* in loss recovery, new data is clocked out by the pipe */
+		if (sndvar->in_recovery) {
+			remaining_window = MIN((int)(sndvar->cwnd - GetSACKPipe(cur_stream)), 
+					(int)(sndvar->peer_wnd - (seq - sndvar->snd_una)));
+		}
+#endif
 		/* if there is no space in the window */
 		if (remaining_window <= 0 ||
 		    (remaining_window < sndvar->mss && seq - sndvar->snd_una > 0)) {
@@ -562,7 +756,7 @@ FlushTCPSendingBuffer(mtcp_manager_t mtcp, tcp_stream *cur_stream, uint32_t cur_
 		/* payload size limited by remaining window space */
 		len = MIN(len, remaining_window);
 		/* payload size limited by TCP MSS */
-		pkt_len = MIN(len, sndvar->mss - CalculateOptionLength(TCP_FLAG_ACK));
+		pkt_len = MIN(len, sndvar->mss - CalculateOptionLength(TCP_FLAG_ACK, 0));
 
 #if RATE_LIMIT_ENABLED
 		// update rate
@@ -588,12 +782,31 @@ FlushTCPSendingBuffer(mtcp_manager_t mtcp, tcp_stream *cur_stream, uint32_t cur_
                     goto out;
                 }
 #endif
+		/* a departure time further ahead than one packet plus the burst
+		 * allowance is stale (e.g., after the clock wrapped while idle) */
+		if (rate > 0 && (uint32_t)(sndvar->pace_ts - cur_ts) >
+				(uint64_t)sndvar->mss * HZ / rate + TCP_PACING_BURST)
+			sndvar->pace_ts = cur_ts;
+
+		/* off the send list until the departure time of the next packet */
+		if (rate > 0 && TCP_SEQ_GT(sndvar->pace_ts, cur_ts)) {
+			AddtoPaceTimer(mtcp, cur_stream, sndvar->pace_ts);
+			goto out;
+		}
+
 		if ((sndlen = SendTCPPacket(mtcp, cur_stream, cur_ts,
 					    TCP_FLAG_ACK, data, pkt_len)) < 0) {
 			/* there is no available tx buf */
 			packets = -3;
 			goto out;
 		}
+
+		if (rate > 0) {
+			/* unused rate is kept only for a short burst */
+			if (TCP_SEQ_LT(sndvar->pace_ts, cur_ts - TCP_PACING_BURST))
+				sndvar->pace_ts = cur_ts - TCP_PACING_BURST;
+			sndvar->pace_ts += (uint64_t)sndlen * HZ / rate;
+		}
 #if USE_CCP
 		if (sndvar->missing_seq) {
 			sndvar->missing_seq = 0;
@@ -616,7 +829,7 @@ SendControlPacket(mtcp_manager_t mtcp, tcp_stream *cur_stream, uint32_t cur_ts)
 
 	if (cur_stream->state == TCP_ST_SYN_SENT) {
 		/* Send SYN here */
-		ret = SendTCPPacket(mtcp, cur_stream, cur_ts, TCP_FLAG_SYN, NULL, 0);
+		ret = TFOSendSYN(mtcp, cur_stream, cur_ts);
 
 	} else if (cur_stream->state == TCP_ST_SYN_RCVD) {
 		/* Send SYN/ACK here */
@@ -633,8 +846,10 @@ SendControlPacket(mtcp_manager_t mtcp, tcp_stream *cur_stream, uint32_t cur_ts)
 		ret = SendTCPPacket(mtcp, cur_stream, cur_ts, TCP_FLAG_ACK, NULL, 0);
 
 	} else if (cur_stream->state == TCP_ST_LAST_ACK) {
-		/* if it is on ack_list, send it after sending ack */
-		if (sndvar->on_send_list || sndvar->on_ack_list) {
+		/* if it is on ack_list or waits on the pace timer,
+		 * send it after sending the data and ack */
+		if (sndvar->on_send_list || sndvar->on_ack_list ||
+				cur_stream->on_pace_timer) {
 			ret = -1;
 		} else {
 			/* Send FIN/ACK here */
@@ -642,8 +857,10 @@ SendControlPacket(mtcp_manager_t mtcp, tcp_stream *cur_stream, uint32_t cur_ts)
 					TCP_FLAG_FIN | TCP_FLAG_ACK, NULL, 0);
 		}
 	} else if (cur_stream->state == TCP_ST_FIN_WAIT_1) {
-		/* if it is on ack_list, send it after sending ack */
-		if (sndvar->on_send_list || sndvar->on_ack_list) {
+		/* if it is on ack_list or waits on the pace timer,
+		 * send it after sending the data and ack */
+		if (sndvar->on_send_list || sndvar->on_ack_list ||
+				cur_stream->on_pace_timer) {
 			ret = -1;
 		} else {
 			/* Send FIN/ACK here */
@@ -776,7 +993,9 @@ WriteTCPDataList(mtcp_manager_t mtcp,
 
 			/* Send data here */
 			/* Only can send data when ESTABLISHED or CLOSE_WAIT */
-			if (cur_stream->state == TCP_ST_ESTABLISHED) {
+			/* (or before the handshake of an accepted fast open) */
+			if (cur_stream->state == TCP_ST_ESTABLISHED || 
+					TFO_EARLY_CHILD(cur_stream)) {
 				if (cur_stream->sndvar->on_control_list) {
 					/* delay sending data after until on_control_list becomes off */
 					//TRACE_DBG("Stream %u: delay sending data.\n", cur_stream->id);
@@ -0,0 +1,402 @@
+#include <string.h>
+
+#include "tcp_rack.h"
+#include "tcp_in.h"
+#include "tcp_out.h"
+#include "tcp_util.h"
+#include "tcp_cc.h"
+#include "timer.h"
+#include "debug.h"
+
+#if TCP_RACK_TLP_ENABLED
+
+#define MAX(a, b) ((a)>(b)?(a):(b))
+#define MIN(a, b) ((a)<(b)?(a):(b))
+
+/*
+ * The outstanding data [snd_una, snd_max) is recorded in rack->seg as at
+ * most RACK_MAX_SEGS ranges in sequence order, each with the first and
+ * the last time any of its bytes was sent. When the table is full, the
+ * two neighbours closest in time are merged. Delivered data is dated by
+ * first_ts and outstanding data by last_ts, so the coarser the table
+ * gets, the later (never the sooner) losses are detected.
+ */
+/*----------------------------------------------------------------------------*/
+static inline void
+RACKMergeSegs(struct rack_state *rack)
+{
+	struct rack_seg *a, *b;
+	uint32_t span, best_span = 0;
+	int i, best = -1;
+
+	for (i = 0; i < rack->segs - 1; i++) {
+		a = &rack->seg[i];
+		b = &rack->seg[i + 1];
+		span = (TCP_SEQ_GT(b->last_ts, a->last_ts) ? b->last_ts : a->last_ts) -
+				(TCP_SEQ_LT(b->first_ts, a->first_ts) ? b->first_ts : a->first_ts);
+		if (best < 0 || span < best_span) {
+			best = i;
+			best_span = span;
+		}
+	}
+
+	a = &rack->seg[best];
+	b = &rack->seg[best + 1];
+	a->end_seq = b->end_seq;
+	if (TCP_SEQ_LT(b->first_ts, a->first_ts))
+		a->first_ts = b->first_ts;
+	if (TCP_SEQ_GT(b->last_ts, a->last_ts))
+		a->last_ts = b->last_ts;
+	a->rxt |= b->rxt;
+
+	memmove(&rack->seg[best + 1], &rack->seg[best + 2],
+			(rack->segs - best - 2) * sizeof(struct rack_seg));
+	rack->segs--;
+}
+/*----------------------------------------------------------------------------*/
+/* splits rack->seg[i] at seq (inside it), if there is room */
+static inline int
+RACKSplitSeg(struct rack_state *rack, int i, uint32_t seq)
+{
+	if (rack->segs == RACK_MAX_SEGS)
+		return FALSE;
+
+	memmove(&rack->seg[i + 1], &rack->seg[i],
+			(rack->segs - i) * sizeof(struct rack_seg));
+	rack->seg[i].end_seq = seq;
+	rack->segs++;
+
+	return TRUE;
+}
+/*----------------------------------------------------------------------------*/
+inline void
+RACKOnTransmit(tcp_stream *cur_stream, uint32_t cur_ts,
+		uint32_t seq, uint32_t len)
+{
+	struct rack_state *rack = &cur_stream->sndvar->rack;
+	struct rack_seg *seg;
+	uint32_t end = seq + len;
+	uint32_t start;
+	int i;
+
+	if (TCP_SEQ_GEQ(seq, cur_stream->sndvar->snd_max)) {
+		/* new data: extend the last entry if sent at the same time */
+		if (rack->segs > 0) {
+			seg = &rack->seg[rack->segs - 1];
+			if (!seg->rxt && seg->last_ts == cur_ts) {
+				seg->end_seq = end;
+				return;
+			}
+		}
+		if (rack->segs == RACK_MAX_SEGS)
+			RACKMergeSegs(rack);
+		seg = &rack->seg[rack->segs++];
+		seg->end_seq = end;
+		seg->first_ts = seg->last_ts = cur_ts;
+		seg->rxt = FALSE;
+		return;
+	}
+
+	/* retransmission: restamp the entries overlapping [seq, end) */
+	start = cur_stream->sndvar->snd_una;
+	for (i = 0; i < rack->segs && TCP_SEQ_LT(start, end);
+			start = rack->seg[i++].end_seq) {
+		seg = &rack->seg[i];
+		if (TCP_SEQ_LEQ(seg->end_seq, seq))
+			continue;
+		/* the part before seq keeps its times */
+		if (TCP_SEQ_LT(start, seq) && RACKSplitSeg(rack, i, seq))
+			continue;
+		if (TCP_SEQ_GT(seg->end_seq, end))
+			RACKSplitSeg(rack, i, end);
+
+		if (TCP_SEQ_GEQ(start, seq) && TCP_SEQ_LEQ(seg->end_seq, end))
+			seg->first_ts = cur_ts;
+		seg->last_ts = cur_ts;
+		seg->rxt = TRUE;
+	}
+}
+/*----------------------------------------------------------------------------*/
+/* (part of) seg is delivered: update the most recently sent delivered data */
+static inline void
+RACKUpdate(struct rack_state *rack, const struct rack_seg *seg, uint32_t cur_ts)
+{
+	uint32_t rtt = cur_ts - seg->first_ts;
+
+	/* too soon, the ack is for an earlier transmission (RFC 8985 6.2) */
+	if (seg->rxt && rtt < rack->min_rtt)
+		return;
+
+	if (!seg->rxt && (rack->min_rtt == 0 || rtt < rack->min_rtt))
+		rack->min_rtt = rtt;
+
+	if (!rack->has_sample || TCP_SEQ_GT(seg->first_ts, rack->xmit_ts) ||
+			(seg->first_ts == rack->xmit_ts &&
+			 TCP_SEQ_GT(seg->end_seq, rack->end_seq))) {
+		rack->has_sample = TRUE;
+		rack->xmit_ts = seg->first_ts;
+		rack->end_seq = seg->end_seq;
+		rack->rtt = rtt;
+	}
+}
+/*----------------------------------------------------------------------------*/
+/*
+ * Deems lost the outstanding data sent before the most recently delivered
+ * one, once the rtt plus the reordering window has passed since it was
+ * sent (RFC 8985 6.2), and arms the reordering timer for the rest.
+ * Returns TRUE if some more data is deemed lost.
+ */
+static inline int
+RACKDetectLoss(mtcp_manager_t mtcp, tcp_stream *cur_stream,
+		uint32_t cur_ts, uint32_t una)
+{
+	struct tcp_send_vars *sndvar = cur_stream->sndvar;
+	struct rack_state *rack = &sndvar->rack;
+	struct rack_seg *seg;
+	uint32_t reo_wnd, deadline, wait = 0;
+	uint32_t start;
+	int lost = FALSE;
+	int i;
+
+	if (!rack->has_sample)
+		return FALSE;
+
+	if (TCP_SEQ_LT(rack->lost_seq, una))
+		rack->lost_seq = una;
+
+	/* a quarter of the min rtt, not adapted to D-SACKs */
+	reo_wnd = rack->min_rtt >> 2;
+
+	start = una;
+	for (i = 0; i < rack->segs; start = rack->seg[i++].end_seq) {
+		seg = &rack->seg[i];
+		if (!TCP_SEQ_LT(seg->last_ts, rack->xmit_ts))
+			continue;
+		if (TCP_SEQ_GEQ(GetSACKedRightEdge(cur_stream, start), seg->end_seq))
+			continue;
+
+		deadline = seg->last_ts + rack->rtt + reo_wnd;
+		if (TCP_SEQ_LT(cur_ts, deadline)) {
+			if (wait == 0 || deadline - cur_ts < wait)
+				wait = deadline - cur_ts;
+			continue;
+		}
+
+		if (TCP_SEQ_GT(seg->end_seq, rack->lost_seq)) {
+			rack->lost_seq = seg->end_seq;
+			lost = TRUE;
+		}
+		/* the retransmission is lost as well: send it again */
+		if (sndvar->in_recovery && TCP_SEQ_LT(start, sndvar->high_rxt)) {
+			TRACE_LOSS("Stream %d: retransmission lost. seq: %u\n",
+					cur_stream->id, start - sndvar->iss);
+			sndvar->high_rxt = start;
+			lost = TRUE;
+		}
+	}
+
+	if (wait > 0) {
+		rack->timer_mode = RACK_TIMER_REO;
+		AddtoRACKTimer(mtcp, cur_stream, cur_ts + wait);
+	} else if (rack->timer_mode == RACK_TIMER_REO) {
+		RemoveFromRACKTimer(mtcp, cur_stream);
+	}
+
+	return lost;
+}
+/*----------------------------------------------------------------------------*/
+/*
+ * Updates RACK with the data cumulatively acked up to ack_seq and the
+ * SACK scoreboard, and runs the loss detection. Called before snd_una
+ * moves. Returns TRUE if some more data is deemed lost.
+ */
+int
+RACKOnAck(mtcp_manager_t mtcp, tcp_stream *cur_stream,
+		uint32_t cur_ts, uint32_t ack_seq)
+{
+	struct tcp_send_vars *sndvar = cur_stream->sndvar;
+	struct tcp_recv_vars *rcvvar = cur_stream->rcvvar;
+	struct rack_state *rack = &sndvar->rack;
+	uint32_t una = sndvar->snd_una;
+	uint32_t start;
+	int i, j;
+
+	if (TCP_SEQ_GT(ack_seq, una)) {
+		for (i = 0; i < rack->segs &&
+				TCP_SEQ_LEQ(rack->seg[i].end_seq, ack_seq); i++) {
+			RACKUpdate(rack, &rack->seg[i], cur_ts);
+		}
+		/* partially acked */
+		start = (i == 0) ? una : rack->seg[i - 1].end_seq;
+		if (i < rack->segs && TCP_SEQ_LT(start, ack_seq))
+			RACKUpdate(rack, &rack->seg[i], cur_ts);
+
+		memmove(&rack->seg[0], &rack->seg[i],
+				(rack->segs - i) * sizeof(struct rack_seg));
+		rack->segs -= i;
+		una = ack_seq;
+
+		if (rack->tlp_out && TCP_SEQ_GEQ(ack_seq, rack->tlp_end_seq)) {
+			rack->tlp_out = FALSE;
+			/* without D-SACK, assume the probe repaired a loss (RFC 8985 7.4) */
+			if (rack->tlp_rxt && !sndvar->in_recovery) {
+				TRACE_LOSS("Stream %d: loss repaired by the probe\n",
+						cur_stream->id);
+				sndvar->cc->on_loss(cur_stream, cur_ts);
+				CCEvent(cur_stream, cur_ts, CC_EVENT_RECOVERY_EXIT);
+			}
+		}
+	}
+
+	/* entries with some sacked bytes */
+	start = una;
+	for (i = 0, j = 0; i < rack->segs && j < rcvvar->sacks;
+			start = rack->seg[i++].end_seq) {
+		while (j < rcvvar->sacks &&
+				TCP_SEQ_LEQ(rcvvar->sack_table[j].right_edge, start))
+			j++;
+		if (j < rcvvar->sacks &&
+				TCP_SEQ_LT(rcvvar->sack_table[j].left_edge, rack->seg[i].end_seq))
+			RACKUpdate(rack, &rack->seg[i], cur_ts);
+	}
+
+	return RACKDetectLoss(mtcp, cur_stream, cur_ts, una);
+}
+/*----------------------------------------------------------------------------*/
+/* arms the probe timeout if a tail loss probe may be needed (RFC 8985 7.2) */
+void
+RACKScheduleTLP(mtcp_manager_t mtcp, tcp_stream *cur_stream, uint32_t cur_ts)
+{
+	struct tcp_send_vars *sndvar = cur_stream->sndvar;
+	struct rack_state *rack = &sndvar->rack;
+	uint32_t pto;
+
+	/* the reordering timer goes first */
+	if (cur_stream->on_rack_timer && rack->timer_mode == RACK_TIMER_REO)
+		return;
+
+	if (!cur_stream->sack_permit || sndvar->in_recovery || rack->tlp_out ||
+			cur_stream->rcvvar->srtt == 0 ||
+			sndvar->snd_max == sndvar->snd_una ||
+			(cur_stream->state != TCP_ST_ESTABLISHED &&
+			 cur_stream->state != TCP_ST_CLOSE_WAIT)) {
+		RemoveFromRACKTimer(mtcp, cur_stream);
+		return;
+	}
+
+	/* 2 * srtt, plus the peer's delayed ack if a single segment is out */
+	pto = cur_stream->rcvvar->srtt >> 2;
+	if (sndvar->snd_max - sndvar->snd_una <= sndvar->mss)
+		pto += TCP_TLP_WCDELACK;
+
+	/* no probe if the retransmission timer expires first */
+	if (cur_stream->on_rto_list && TCP_SEQ_LEQ(sndvar->ts_rto, cur_ts + pto)) {
+		RemoveFromRACKTimer(mtcp, cur_stream);
+		return;
+	}
+
+	rack->timer_mode = RACK_TIMER_TLP;
+	AddtoRACKTimer(mtcp, cur_stream, cur_ts + pto);
+}
+/*----------------------------------------------------------------------------*/
+/*
+ * Sends one segment of new data if the receive window allows,
+ * the last segment sent otherwise (RFC 8985 7.3).
+ */
+static inline void
+SendTailLossProbe(mtcp_manager_t mtcp, tcp_stream *cur_stream, uint32_t cur_ts)
+{
+	struct tcp_send_vars *sndvar = cur_stream->sndvar;
+	struct rack_state *rack = &sndvar->rack;
+	const uint32_t maxlen = sndvar->mss - CalculateOptionLength(TCP_FLAG_ACK, 0);
+	uint32_t snd_nxt = cur_stream->snd_nxt;
+	uint32_t buffered;
+	uint32_t seq, len;
+	int ret;
+
+	if (!sndvar->sndbuf || sndvar->in_recovery || rack->tlp_out ||
+			sndvar->snd_max == sndvar->snd_una ||
+			(cur_stream->state != TCP_ST_ESTABLISHED &&
+			 cur_stream->state != TCP_ST_CLOSE_WAIT)) {
+		return;
+	}
+
+	SBUF_LOCK(&sndvar->write_lock);
+
+	buffered = sndvar->sndbuf->head_seq + sndvar->sndbuf->len - sndvar->snd_max;
+	len = MIN(buffered, maxlen);
+	if (len > 0 && snd_nxt == sndvar->snd_max &&
+			sndvar->snd_max - sndvar->snd_una + len <= sndvar->peer_wnd) {
+		seq = sndvar->snd_max;
+		rack->tlp_rxt = FALSE;
+	} else {
+		len = MIN(sndvar->snd_max - sndvar->snd_una, maxlen);
+		seq = sndvar->snd_max - len;
+		rack->tlp_rxt = TRUE;
+	}
+
+	/* SendTCPPacket() sends from snd_nxt */
+	rack->tlp_out = TRUE;
+	cur_stream->snd_nxt = seq;
+	ret = SendTCPPacket(mtcp, cur_stream, cur_ts, TCP_FLAG_ACK,
+			sndvar->sndbuf->head + (seq - sndvar->sndbuf->head_seq), len);
+	if (ret < 0 || rack->tlp_rxt)
+		cur_stream->snd_nxt = snd_nxt;
+
+	SBUF_UNLOCK(&sndvar->write_lock);
+
+	if (ret < 0) {
+		/* no tx buffer, try again on the next tick */
+		rack->tlp_out = FALSE;
+		rack->timer_mode = RACK_TIMER_TLP;
+		AddtoRACKTimer(mtcp, cur_stream, cur_ts + 1);
+		return;
+	}
+
+	TRACE_LOSS("Stream %d: tail loss probe. seq: %u, len: %u, %s\n",
+			cur_stream->id, seq - sndvar->iss, len,
+			rack->tlp_rxt ? "retransmission" : "new data");
+	rack->tlp_end_seq = sndvar->snd_max;
+
+	/* the retransmission timer restarts from the probe */
+	RemoveFromRTOList(mtcp, cur_stream);
+	sndvar->ts_rto = cur_ts + sndvar->rto;
+	AddtoRTOList(mtcp, cur_stream);
+}
+/*----------------------------------------------------------------------------*/
+void
+HandleRACKTimer(mtcp_manager_t mtcp, uint32_t cur_ts, tcp_stream *cur_stream)
+{
+	struct tcp_send_vars *sndvar = cur_stream->sndvar;
+
+	if (cur_stream->close_reason != TCP_NOT_CLOSED)
+		return;
+
+	if (sndvar->rack.timer_mode == RACK_TIMER_TLP) {
+		SendTailLossProbe(mtcp, cur_stream, cur_ts);
+		return;
+	}
+
+	/* the reordering window of some data has passed */
+	if (RACKDetectLoss(mtcp, cur_stream, cur_ts, sndvar->snd_una)) {
+		if (!sndvar->in_recovery) {
+			TRACE_LOSS("Stream %d: RACK reordering timeout\n", cur_stream->id);
+			EnterSACKRecovery(mtcp, cur_stream, cur_ts);
+		} else {
+			AddtoSendList(mtcp, cur_stream);
+		}
+	}
+}
+/*----------------------------------------------------------------------------*/
+void
+RACKOnRTO(mtcp_manager_t mtcp, tcp_stream *cur_stream)
+{
+	struct rack_state *rack = &cur_stream->sndvar->rack;
+
+	/* everything is retransmitted from snd_una */
+	rack->tlp_out = FALSE;
+	rack->lost_seq = cur_stream->sndvar->snd_una;
+	RemoveFromRACKTimer(mtcp, cur_stream);
+}
+/*----------------------------------------------------------------------------*/
+#endif /* TCP_RACK_TLP_ENABLED */
@@ -7,6 +7,9 @@
 #include "eventpoll.h"
 #include "ip_out.h"
 #include "timer.h"
+#include "tcp_cc.h"
+#include "tcp_fastopen.h"
+#include "tcp_syncookie.h"
 #include "debug.h"
 #if RATE_LIMIT_ENABLED || PACING_ENABLED
 #include "pacing.h"
@@ -58,6 +61,12 @@ InitializeTCPStreamManager()
 	next_seed = time(NULL);
 }
 /*---------------------------------------------------------------------------*/
+uint32_t
+GenerateISS()
+{
+	return rand_r(&next_seed) % TCP_MAX_SEQ;
+}
+/*---------------------------------------------------------------------------*/
 unsigned int
 HashFlow(const void *f)
 {
@@ -126,7 +135,7 @@ RaiseReadEvent(mtcp_manager_t mtcp, tcp_stream *stream)
 {
 	if (stream->socket) {
 		if (stream->socket->epoll & MTCP_EPOLLIN) {
-			AddEpollEvent(mtcp->ep, 
+			AddEpollEvent(stream->socket->reg_ep, 
 					MTCP_EVENT_QUEUE, stream->socket, MTCP_EPOLLIN);
 #if BLOCKING_SUPPORT
 		} else if (!(stream->socket->opts & MTCP_NONBLOCK)) {
@@ -147,7 +156,7 @@ RaiseWriteEvent(mtcp_manager_t mtcp, tcp_stream *stream)
 {
 	if (stream->socket) {
 		if (stream->socket->epoll & MTCP_EPOLLOUT) {
-			AddEpollEvent(mtcp->ep, 
+			AddEpollEvent(stream->socket->reg_ep, 
 					MTCP_EVENT_QUEUE, stream->socket, MTCP_EPOLLOUT);
 #if BLOCKING_SUPPORT
 		} else if (!(stream->socket->opts & MTCP_NONBLOCK)) {
@@ -168,10 +177,10 @@ RaiseCloseEvent(mtcp_manager_t mtcp, tcp_stream *stream)
 {
 	if (stream->socket) {
 		if (stream->socket->epoll & MTCP_EPOLLRDHUP) {
-			AddEpollEvent(mtcp->ep, 
+			AddEpollEvent(stream->socket->reg_ep, 
 					MTCP_EVENT_QUEUE, stream->socket, MTCP_EPOLLRDHUP);
 		} else if (stream->socket->epoll & MTCP_EPOLLIN) {
-			AddEpollEvent(mtcp->ep, 
+			AddEpollEvent(stream->socket->reg_ep, 
 					MTCP_EVENT_QUEUE, stream->socket, MTCP_EPOLLIN);
 #if BLOCKING_SUPPORT
 		} else if (!(stream->socket->opts & MTCP_NONBLOCK)) {
@@ -199,7 +208,7 @@ RaiseErrorEvent(mtcp_manager_t mtcp, tcp_stream *stream)
 {
 	if (stream->socket) {
 		if (stream->socket->epoll & MTCP_EPOLLERR) {
-			AddEpollEvent(mtcp->ep, 
+			AddEpollEvent(stream->socket->reg_ep, 
 					MTCP_EVENT_QUEUE, stream->socket, MTCP_EPOLLERR);
 #if BLOCKING_SUPPORT
 		} else if (!(stream->socket->opts & MTCP_NONBLOCK)) {
@@ -298,7 +307,7 @@ CreateTCPStream(mtcp_manager_t mtcp, socket_map_t socket, int type,
 	stream->stream_type = type;
 	stream->state = TCP_ST_LISTEN;
 
-	stream->on_rto_idx = -1;
+	InitStreamTimers(stream);
 	
 	stream->sndvar->ip_id = 0;
 	stream->sndvar->mss = TCP_DEFAULT_MSS;
@@ -307,22 +316,30 @@ CreateTCPStream(mtcp_manager_t mtcp, socket_map_t socket, int type,
 	stream->sndvar->nif_out = GetOutputInterface(stream->daddr, &is_external);
 	stream->is_external = is_external;
 
-	stream->sndvar->iss = rand_r(&next_seed) % TCP_MAX_SEQ;
+	stream->sndvar->iss = GenerateISS();
 	//stream->sndvar->iss = 0;
 	stream->rcvvar->irs = 0;
 
 	stream->snd_nxt = stream->sndvar->iss;
 	stream->sndvar->snd_una = stream->sndvar->iss;
+	stream->sndvar->snd_max = stream->sndvar->iss;
+	stream->sndvar->ecn_recover = stream->sndvar->iss;
+#if TCP_RACK_TLP_ENABLED
+	stream->sndvar->rack.lost_seq = stream->sndvar->iss;
+#endif
 #if USE_CCP
 	stream->sndvar->missing_seq = 0;
 #endif
 	stream->sndvar->snd_wnd = CONFIG.sndbuf_size;
 	stream->rcv_nxt = 0;
 	stream->rcvvar->rcv_wnd = TCP_INITIAL_WINDOW;
+	stream->rcvvar->quickacks = TCP_MAX_QUICKACKS;
 
 	stream->rcvvar->snd_wl1 = stream->rcvvar->irs - 1;
 
 	stream->sndvar->rto = TCP_INITIAL_RTO;
+	stream->sndvar->cc = (socket && socket->cc) ? 
+			socket->cc : GetDefaultCongestionControl();
 
 #if BLOCKING_SUPPORT
 	if (pthread_cond_init(&stream->rcvvar->read_cond, NULL)) {
@@ -386,13 +403,46 @@ CreateTCPStream(mtcp_manager_t mtcp, socket_map_t socket, int type,
 	return stream;
 }
 /*---------------------------------------------------------------------------*/
+/* the pool connect() takes local addresses towards daddr from */
+addr_pool_t
+GetAddressPool(mtcp_manager_t mtcp, in_addr_t daddr)
+{
+	uint8_t is_external;
+	int nif;
+
+	if (mtcp->ap)
+		return mtcp->ap;
+
+	nif = GetOutputInterface(daddr, &is_external);
+	if (nif < 0) {
+		TRACE_ERROR("nif is negative!\n");
+		return NULL;
+	}
+	UNUSED(is_external);
+
+	return ap[CONFIG.nif_to_eidx[nif]];
+}
+/*---------------------------------------------------------------------------*/
+/* returns the local address a connect() took back to its address pool */
+void
+ReleaseBoundAddress(mtcp_manager_t mtcp, 
+		const struct sockaddr_in *saddr, const struct sockaddr_in *daddr)
+{
+	int ret;
+
+	ret = FreeAddress(GetAddressPool(mtcp, daddr->sin_addr.s_addr), 
+			mtcp->ctx->cpu, saddr, daddr);
+	if (ret < 0) {
+		TRACE_ERROR("(NEVER HAPPEN) Failed to free address.\n");
+	}
+}
+/*---------------------------------------------------------------------------*/
 void
 DestroyTCPStream(mtcp_manager_t mtcp, tcp_stream *stream)
 {
-	struct sockaddr_in addr;
+	struct sockaddr_in addr, daddr;
 	int bound_addr = FALSE;
 	uint8_t *sa, *da;
-	int ret;
 
 #ifdef DUMP_STREAM
 	if (stream->close_reason != TCP_ACTIVE_CLOSE && 
@@ -476,13 +526,15 @@ DestroyTCPStream(mtcp_manager_t mtcp, tcp_stream *stream)
 		bound_addr = TRUE;
 		addr.sin_addr.s_addr = stream->saddr;
 		addr.sin_port = stream->sport;
+		daddr.sin_addr.s_addr = stream->daddr;
+		daddr.sin_port = stream->dport;
 	}
 
 	RemoveFromControlList(mtcp, stream);
 	RemoveFromSendList(mtcp, stream);
 	RemoveFromACKList(mtcp, stream);
 	
-	if (stream->on_rto_idx >= 0)
+	if (stream->on_rto_list)
 		RemoveFromRTOList(mtcp, stream);
  	
 	if (stream->on_timewait_list)
@@ -491,6 +543,14 @@ DestroyTCPStream(mtcp_manager_t mtcp, tcp_stream *stream)
 	if (CONFIG.tcp_timeout > 0)
 		RemoveFromTimeoutList(mtcp, stream);
 
+	RemoveFromDelayedACKTimer(mtcp, stream);
+	RemoveFromPaceTimer(mtcp, stream);
+	TFOReleasePending(mtcp, stream);
+	ReleaseHalfOpen(mtcp, stream);
+#if TCP_RACK_TLP_ENABLED
+	RemoveFromRACKTimer(mtcp, stream);
+#endif
+
 #if BLOCKING_SUPPORT
 	if (stream->on_snd_br_list) {
 		stream->on_snd_br_list = FALSE;
@@ -544,23 +604,7 @@ DestroyTCPStream(mtcp_manager_t mtcp, tcp_stream *stream)
 	pthread_mutex_unlock(&mtcp->ctx->flow_pool_lock);
 
 	if (bound_addr) {
-		if (mtcp->ap) {
-			ret = FreeAddress(mtcp->ap, &addr);
-		} else {
-			uint8_t is_external;
-			int nif = GetOutputInterface(addr.sin_addr.s_addr, &is_external);
-			if (nif < 0) {
-				TRACE_ERROR("nif is negative!\n");
-				ret = -1;
-			} else {
-			        int eidx = CONFIG.nif_to_eidx[nif];
-				ret = FreeAddress(ap[eidx], &addr);
-			}
-			UNUSED(is_external);
-		}
-		if (ret < 0) {
-			TRACE_ERROR("(NEVER HAPPEN) Failed to free address.\n");
-		}
+		ReleaseBoundAddress(mtcp, &addr, &daddr);
 	}
 
 
@@ -610,7 +654,7 @@ DumpStream(mtcp_manager_t mtcp, tcp_stream *stream)
 	thread_printf(mtcp, mtcp->log_fp, 
 			"on_hash_table: %u, on_control_list: %u (wait: %u), on_send_list: %u, "
 			"on_ack_list: %u, is_wack: %u, ack_cnt: %u\n"
-			"on_rto_idx: %d, on_timewait_list: %u, on_timeout_list: %u, "
+			"on_rto_list: %u, on_timewait_list: %u, on_timeout_list: %u, "
 			"on_rcv_br_list: %u, on_snd_br_list: %u\n"
 			"on_sendq: %u, on_ackq: %u, closed: %u, on_closeq: %u, "
 			"on_closeq_int: %u, on_resetq: %u, on_resetq_int: %u\n"
@@ -619,7 +663,7 @@ DumpStream(mtcp_manager_t mtcp, tcp_stream *stream)
 			"is_bound_addr: %u, need_wnd_adv: %u\n", stream->on_hash_table, 
 			sndvar->on_control_list, stream->control_list_waiting, sndvar->on_send_list, 
 			sndvar->on_ack_list, sndvar->is_wack, sndvar->ack_cnt, 
-			stream->on_rto_idx, stream->on_timewait_list, stream->on_timeout_list, 
+			stream->on_rto_list, stream->on_timewait_list, stream->on_timeout_list, 
 			stream->on_rcv_br_list, stream->on_snd_br_list, 
 			sndvar->on_sendq, sndvar->on_ackq, 
 			stream->closed, sndvar->on_closeq, sndvar->on_closeq_int, 
@@ -636,9 +680,10 @@ DumpStream(mtcp_manager_t mtcp, tcp_stream *stream)
 			sndvar->wscale_mine, sndvar->wscale_peer, sndvar->nif_out);
 	thread_printf(mtcp, mtcp->log_fp, 
 			"snd_nxt: %u, snd_una: %u, iss: %u, fss: %u\nsnd_wnd: %u, "
-			"peer_wnd: %u, cwnd: %u, ssthresh: %u\n", 
+			"peer_wnd: %u, cwnd: %u, ssthresh: %u, cc: %s\n", 
 			stream->snd_nxt, sndvar->snd_una, sndvar->iss, sndvar->fss, 
-			sndvar->snd_wnd, sndvar->peer_wnd, sndvar->cwnd, sndvar->ssthresh);
+			sndvar->snd_wnd, sndvar->peer_wnd, sndvar->cwnd, sndvar->ssthresh, 
+			sndvar->cc->name);
 
 	if (sndvar->sndbuf) {
 		thread_printf(mtcp, mtcp->log_fp, 
@@ -195,6 +195,35 @@ StreamEnqueue(stream_queue_t sq, tcp_stream *stream)
 	return -1;
 }
 /*---------------------------------------------------------------------------*/
+/* enqueues the streams in order and publishes them with a single tail 
+   update; returns how many were enqueued (less than cnt when full) */
+int 
+StreamEnqueueBatch(stream_queue_t sq, tcp_stream **streams, int cnt)
+{
+	index_type h = sq->_head;
+	index_type t = sq->_tail;
+	index_type nt;
+	int i;
+
+	for (i = 0; i < cnt; i++) {
+		nt = NextIndex(sq, t);
+		if (nt == h) {
+			TRACE_ERROR("Exceed capacity of stream queue!\n");
+			break;
+		}
+		sq->_q[t] = streams[i];
+		t = nt;
+	}
+
+	if (i > 0) {
+		/* the entries must be in place before the consumer sees the tail */
+		__asm__ volatile("" : : : "memory");
+		sq->_tail = t;
+	}
+
+	return i;
+}
+/*---------------------------------------------------------------------------*/
 tcp_stream *
 StreamDequeue(stream_queue_t sq)
 {
@@ -0,0 +1,175 @@
+#include "tcp_syncookie.h"
+#include "tcp_minisock.h"
+#include "tcp_in.h"
+#include "tcp_util.h"
+#include "debug.h"
+
+/*
+ * A cookie is the ISN of our SYN/ACK:
+ *
+ *   | count (2) | mss index (2) | SipHash-2-4 MAC (28) |
+ *
+ * count is the 67s period (cur_ts >> SYNCOOKIE_PERIOD_SHIFT) the cookie was
+ * made in, and the MAC covers the four-tuple, the peer's ISN, the full
+ * count and the mss index. A cookie is good for the period it was made in
+ * and the next one. The full count wraps with the 32-bit us clock, so it
+ * is kept to SYNCOOKIE_COUNT_MASK on both ends.
+ *
+ * The rest of the SYN options only fit if the peer does timestamps: the
+ * low bits of our TSval carry its window scale, SACK permission and ECN
+ * (SYN_OPT_*), and come back in the TSecr of the ACK. Without timestamps,
+ * the SYN/ACK offers none of those.
+ */
+#define SYNCOOKIE_PERIOD_SHIFT	26			/* 2^26 us, about 67s */
+#define SYNCOOKIE_LIFETIME		(2U << SYNCOOKIE_PERIOD_SHIFT)
+#define SYNCOOKIE_COUNT_SHIFT	30
+#define SYNCOOKIE_COUNT_MASK	(0xffffffff >> SYNCOOKIE_PERIOD_SHIFT)
+#define SYNCOOKIE_MSS_SHIFT		28
+#define SYNCOOKIE_MAC_MASK		0x0fffffff
+
+#define SYNCOOKIE_TS_MASK		(SYN_OPT_WSCALE | SYN_OPT_SACK | SYN_OPT_ECN)
+
+static const uint16_t syncookie_mss[] = {536, 1220, 1440, 1460};
+
+static uint64_t syncookie_secret[2];
+/*----------------------------------------------------------------------------*/
+void
+InitSYNCookies(void)
+{
+	if (!GenerateSecretKey(syncookie_secret)) {
+		TRACE_ERROR("Failed to read /dev/urandom, "
+				"SYN cookies are predictable.\n");
+	}
+}
+/*----------------------------------------------------------------------------*/
+int
+SYNCookieNeeded(mtcp_manager_t mtcp)
+{
+	if (CONFIG.tcp_syncookies == TCP_SYNCOOKIES_ALWAYS)
+		return TRUE;
+	return (CONFIG.tcp_syncookies == TCP_SYNCOOKIES_ON &&
+			mtcp->half_open_cnt >= CONFIG.tcp_max_syn_backlog);
+}
+/*----------------------------------------------------------------------------*/
+/*
+ * Releases the half-open slot a stream took in HandlePassiveOpen(), once
+ * the handshake completes or the stream goes away. Minisocks release
+ * theirs in FreeMinisock().
+ */
+void
+ReleaseHalfOpen(mtcp_manager_t mtcp, tcp_stream *cur_stream)
+{
+	if (cur_stream->half_open) {
+		cur_stream->half_open = FALSE;
+		mtcp->half_open_cnt--;
+	}
+}
+/*----------------------------------------------------------------------------*/
+static inline uint32_t
+CookieMAC(const struct iphdr *iph, const struct tcphdr *tcph,
+		uint32_t peer_isn, uint32_t count, uint32_t mssidx)
+{
+	uint64_t m[3];
+
+	m[0] = ((uint64_t)iph->saddr << 32) | iph->daddr;
+	m[1] = ((uint64_t)tcph->source << 48) |
+			((uint64_t)tcph->dest << 32) | peer_isn;
+	m[2] = ((uint64_t)count << 2) | mssidx;
+
+	return (uint32_t)SipHash24(syncookie_secret, m, 3) & SYNCOOKIE_MAC_MASK;
+}
+/*----------------------------------------------------------------------------*/
+/*
+ * Answers a SYN without keeping any state. Returns 0, or ERROR if there is
+ * no room in the tx queue.
+ */
+int
+SendSYNCookie(mtcp_manager_t mtcp, uint32_t cur_ts,
+		const struct iphdr *iph, const struct tcphdr *tcph, uint32_t seq)
+{
+	struct tcp_syn_options syn;
+	uint32_t count, mssidx, cookie;
+	uint32_t ts_val = 0;
+	int ret;
+
+	ParseSYNOptions(mtcp, tcph, &syn);
+
+	for (mssidx = sizeof(syncookie_mss) / sizeof(syncookie_mss[0]) - 1;
+			mssidx > 0; mssidx--) {
+		if (syncookie_mss[mssidx] <= syn.mss)
+			break;
+	}
+	count = (cur_ts >> SYNCOOKIE_PERIOD_SHIFT) & SYNCOOKIE_COUNT_MASK;
+	cookie = (count << SYNCOOKIE_COUNT_SHIFT) |
+			(mssidx << SYNCOOKIE_MSS_SHIFT) |
+			CookieMAC(iph, tcph, seq, count, mssidx);
+
+	if (syn.opts & SYN_OPT_TIMESTAMP) {
+		ts_val = (cur_ts & ~SYNCOOKIE_TS_MASK) | (syn.opts & SYNCOOKIE_TS_MASK);
+	} else {
+		/* nowhere to keep them */
+		syn.opts = SYN_OPT_WSCALE;
+	}
+
+	ret = SendSYNACKStandalone(mtcp, cur_ts, iph->daddr, tcph->dest,
+			iph->saddr, tcph->source, cookie, seq + 1, syn.opts,
+			ts_val, syn.ts_val);
+	if (ret < 0)
+		return ret;
+
+	mtcp->last_syncookie_ts = cur_ts;
+	TRACE_DBG("Sent SYN cookie %u (mss %u, opts 0x%x)\n",
+			cookie, syncookie_mss[mssidx], syn.opts);
+
+	return 0;
+}
+/*----------------------------------------------------------------------------*/
+/*
+ * Checks the cookie acked by a segment without a stream, and if it is one
+ * of ours, creates the stream the SYN would have had. Returns NULL if the
+ * cookie is not valid.
+ */
+tcp_stream *
+CreateStreamFromCookie(mtcp_manager_t mtcp, uint32_t cur_ts,
+		const struct iphdr *iph, const struct tcphdr *tcph,
+		uint32_t seq, uint32_t ack_seq)
+{
+	struct tcp_timestamp ts;
+	uint32_t cookie = ack_seq - 1;
+	uint32_t count, mssidx;
+	uint32_t ts_recent = 0;
+	uint8_t opts = SYN_OPT_WSCALE;
+
+	/* only take cookies if we have handed some out lately */
+	if (CONFIG.tcp_syncookies == TCP_SYNCOOKIES_OFF ||
+			(int32_t)(cur_ts - mtcp->last_syncookie_ts) >=
+			(int32_t)SYNCOOKIE_LIFETIME) {
+		return NULL;
+	}
+
+	count = cur_ts >> SYNCOOKIE_PERIOD_SHIFT;
+	if (((count - (cookie >> SYNCOOKIE_COUNT_SHIFT)) & 0x3) > 1)
+		return NULL;
+	/* a cookie of the last period before the clock wrap gives count 63 */
+	count = (count - ((count - (cookie >> SYNCOOKIE_COUNT_SHIFT)) & 0x3)) &
+			SYNCOOKIE_COUNT_MASK;
+	mssidx = (cookie >> SYNCOOKIE_MSS_SHIFT) & 0x3;
+	if ((cookie & SYNCOOKIE_MAC_MASK) !=
+			CookieMAC(iph, tcph, seq - 1, count, mssidx)) {
+		TRACE_DBG("Invalid SYN cookie %u\n", cookie);
+		return NULL;
+	}
+
+#if TCP_OPT_TIMESTAMP_ENABLED
+	if (ParseTCPTimestamp(NULL, &ts, (uint8_t *)tcph + TCP_HEADER_LEN,
+				(tcph->doff << 2) - TCP_HEADER_LEN)) {
+		opts = SYN_OPT_TIMESTAMP | (ts.ts_ref & SYNCOOKIE_TS_MASK);
+		ts_recent = ts.ts_val;
+	}
+#endif
+
+	return CreateStreamFromSYN(mtcp, cur_ts, iph->daddr, tcph->dest,
+			iph->saddr, tcph->source, cookie, seq - 1,
+			syncookie_mss[mssidx], opts, ts_recent);
+}
+/*----------------------------------------------------------------------------*/
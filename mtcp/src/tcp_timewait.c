@@ -0,0 +1,386 @@
+#include <string.h>
+
+#include "tcp_timewait.h"
+#include "tcp_in.h"
+#include "tcp_out.h"
+#include "tcp_util.h"
+#include "debug.h"
+
+#define MIN(a, b) ((a)<(b)?(a):(b))
+#define TCP_MAX_WINDOW 65535
+
+/* peers' timestamps tick at least once a second (RFC 7323), so a new
+   connection on the same 4-tuple is safe from old duplicates after that */
+#define TW_REUSE_DELAY			SEC_TO_TS(1)
+
+TAILQ_HEAD(tw_sock_head, tcp_tw_sock);
+
+struct timewait_table
+{
+	struct tcp_tw_sock *pool;
+	struct tcp_tw_sock *free_list;		/* linked by hash_next */
+	struct tcp_tw_sock **bucket;
+	uint32_t mask;
+	int cnt;
+
+	/* entries come in with the same timeout, so appending keeps both
+	   lists nearly sorted; a restarted TIME_WAIT is inserted in order */
+	struct tw_sock_head reuse_list;		/* by reuse */
+	struct tw_sock_head expire_list;	/* by expire */
+};
+/*----------------------------------------------------------------------------*/
+struct timewait_table *
+CreateTimewaitTable(int size)
+{
+	struct timewait_table *table;
+	uint32_t nbuckets = 1;
+	int i;
+
+	table = (struct timewait_table *)calloc(1, sizeof(struct timewait_table));
+	if (!table)
+		return NULL;
+
+	while (nbuckets < (uint32_t)size)
+		nbuckets <<= 1;
+	table->mask = nbuckets - 1;
+
+	table->pool = (struct tcp_tw_sock *)calloc(size, sizeof(struct tcp_tw_sock));
+	table->bucket = (struct tcp_tw_sock **)
+			calloc(nbuckets, sizeof(struct tcp_tw_sock *));
+	if (!table->pool || !table->bucket) {
+		DestroyTimewaitTable(table);
+		return NULL;
+	}
+
+	for (i = size - 1; i >= 0; i--) {
+		table->pool[i].hash_next = table->free_list;
+		table->free_list = &table->pool[i];
+	}
+	TAILQ_INIT(&table->reuse_list);
+	TAILQ_INIT(&table->expire_list);
+
+	return table;
+}
+/*----------------------------------------------------------------------------*/
+void
+DestroyTimewaitTable(struct timewait_table *table)
+{
+	if (!table)
+		return;
+	free(table->bucket);
+	free(table->pool);
+	free(table);
+}
+/*----------------------------------------------------------------------------*/
+static inline struct tcp_tw_sock **
+TimewaitBucket(struct timewait_table *table, uint32_t saddr, uint16_t sport,
+		uint32_t daddr, uint16_t dport)
+{
+	uint32_t hash = (saddr ^ daddr ^ ((uint32_t)sport << 16 | dport)) * 2654435761U;
+
+	return &table->bucket[(hash >> 16) & table->mask];
+}
+/*----------------------------------------------------------------------------*/
+static inline struct tcp_tw_sock *
+TimewaitSearch(struct timewait_table *table, uint32_t saddr, uint16_t sport,
+		uint32_t daddr, uint16_t dport)
+{
+	struct tcp_tw_sock *tw;
+
+	tw = *TimewaitBucket(table, saddr, sport, daddr, dport);
+	for (; tw; tw = tw->hash_next) {
+		if (tw->saddr == saddr && tw->sport == sport &&
+				tw->daddr == daddr && tw->dport == dport)
+			return tw;
+	}
+	return NULL;
+}
+/*----------------------------------------------------------------------------*/
+static inline void
+InsertExpireTimer(struct timewait_table *table, struct tcp_tw_sock *tw)
+{
+	struct tcp_tw_sock *prev;
+
+	TAILQ_FOREACH_REVERSE(prev, &table->expire_list, tw_sock_head, timer_link) {
+		if (TCP_SEQ_LEQ(prev->expire, tw->expire))
+			break;
+	}
+	if (prev)
+		TAILQ_INSERT_AFTER(&table->expire_list, prev, tw, timer_link);
+	else
+		TAILQ_INSERT_HEAD(&table->expire_list, tw, timer_link);
+}
+/*----------------------------------------------------------------------------*/
+static inline void
+InsertReuseTimer(struct timewait_table *table, struct tcp_tw_sock *tw)
+{
+	struct tcp_tw_sock *prev;
+
+	TAILQ_FOREACH_REVERSE(prev, &table->reuse_list, tw_sock_head, timer_link) {
+		if (TCP_SEQ_LEQ(prev->reuse, tw->reuse))
+			break;
+	}
+	if (prev)
+		TAILQ_INSERT_AFTER(&table->reuse_list, prev, tw, timer_link);
+	else
+		TAILQ_INSERT_HEAD(&table->reuse_list, tw, timer_link);
+}
+/*----------------------------------------------------------------------------*/
+static inline void
+RemoveTimewaitTimer(struct timewait_table *table, struct tcp_tw_sock *tw)
+{
+	if (tw->flags & TW_REUSE_PENDING)
+		TAILQ_REMOVE(&table->reuse_list, tw, timer_link);
+	else
+		TAILQ_REMOVE(&table->expire_list, tw, timer_link);
+}
+/*----------------------------------------------------------------------------*/
+/* gives the local port of an active close back to the address pool */
+static inline void
+ReleaseTimewaitAddress(mtcp_manager_t mtcp, struct tcp_tw_sock *tw)
+{
+	struct sockaddr_in addr, daddr;
+
+	if (!(tw->flags & TW_BOUND_ADDR))
+		return;
+
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = tw->saddr;
+	addr.sin_port = tw->sport;
+	daddr.sin_family = AF_INET;
+	daddr.sin_addr.s_addr = tw->daddr;
+	daddr.sin_port = tw->dport;
+	ReleaseBoundAddress(mtcp, &addr, &daddr);
+	tw->flags &= ~TW_BOUND_ADDR;
+}
+/*----------------------------------------------------------------------------*/
+static void
+FreeTimewait(mtcp_manager_t mtcp, struct tcp_tw_sock *tw)
+{
+	struct timewait_table *table = mtcp->timewait;
+	struct tcp_tw_sock **pp;
+
+	ReleaseTimewaitAddress(mtcp, tw);
+
+	pp = TimewaitBucket(table, tw->saddr, tw->sport, tw->daddr, tw->dport);
+	while (*pp != tw)
+		pp = &(*pp)->hash_next;
+	*pp = tw->hash_next;
+	RemoveTimewaitTimer(table, tw);
+
+	tw->hash_next = table->free_list;
+	table->free_list = tw;
+	table->cnt--;
+}
+/*----------------------------------------------------------------------------*/
+/* 
+ * drops the entry of a 4-tuple that a connect() took again after 
+ * tcp_tw_reuse gave its local port back; left in place, it would answer 
+ * for the tuple with stale sequence numbers once the new connection is 
+ * gone without a TIME_WAIT of its own (RST, failed handshake)
+ */
+void
+ReuseTimewait(mtcp_manager_t mtcp, uint32_t saddr, uint16_t sport, 
+		uint32_t daddr, uint16_t dport)
+{
+	struct timewait_table *table = mtcp->timewait;
+	struct tcp_tw_sock *tw;
+
+	if (table->cnt == 0)
+		return;
+
+	tw = TimewaitSearch(table, saddr, sport, daddr, dport);
+	/* an entry still owning the port was not given to the address pool */
+	if (tw && !(tw->flags & TW_BOUND_ADDR))
+		FreeTimewait(mtcp, tw);
+}
+/*----------------------------------------------------------------------------*/
+/* 
+ * takes the rest of TIME_WAIT over from a stream about to be destroyed. 
+ * The entry takes the local address of a connect() with it, so the caller 
+ * must not free it. Returns FALSE if the table is full; the connection 
+ * then skips TIME_WAIT, as Linux does past tcp_max_tw_buckets.
+ */
+int
+EnterTimewait(mtcp_manager_t mtcp, tcp_stream *cur_stream, uint32_t cur_ts)
+{
+	struct timewait_table *table = mtcp->timewait;
+	struct tcp_tw_sock *tw;
+	struct tcp_tw_sock **pp;
+
+	tw = TimewaitSearch(table, cur_stream->saddr, cur_stream->sport, 
+			cur_stream->daddr, cur_stream->dport);
+	if (tw) {
+		/* a reused 4-tuple closed again: the old entry gave its address up */
+		RemoveTimewaitTimer(table, tw);
+	} else {
+		tw = table->free_list;
+		if (!tw) {
+			TRACE_DBG("Stream %u: TIME_WAIT table is full.\n", cur_stream->id);
+			return FALSE;
+		}
+		table->free_list = tw->hash_next;
+
+		tw->saddr = cur_stream->saddr;
+		tw->sport = cur_stream->sport;
+		tw->daddr = cur_stream->daddr;
+		tw->dport = cur_stream->dport;
+		pp = TimewaitBucket(table, tw->saddr, tw->sport, tw->daddr, tw->dport);
+		tw->hash_next = *pp;
+		*pp = tw;
+		table->cnt++;
+	}
+
+	tw->snd_nxt = cur_stream->sndvar->fss + 1;
+	tw->rcv_nxt = cur_stream->rcv_nxt;
+	tw->ts_recent = cur_stream->rcvvar->ts_recent;
+	tw->ts_recent_upd = cur_stream->rcvvar->ts_last_ts_upd;
+	tw->expire = cur_stream->rcvvar->ts_tw_expire;
+	tw->window = MIN(cur_stream->rcvvar->rcv_wnd >> cur_stream->sndvar->wscale_mine, 
+			TCP_MAX_WINDOW);
+	tw->flags = 0;
+	if (cur_stream->saw_timestamp)
+		tw->flags |= TW_TIMESTAMP;
+	if (cur_stream->is_bound_addr) {
+		tw->flags |= TW_BOUND_ADDR;
+		cur_stream->is_bound_addr = FALSE;
+	}
+
+	tw->reuse = tw->ts_recent_upd + TW_REUSE_DELAY;
+	if (CONFIG.tcp_tw_reuse && (tw->flags & TW_TIMESTAMP) && 
+			(tw->flags & TW_BOUND_ADDR)) {
+		if (TCP_SEQ_LEQ(tw->reuse, cur_ts)) {
+			ReleaseTimewaitAddress(mtcp, tw);
+		} else {
+			tw->flags |= TW_REUSE_PENDING;
+			InsertReuseTimer(table, tw);
+			return TRUE;
+		}
+	}
+	InsertExpireTimer(table, tw);
+
+	return TRUE;
+}
+/*----------------------------------------------------------------------------*/
+static inline void
+SendTimewaitACK(mtcp_manager_t mtcp, struct tcp_tw_sock *tw, uint32_t cur_ts)
+{
+	SendTCPPacketStandalone(mtcp, tw->saddr, tw->sport, tw->daddr, tw->dport, 
+			tw->snd_nxt, tw->rcv_nxt, tw->window, TCP_FLAG_ACK, 
+			NULL, 0, cur_ts, tw->ts_recent);
+}
+/*----------------------------------------------------------------------------*/
+/* 
+ * handles a segment of a connection in TIME_WAIT. Returns FALSE if there 
+ * is no such connection or if the segment is a SYN that may open a new 
+ * one; the entry is gone then and the SYN goes on as a passive open.
+ */
+int
+TimewaitSegment(mtcp_manager_t mtcp, uint32_t cur_ts,
+		const struct iphdr *iph, const struct tcphdr *tcph,
+		uint32_t seq, int payloadlen)
+{
+	struct timewait_table *table = mtcp->timewait;
+	struct tcp_tw_sock *tw;
+	struct tcp_timestamp ts;
+	int has_ts;
+
+	if (table->cnt == 0)
+		return FALSE;
+
+	tw = TimewaitSearch(table, iph->daddr, tcph->dest, iph->saddr, tcph->source);
+	if (!tw)
+		return FALSE;
+
+	/* RFC 1337: an RST must not cut TIME_WAIT short */
+	if (tcph->rst)
+		return TRUE;
+
+	has_ts = ParseTCPTimestamp(NULL, &ts, (uint8_t *)tcph + TCP_HEADER_LEN, 
+			(tcph->doff << 2) - TCP_HEADER_LEN);
+
+	if (tcph->syn && !tcph->ack) {
+		/* RFC 6191: a newer timestamp, or without timestamps a sequence 
+		   number past the old connection, cannot be an old duplicate */
+		if ((tw->flags & TW_TIMESTAMP)? 
+				(has_ts && TCP_SEQ_GT(ts.ts_val, tw->ts_recent)) : 
+				TCP_SEQ_GT(seq, tw->rcv_nxt)) {
+			TRACE_STATE("TIME_WAIT connection reused by a new SYN.\n");
+			FreeTimewait(mtcp, tw);
+			return FALSE;
+		}
+		SendTimewaitACK(mtcp, tw, cur_ts);
+		return TRUE;
+	}
+
+	/* PAWS */
+	if ((tw->flags & TW_TIMESTAMP) && has_ts && 
+			TCP_SEQ_LT(ts.ts_val, tw->ts_recent)) {
+		SendTimewaitACK(mtcp, tw, cur_ts);
+		return TRUE;
+	}
+
+	if (tcph->fin) {
+		/* our ack of the FIN got lost: ack again and restart 2MSL */
+		if (has_ts && (tw->flags & TW_TIMESTAMP))
+			tw->ts_recent = ts.ts_val;
+		tw->expire = cur_ts + CONFIG.tcp_timewait;
+		if (!(tw->flags & TW_REUSE_PENDING)) {
+			TAILQ_REMOVE(&table->expire_list, tw, timer_link);
+			InsertExpireTimer(table, tw);
+		}
+		SendTimewaitACK(mtcp, tw, cur_ts);
+	} else if (payloadlen > 0 || seq != tw->rcv_nxt) {
+		SendTimewaitACK(mtcp, tw, cur_ts);
+	}
+
+	return TRUE;
+}
+/*----------------------------------------------------------------------------*/
+void
+CheckTimewaitTimers(mtcp_manager_t mtcp, uint32_t cur_ts)
+{
+	struct timewait_table *table = mtcp->timewait;
+	struct tcp_tw_sock *tw;
+
+	if (table->cnt == 0)
+		return;
+
+	while ((tw = TAILQ_FIRST(&table->reuse_list)) && 
+			TCP_SEQ_LEQ(tw->reuse, cur_ts)) {
+		TAILQ_REMOVE(&table->reuse_list, tw, timer_link);
+		tw->flags &= ~TW_REUSE_PENDING;
+		ReleaseTimewaitAddress(mtcp, tw);
+		InsertExpireTimer(table, tw);
+	}
+
+	while ((tw = TAILQ_FIRST(&table->expire_list)) && 
+			TCP_SEQ_LEQ(tw->expire, cur_ts)) {
+		FreeTimewait(mtcp, tw);
+	}
+}
+/*----------------------------------------------------------------------------*/
+/* ticks from cur_ts until a TIME_WAIT timer fires, at most limit */
+uint32_t
+TimewaitIdleTicks(mtcp_manager_t mtcp, uint32_t cur_ts, uint32_t limit)
+{
+	struct timewait_table *table = mtcp->timewait;
+	struct tcp_tw_sock *tw;
+
+	if (table->cnt == 0)
+		return limit;
+
+	if ((tw = TAILQ_FIRST(&table->reuse_list))) {
+		if (TCP_SEQ_LEQ(tw->reuse, cur_ts))
+			return 0;
+		limit = MIN(tw->reuse - cur_ts, limit);
+	}
+	if ((tw = TAILQ_FIRST(&table->expire_list))) {
+		if (TCP_SEQ_LEQ(tw->expire, cur_ts))
+			return 0;
+		limit = MIN(tw->expire - cur_ts, limit);
+	}
+
+	return limit;
+}
+/*----------------------------------------------------------------------------*/
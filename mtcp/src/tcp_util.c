@@ -1,4 +1,8 @@
 #include <assert.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
 
 #include "tcp_util.h"
 #include "tcp_ring_buffer.h"
@@ -6,6 +10,7 @@
 #include "debug.h"
 #include "timer.h"
 #include "ip_in.h"
+#include "tcp_fastopen.h"
 
 #define MAX(a, b) ((a)>(b)?(a):(b))
 #define MIN(a, b) ((a)<(b)?(a):(b))
@@ -50,6 +55,9 @@ ParseTCPOptions(tcp_stream *cur_stream,
 				cur_stream->rcvvar->ts_recent = ntohl(*(uint32_t *)(tcpopt + i));
 				cur_stream->rcvvar->ts_last_ts_upd = cur_ts;
 				i += 8;
+			} else if (opt == TCP_OPT_FASTOPEN) {
+				ParseTFOOption(cur_stream, tcpopt + i, optlen - 2);
+				i += optlen - 2;
 			} else {
 				// not handle
 				i += optlen - 2;
@@ -92,95 +100,323 @@ ParseTCPTimestamp(tcp_stream *cur_stream,
 }
 #if TCP_OPT_SACK_ENABLED
 /*----------------------------------------------------------------------------*/
+/* 
+ * SACK scoreboard: rcvvar->sack_table holds rcvvar->sacks disjoint, 
+ * non-adjacent [left_edge, right_edge) blocks above snd_una, sorted by 
+ * sequence number. sacked_bytes is the total length of the blocks.
+ */
+/*----------------------------------------------------------------------------*/
+uint32_t
+GetSACKedRightEdge(tcp_stream *cur_stream, uint32_t seq)
+{
+	struct tcp_recv_vars *rcvvar = cur_stream->rcvvar;
+	int i;
+
+	for (i = 0; i < rcvvar->sacks; i++) {
+		if (TCP_SEQ_LT(seq, rcvvar->sack_table[i].left_edge))
+			break;
+		if (TCP_SEQ_LT(seq, rcvvar->sack_table[i].right_edge))
+			return rcvvar->sack_table[i].right_edge;
+	}
+	return seq;
+}
+/*----------------------------------------------------------------------------*/
 int
 SeqIsSacked(tcp_stream *cur_stream, uint32_t seq)
 {
-	uint8_t i;
-	uint32_t left, right;
-	for (i = 0; i < MAX_SACK_ENTRY; i++) {
-		left = cur_stream->rcvvar->sack_table[i].left_edge;
-		right = cur_stream->rcvvar->sack_table[i].right_edge;
-		if (seq >= left && seq < right) {
-			//fprintf(stderr, "Found seq=%u in (%u,%u)\n", seq - cur_stream->sndvar->iss, left - cur_stream->sndvar->iss, right - cur_stream->sndvar->iss);
-			return TRUE;
+	return GetSACKedRightEdge(cur_stream, seq) != seq;
+}
+/*----------------------------------------------------------------------------*/
+void
+_update_sack_table(tcp_stream *cur_stream, uint32_t left_edge, uint32_t right_edge)
+{
+	struct tcp_recv_vars *rcvvar = cur_stream->rcvvar;
+	struct sack_entry *table = rcvvar->sack_table;
+	uint32_t newly_sacked;
+	int i, j;
+
+	/* ignore D-SACKs and blocks outside of the outstanding data */
+	if (TCP_SEQ_LT(left_edge, cur_stream->sndvar->snd_una))
+		left_edge = cur_stream->sndvar->snd_una;
+	if (TCP_SEQ_GT(right_edge, cur_stream->sndvar->snd_max))
+		right_edge = cur_stream->sndvar->snd_max;
+	if (!TCP_SEQ_LT(left_edge, right_edge))
+		return;
+
+	/* find the first block that touches or follows the new one */
+	for (i = 0; i < rcvvar->sacks; i++) {
+		if (TCP_SEQ_GEQ(table[i].right_edge, left_edge))
+			break;
+	}
+
+	if (i == rcvvar->sacks || TCP_SEQ_GT(table[i].left_edge, right_edge)) {
+		/* disjoint: insert a new block at i, dropping the highest if full */
+		if (rcvvar->sacks == MAX_SACK_ENTRY) {
+			if (i == MAX_SACK_ENTRY)
+				return;
+			rcvvar->sacked_bytes -= table[MAX_SACK_ENTRY - 1].right_edge - 
+					table[MAX_SACK_ENTRY - 1].left_edge;
+			rcvvar->sacks--;
+		}
+		for (j = rcvvar->sacks; j > i; j--)
+			table[j] = table[j - 1];
+		table[i].left_edge = left_edge;
+		table[i].right_edge = right_edge;
+		rcvvar->sacks++;
+		newly_sacked = right_edge - left_edge;
+
+	} else {
+		/* overlapping: grow block i and swallow the blocks it now covers */
+		newly_sacked = 0;
+		if (TCP_SEQ_LT(left_edge, table[i].left_edge)) {
+			newly_sacked += table[i].left_edge - left_edge;
+			table[i].left_edge = left_edge;
+		}
+		if (TCP_SEQ_GT(right_edge, table[i].right_edge)) {
+			newly_sacked += right_edge - table[i].right_edge;
+			table[i].right_edge = right_edge;
+		}
+		j = i + 1;
+		while (j < rcvvar->sacks && 
+				TCP_SEQ_LEQ(table[j].left_edge, table[i].right_edge)) {
+			/* the bytes of block j were counted twice above */
+			if (TCP_SEQ_GT(table[j].right_edge, table[i].right_edge)) {
+				newly_sacked -= table[i].right_edge - table[j].left_edge;
+				table[i].right_edge = table[j].right_edge;
+			} else {
+				newly_sacked -= table[j].right_edge - table[j].left_edge;
+			}
+			j++;
+		}
+		if (j > i + 1) {
+			memmove(&table[i + 1], &table[j], 
+					(rcvvar->sacks - j) * sizeof(struct sack_entry));
+			rcvvar->sacks -= j - i - 1;
 		}
 	}
-	return FALSE;
+
+	rcvvar->sacked_bytes += newly_sacked;
+	rcvvar->sacked_pkts += (newly_sacked / cur_stream->sndvar->mss);
 }
 /*----------------------------------------------------------------------------*/
 void
-_update_sack_table(tcp_stream *cur_stream, uint32_t left_edge, uint32_t right_edge)
+RemoveAckedSACKBlocks(tcp_stream *cur_stream, uint32_t ack_seq)
+{
+	struct tcp_recv_vars *rcvvar = cur_stream->rcvvar;
+	struct sack_entry *table = rcvvar->sack_table;
+	int i;
+
+	for (i = 0; i < rcvvar->sacks; i++) {
+		if (TCP_SEQ_GT(table[i].right_edge, ack_seq))
+			break;
+		rcvvar->sacked_bytes -= table[i].right_edge - table[i].left_edge;
+	}
+	if (i > 0) {
+		memmove(&table[0], &table[i], 
+				(rcvvar->sacks - i) * sizeof(struct sack_entry));
+		rcvvar->sacks -= i;
+	}
+
+	if (rcvvar->sacks > 0 && TCP_SEQ_LT(table[0].left_edge, ack_seq)) {
+		rcvvar->sacked_bytes -= ack_seq - table[0].left_edge;
+		table[0].left_edge = ack_seq;
+	}
+}
+/*----------------------------------------------------------------------------*/
+void
+ResetSACKScoreboard(tcp_stream *cur_stream)
+{
+	cur_stream->rcvvar->sacks = 0;
+	cur_stream->rcvvar->sacked_bytes = 0;
+	cur_stream->sndvar->in_recovery = FALSE;
+}
+/*----------------------------------------------------------------------------*/
+/* 
+ * Returns the sequence below which unsacked data is deemed lost: more 
+ * than (DupThresh - 1) * SMSS bytes are sacked above it (RFC 6675 IsLost).
+ * In loss recovery, the first hole is always deemed lost.
+ */
+static inline uint32_t
+GetSACKLostEdge(tcp_stream *cur_stream)
 {
-	uint8_t i, j;
-	uint32_t newly_sacked = 0;
-	long int ld, rd, lrd, rld;
-	for (i = 0; i < MAX_SACK_ENTRY; i++) {
-		ld = (long int) left_edge - cur_stream->rcvvar->sack_table[i].left_edge;
-		rd = (long int) right_edge - cur_stream->rcvvar->sack_table[i].right_edge;
-		// if block already in table, don't need to do anything
-		if (ld == 0 && rd == 0) {
-			return;
+	struct tcp_recv_vars *rcvvar = cur_stream->rcvvar;
+	uint32_t sacked = 0;
+	uint32_t lost_edge;
+	int i;
+
+	if (rcvvar->sacks == 0)
+		return cur_stream->sndvar->snd_una;
+
+	lost_edge = cur_stream->sndvar->snd_una;
+	for (i = rcvvar->sacks - 1; i >= 0; i--) {
+		sacked += rcvvar->sack_table[i].right_edge - 
+				rcvvar->sack_table[i].left_edge;
+		if (sacked > (TCP_DUPTHRESH - 1) * cur_stream->sndvar->mss) {
+			lost_edge = rcvvar->sack_table[i].left_edge;
+			break;
 		}
+	}
 
-		lrd = (long int) left_edge - cur_stream->rcvvar->sack_table[i].right_edge;
-		rld = (long int) right_edge - cur_stream->rcvvar->sack_table[i].left_edge;
+	if (cur_stream->sndvar->in_recovery && 
+			TCP_SEQ_LT(lost_edge, rcvvar->sack_table[0].left_edge)) {
+		lost_edge = rcvvar->sack_table[0].left_edge;
+	}
+#if TCP_RACK_TLP_ENABLED
+	/* and up to the data deemed lost by RACK */
+	if (TCP_SEQ_GT(cur_stream->sndvar->rack.lost_seq, lost_edge)) {
+		lost_edge = cur_stream->sndvar->rack.lost_seq;
+	}
+#endif
 
-		// if block does not overlap i at all, skip
-		if (lrd > 0 || rld < 0) {
-			continue;
+	return lost_edge;
+}
+/*----------------------------------------------------------------------------*/
+/* 
+ * Finds the first hole at or after seq that is deemed lost. 
+ * Returns FALSE if there is none.
+ */
+int
+GetNextLostSeq(tcp_stream *cur_stream, uint32_t seq, 
+		uint32_t *hole_seq, uint32_t *hole_len)
+{
+	struct tcp_recv_vars *rcvvar = cur_stream->rcvvar;
+	uint32_t lost_edge;
+	int i;
+
+	if (TCP_SEQ_LT(seq, cur_stream->sndvar->snd_una))
+		seq = cur_stream->sndvar->snd_una;
+	lost_edge = GetSACKLostEdge(cur_stream);
+
+	for (i = 0; i < rcvvar->sacks; i++) {
+		if (!TCP_SEQ_LT(seq, lost_edge))
+			return FALSE;
+		if (TCP_SEQ_LT(seq, rcvvar->sack_table[i].left_edge)) {
+			*hole_seq = seq;
+			*hole_len = MIN(rcvvar->sack_table[i].left_edge, lost_edge) - seq;
+			return TRUE;
 		}
+		if (TCP_SEQ_LT(seq, rcvvar->sack_table[i].right_edge))
+			seq = rcvvar->sack_table[i].right_edge;
+	}
 
-		// left_edge is further left than i.left_edge
-		if (ld < 0) {
-			newly_sacked += (-ld);
-			// expand i to account for this extra space, and merge with any
-			// blocks whose right_edge = i.left (i.e. blocks are touching)
-			cur_stream->rcvvar->sack_table[i].left_edge = left_edge;
-			for (j=0; j < MAX_SACK_ENTRY; j++) {
-				if (cur_stream->rcvvar->sack_table[j].right_edge == left_edge) {
-					cur_stream->rcvvar->sack_table[i].left_edge = cur_stream->rcvvar->sack_table[j].right_edge;
-					cur_stream->rcvvar->sack_table[j].left_edge = 0;
-					cur_stream->rcvvar->sack_table[j].right_edge = 0;
-					break;
-				}
+	return FALSE;
+}
+/*----------------------------------------------------------------------------*/
+/* 
+ * Estimates the number of outstanding bytes in the network (RFC 6675 pipe):
+ * the bytes neither sacked nor deemed lost, plus the lost bytes that are 
+ * already retransmitted (those below high_rxt).
+ */
+uint32_t
+GetSACKPipe(tcp_stream *cur_stream)
+{
+	struct tcp_send_vars *sndvar = cur_stream->sndvar;
+	struct tcp_recv_vars *rcvvar = cur_stream->rcvvar;
+	uint32_t lost = 0;
+	uint32_t seq, len;
+	uint32_t outstanding;
+
+	outstanding = sndvar->snd_max - sndvar->snd_una - rcvvar->sacked_bytes;
+
+	seq = sndvar->high_rxt;
+	while (GetNextLostSeq(cur_stream, seq, &seq, &len)) {
+		lost += len;
+		seq += len;
+	}
+
+	return (lost < outstanding) ? outstanding - lost : 0;
+}
+/*----------------------------------------------------------------------------*/
+static inline int
+AddSACKBlock(struct sack_entry *blocks, int n, const struct fragment_ctx *frag)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (blocks[i].left_edge == frag->seq)
+			return n;
+	}
+	blocks[n].left_edge = frag->seq;
+	blocks[n].right_edge = frag->seq + frag->len;
+	return n + 1;
+}
+/*---------------------------------------------------------------------------*/
+/* 
+ * Rebuilds the SACK blocks to advertise from the out-of-order fragments
+ * of the receive buffer (RFC 2018). The first block holds the segment 
+ * that just arrived, followed by the blocks reported most recently and 
+ * then the remaining fragments in sequence order.
+ * Should be called with the read lock held, right after RBPut().
+ */
+void
+UpdateSACKBlocks(tcp_stream *cur_stream, uint32_t seq)
+{
+	struct tcp_recv_vars *rcvvar = cur_stream->rcvvar;
+	struct sack_entry blocks[MAX_RCV_SACK_ENTRY];
+	struct fragment_ctx *frag;
+	int i, n = 0;
+
+	if (!rcvvar->rcvbuf) {
+		rcvvar->rcv_sacks = 0;
+		return;
+	}
+
+	/* the block containing the segment that triggered this ack */
+	if (TCP_SEQ_GT(seq, cur_stream->rcv_nxt)) {
+		for (frag = rcvvar->rcvbuf->fctx; frag; frag = frag->next) {
+			if (TCP_SEQ_LEQ(frag->seq, seq) && 
+					TCP_SEQ_LT(seq, frag->seq + frag->len)) {
+				n = AddSACKBlock(blocks, n, frag);
+				break;
 			}
 		}
-		// right edge is further right than i.right_edge
-		if (rd > 0) {
-			newly_sacked += rd;
-			// expand i to account for this extra space, and merge with any
-			// blocks whose left_edge = i.right (i.e. blocks are touching)
-			cur_stream->rcvvar->sack_table[i].right_edge = right_edge;
-			for (j=0; j < MAX_SACK_ENTRY; j++) {
-				if (cur_stream->rcvvar->sack_table[j].left_edge == right_edge) {
-					cur_stream->rcvvar->sack_table[i].right_edge = cur_stream->rcvvar->sack_table[j].left_edge;
-					cur_stream->rcvvar->sack_table[j].left_edge = 0;
-					cur_stream->rcvvar->sack_table[j].right_edge = 0;
-					break;
-				}
+	}
+
+	/* previously reported blocks (they may have grown since) */
+	for (i = 0; i < rcvvar->rcv_sacks && n < MAX_RCV_SACK_ENTRY; i++) {
+		uint32_t left = rcvvar->rcv_sack[i].left_edge;
+
+		if (TCP_SEQ_LEQ(left, cur_stream->rcv_nxt))
+			continue;
+		for (frag = rcvvar->rcvbuf->fctx; frag; frag = frag->next) {
+			if (TCP_SEQ_LEQ(frag->seq, left) && 
+					TCP_SEQ_LT(left, frag->seq + frag->len)) {
+				n = AddSACKBlock(blocks, n, frag);
+				break;
 			}
 		}
 	}
-	if (newly_sacked == 0) {
-		cur_stream->rcvvar->sack_table
-			[cur_stream->rcvvar->sacks].left_edge = left_edge;
-		cur_stream->rcvvar->sack_table
-			[cur_stream->rcvvar->sacks].right_edge = right_edge;
-		cur_stream->rcvvar->sacks++;
-		newly_sacked = (right_edge - left_edge);
-	}
 
-	//fprintf(stderr, "SACK (%u,%u)->%u/%u\n", left_edge, right_edge, newly_sacked, newly_sacked / 1448);
-	cur_stream->rcvvar->sacked_pkts += (newly_sacked / cur_stream->sndvar->mss);
+	/* fill up with the other out-of-order fragments */
+	for (frag = rcvvar->rcvbuf->fctx; 
+			frag && n < MAX_RCV_SACK_ENTRY; frag = frag->next) {
+		if (TCP_SEQ_GT(frag->seq, cur_stream->rcv_nxt))
+			n = AddSACKBlock(blocks, n, frag);
+	}
 
-	return;
+	memcpy(rcvvar->rcv_sack, blocks, n * sizeof(struct sack_entry));
+	rcvvar->rcv_sacks = n;
 }
-/*----------------------------------------------------------------------------*/
+/*---------------------------------------------------------------------------*/
 int
-GenerateSACKOption(tcp_stream *cur_stream, uint8_t *tcpopt)
+GenerateSACKOption(tcp_stream *cur_stream, uint8_t *tcpopt, int nblocks)
 {
-	// TODO
-	return 0;
+	struct sack_entry *blocks = cur_stream->rcvvar->rcv_sack;
+	uint32_t *edges;
+	int i;
+
+	tcpopt[0] = TCP_OPT_NOP;
+	tcpopt[1] = TCP_OPT_NOP;
+	tcpopt[2] = TCP_OPT_SACK;
+	tcpopt[3] = 2 + nblocks * TCP_OPT_SACK_BLOCK_LEN;
+
+	edges = (uint32_t *)(tcpopt + 4);
+	for (i = 0; i < nblocks; i++) {
+		edges[2 * i] = htonl(blocks[i].left_edge);
+		edges[2 * i + 1] = htonl(blocks[i].right_edge);
+	}
+
+	return 4 + nblocks * TCP_OPT_SACK_BLOCK_LEN;
 }
 /*----------------------------------------------------------------------------*/
 void
@@ -327,3 +563,68 @@ PrintTCPOptions(uint8_t *tcpopt, int len)
 		}
 	}
 }
+/*---------------------------------------------------------------------------*/
+#define ROTL64(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+#define SIPROUND \
+	do { \
+		v0 += v1; v1 = ROTL64(v1, 13); v1 ^= v0; v0 = ROTL64(v0, 32); \
+		v2 += v3; v3 = ROTL64(v3, 16); v3 ^= v2; \
+		v0 += v3; v3 = ROTL64(v3, 21); v3 ^= v0; \
+		v2 += v1; v1 = ROTL64(v1, 17); v1 ^= v2; v2 = ROTL64(v2, 32); \
+	} while (0)
+/*---------------------------------------------------------------------------*/
+/* SipHash-2-4 of a message of nwords 64-bit words */
+uint64_t
+SipHash24(const uint64_t key[2], const uint64_t *m, int nwords)
+{
+	uint64_t v0 = key[0] ^ 0x736f6d6570736575ULL;
+	uint64_t v1 = key[1] ^ 0x646f72616e646f6dULL;
+	uint64_t v2 = key[0] ^ 0x6c7967656e657261ULL;
+	uint64_t v3 = key[1] ^ 0x7465646279746573ULL;
+	uint64_t b = (uint64_t)(nwords * 8) << 56;
+	int i;
+
+	for (i = 0; i < nwords; i++) {
+		v3 ^= m[i];
+		SIPROUND;
+		SIPROUND;
+		v0 ^= m[i];
+	}
+
+	v3 ^= b;
+	SIPROUND;
+	SIPROUND;
+	v0 ^= b;
+
+	v2 ^= 0xff;
+	SIPROUND;
+	SIPROUND;
+	SIPROUND;
+	SIPROUND;
+
+	return v0 ^ v1 ^ v2 ^ v3;
+}
+/*---------------------------------------------------------------------------*/
+/* 
+ * Fills a SipHash key from /dev/urandom. Returns FALSE if that failed and 
+ * the key was derived from the clock and the pid instead.
+ */
+int
+GenerateSecretKey(uint64_t key[2])
+{
+	struct timespec ts;
+	int fd, ret = -1;
+
+	fd = open("/dev/urandom", O_RDONLY);
+	if (fd >= 0) {
+		ret = read(fd, key, 2 * sizeof(uint64_t));
+		close(fd);
+	}
+	if (ret == 2 * sizeof(uint64_t))
+		return TRUE;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	key[0] = ((uint64_t)ts.tv_sec << 32) ^ ts.tv_nsec;
+	key[1] = ((uint64_t)getpid() << 32) ^ (uintptr_t)&ts;
+	return FALSE;
+}
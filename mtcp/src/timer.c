@@ -1,6 +1,11 @@
 #include "timer.h"
 #include "tcp_in.h"
 #include "tcp_out.h"
+#include "tcp_util.h"
+#include "tcp_cc.h"
+#include "tcp_rack.h"
+#include "tcp_fastopen.h"
+#include "tcp_timewait.h"
 #include "stat.h"
 #include "debug.h"
 #if USE_CCP
@@ -15,33 +20,115 @@
 #endif
 
 /*----------------------------------------------------------------------------*/
-struct rto_hashstore*
-InitRTOHashstore()
+struct timer_wheel *
+InitTimerWheel(uint32_t cur_ts)
 {
 	int i;
-	struct rto_hashstore* hs = calloc(1, sizeof(struct rto_hashstore));
-	if (!hs) {
-		TRACE_ERROR("calloc: InitHashStore");
-		return 0;
+	struct timer_wheel *tw = calloc(1, sizeof(struct timer_wheel));
+	if (!tw) {
+		TRACE_ERROR("calloc: InitTimerWheel");
+		return NULL;
 	}
 
-	for (i = 0; i < RTO_HASH; i++)
-		TAILQ_INIT(&hs->rto_list[i]);
-		
-	TAILQ_INIT(&hs->rto_list[RTO_HASH]);
+	for (i = 0; i < TW_NUM_SLOTS; i++)
+		TAILQ_INIT(&tw->slot[i]);
+	tw->now = cur_ts;
 
-	return hs;
+	return tw;
 }
 /*----------------------------------------------------------------------------*/
-inline void 
-AddtoRTOList(mtcp_manager_t mtcp, tcp_stream *cur_stream)
+void
+DestroyTimerWheel(struct timer_wheel *tw)
+{
+	free(tw);
+}
+/*----------------------------------------------------------------------------*/
+static inline void
+InitTimer(struct tcp_timer *timer, tcp_stream *cur_stream, uint8_t type)
+{
+	timer->stream = cur_stream;
+	timer->slot = -1;
+	timer->type = type;
+}
+/*----------------------------------------------------------------------------*/
+inline void
+InitStreamTimers(tcp_stream *cur_stream)
+{
+	InitTimer(&cur_stream->sndvar->timer, cur_stream, TIMER_RTO);
+	InitTimer(&cur_stream->sndvar->to_timer, cur_stream, TIMER_TIMEOUT);
+	InitTimer(&cur_stream->sndvar->dack_timer, cur_stream, TIMER_DELAYED_ACK);
+	InitTimer(&cur_stream->sndvar->pace_timer, cur_stream, TIMER_PACE);
+#if TCP_RACK_TLP_ENABLED
+	InitTimer(&cur_stream->sndvar->rack_timer, cur_stream, TIMER_RACK);
+#endif
+}
+/*----------------------------------------------------------------------------*/
+/* 
+ * Pick the slot of a timer. A timer that expires within TW_SLOTS ticks
+ * goes to level 0, otherwise to the lowest level that can hold it.
+ * Already expired timers are put on the slot of the next tick.
+ */
+static inline int
+TimerSlot(struct timer_wheel *tw, uint32_t expire)
+{
+	uint32_t delta;
+	int level;
+
+	if ((int32_t)(expire - tw->now) < 0)
+		expire = tw->now;
+	delta = expire - tw->now;
+
+	for (level = 0; level < TW_LEVELS - 1; level++) {
+		if (delta < (1U << (TW_BITS * (level + 1))))
+			break;
+	}
+
+	return level * TW_SLOTS + ((expire >> (TW_BITS * level)) & TW_MASK);
+}
+/*----------------------------------------------------------------------------*/
+static inline void
+LinkTimer(struct timer_wheel *tw, struct tcp_timer *timer, int slot)
+{
+	timer->slot = slot;
+	TAILQ_INSERT_TAIL(&tw->slot[slot], timer, link);
+	tw->level_cnt[slot / TW_SLOTS]++;
+}
+/*----------------------------------------------------------------------------*/
+static inline void
+UnlinkTimer(struct timer_wheel *tw, struct tcp_timer *timer)
 {
-	if (!mtcp->rto_list_cnt) {
-		mtcp->rto_store->rto_now_idx = 0;
-		mtcp->rto_store->rto_now_ts = cur_stream->sndvar->ts_rto;
+	TAILQ_REMOVE(&tw->slot[timer->slot], timer, link);
+	tw->level_cnt[timer->slot / TW_SLOTS]--;
+	timer->slot = -1;
+}
+/*----------------------------------------------------------------------------*/
+static inline void
+ArmTimer(struct timer_wheel *tw, struct tcp_timer *timer, uint32_t expire)
+{
+	if (timer->slot >= 0) {
+		UnlinkTimer(tw, timer);
+		tw->cnt--;
 	}
 
-	if (cur_stream->on_rto_idx < 0 ) {
+	timer->expire = expire;
+	LinkTimer(tw, timer, TimerSlot(tw, expire));
+	tw->cnt++;
+}
+/*----------------------------------------------------------------------------*/
+static inline void
+CancelTimer(struct timer_wheel *tw, struct tcp_timer *timer)
+{
+	if (timer->slot < 0)
+		return;
+
+	UnlinkTimer(tw, timer);
+	tw->cnt--;
+}
+/*----------------------------------------------------------------------------*/
+inline void 
+AddtoRTOList(mtcp_manager_t mtcp, tcp_stream *cur_stream)
+{
+	if (!cur_stream->on_rto_list) {
 		if (cur_stream->on_timewait_list) {
 			TRACE_ERROR("Stream %u: cannot be in both "
 					"rto and timewait list.\n", cur_stream->id);
@@ -51,17 +138,10 @@ AddtoRTOList(mtcp_manager_t mtcp, tcp_stream *cur_stream)
 			return;
 		}
 
-		int diff = (int32_t)(cur_stream->sndvar->ts_rto - mtcp->rto_store->rto_now_ts);
-		if (diff < RTO_HASH) {
-			int offset= (diff + mtcp->rto_store->rto_now_idx) % RTO_HASH;
-			cur_stream->on_rto_idx = offset;
-			TAILQ_INSERT_TAIL(&(mtcp->rto_store->rto_list[offset]), 
-					cur_stream, sndvar->timer_link);
-		} else {
-			cur_stream->on_rto_idx = RTO_HASH;
-			TAILQ_INSERT_TAIL(&(mtcp->rto_store->rto_list[RTO_HASH]), 
-					cur_stream, sndvar->timer_link);
-		}
+		cur_stream->on_rto_list = TRUE;
+		cur_stream->sndvar->timer.type = TIMER_RTO;
+		ArmTimer(mtcp->timer_wheel, 
+				&cur_stream->sndvar->timer, cur_stream->sndvar->ts_rto);
 		mtcp->rto_list_cnt++;
 	}
 }
@@ -69,15 +149,12 @@ AddtoRTOList(mtcp_manager_t mtcp, tcp_stream *cur_stream)
 inline void 
 RemoveFromRTOList(mtcp_manager_t mtcp, tcp_stream *cur_stream)
 {
-	if (cur_stream->on_rto_idx < 0) {
-//		assert(0);
+	if (!cur_stream->on_rto_list) {
 		return;
 	}
-	
-	TAILQ_REMOVE(&mtcp->rto_store->rto_list[cur_stream->on_rto_idx], 
-			cur_stream, sndvar->timer_link);
-	cur_stream->on_rto_idx = -1;
 
+	CancelTimer(mtcp->timer_wheel, &cur_stream->sndvar->timer);
+	cur_stream->on_rto_list = FALSE;
 	mtcp->rto_list_cnt--;
 }
 /*----------------------------------------------------------------------------*/
@@ -86,15 +163,10 @@ AddtoTimewaitList(mtcp_manager_t mtcp, tcp_stream *cur_stream, uint32_t cur_ts)
 {
 	cur_stream->rcvvar->ts_tw_expire = cur_ts + CONFIG.tcp_timewait;
 
-	if (cur_stream->on_timewait_list) {
-		// Update list in sorted way by ts_tw_expire
-		TAILQ_REMOVE(&mtcp->timewait_list, cur_stream, sndvar->timer_link);
-		TAILQ_INSERT_TAIL(&mtcp->timewait_list, cur_stream, sndvar->timer_link);	
-	} else {
-		if (cur_stream->on_rto_idx >= 0) {
+	if (!cur_stream->on_timewait_list) {
+		if (cur_stream->on_rto_list) {
 			TRACE_DBG("Stream %u: cannot be in both "
 					"timewait and rto list.\n", cur_stream->id);
-			//assert(0);
 #ifdef DUMP_STREAM
 			DumpStream(mtcp, cur_stream);
 #endif
@@ -102,9 +174,14 @@ AddtoTimewaitList(mtcp_manager_t mtcp, tcp_stream *cur_stream, uint32_t cur_ts)
 		}
 
 		cur_stream->on_timewait_list = TRUE;
-		TAILQ_INSERT_TAIL(&mtcp->timewait_list, cur_stream, sndvar->timer_link);
+		cur_stream->sndvar->timer.type = TIMER_TIMEWAIT;
 		mtcp->timewait_list_cnt++;
 	}
+
+	/* the stream only stays until the ack of the FIN is out; then it 
+	   hands over to a TIME_WAIT entry (see HandleTimewaitExpire). 
+	   (re)arming an armed timer just moves it to the new slot */
+	ArmTimer(mtcp->timer_wheel, &cur_stream->sndvar->timer, cur_ts);
 }
 /*----------------------------------------------------------------------------*/
 inline void 
@@ -115,7 +192,7 @@ RemoveFromTimewaitList(mtcp_manager_t mtcp, tcp_stream *cur_stream)
 		return;
 	}
 	
-	TAILQ_REMOVE(&mtcp->timewait_list, cur_stream, sndvar->timer_link);
+	CancelTimer(mtcp->timer_wheel, &cur_stream->sndvar->timer);
 	cur_stream->on_timewait_list = FALSE;
 	mtcp->timewait_list_cnt--;
 }
@@ -129,7 +206,8 @@ AddtoTimeoutList(mtcp_manager_t mtcp, tcp_stream *cur_stream)
 	}
 
 	cur_stream->on_timeout_list = TRUE;
-	TAILQ_INSERT_TAIL(&mtcp->timeout_list, cur_stream, sndvar->timeout_link);
+	ArmTimer(mtcp->timer_wheel, &cur_stream->sndvar->to_timer, 
+			cur_stream->last_active_ts + CONFIG.tcp_timeout);
 	mtcp->timeout_list_cnt++;
 }
 /*----------------------------------------------------------------------------*/
@@ -138,7 +216,7 @@ RemoveFromTimeoutList(mtcp_manager_t mtcp, tcp_stream *cur_stream)
 {
 	if (cur_stream->on_timeout_list) {
 		cur_stream->on_timeout_list = FALSE;
-		TAILQ_REMOVE(&mtcp->timeout_list, cur_stream, sndvar->timeout_link);
+		CancelTimer(mtcp->timer_wheel, &cur_stream->sndvar->to_timer);
 		mtcp->timeout_list_cnt--;
 	}
 }
@@ -146,13 +224,71 @@ RemoveFromTimeoutList(mtcp_manager_t mtcp, tcp_stream *cur_stream)
 inline void 
 UpdateTimeoutList(mtcp_manager_t mtcp, tcp_stream *cur_stream)
 {
-	if (cur_stream->on_timeout_list) {
-		TAILQ_REMOVE(&mtcp->timeout_list, cur_stream, sndvar->timeout_link);
-		TAILQ_INSERT_TAIL(&mtcp->timeout_list, cur_stream, sndvar->timeout_link);
-	}
+	/* 
+	 * The timeout timer is not moved on every packet. The caller has 
+	 * already refreshed last_active_ts, and the timer is pushed forward 
+	 * lazily when it fires (see HandleTimeout).
+	 */
 }
 /*----------------------------------------------------------------------------*/
 inline void
+AddtoDelayedACKTimer(mtcp_manager_t mtcp, tcp_stream *cur_stream, uint32_t expire)
+{
+	if (cur_stream->on_dack_timer)
+		return;
+
+	cur_stream->on_dack_timer = TRUE;
+	ArmTimer(mtcp->timer_wheel, &cur_stream->sndvar->dack_timer, expire);
+}
+/*----------------------------------------------------------------------------*/
+inline void
+RemoveFromDelayedACKTimer(mtcp_manager_t mtcp, tcp_stream *cur_stream)
+{
+	if (!cur_stream->on_dack_timer)
+		return;
+
+	cur_stream->on_dack_timer = FALSE;
+	CancelTimer(mtcp->timer_wheel, &cur_stream->sndvar->dack_timer);
+}
+/*----------------------------------------------------------------------------*/
+inline void
+AddtoPaceTimer(mtcp_manager_t mtcp, tcp_stream *cur_stream, uint32_t expire)
+{
+	cur_stream->on_pace_timer = TRUE;
+	ArmTimer(mtcp->timer_wheel, &cur_stream->sndvar->pace_timer, expire);
+}
+/*----------------------------------------------------------------------------*/
+inline void
+RemoveFromPaceTimer(mtcp_manager_t mtcp, tcp_stream *cur_stream)
+{
+	if (!cur_stream->on_pace_timer)
+		return;
+
+	cur_stream->on_pace_timer = FALSE;
+	CancelTimer(mtcp->timer_wheel, &cur_stream->sndvar->pace_timer);
+}
+/*----------------------------------------------------------------------------*/
+#if TCP_RACK_TLP_ENABLED
+inline void
+AddtoRACKTimer(mtcp_manager_t mtcp, tcp_stream *cur_stream, uint32_t expire)
+{
+	/* (re)arming an armed timer just moves it to the new slot */
+	cur_stream->on_rack_timer = TRUE;
+	ArmTimer(mtcp->timer_wheel, &cur_stream->sndvar->rack_timer, expire);
+}
+/*----------------------------------------------------------------------------*/
+inline void
+RemoveFromRACKTimer(mtcp_manager_t mtcp, tcp_stream *cur_stream)
+{
+	if (!cur_stream->on_rack_timer)
+		return;
+
+	cur_stream->on_rack_timer = FALSE;
+	CancelTimer(mtcp->timer_wheel, &cur_stream->sndvar->rack_timer);
+}
+#endif /* TCP_RACK_TLP_ENABLED */
+/*----------------------------------------------------------------------------*/
+inline void
 UpdateRetransmissionTimer(mtcp_manager_t mtcp, 
 		tcp_stream *cur_stream, uint32_t cur_ts)
 {
@@ -161,7 +297,7 @@ UpdateRetransmissionTimer(mtcp_manager_t mtcp,
 	cur_stream->sndvar->nrtx = 0;
 
 	/* if in rto list, remove it */
-	if (cur_stream->on_rto_idx >= 0) {
+	if (cur_stream->on_rto_list) {
 		RemoveFromRTOList(mtcp, cur_stream);
 	}
 
@@ -203,7 +339,10 @@ HandleRTO(mtcp_manager_t mtcp, uint32_t cur_ts, tcp_stream *cur_stream)
 	} else {
 		/* if it exceeds the threshold, destroy and notify to application */
 		TRACE_RTO("Stream %d: Exceed MAX_RTX\n", cur_stream->id);
-		if (cur_stream->state < TCP_ST_ESTABLISHED) {
+		/* an accepted fast open child has a socket before ESTABLISHED 
+		   and is told like an established connection */
+		if (cur_stream->state < TCP_ST_ESTABLISHED && 
+				!(TFO_EARLY_CHILD(cur_stream) && cur_stream->socket)) {
 			cur_stream->state = TCP_ST_CLOSED;
 			cur_stream->close_reason = TCP_CONN_FAIL;
 			DestroyTCPStream(mtcp, cur_stream);
@@ -222,6 +361,15 @@ HandleRTO(mtcp_manager_t mtcp, uint32_t cur_ts, tcp_stream *cur_stream)
 	if (cur_stream->sndvar->nrtx > cur_stream->sndvar->max_nrtx) {
 		cur_stream->sndvar->max_nrtx = cur_stream->sndvar->nrtx;
 	}
+	/* Karn's algorithm: no rtt sample across retransmissions */
+	cur_stream->rcvvar->rtt_sampling = FALSE;
+#if TCP_OPT_SACK_ENABLED
+	/* go back to snd_una, the receiver may have reneged the sacked data */
+	ResetSACKScoreboard(cur_stream);
+#endif
+#if TCP_RACK_TLP_ENABLED
+	RACKOnRTO(mtcp, cur_stream);
+#endif
 
 	/* update rto timestamp */
 	if (cur_stream->state >= TCP_ST_ESTABLISHED) {
@@ -231,6 +379,9 @@ HandleRTO(mtcp_manager_t mtcp, uint32_t cur_ts, tcp_stream *cur_stream)
 		rto_prev = cur_stream->sndvar->rto;
 		cur_stream->sndvar->rto = ((cur_stream->rcvvar->srtt >> 3) + 
 				cur_stream->rcvvar->rttvar) << backoff;
+		if (cur_stream->sndvar->rto > TCP_RTO_MAX) {
+			cur_stream->sndvar->rto = TCP_RTO_MAX;
+		}
 		if (cur_stream->sndvar->rto <= 0) {
 			TRACE_RTO("Stream %d current rto: %u, prev: %u, state: %s\n", 
 					cur_stream->id, cur_stream->sndvar->rto, rto_prev, 
@@ -246,11 +397,7 @@ HandleRTO(mtcp_manager_t mtcp, uint32_t cur_ts, tcp_stream *cur_stream)
 	//cur_stream->sndvar->ts_rto = cur_ts + cur_stream->sndvar->rto;
 
 	/* reduce congestion window and ssthresh */
-	cur_stream->sndvar->ssthresh = MIN(cur_stream->sndvar->cwnd, cur_stream->sndvar->peer_wnd) / 2;
-	if (cur_stream->sndvar->ssthresh < (2 * cur_stream->sndvar->mss)) {
-		cur_stream->sndvar->ssthresh = cur_stream->sndvar->mss * 2;
-	}
-	cur_stream->sndvar->cwnd = cur_stream->sndvar->mss;
+	cur_stream->sndvar->cc->on_rto(cur_stream, cur_ts);
 	TRACE_CONG("Stream %d Timeout. cwnd: %u, ssthresh: %u\n", 
 			cur_stream->id, cur_stream->sndvar->cwnd, cur_stream->sndvar->ssthresh);
 
@@ -352,172 +499,256 @@ HandleRTO(mtcp_manager_t mtcp, uint32_t cur_ts, tcp_stream *cur_stream)
 
 	} else {
 		AddtoControlList(mtcp, cur_stream, cur_ts);
+		/* an accepted fast open resends its data after the SYN/ACK */
+		if (TFO_EARLY_CHILD(cur_stream) && 
+				cur_stream->sndvar->sndbuf && cur_stream->sndvar->sndbuf->len > 0) {
+			AddtoSendList(mtcp, cur_stream);
+		}
 	}
 
 	return 0;
 }
 /*----------------------------------------------------------------------------*/
-static inline void 
-RearrangeRTOStore(mtcp_manager_t mtcp) {
-	tcp_stream *walk, *next;
-	struct rto_head* rto_list = &mtcp->rto_store->rto_list[RTO_HASH];
-	int cnt = 0;
-
-	for (walk = TAILQ_FIRST(rto_list);
-			walk != NULL; walk = next) {
-		next = TAILQ_NEXT(walk, sndvar->timer_link);
-
-		int diff = (int32_t)(mtcp->rto_store->rto_now_ts - walk->sndvar->ts_rto);
-		if (diff < RTO_HASH) {
-			int offset = (diff + mtcp->rto_store->rto_now_idx) % RTO_HASH;
-			TAILQ_REMOVE(&mtcp->rto_store->rto_list[RTO_HASH],
-					            walk, sndvar->timer_link);
-			walk->on_rto_idx = offset;
-			TAILQ_INSERT_TAIL(&(mtcp->rto_store->rto_list[offset]),
-					walk, sndvar->timer_link);
-		}
-		cnt++;
-	}	
+static inline void
+HandleTimewaitExpire(mtcp_manager_t mtcp, uint32_t cur_ts, tcp_stream *cur_stream)
+{
+	/* wait until the pending control packet (e.g., ACK of FIN) goes out */
+	if (cur_stream->sndvar->on_control_list) {
+		ArmTimer(mtcp->timer_wheel, &cur_stream->sndvar->timer, cur_ts + 1);
+		return;
+	}
+
+	cur_stream->on_timewait_list = FALSE;
+	mtcp->timewait_list_cnt--;
+
+	/* a compact entry waits out the rest of TIME_WAIT */
+	if (TCP_SEQ_GT(cur_stream->rcvvar->ts_tw_expire, cur_ts))
+		EnterTimewait(mtcp, cur_stream, cur_ts);
+
+	cur_stream->state = TCP_ST_CLOSED;
+	cur_stream->close_reason = TCP_ACTIVE_CLOSE;
+	TRACE_STATE("Stream %d: TCP_ST_CLOSED\n", cur_stream->id);
+	DestroyTCPStream(mtcp, cur_stream);
 }
 /*----------------------------------------------------------------------------*/
-void
-CheckRtmTimeout(mtcp_manager_t mtcp, uint32_t cur_ts, int thresh)
+static inline void
+HandleTimeout(mtcp_manager_t mtcp, uint32_t cur_ts, tcp_stream *cur_stream)
 {
-	tcp_stream *walk, *next;
-	struct rto_head* rto_list;
-	int cnt;
-	
-	if (!mtcp->rto_list_cnt) {
+	/* the stream was active after arming the timer: push it forward */
+	if ((int32_t)(cur_ts - cur_stream->last_active_ts) < CONFIG.tcp_timeout) {
+		ArmTimer(mtcp->timer_wheel, &cur_stream->sndvar->to_timer, 
+				cur_stream->last_active_ts + CONFIG.tcp_timeout);
 		return;
 	}
 
-	STAT_COUNT(mtcp->runstat.rounds_rtocheck);
+	cur_stream->on_timeout_list = FALSE;
+	mtcp->timeout_list_cnt--;
+	cur_stream->state = TCP_ST_CLOSED;
+	cur_stream->close_reason = TCP_TIMEDOUT;
+	if (cur_stream->socket) {
+		RaiseErrorEvent(mtcp, cur_stream);
+	} else {
+		DestroyTCPStream(mtcp, cur_stream);
+	}
+}
+/*----------------------------------------------------------------------------*/
+static inline void
+HandleDelayedACK(mtcp_manager_t mtcp, uint32_t cur_ts, tcp_stream *cur_stream)
+{
+	cur_stream->on_dack_timer = FALSE;
+	EnqueueACK(mtcp, cur_stream, cur_ts, ACK_OPT_AGGREGATE);
+}
+/*----------------------------------------------------------------------------*/
+static inline void
+FireTimer(mtcp_manager_t mtcp, uint32_t cur_ts, struct tcp_timer *timer)
+{
+	tcp_stream *cur_stream = timer->stream;
+
+	switch (timer->type) {
+	case TIMER_RTO:
+		cur_stream->on_rto_list = FALSE;
+		mtcp->rto_list_cnt--;
+		HandleRTO(mtcp, cur_ts, cur_stream);
+		break;
+
+	case TIMER_TIMEWAIT:
+		HandleTimewaitExpire(mtcp, cur_ts, cur_stream);
+		break;
+
+	case TIMER_TIMEOUT:
+		HandleTimeout(mtcp, cur_ts, cur_stream);
+		break;
+
+	case TIMER_DELAYED_ACK:
+		HandleDelayedACK(mtcp, cur_ts, cur_stream);
+		break;
+
+	case TIMER_PACE:
+		/* the departure time of the next paced packet */
+		cur_stream->on_pace_timer = FALSE;
+		if (cur_stream->sndvar->sndbuf && cur_stream->sndvar->sndbuf->len > 0)
+			AddtoSendList(mtcp, cur_stream);
+		break;
 
-	cnt = 0;
-			
-	while (1) {
-		
-		rto_list = &mtcp->rto_store->rto_list[mtcp->rto_store->rto_now_idx];
-		if ((int32_t)(cur_ts - mtcp->rto_store->rto_now_ts) < 0) {
-			break;
-		}
-		
-		for (walk = TAILQ_FIRST(rto_list);
-				walk != NULL; walk = next) {
-			if (++cnt > thresh) {
-				break;
-			}
-			next = TAILQ_NEXT(walk, sndvar->timer_link);
+#if TCP_RACK_TLP_ENABLED
+	case TIMER_RACK:
+		cur_stream->on_rack_timer = FALSE;
+		HandleRACKTimer(mtcp, cur_ts, cur_stream);
+		break;
+#endif
 
-			TRACE_LOOP("Inside rto list. cnt: %u, stream: %d\n", 
-					cnt, walk->s_id);
+	default:
+		TRACE_ERROR("Stream %d: unknown timer type %u\n", 
+				cur_stream->id, timer->type);
+		break;
+	}
+}
+/*----------------------------------------------------------------------------*/
+/* 
+ * Move the timers of an upper level slot down to the lower levels.
+ * Returns the index of the slot so that the caller can keep cascading 
+ * while the index wraps around to zero.
+ */
+static inline int
+Cascade(struct timer_wheel *tw, int level)
+{
+	struct tcp_timer *timer;
+	int idx;
 
-			if (walk->on_rto_idx >= 0) {
-				TAILQ_REMOVE(rto_list, walk, sndvar->timer_link);
-				mtcp->rto_list_cnt--;
-				walk->on_rto_idx = -1;
-				HandleRTO(mtcp, cur_ts, walk);
-			} else {
-				TRACE_ERROR("Stream %d: not on rto list.\n", walk->id);
-#ifdef DUMP_STREAM
-				DumpStream(mtcp, walk);
-#endif
-			}
-		}
+	idx = (tw->now >> (TW_BITS * level)) & TW_MASK;
 
-		if (cnt > thresh) {
-			break;
-		} else {
-			mtcp->rto_store->rto_now_idx = (mtcp->rto_store->rto_now_idx + 1) % RTO_HASH;
-			mtcp->rto_store->rto_now_ts++;
-			if (!(mtcp->rto_store->rto_now_idx % 1000)) {
-				RearrangeRTOStore(mtcp);
-			}
-		}
+	while ((timer = TAILQ_FIRST(&tw->slot[level * TW_SLOTS + idx])) != NULL) {
+		UnlinkTimer(tw, timer);
+		LinkTimer(tw, timer, TimerSlot(tw, timer->expire));
+	}
 
+	return idx;
+}
+/*----------------------------------------------------------------------------*/
+/* 
+ * When level 0 is empty, nothing can expire before the next slot of the 
+ * lowest non-empty level is cascaded, so skip the ticks in between.
+ */
+static inline uint32_t
+NextTick(struct timer_wheel *tw)
+{
+	uint32_t span;
+	int level;
+
+	for (level = 0; level < TW_LEVELS - 1; level++) {
+		if (tw->level_cnt[level])
+			break;
 	}
+	if (level == 0)
+		return tw->now;
 
-	TRACE_ROUND("Checking retransmission timeout. cnt: %d\n", cnt);
+	span = 1U << (TW_BITS * level);
+	return (tw->now & ~(span - 1)) + span;
 }
 /*----------------------------------------------------------------------------*/
-void 
-CheckTimewaitExpire(mtcp_manager_t mtcp, uint32_t cur_ts, int thresh)
+void
+CheckTimers(mtcp_manager_t mtcp, uint32_t cur_ts, int thresh)
 {
-	tcp_stream *walk, *next;
+	struct timer_wheel *tw = mtcp->timer_wheel;
+	struct timer_head *expired;
+	struct tcp_timer *timer;
+	uint32_t next;
+	int level;
 	int cnt;
 
-	STAT_COUNT(mtcp->runstat.rounds_twcheck);
+	if (!tw->cnt) {
+		/* nothing to cascade, jump to the current tick */
+		tw->now = cur_ts;
+		return;
+	}
+
+	STAT_COUNT(mtcp->runstat.rounds_rtocheck);
 
 	cnt = 0;
+	while ((int32_t)(cur_ts - tw->now) >= 0 && cnt < thresh) {
 
-	for (walk = TAILQ_FIRST(&mtcp->timewait_list); 
-				walk != NULL; walk = next) {
-		if (++cnt > thresh)
-			break;
-		next = TAILQ_NEXT(walk, sndvar->timer_link);
-		
-		TRACE_LOOP("Inside timewait list. cnt: %u, stream: %d\n", 
-				cnt, walk->s_id);
-		
-		if (walk->on_timewait_list) {
-			if ((int32_t)(cur_ts - walk->rcvvar->ts_tw_expire) >= 0) {
-				if (!walk->sndvar->on_control_list) {
-					
-					TAILQ_REMOVE(&mtcp->timewait_list, walk, sndvar->timer_link);
-					walk->on_timewait_list = FALSE;
-					mtcp->timewait_list_cnt--;
-
-					walk->state = TCP_ST_CLOSED;
-					walk->close_reason = TCP_ACTIVE_CLOSE;
-					TRACE_STATE("Stream %d: TCP_ST_CLOSED\n", walk->id);
-					DestroyTCPStream(mtcp, walk);
-				}
-			} else {
+		/* refill level 0 from the upper levels on wrap around */
+		if ((tw->now & TW_MASK) == 0) {
+			for (level = 1; level < TW_LEVELS; level++) {
+				if (Cascade(tw, level) != 0)
+					break;
+			}
+		}
+
+		next = NextTick(tw);
+		if (next != tw->now) {
+			if ((int32_t)(cur_ts - next) < 0) {
+				tw->now = cur_ts + 1;
 				break;
 			}
-		} else {
-			TRACE_ERROR("Stream %d: not on timewait list.\n", walk->id);
-#ifdef DUMP_STREAM
-			DumpStream(mtcp, walk);
-#endif
+			tw->now = next;
+			continue;
+		}
+
+		/* 
+		 * Move the current slot to the expired list first: the handlers 
+		 * may re-arm timers, and those should land on the next tick. 
+		 * Handlers may also cancel other timers on the expired list.
+		 */
+		expired = &tw->slot[TW_EXPIRED];
+		while ((timer = TAILQ_FIRST(&tw->slot[tw->now & TW_MASK])) != NULL) {
+			UnlinkTimer(tw, timer);
+			LinkTimer(tw, timer, TW_EXPIRED);
+		}
+		tw->now++;
+
+		while ((timer = TAILQ_FIRST(expired)) != NULL) {
+			UnlinkTimer(tw, timer);
+			tw->cnt--;
+			cnt++;
+
+			TRACE_LOOP("Timer fired. cnt: %u, stream: %d, type: %u\n", 
+					cnt, timer->stream->id, timer->type);
+
+			FireTimer(mtcp, cur_ts, timer);
 		}
 	}
 
-	TRACE_ROUND("Checking timewait timeout. cnt: %d\n", cnt);
+	TRACE_ROUND("Checking timers. cnt: %d\n", cnt);
 }
 /*----------------------------------------------------------------------------*/
-void 
-CheckConnectionTimeout(mtcp_manager_t mtcp, uint32_t cur_ts, int thresh)
+/* 
+ * Ticks from cur_ts until a timer may fire, at most limit. A level 0 slot 
+ * holds the timers of a single tick; a timer on an upper level is only 
+ * known to the span of its slot, so the tick at which that slot is 
+ * cascaded is taken instead. Used to bound the sleep of an idle thread.
+ */
+uint32_t
+TimerIdleTicks(struct timer_wheel *tw, uint32_t cur_ts, uint32_t limit)
 {
-	tcp_stream *walk, *next;
-	int cnt;
+	uint32_t base, tick, idle;
+	int level, k, first, last;
 
-	STAT_COUNT(mtcp->runstat.rounds_tocheck);
+	if (!tw->cnt)
+		return limit;
+	if ((int32_t)(cur_ts - tw->now) >= 0)
+		return 0;
 
-	cnt = 0;
-	for (walk = TAILQ_FIRST(&mtcp->timeout_list);
-			walk != NULL; walk = next) {
-		if (++cnt > thresh)
-			break;
-		next = TAILQ_NEXT(walk, sndvar->timeout_link);
-
-		if ((int32_t)(cur_ts - walk->last_active_ts) >= 
-				CONFIG.tcp_timeout) {
-
-			walk->on_timeout_list = FALSE;
-			TAILQ_REMOVE(&mtcp->timeout_list, walk, sndvar->timeout_link);
-			mtcp->timeout_list_cnt--;
-			walk->state = TCP_ST_CLOSED;
-			walk->close_reason = TCP_TIMEDOUT;
-			if (walk->socket) {
-				RaiseErrorEvent(mtcp, walk);
-			} else {
-				DestroyTCPStream(mtcp, walk);
-			}
-		} else {
+	idle = limit;
+	for (level = 0; level < TW_LEVELS; level++) {
+		if (!tw->level_cnt[level])
+			continue;
+
+		/* level 0 starts at the current slot, the upper levels at the 
+		   next one, and the slot we are in comes last in the lap */
+		base = tw->now >> (TW_BITS * level);
+		first = (level == 0)? 0 : 1;
+		last = (level == 0)? TW_SLOTS - 1 : TW_SLOTS;
+		for (k = first; k <= last; k++) {
+			if (TAILQ_EMPTY(&tw->slot[level * TW_SLOTS + ((base + k) & TW_MASK)]))
+				continue;
+			tick = (level == 0)? tw->now + k : (base + k) << (TW_BITS * level);
+			if (tick - cur_ts < idle)
+				idle = tick - cur_ts;
 			break;
 		}
-
 	}
+
+	return idle;
 }
 /*----------------------------------------------------------------------------*/